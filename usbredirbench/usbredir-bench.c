@@ -0,0 +1,1242 @@
+/* usbredir-bench.c usbredirhost <-> usbredirparser end to end benchmark
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This benchmark pairs an usbredirhost, redirecting a usbredirsim simulated
+   device, with an usbredir-guest usbredirparser over a socketpair (or a tcp
+   loopback connection), runs scripted workloads on the guest side and
+   reports throughput, latency percentiles, cpu time per byte and the number
+   of errors / dropped packets. Both sides run in a single process and
+   thread, so the cpu time is the total for host + guest. */
+
+#define _GNU_SOURCE /* For ppoll */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "usbredirhost.h"
+#include "usbredirsim.h"
+
+#define BENCH_VERSION "usbredir-bench " PACKAGE_VERSION
+
+/* Max number of outstanding packets on the guest side */
+#define MAX_QUEUE_DEPTH 64
+/* Max number of allocation call sites reported by --alloc-stats */
+#define MAX_ALLOC_SITES 64
+/* Number of iso out packets the guest sends ahead of the device consuming
+   them, half of the host's buffers (pkts_per_urb * no_urbs / 2) */
+#define ISO_OUT_AHEAD 48
+/* iso-out-halt sends a clear halt for the iso in ep every this many packets,
+   with the sim's sync latency set to ISO_OUT_HALT_SYNC_LATENCY us */
+#define ISO_OUT_HALT_INTERVAL 1000
+#define ISO_OUT_HALT_SYNC_LATENCY 20000
+/* iso-in-uvc makes the sim send a video frame every this many packets */
+#define UVC_FRAME_PACKETS 256
+/* interrupt-in-late uses a 1 ms polling period, for an initial interrupt
+   depth of INTERRUPT_LATE_DEPTH, and does not handle libusb events for
+   INTERRUPT_LATE_US every INTERRUPT_LATE_EVERY_US, the host should detect
+   the underruns this causes and grow the depth */
+#define INTERRUPT_LATE_INTERVAL 4
+#define INTERRUPT_LATE_DEPTH 8
+#define INTERRUPT_LATE_US 20000
+#define INTERRUPT_LATE_EVERY_US 250000
+
+enum {
+    bench_bulk_read,
+    bench_bulk_write,
+    bench_iso_in,
+    bench_iso_in_uvc,
+    bench_iso_out,
+    bench_iso_out_halt,
+    bench_interrupt_in,
+    bench_interrupt_in_late,
+    bench_cancel_storm,
+    bench_enumerate,
+};
+
+struct bench_workload {
+    const char *name;
+    int type;            /* bench_* */
+    int device;          /* usbredirsim_device_* */
+    int speed;
+    int latency;         /* sim completion latency in us */
+    int size;            /* transfer size for bulk workloads */
+    int queue_depth;     /* outstanding transfers for bulk workloads */
+    uint64_t count;      /* packets to transfer */
+};
+
+static const struct bench_workload workloads[] = {
+    { "bulk-read-512", bench_bulk_read, usbredirsim_device_bulk,
+      LIBUSB_SPEED_SUPER, 0, 512, 8, 200000 },
+    { "bulk-read-4k", bench_bulk_read, usbredirsim_device_bulk,
+      LIBUSB_SPEED_SUPER, 0, 4096, 8, 100000 },
+    { "bulk-read-64k", bench_bulk_read, usbredirsim_device_bulk,
+      LIBUSB_SPEED_SUPER, 0, 65536, 8, 20000 },
+    { "bulk-write-512", bench_bulk_write, usbredirsim_device_bulk,
+      LIBUSB_SPEED_SUPER, 0, 512, 8, 200000 },
+    { "bulk-write-4k", bench_bulk_write, usbredirsim_device_bulk,
+      LIBUSB_SPEED_SUPER, 0, 4096, 8, 100000 },
+    { "bulk-write-64k", bench_bulk_write, usbredirsim_device_bulk,
+      LIBUSB_SPEED_SUPER, 0, 65536, 8, 20000 },
+    { "iso-in", bench_iso_in, usbredirsim_device_iso,
+      LIBUSB_SPEED_HIGH, 0, 0, 0, 40000 },
+    { "iso-in-uvc", bench_iso_in_uvc, usbredirsim_device_iso,
+      LIBUSB_SPEED_HIGH, 0, 0, 0, 40000 },
+    { "iso-out", bench_iso_out, usbredirsim_device_iso,
+      LIBUSB_SPEED_HIGH, 0, 1024, 0, 40000 },
+    { "iso-out-halt", bench_iso_out_halt, usbredirsim_device_iso,
+      LIBUSB_SPEED_HIGH, 0, 1024, 0, 40000 },
+    { "interrupt-in", bench_interrupt_in, usbredirsim_device_hid,
+      LIBUSB_SPEED_HIGH, 0, 0, 0, 20000 },
+    { "interrupt-in-late", bench_interrupt_in_late, usbredirsim_device_hid,
+      LIBUSB_SPEED_HIGH, 0, 0, 0, 2000 },
+    { "cancel-storm", bench_cancel_storm, usbredirsim_device_bulk,
+      LIBUSB_SPEED_SUPER, 1000, 65536, 16, 20000 },
+    { "enumerate", bench_enumerate, usbredirsim_device_hid,
+      LIBUSB_SPEED_HIGH, 1000, 0, 1, 2000 },
+};
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+#define WORKLOAD_ISO_IN(w) \
+    ((w)->type == bench_iso_in || (w)->type == bench_iso_in_uvc)
+#define WORKLOAD_ISO_OUT(w) \
+    ((w)->type == bench_iso_out || (w)->type == bench_iso_out_halt)
+#define WORKLOAD_INTERRUPT_IN(w) \
+    ((w)->type == bench_interrupt_in || (w)->type == bench_interrupt_in_late)
+
+/* The descriptor requests done by the enumerate workload, in a loop */
+static const struct {
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+} enumerate_requests[] = {
+    { 0x0100, 0x0000,   8 }, /* Device descriptor, bMaxPacketSize0 only */
+    { 0x0100, 0x0000,  18 },
+    { 0x0200, 0x0000,   9 }, /* Config descriptor, wTotalLength only */
+    { 0x0200, 0x0000, 255 },
+    { 0x0300, 0x0000, 255 }, /* String descriptor languages */
+    { 0x0301, 0x0409, 255 },
+    { 0x0302, 0x0409, 255 },
+    { 0x0303, 0x0409, 255 },
+};
+#define ENUMERATE_REQUEST_COUNT \
+    (int)(sizeof(enumerate_requests) / sizeof(enumerate_requests[0]))
+
+struct bench {
+    const struct bench_workload *workload;
+    struct usbredirhost *host;
+    struct usbredirparser *guest;
+    int host_fd;
+    int guest_fd;
+    int running;
+    int started;
+    uint64_t count;
+    /* Guest side state */
+    uint64_t next_id;
+    uint64_t expected_id;
+    uint64_t submitted;
+    uint64_t done;
+    uint64_t submit_time[MAX_QUEUE_DEPTH];
+    uint64_t last_time;
+    uint64_t stream_start_time;
+    uint64_t next_late_time;
+    uint8_t *data;
+    /* Results */
+    uint64_t start_time;
+    uint64_t end_time;
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t errors;
+    uint64_t drops;
+    uint64_t cancelled;
+    uint64_t output_size_calls;
+    uint64_t guest_bytes;
+    /* iso-in-uvc video frames, partial ones are missing packets */
+    int uvc_in_frame;
+    int uvc_frame_ok;
+    uint8_t uvc_fid;
+    uint64_t frames;
+    uint64_t partial_frames;
+    struct usbredirhost_interrupt_stats interrupt_stats;
+    uint32_t *latencies;
+    uint64_t latency_count;
+    uint64_t latency_size;
+};
+
+static int verbose = usbredirparser_warning;
+static int use_tcp;
+static int time_limit = 10;
+static int queue_depth;
+static int latency = -1;
+static int error_rate;
+static uint64_t packet_count;
+static int alloc_stats;
+static int async_ops;
+static int engine_threads;
+static int coalesce_window = -1;
+static int guest_rate;
+static int frame_drop;
+static int failed;
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t bench_cpu_time(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void bench_add_latency(struct bench *bench, uint64_t latency)
+{
+    if (bench->latency_count == bench->latency_size) {
+        uint64_t size = bench->latency_size ? bench->latency_size * 2 : 4096;
+        uint32_t *latencies;
+
+        latencies = realloc(bench->latencies, size * sizeof(uint32_t));
+        if (!latencies) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        bench->latencies = latencies;
+        bench->latency_size = size;
+    }
+    bench->latencies[bench->latency_count++] = latency;
+}
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+    uint32_t l1 = *(const uint32_t *)a, l2 = *(const uint32_t *)b;
+
+    return (l1 > l2) - (l1 < l2);
+}
+
+static uint32_t bench_percentile(struct bench *bench, int percentile)
+{
+    uint64_t i;
+
+    if (!bench->latency_count)
+        return 0;
+
+    i = bench->latency_count * percentile / 100;
+    if (i >= bench->latency_count)
+        i = bench->latency_count - 1;
+    return bench->latencies[i];
+}
+
+static void bench_packet_done(struct bench *bench, uint64_t bytes)
+{
+    bench->packets++;
+    bench->bytes += bytes;
+    if (bench->packets >= bench->count) {
+        bench->end_time = bench_now();
+        bench->running = 0;
+    }
+}
+
+/****** Transport ******/
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= verbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+static int bench_read(int fd, uint8_t *data, int count)
+{
+    int r = read(fd, data, count);
+    if (r < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        return -1;
+    }
+    if (r == 0) /* Peer disconnected */
+        return -1;
+    return r;
+}
+
+static int bench_write(int fd, uint8_t *data, int count)
+{
+    int r = write(fd, data, count);
+    if (r < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        return -1;
+    }
+    return r;
+}
+
+static int bench_host_read(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+
+    return bench_read(bench->host_fd, data, count);
+}
+
+static int bench_host_write(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+
+    return bench_write(bench->host_fd, data, count);
+}
+
+/* With --async-ops the host also sends packets from its worker thread, write
+   those right away rather then waiting for the main loop to poll for it */
+static void bench_host_flush(void *priv)
+{
+    struct bench *bench = priv;
+
+    if (bench->host)
+        usbredirhost_write_guest_data(bench->host);
+}
+
+/* For iso-in, so that the host can drop packets when we fall behind */
+static uint64_t bench_host_buffered_output_size(void *priv)
+{
+    struct bench *bench = priv;
+    int queued = 0;
+
+    bench->output_size_calls++;
+    if (ioctl(bench->host_fd, TIOCOUTQ, &queued) < 0)
+        return 0;
+    return queued;
+}
+
+static int bench_guest_read(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+    int64_t allowed;
+    int r;
+
+    /* --guest-rate, a guest which does not keep up with the stream */
+    if (guest_rate && bench->started) {
+        allowed = (int64_t)(bench_now() - bench->start_time) *
+                  guest_rate / 1000 - bench->guest_bytes;
+        if (allowed <= 0)
+            return 0;
+        if (count > allowed)
+            count = allowed;
+    }
+    r = bench_read(bench->guest_fd, data, count);
+    if (r > 0)
+        bench->guest_bytes += r;
+    return r;
+}
+
+static int bench_guest_write(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+
+    return bench_write(bench->guest_fd, data, count);
+}
+
+static void bench_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
+static void bench_connect(int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd;
+
+    if (!use_tcp) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            perror("socketpair");
+            exit(1);
+        }
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+            bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+            getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) ||
+            listen(listen_fd, 1)) {
+        perror("tcp listen");
+        exit(1);
+    }
+    fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[1] == -1 ||
+            connect(fds[1], (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("tcp connect");
+        exit(1);
+    }
+    fds[0] = accept(listen_fd, NULL, NULL);
+    if (fds[0] == -1) {
+        perror("tcp accept");
+        exit(1);
+    }
+    close(listen_fd);
+}
+
+/****** Guest side workloads ******/
+
+static void bench_submit(struct bench *bench)
+{
+    const struct bench_workload *w = bench->workload;
+    uint64_t id = bench->next_id++;
+    struct usb_redir_bulk_packet_header bulk_packet = {
+        .length      = w->size,
+        .length_high = w->size >> 16,
+    };
+
+    bench->submit_time[id % MAX_QUEUE_DEPTH] = bench_now();
+    bench->submitted++;
+
+    if (w->type == bench_bulk_write) {
+        bulk_packet.endpoint = 0x01;
+        usbredirparser_send_bulk_packet(bench->guest, id, &bulk_packet,
+                                        bench->data, w->size);
+        return;
+    }
+
+    bulk_packet.endpoint = 0x81;
+    usbredirparser_send_bulk_packet(bench->guest, id, &bulk_packet, NULL, 0);
+    if (w->type == bench_cancel_storm) {
+        /* Measure the time from the cancel to the guest getting the
+           cancelled status back */
+        usbredirparser_send_cancel_data_packet(bench->guest, id);
+        bench->submit_time[id % MAX_QUEUE_DEPTH] = bench_now();
+    }
+}
+
+static void bench_submit_control(struct bench *bench)
+{
+    uint64_t id = bench->next_id++;
+    int i = bench->submitted % ENUMERATE_REQUEST_COUNT;
+    struct usb_redir_control_packet_header control_packet = {
+        .endpoint    = 0x80,
+        .request     = LIBUSB_REQUEST_GET_DESCRIPTOR,
+        .requesttype = LIBUSB_ENDPOINT_IN,
+        .value       = enumerate_requests[i].value,
+        .index       = enumerate_requests[i].index,
+        .length      = enumerate_requests[i].length,
+    };
+
+    bench->submit_time[id % MAX_QUEUE_DEPTH] = bench_now();
+    bench->submitted++;
+    usbredirparser_send_control_packet(bench->guest, id, &control_packet,
+                                       NULL, 0);
+}
+
+static void bench_start(struct bench *bench)
+{
+    const struct bench_workload *w = bench->workload;
+    int i;
+
+    bench->started = 1;
+    bench->start_time = bench_now();
+
+    switch (w->type) {
+    case bench_bulk_read:
+    case bench_bulk_write:
+    case bench_cancel_storm:
+        for (i = 0; i < queue_depth && bench->submitted < bench->count; i++)
+            bench_submit(bench);
+        break;
+    case bench_enumerate:
+        bench_submit_control(bench);
+        break;
+    case bench_iso_in:
+    case bench_iso_in_uvc:
+    case bench_iso_out:
+    case bench_iso_out_halt: {
+        struct usb_redir_set_alt_setting_header set_alt_setting = {
+            .interface = 0,
+            .alt = 1,
+        };
+        usbredirparser_send_set_alt_setting(bench->guest, 0,
+                                            &set_alt_setting);
+        break;
+    }
+    case bench_interrupt_in:
+    case bench_interrupt_in_late: {
+        struct usb_redir_start_interrupt_receiving_header start = {
+            .endpoint = 0x81,
+        };
+        usbredirparser_send_start_interrupt_receiving(bench->guest, 0,
+                                                      &start);
+        break;
+    }
+    }
+}
+
+static void bench_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct bench *bench = priv;
+
+    if (!bench->started)
+        bench_start(bench);
+}
+
+static void bench_device_disconnect(void *priv)
+{
+    struct bench *bench = priv;
+
+    fprintf(stderr, "%s: device disconnected\n", bench->workload->name);
+    bench->end_time = bench_now();
+    bench->running = 0;
+}
+
+static void bench_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+}
+
+static void bench_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void bench_configuration_status(void *priv, uint64_t id,
+    struct usb_redir_configuration_status_header *configuration_status)
+{
+}
+
+static void bench_alt_setting_status(void *priv, uint64_t id,
+    struct usb_redir_alt_setting_status_header *alt_setting_status)
+{
+    struct bench *bench = priv;
+    struct usb_redir_start_iso_stream_header start = {
+        .endpoint = WORKLOAD_ISO_OUT(bench->workload) ? 0x02 : 0x82,
+        .pkts_per_urb = 32,
+        .no_urbs = 3,
+    };
+
+    if (alt_setting_status->status != usb_redir_success) {
+        fprintf(stderr, "%s: set alt setting failed\n", bench->workload->name);
+        bench->running = 0;
+        return;
+    }
+    usbredirparser_send_start_iso_stream(bench->guest, 0, &start);
+}
+
+static void bench_iso_stream_status(void *priv, uint64_t id,
+    struct usb_redir_iso_stream_status_header *iso_stream_status)
+{
+    struct bench *bench = priv;
+
+    if (iso_stream_status->status != usb_redir_success) {
+        fprintf(stderr, "%s: iso stream status %d\n", bench->workload->name,
+                iso_stream_status->status);
+        bench->errors++;
+    } else if (WORKLOAD_ISO_OUT(bench->workload) &&
+               !bench->stream_start_time) {
+        bench->stream_start_time = bench_now();
+    }
+}
+
+static void bench_send_clear_halt(struct bench *bench, uint8_t ep)
+{
+    struct usb_redir_control_packet_header control_packet = {
+        .endpoint    = 0x00,
+        .request     = LIBUSB_REQUEST_CLEAR_FEATURE,
+        .requesttype = LIBUSB_RECIPIENT_ENDPOINT,
+        .value       = 0, /* ENDPOINT_HALT */
+        .index       = ep,
+    };
+
+    usbredirparser_send_control_packet(bench->guest, bench->next_id++,
+                                       &control_packet, NULL, 0);
+}
+
+/* Send iso out packets at the rate the sim device consumes them (one per
+   microframe), keeping ISO_OUT_AHEAD packets buffered in the host. The
+   latency is how late a packet gets send, when the host blocks the guest
+   can not keep up and the host's iso out buffers run empty. */
+static void bench_iso_out_send(struct bench *bench)
+{
+    const struct bench_workload *w = bench->workload;
+    struct usb_redir_iso_packet_header iso_packet = {
+        .endpoint = 0x02,
+        .status   = usb_redir_success,
+        .length   = w->size,
+    };
+    uint64_t now, due, due_time;
+
+    if (!bench->stream_start_time)
+        return;
+
+    now = bench_now();
+    due = (now - bench->stream_start_time) / 125 + ISO_OUT_AHEAD;
+    while (bench->running && bench->submitted < due) {
+        if (w->type == bench_iso_out_halt && bench->submitted &&
+                bench->submitted % ISO_OUT_HALT_INTERVAL == 0)
+            bench_send_clear_halt(bench, 0x82);
+        if (bench->submitted >= ISO_OUT_AHEAD) {
+            due_time = bench->stream_start_time +
+                       (bench->submitted - ISO_OUT_AHEAD) * 125;
+            bench_add_latency(bench, now - due_time);
+        }
+        usbredirparser_send_iso_packet(bench->guest, bench->next_id++,
+                                       &iso_packet, bench->data, w->size);
+        bench->submitted++;
+        bench_packet_done(bench, w->size);
+    }
+}
+
+static void bench_interrupt_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_interrupt_receiving_status_header *status)
+{
+    struct bench *bench = priv;
+
+    if (status->status != usb_redir_success) {
+        fprintf(stderr, "%s: interrupt receiving status %d\n",
+                bench->workload->name, status->status);
+        bench->errors++;
+    }
+}
+
+static void bench_bulk_streams_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_streams_status_header *bulk_streams_status)
+{
+}
+
+static void bench_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    usbredirparser_free_packet_data(bench->guest, data);
+    if (!bench->running || bench->workload->type != bench_enumerate)
+        return;
+
+    bench_add_latency(bench,
+                      bench_now() - bench->submit_time[id % MAX_QUEUE_DEPTH]);
+    if (control_packet->status != usb_redir_success)
+        bench->errors++;
+    if (bench->submitted < bench->count)
+        bench_submit_control(bench);
+    bench_packet_done(bench, data_len);
+}
+
+static void bench_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+    uint64_t bytes;
+
+    usbredirparser_free_packet_data(bench->guest, data);
+    if (!bench->running)
+        return;
+
+    bench_add_latency(bench,
+                      bench_now() - bench->submit_time[id % MAX_QUEUE_DEPTH]);
+    if (bulk_packet->status == usb_redir_cancelled)
+        bench->cancelled++;
+    else if (bulk_packet->status != usb_redir_success)
+        bench->errors++;
+
+    bytes = data_len;
+    if (bulk_packet->endpoint == 0x01 &&
+            bulk_packet->status == usb_redir_success)
+        bytes = (bulk_packet->length_high << 16) | bulk_packet->length;
+    if (bench->submitted < bench->count)
+        bench_submit(bench);
+    bench_packet_done(bench, bytes);
+}
+
+/* For streams we record the inter-arrival time as latency, and use gaps in
+   the packet ids to detect packets dropped by the host */
+static void bench_stream_packet(struct bench *bench, uint64_t id,
+                                int status, int data_len)
+{
+    uint64_t now = bench_now();
+
+    if (!bench->running)
+        return;
+
+    if (bench->packets)
+        bench_add_latency(bench, now - bench->last_time);
+    else
+        bench->expected_id = id;
+    bench->last_time = now;
+
+    if (id > bench->expected_id)
+        bench->drops += id - bench->expected_id;
+    bench->expected_id = id + 1;
+    if (status != usb_redir_success)
+        bench->errors++;
+
+    bench_packet_done(bench, data_len);
+}
+
+/* Count complete and partial video frames, using the uvc payload headers
+   of the sim, a frame is partial when packets of it got dropped */
+static void bench_uvc_packet(struct bench *bench, uint64_t id,
+                             uint8_t *data, int data_len)
+{
+    if (!bench->running || data_len < 2)
+        return;
+
+    if (bench->uvc_in_frame && bench->packets && id != bench->expected_id)
+        bench->uvc_frame_ok = 0;
+    if (!bench->uvc_in_frame || (data[1] & 0x01) != bench->uvc_fid) {
+        if (bench->uvc_in_frame)
+            bench->partial_frames++; /* EOF got dropped */
+        bench->uvc_in_frame = 1;
+        bench->uvc_frame_ok = 1;
+        bench->uvc_fid = data[1] & 0x01;
+    }
+    if (data[1] & 0x02) {
+        if (bench->uvc_frame_ok)
+            bench->frames++;
+        else
+            bench->partial_frames++;
+        bench->uvc_in_frame = 0;
+    }
+}
+
+static void bench_iso_packet(void *priv, uint64_t id,
+    struct usb_redir_iso_packet_header *iso_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    if (bench->workload->type == bench_iso_in_uvc)
+        bench_uvc_packet(bench, id, data, data_len);
+    usbredirparser_free_packet_data(bench->guest, data);
+    bench_stream_packet(bench, id, iso_packet->status, data_len);
+}
+
+static void bench_interrupt_packet(void *priv, uint64_t id,
+    struct usb_redir_interrupt_packet_header *interrupt_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    usbredirparser_free_packet_data(bench->guest, data);
+    bench_stream_packet(bench, id, interrupt_packet->status, data_len);
+}
+
+static void bench_coalesced_interrupt_packet(void *priv, uint64_t id,
+    struct usb_redir_coalesced_interrupt_packet_header *coalesced,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+    struct usb_redir_interrupt_report *report;
+    int i, pos = 0;
+
+    for (i = 0; i < coalesced->count; i++) {
+        report = (struct usb_redir_interrupt_report *)(data + pos);
+        bench_stream_packet(bench, id + i, report->status, report->length);
+        pos += sizeof(*report) + report->length;
+    }
+    usbredirparser_free_packet_data(bench->guest, data);
+}
+
+static struct usbredirparser *bench_create_guest(struct bench *bench)
+{
+    struct usbredirparser *parser;
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    parser = usbredirparser_create();
+    if (!parser) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    parser->priv = bench;
+    parser->log_func = bench_log;
+    parser->read_func = bench_guest_read;
+    parser->write_func = bench_guest_write;
+    parser->device_connect_func = bench_device_connect;
+    parser->device_disconnect_func = bench_device_disconnect;
+    parser->interface_info_func = bench_interface_info;
+    parser->ep_info_func = bench_ep_info;
+    parser->configuration_status_func = bench_configuration_status;
+    parser->alt_setting_status_func = bench_alt_setting_status;
+    parser->iso_stream_status_func = bench_iso_stream_status;
+    parser->interrupt_receiving_status_func = bench_interrupt_receiving_status;
+    parser->bulk_streams_status_func = bench_bulk_streams_status;
+    parser->control_packet_func = bench_control_packet;
+    parser->bulk_packet_func = bench_bulk_packet;
+    parser->iso_packet_func = bench_iso_packet;
+    parser->interrupt_packet_func = bench_interrupt_packet;
+    parser->coalesced_interrupt_packet_func = bench_coalesced_interrupt_packet;
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_coalesced_interrupt);
+    usbredirparser_init(parser, BENCH_VERSION, caps, USB_REDIR_CAPS_SIZE, 0);
+    return parser;
+}
+
+/****** Main loop ******/
+
+static void bench_main_loop(struct bench *bench, libusb_context *ctx)
+{
+    const struct libusb_pollfd **pollfds;
+    struct pollfd fds[16];
+    struct timeval tv;
+    struct timespec timeout;
+    uint64_t deadline = bench_now() + (uint64_t)time_limit * 1000000;
+    int i, n, nfds;
+
+    /* With --engine the engine's threads handle the libusb events */
+    pollfds = engine_threads ? NULL : libusb_get_pollfds(ctx);
+    while (bench->running) {
+        fds[0].fd = bench->host_fd;
+        fds[0].events = POLLIN;
+        if (usbredirhost_has_data_to_write(bench->host))
+            fds[0].events |= POLLOUT;
+        fds[1].fd = bench->guest_fd;
+        fds[1].events = POLLIN;
+        if (usbredirparser_has_data_to_write(bench->guest))
+            fds[1].events |= POLLOUT;
+        nfds = 2;
+        for (i = 0; pollfds && pollfds[i] && nfds < 16; i++, nfds++) {
+            fds[nfds].fd = pollfds[i]->fd;
+            fds[nfds].events = pollfds[i]->events;
+        }
+
+        /* Use ppoll for its us resolution, the sim device completes
+           transfers at (micro)frame boundaries */
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = 100000000;
+        if (!engine_threads && libusb_get_next_timeout(ctx, &tv) == 1 &&
+                tv.tv_sec == 0 && tv.tv_usec * 1000 < timeout.tv_nsec)
+            timeout.tv_nsec = tv.tv_usec * 1000;
+        /* And iso-out sends a packet every microframe */
+        if (bench->stream_start_time && timeout.tv_nsec > 125000)
+            timeout.tv_nsec = 125000;
+
+        n = ppoll(fds, nfds, &timeout, NULL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        /* interrupt-in-late simulates an event loop which runs late */
+        if (bench->workload->type == bench_interrupt_in_late &&
+                !engine_threads && bench->started &&
+                bench_now() >= bench->next_late_time) {
+            if (bench->next_late_time)
+                usleep(INTERRUPT_LATE_US);
+            bench->next_late_time = bench_now() + INTERRUPT_LATE_EVERY_US;
+        }
+
+        tv.tv_sec = tv.tv_usec = 0;
+        if (!engine_threads)
+            libusb_handle_events_timeout(ctx, &tv);
+
+        if (WORKLOAD_ISO_OUT(bench->workload))
+            bench_iso_out_send(bench);
+
+        if ((fds[0].revents & (POLLIN | POLLHUP)) &&
+                usbredirhost_read_guest_data(bench->host))
+            break;
+        if ((fds[0].revents & POLLOUT) &&
+                usbredirhost_write_guest_data(bench->host))
+            break;
+        if ((fds[1].revents & (POLLIN | POLLHUP)) &&
+                usbredirparser_do_read(bench->guest))
+            break;
+        if ((fds[1].revents & POLLOUT) &&
+                usbredirparser_do_write(bench->guest))
+            break;
+
+        if (bench_now() > deadline) {
+            fprintf(stderr, "%s: time limit reached\n",
+                    bench->workload->name);
+            break;
+        }
+    }
+    if (bench->running) {
+        bench->end_time = bench_now();
+        bench->running = 0;
+    }
+    free(pollfds);
+}
+
+static void bench_print_header(void)
+{
+    printf("%-16s %9s %9s %8s %8s %8s %8s %9s %7s %7s\n", "workload",
+           "MB/s", "pkts/s", "p50 us", "p90 us", "p99 us", "max us",
+           "cpu ns/B", "errors", "drops");
+}
+
+static void bench_print(struct bench *bench, uint64_t cpu_time)
+{
+    double secs = (bench->end_time - bench->start_time) / 1e6;
+
+    qsort(bench->latencies, bench->latency_count, sizeof(uint32_t),
+          bench_cmp_latency);
+
+    printf("%-16s %9.1f %9.0f %8u %8u %8u %8u %9.2f %7"PRIu64" %7"PRIu64"\n",
+           bench->workload->name,
+           secs > 0 ? bench->bytes / secs / 1e6 : 0.0,
+           secs > 0 ? bench->packets / secs : 0.0,
+           bench_percentile(bench, 50), bench_percentile(bench, 90),
+           bench_percentile(bench, 99), bench_percentile(bench, 100),
+           bench->bytes ? cpu_time * 1000.0 / bench->bytes : 0.0,
+           bench->errors, bench->drops);
+    if (bench->workload->type == bench_cancel_storm && verbose >= 3)
+        printf("  %"PRIu64" of %"PRIu64" transfers cancelled\n",
+               bench->cancelled, bench->packets);
+    if (WORKLOAD_ISO_IN(bench->workload) && verbose >= 3)
+        printf("  %"PRIu64" buffered output size calls\n",
+               bench->output_size_calls);
+    if (bench->workload->type == bench_iso_in_uvc)
+        printf("  %"PRIu64" complete frames, %"PRIu64" partial frames\n",
+               bench->frames, bench->partial_frames);
+    if (bench->workload->type == bench_interrupt_in_late ||
+            (bench->workload->type == bench_interrupt_in && verbose >= 3))
+        printf("  interrupt depth %d (max %d), %"PRIu64" underruns, "
+               "%"PRIu64" reports in %"PRIu64" packets\n",
+               bench->interrupt_stats.depth,
+               bench->interrupt_stats.max_depth,
+               bench->interrupt_stats.underruns,
+               bench->interrupt_stats.completions,
+               bench->interrupt_stats.packets);
+}
+
+static int bench_cmp_alloc_site(const void *a, const void *b)
+{
+    const struct usbredirparser_alloc_site *sa = a, *sb = b;
+
+    return (sa->count < sb->count) - (sa->count > sb->count);
+}
+
+static void bench_print_alloc_stats(struct bench *bench)
+{
+    struct usbredirparser_alloc_site sites[MAX_ALLOC_SITES];
+    uint64_t count = 0, bytes = 0;
+    int i, n;
+
+    n = usbredirparser_get_alloc_stats(sites, MAX_ALLOC_SITES);
+    if (n > MAX_ALLOC_SITES)
+        n = MAX_ALLOC_SITES;
+    qsort(sites, n, sizeof(sites[0]), bench_cmp_alloc_site);
+    for (i = 0; i < n; i++) {
+        printf("  %-36s:%-5d %10"PRIu64" allocs %12"PRIu64" bytes\n",
+               sites[i].file, sites[i].line, sites[i].count, sites[i].bytes);
+        count += sites[i].count;
+        bytes += sites[i].bytes;
+    }
+    printf("  total %"PRIu64" allocs, %.2f allocs/pkt, %.0f bytes/pkt\n",
+           count, bench->packets ? (double)count / bench->packets : 0.0,
+           bench->packets ? (double)bytes / bench->packets : 0.0);
+}
+
+static void bench_run(const struct bench_workload *workload)
+{
+    struct usbredirsim_config config;
+    struct bench bench;
+    struct usbredirhost_engine *engine = NULL;
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    uint64_t cpu_time;
+    int fds[2], host_flags;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.workload = workload;
+    bench.count = packet_count ? packet_count : workload->count;
+    bench.running = 1;
+    if (!queue_depth || queue_depth > MAX_QUEUE_DEPTH)
+        queue_depth = workload->queue_depth;
+    bench.data = calloc(1, workload->size ? workload->size : 1);
+    if (!bench.data) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+
+    usbredirsim_get_config(&config);
+    config.device = workload->device;
+    config.speed = workload->speed;
+    config.latency = (latency >= 0) ? latency : workload->latency;
+    if (!config.interrupt_interval) /* USBREDIRSIM_INTERRUPT_INTERVAL */
+        config.interrupt_interval =
+            (workload->type == bench_interrupt_in_late) ?
+            INTERRUPT_LATE_INTERVAL : 1;
+    config.error_rate = error_rate;
+    if (workload->type == bench_iso_out_halt && !config.sync_latency)
+        config.sync_latency = ISO_OUT_HALT_SYNC_LATENCY;
+    if (workload->type == bench_iso_in_uvc && !config.uvc_frame_packets)
+        config.uvc_frame_packets = UVC_FRAME_PACKETS;
+    usbredirsim_set_config(&config);
+
+    if (engine_threads) {
+        engine = usbredirhost_engine_create(engine_threads);
+        if (!engine) {
+            fprintf(stderr, "Could not create usbredirhost engine\n");
+            exit(1);
+        }
+        ctx = usbredirhost_engine_get_context(engine);
+    } else if (libusb_init(&ctx)) {
+        fprintf(stderr, "Could not init libusb\n");
+        exit(1);
+    }
+    handle = libusb_open_device_with_vid_pid(ctx, 0x1209,
+                                             0x0001 + workload->device);
+    if (!handle) {
+        fprintf(stderr, "Could not open simulated device\n");
+        exit(1);
+    }
+
+    bench_connect(fds);
+    bench.host_fd = fds[0];
+    bench.guest_fd = fds[1];
+    bench_set_nonblock(bench.host_fd);
+    bench_set_nonblock(bench.guest_fd);
+
+    usbredirparser_reset_alloc_stats();
+    cpu_time = bench_cpu_time();
+    bench.guest = bench_create_guest(&bench);
+    if (async_ops || engine || frame_drop) {
+        host_flags = usbredirhost_fl_builtin_lock;
+        if (async_ops)
+            host_flags |= usbredirhost_fl_async_ops;
+        if (frame_drop)
+            host_flags |= usbredirhost_fl_uvc_frame_drop;
+        bench.host = usbredirhost_open_full(ctx, handle, bench_log,
+                                   bench_host_read, bench_host_write,
+                                   bench_host_flush, NULL, NULL, NULL, NULL,
+                                   &bench, BENCH_VERSION, verbose, host_flags);
+    } else
+        bench.host = usbredirhost_open(ctx, handle, bench_log,
+                                       bench_host_read, bench_host_write,
+                                       &bench, BENCH_VERSION, verbose, 0);
+    if (!bench.host) {
+        fprintf(stderr, "Could not open usbredirhost\n");
+        exit(1);
+    }
+    if (coalesce_window >= 0)
+        usbredirhost_set_interrupt_coalescing(bench.host, coalesce_window);
+    if (WORKLOAD_ISO_IN(workload))
+        usbredirhost_set_buffered_output_size_cb(bench.host,
+                                         bench_host_buffered_output_size);
+
+    bench_main_loop(&bench, ctx);
+    cpu_time = bench_cpu_time() - cpu_time;
+
+    if (WORKLOAD_INTERRUPT_IN(workload))
+        usbredirhost_get_interrupt_stats(bench.host, 0x81,
+                                         &bench.interrupt_stats);
+    usbredirhost_close(bench.host);
+    usbredirparser_destroy(bench.guest);
+    if (engine)
+        usbredirhost_engine_destroy(engine);
+    else
+        libusb_exit(ctx);
+    close(bench.host_fd);
+    close(bench.guest_fd);
+
+    bench_print(&bench, cpu_time);
+    if (workload->type == bench_interrupt_in_late && !engine_threads &&
+            (!bench.interrupt_stats.underruns ||
+             bench.interrupt_stats.max_depth <= INTERRUPT_LATE_DEPTH)) {
+        fprintf(stderr, "%s: late event handling did not grow the "
+                "interrupt depth\n", workload->name);
+        failed = 1;
+    }
+    if (alloc_stats)
+        bench_print_alloc_stats(&bench);
+    free(bench.latencies);
+    free(bench.data);
+}
+
+static void usage(int exit_code, char *argv0)
+{
+    int i;
+
+    fprintf(exit_code? stderr:stdout,
+        "Usage: %s [-w|--workload <name>] [-n|--packets <count>]\n"
+        "          [-q|--queue-depth <n>] [-l|--latency <us>]\n"
+        "          [-e|--error-rate <n>] [-t|--time-limit <secs>] [--tcp]\n"
+        "          [-v|--verbose <0-5>] [--alloc-stats] [--async-ops]\n"
+        "          [--engine <threads>] [--coalesce <us>]\n"
+        "          [--guest-rate <kB/s>] [--frame-drop]\n"
+        "Workloads:", argv0);
+    for (i = 0; i < WORKLOAD_COUNT; i++)
+        fprintf(exit_code? stderr:stdout, " %s", workloads[i].name);
+    fprintf(exit_code? stderr:stdout, "\n"
+        "For the iso-in and interrupt workloads the latency is the packet\n"
+        "inter-arrival time, for cancel-storm it is the cancel latency,\n"
+        "iso-out sends packets at the rate the device consumes them (the\n"
+        "latency is how late they get send) and enumerate does one\n"
+        "descriptor request at a time. iso-out-halt also sends a clear\n"
+        "halt every %d packets, which takes %d us unless\n"
+        "USBREDIRSIM_SYNC_LATENCY is set, --async-ops lets the host\n"
+        "handle these on a worker thread\n"
+        "interrupt-in-late stops handling libusb events for %d ms every\n"
+        "%d ms and fails if the host does not grow the interrupt depth\n"
+        "--engine lets an usbredirhost_engine handle the libusb events\n"
+        "--coalesce sets the interrupt report coalescing window, 0 to\n"
+        "disable it\n"
+        "--guest-rate limits how fast the guest reads, --frame-drop makes\n"
+        "the host drop whole video frames when the guest falls behind\n"
+        "--alloc-stats needs usbredir to be configured with "
+        "--enable-alloc-stats\n",
+        ISO_OUT_HALT_INTERVAL, ISO_OUT_HALT_SYNC_LATENCY,
+        INTERRUPT_LATE_US / 1000, INTERRUPT_LATE_EVERY_US / 1000);
+    exit(exit_code);
+}
+
+static const struct option longopts[] = {
+    { "workload", required_argument, NULL, 'w' },
+    { "packets", required_argument, NULL, 'n' },
+    { "queue-depth", required_argument, NULL, 'q' },
+    { "latency", required_argument, NULL, 'l' },
+    { "error-rate", required_argument, NULL, 'e' },
+    { "time-limit", required_argument, NULL, 't' },
+    { "tcp", no_argument, NULL, 'T' },
+    { "alloc-stats", no_argument, NULL, 'A' },
+    { "async-ops", no_argument, NULL, 'a' },
+    { "engine", required_argument, NULL, 'E' },
+    { "coalesce", required_argument, NULL, 'C' },
+    { "guest-rate", required_argument, NULL, 'g' },
+    { "frame-drop", no_argument, NULL, 'F' },
+    { "verbose", required_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static int parse_int(const char *opt, const char *arg, char *argv0)
+{
+    char *endptr;
+    long l = strtol(arg, &endptr, 10);
+
+    if (*endptr != '\0' || l < 0) {
+        fprintf(stderr, "Invalid value for --%s: '%s'\n", opt, arg);
+        usage(1, argv0);
+    }
+    return l;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, o, found = 0, queue_depth_arg = 0;
+    char *workload = NULL;
+
+    while ((o = getopt_long(argc, argv, "hw:n:q:l:e:t:v:", longopts,
+                            NULL)) != -1) {
+        switch (o) {
+        case 'w':
+            workload = optarg;
+            break;
+        case 'n':
+            packet_count = parse_int("packets", optarg, argv[0]);
+            break;
+        case 'q':
+            queue_depth_arg = parse_int("queue-depth", optarg, argv[0]);
+            if (queue_depth_arg > MAX_QUEUE_DEPTH) {
+                fprintf(stderr, "Max queue depth is %d\n", MAX_QUEUE_DEPTH);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'l':
+            latency = parse_int("latency", optarg, argv[0]);
+            break;
+        case 'e':
+            error_rate = parse_int("error-rate", optarg, argv[0]);
+            break;
+        case 't':
+            time_limit = parse_int("time-limit", optarg, argv[0]);
+            break;
+        case 'T':
+            use_tcp = 1;
+            break;
+        case 'a':
+            async_ops = 1;
+            break;
+        case 'E':
+            engine_threads = parse_int("engine", optarg, argv[0]);
+            break;
+        case 'C':
+            coalesce_window = parse_int("coalesce", optarg, argv[0]);
+            break;
+        case 'g':
+            guest_rate = parse_int("guest-rate", optarg, argv[0]);
+            break;
+        case 'F':
+            frame_drop = 1;
+            break;
+        case 'A':
+            if (usbredirparser_get_alloc_stats(NULL, 0) < 0) {
+                fprintf(stderr, "usbredir was built without "
+                        "--enable-alloc-stats\n");
+                exit(1);
+            }
+            alloc_stats = 1;
+            break;
+        case 'v':
+            verbose = parse_int("verbose", optarg, argv[0]);
+            break;
+        case '?':
+        case 'h':
+            usage(o == '?', argv[0]);
+            break;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "Excess non option arguments\n");
+        usage(1, argv[0]);
+    }
+
+    bench_print_header();
+    for (i = 0; i < WORKLOAD_COUNT; i++) {
+        if (workload && strcmp(workload, workloads[i].name))
+            continue;
+        queue_depth = queue_depth_arg;
+        bench_run(&workloads[i]);
+        found = 1;
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown workload: '%s'\n", workload);
+        usage(1, argv[0]);
+    }
+
+    exit(failed);
+}
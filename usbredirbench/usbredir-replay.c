@@ -0,0 +1,620 @@
+/* usbredir-replay.c replay usbredir wire captures
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This tool replays a capture made with usbredirparser_start_capture() /
+   usbredirserver --capture, to reproduce performance problems (and bugs) seen with
+   real devices and real guests without needing either.
+
+   By default the packets the capturing side received are fed into a
+   usbredirparser with the same role and caps as the capturing parser, this
+   measures the parser receive path. With --host the packets send by the
+   guest are fed into a usbredirhost redirecting a usbredirsim simulated
+   device, this measures the complete host side. The simulated device is
+   picked based on the device_connect packet in the capture when the capture
+   was made against a usbredirsim device, otherwise it is taken from the
+   USBREDIRSIM_DEVICE environment variable.
+
+   Packets are either replayed with their original timing, or as fast as
+   possible (--speed max). */
+
+#define _GNU_SOURCE /* For ppoll */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include "usbredirhost.h"
+#include "usbredirsim.h"
+
+#define REPLAY_VERSION "usbredir-replay " PACKAGE_VERSION
+
+/* See usbredirparser_start_capture() */
+#define CAPTURE_LINKTYPE 147
+#define CAPTURE_PSEUDO_HEADER_LEN 4
+
+/* How long to keep handling events after the last packet with --host */
+#define DRAIN_TIME 250000
+
+struct replay_record {
+    uint64_t time;       /* in us, relative to the first record */
+    int direction;       /* 0 received, 1 send by the capturing parser */
+    int header_len;
+    uint8_t *data;       /* usbredir packet */
+    uint32_t len;
+};
+
+struct replay {
+    struct replay_record *records;
+    int record_count;
+    int usb_host;        /* 1 if the capturing parser was the usb-host */
+    int feed_direction;  /* direction of the records to feed */
+    /* Feed state */
+    int record;
+    uint32_t pos;
+    uint64_t start_time;
+    /* Results */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t written;
+    uint64_t end_time;
+};
+
+static int verbose = usbredirparser_warning;
+static int max_speed;
+
+static uint64_t replay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/****** Capture loading ******/
+
+static void replay_load(struct replay *replay, const char *filename)
+{
+    uint32_t file_header[6], record_header[4];
+    struct replay_record *record;
+    uint64_t first_time = 0;
+    int size = 0, flags = -1;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+
+    if (fread(file_header, sizeof(file_header), 1, f) != 1) {
+        fprintf(stderr, "%s: error reading pcap header\n", filename);
+        exit(1);
+    }
+    if (file_header[0] == 0xd4c3b2a1) {
+        /* The usbredir packets are in host byte order too */
+        fprintf(stderr, "%s: capture was made on a host with a different "
+                "byte order, cannot replay\n", filename);
+        exit(1);
+    }
+    if (file_header[0] != 0xa1b2c3d4 ||
+            file_header[5] != CAPTURE_LINKTYPE) {
+        fprintf(stderr, "%s: not a usbredir capture\n", filename);
+        exit(1);
+    }
+
+    while (fread(record_header, sizeof(record_header), 1, f) == 1) {
+        uint8_t pseudo_header[CAPTURE_PSEUDO_HEADER_LEN];
+        uint64_t time;
+        uint32_t len;
+
+        if (record_header[2] > record_header[3] ||
+                record_header[2] < CAPTURE_PSEUDO_HEADER_LEN) {
+            fprintf(stderr, "%s: invalid record %d\n",
+                    filename, replay->record_count);
+            exit(1);
+        }
+        if (replay->record_count == size) {
+            size = size ? size * 2 : 1024;
+            record = realloc(replay->records, size * sizeof(*record));
+            if (!record) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(1);
+            }
+            replay->records = record;
+        }
+        record = &replay->records[replay->record_count];
+        /* Truncated records are packets whose data the capturing parser
+           skipped, feed them with zeros in place of the data */
+        record->len = record_header[3] - CAPTURE_PSEUDO_HEADER_LEN;
+        len = record_header[2] - CAPTURE_PSEUDO_HEADER_LEN;
+        record->data = calloc(1, record->len ? record->len : 1);
+        if (!record->data) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        if (fread(pseudo_header, sizeof(pseudo_header), 1, f) != 1 ||
+                (len && fread(record->data, len, 1, f) != 1)) {
+            fprintf(stderr, "%s: short read on record %d\n",
+                    filename, replay->record_count);
+            exit(1);
+        }
+
+        time = (uint64_t)record_header[0] * 1000000 + record_header[1];
+        if (!replay->record_count)
+            first_time = time;
+        record->time = (time > first_time) ? time - first_time : 0;
+        record->direction = pseudo_header[0];
+        record->header_len = pseudo_header[2];
+        if (flags == -1)
+            flags = pseudo_header[1];
+        if (pseudo_header[1] != flags) {
+            fprintf(stderr, "%s: capture contains packets from both sides\n",
+                    filename);
+            exit(1);
+        }
+        if (record->header_len > len) {
+            fprintf(stderr, "%s: invalid header len in record %d\n",
+                    filename, replay->record_count);
+            exit(1);
+        }
+        replay->record_count++;
+    }
+    fclose(f);
+
+    if (!replay->record_count) {
+        fprintf(stderr, "%s: capture contains no packets\n", filename);
+        exit(1);
+    }
+    replay->usb_host = flags & 1;
+}
+
+/* Find the first packet of type in direction, returns a pointer to its
+   type header + data, and their combined length in len */
+static uint8_t *replay_find_packet(struct replay *replay, int direction,
+    uint32_t type, uint32_t *len)
+{
+    struct usb_redir_header *header;
+    struct replay_record *record;
+    int i;
+
+    for (i = 0; i < replay->record_count; i++) {
+        record = &replay->records[i];
+        header = (struct usb_redir_header *)record->data;
+        if (record->direction != direction ||
+                record->len < sizeof(header->type) + sizeof(header->length) ||
+                header->type != type)
+            continue;
+        *len = record->len - record->header_len;
+        return record->data + record->header_len;
+    }
+    return NULL;
+}
+
+/****** Feeding ******/
+
+/* Returns the amount of us until the next record is due, 0 if it is due now,
+   -1 if all records have been fed */
+static int64_t replay_next_due(struct replay *replay)
+{
+    uint64_t now;
+
+    while (replay->record < replay->record_count &&
+           replay->records[replay->record].direction !=
+               replay->feed_direction)
+        replay->record++;
+
+    if (replay->record == replay->record_count)
+        return -1;
+    if (max_speed)
+        return 0;
+
+    now = replay_now() - replay->start_time;
+    if (replay->records[replay->record].time <= now)
+        return 0;
+    return replay->records[replay->record].time - now;
+}
+
+static int replay_read(void *priv, uint8_t *data, int count)
+{
+    struct replay *replay = priv;
+    struct replay_record *record;
+    int r = 0, n;
+
+    while (r < count && replay_next_due(replay) == 0) {
+        record = &replay->records[replay->record];
+        n = record->len - replay->pos;
+        if (n > count - r)
+            n = count - r;
+        memcpy(data + r, record->data + replay->pos, n);
+        replay->pos += n;
+        r += n;
+        if (replay->pos == record->len) {
+            replay->packets++;
+            replay->bytes += record->len;
+            replay->record++;
+            replay->pos = 0;
+        }
+    }
+    return r;
+}
+
+static int replay_write(void *priv, uint8_t *data, int count)
+{
+    struct replay *replay = priv;
+
+    replay->written += count;
+    return count;
+}
+
+static void replay_log(void *priv, int level, const char *msg)
+{
+    if (level <= verbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+static void replay_wait(int64_t usecs)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usecs / 1000000;
+    ts.tv_nsec = (usecs % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+/****** Parser replay ******/
+
+/* The packets are only parsed, so all callbacks are no-ops */
+#define REPLAY_STUB(name, header_type) \
+static void replay_##name(void *priv, uint64_t id, \
+    struct header_type *header) {}
+#define REPLAY_DATA_STUB(name, header_type) \
+static void replay_##name(void *priv, uint64_t id, \
+    struct header_type *header, uint8_t *data, int data_len) { free(data); }
+
+REPLAY_STUB(set_configuration, usb_redir_set_configuration_header)
+REPLAY_STUB(configuration_status, usb_redir_configuration_status_header)
+REPLAY_STUB(set_alt_setting, usb_redir_set_alt_setting_header)
+REPLAY_STUB(get_alt_setting, usb_redir_get_alt_setting_header)
+REPLAY_STUB(alt_setting_status, usb_redir_alt_setting_status_header)
+REPLAY_STUB(start_iso_stream, usb_redir_start_iso_stream_header)
+REPLAY_STUB(stop_iso_stream, usb_redir_stop_iso_stream_header)
+REPLAY_STUB(iso_stream_status, usb_redir_iso_stream_status_header)
+REPLAY_STUB(start_interrupt_receiving,
+            usb_redir_start_interrupt_receiving_header)
+REPLAY_STUB(stop_interrupt_receiving,
+            usb_redir_stop_interrupt_receiving_header)
+REPLAY_STUB(interrupt_receiving_status,
+            usb_redir_interrupt_receiving_status_header)
+REPLAY_STUB(alloc_bulk_streams, usb_redir_alloc_bulk_streams_header)
+REPLAY_STUB(free_bulk_streams, usb_redir_free_bulk_streams_header)
+REPLAY_STUB(bulk_streams_status, usb_redir_bulk_streams_status_header)
+REPLAY_STUB(start_bulk_receiving, usb_redir_start_bulk_receiving_header)
+REPLAY_STUB(stop_bulk_receiving, usb_redir_stop_bulk_receiving_header)
+REPLAY_STUB(bulk_receiving_status, usb_redir_bulk_receiving_status_header)
+REPLAY_DATA_STUB(control_packet, usb_redir_control_packet_header)
+REPLAY_DATA_STUB(bulk_packet, usb_redir_bulk_packet_header)
+REPLAY_DATA_STUB(iso_packet, usb_redir_iso_packet_header)
+REPLAY_DATA_STUB(interrupt_packet, usb_redir_interrupt_packet_header)
+REPLAY_DATA_STUB(buffered_bulk_packet, usb_redir_buffered_bulk_packet_header)
+
+static void replay_void(void *priv) {}
+static void replay_id(void *priv, uint64_t id) {}
+
+static void replay_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect) {}
+static void replay_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info) {}
+static void replay_ep_info(void *priv,
+    struct usb_redir_ep_info_header *ep_info) {}
+static void replay_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count) { free(rules); }
+
+static void replay_parser(struct replay *replay)
+{
+    struct usbredirparser *parser;
+    uint32_t *caps, caps_len;
+    int64_t due;
+    int r;
+
+    /* Use the same caps as the capturing parser, so that the parser ends
+       up in the same state (header len, etc.) */
+    caps = (uint32_t *)replay_find_packet(replay, 1, usb_redir_hello,
+                                          &caps_len);
+    if (!caps || caps_len < sizeof(struct usb_redir_hello_header)) {
+        fprintf(stderr, "capture does not contain our hello packet\n");
+        exit(1);
+    }
+    caps = (uint32_t *)((uint8_t *)caps +
+                        sizeof(struct usb_redir_hello_header));
+    caps_len = (caps_len - sizeof(struct usb_redir_hello_header)) /
+               sizeof(uint32_t);
+
+    parser = usbredirparser_create();
+    if (!parser) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    parser->priv = replay;
+    parser->log_func = replay_log;
+    parser->read_func = replay_read;
+    parser->write_func = replay_write;
+    parser->device_connect_func = replay_device_connect;
+    parser->device_disconnect_func = replay_void;
+    parser->reset_func = replay_void;
+    parser->interface_info_func = replay_interface_info;
+    parser->ep_info_func = replay_ep_info;
+    parser->set_configuration_func = replay_set_configuration;
+    parser->get_configuration_func = replay_id;
+    parser->configuration_status_func = replay_configuration_status;
+    parser->set_alt_setting_func = replay_set_alt_setting;
+    parser->get_alt_setting_func = replay_get_alt_setting;
+    parser->alt_setting_status_func = replay_alt_setting_status;
+    parser->start_iso_stream_func = replay_start_iso_stream;
+    parser->stop_iso_stream_func = replay_stop_iso_stream;
+    parser->iso_stream_status_func = replay_iso_stream_status;
+    parser->start_interrupt_receiving_func = replay_start_interrupt_receiving;
+    parser->stop_interrupt_receiving_func = replay_stop_interrupt_receiving;
+    parser->interrupt_receiving_status_func =
+        replay_interrupt_receiving_status;
+    parser->alloc_bulk_streams_func = replay_alloc_bulk_streams;
+    parser->free_bulk_streams_func = replay_free_bulk_streams;
+    parser->bulk_streams_status_func = replay_bulk_streams_status;
+    parser->cancel_data_packet_func = replay_id;
+    parser->control_packet_func = replay_control_packet;
+    parser->bulk_packet_func = replay_bulk_packet;
+    parser->iso_packet_func = replay_iso_packet;
+    parser->interrupt_packet_func = replay_interrupt_packet;
+    parser->filter_reject_func = replay_void;
+    parser->filter_filter_func = replay_filter_filter;
+    parser->device_disconnect_ack_func = replay_void;
+    parser->start_bulk_receiving_func = replay_start_bulk_receiving;
+    parser->stop_bulk_receiving_func = replay_stop_bulk_receiving;
+    parser->bulk_receiving_status_func = replay_bulk_receiving_status;
+    parser->buffered_bulk_packet_func = replay_buffered_bulk_packet;
+
+    usbredirparser_init(parser, REPLAY_VERSION, caps, caps_len,
+                        replay->usb_host ? usbredirparser_fl_usb_host : 0);
+
+    replay->feed_direction = 0;
+    replay->start_time = replay_now();
+    for (;;) {
+        r = usbredirparser_do_read(parser);
+        if (r < 0) {
+            fprintf(stderr, "parse error replaying packet %d\n",
+                    replay->record);
+            break;
+        }
+        usbredirparser_do_write(parser);
+        due = replay_next_due(replay);
+        if (due == -1)
+            break;
+        if (due)
+            replay_wait(due);
+    }
+    replay->end_time = replay_now();
+
+    usbredirparser_destroy(parser);
+}
+
+/****** Host replay ******/
+
+static void replay_host_main_loop(struct replay *replay,
+    struct usbredirhost *host, libusb_context *ctx)
+{
+    const struct libusb_pollfd **pollfds;
+    struct pollfd fds[16];
+    struct timeval tv;
+    struct timespec timeout;
+    uint64_t drain_until = 0;
+    int64_t due;
+    int i, nfds;
+
+    pollfds = libusb_get_pollfds(ctx);
+    for (;;) {
+        if (usbredirhost_read_guest_data(host)) {
+            fprintf(stderr, "error replaying packet %d\n", replay->record);
+            break;
+        }
+        usbredirhost_write_guest_data(host);
+
+        due = replay_next_due(replay);
+        if (due == -1) {
+            if (!drain_until) {
+                replay->end_time = replay_now();
+                drain_until = replay->end_time + DRAIN_TIME;
+            } else if (replay_now() >= drain_until) {
+                break;
+            }
+            due = DRAIN_TIME;
+        }
+
+        for (i = 0, nfds = 0; pollfds && pollfds[i] && nfds < 16; i++) {
+            fds[nfds].fd = pollfds[i]->fd;
+            fds[nfds].events = pollfds[i]->events;
+            nfds++;
+        }
+        timeout.tv_sec = due / 1000000;
+        timeout.tv_nsec = (due % 1000000) * 1000;
+        if (libusb_get_next_timeout(ctx, &tv) == 1 &&
+                (tv.tv_sec < timeout.tv_sec ||
+                 (tv.tv_sec == timeout.tv_sec &&
+                  tv.tv_usec * 1000 < timeout.tv_nsec))) {
+            timeout.tv_sec = tv.tv_sec;
+            timeout.tv_nsec = tv.tv_usec * 1000;
+        }
+
+        if (ppoll(fds, nfds, &timeout, NULL) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        tv.tv_sec = tv.tv_usec = 0;
+        libusb_handle_events_timeout(ctx, &tv);
+    }
+    if (!replay->end_time)
+        replay->end_time = replay_now();
+    free(pollfds);
+}
+
+static void replay_host(struct replay *replay)
+{
+    struct usb_redir_device_connect_header *device_connect;
+    struct usbredirsim_config config;
+    struct usbredirhost *host;
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    uint32_t len;
+
+    /* Feed what the guest send */
+    replay->feed_direction = replay->usb_host ? 0 : 1;
+
+    usbredirsim_get_config(&config);
+    device_connect = (struct usb_redir_device_connect_header *)
+        replay_find_packet(replay, 1 - replay->feed_direction,
+                           usb_redir_device_connect, &len);
+    if (device_connect &&
+            len >= offsetof(struct usb_redir_device_connect_header,
+                            device_version_bcd) &&
+            device_connect->vendor_id == 0x1209 &&
+            device_connect->product_id >= 0x0001 + usbredirsim_device_bulk &&
+            device_connect->product_id <= 0x0001 + usbredirsim_device_hid) {
+        config.device = device_connect->product_id - 0x0001;
+        config.speed = 0;
+        switch (device_connect->speed) {
+        case usb_redir_speed_low:   config.speed = LIBUSB_SPEED_LOW;   break;
+        case usb_redir_speed_full:  config.speed = LIBUSB_SPEED_FULL;  break;
+        case usb_redir_speed_high:  config.speed = LIBUSB_SPEED_HIGH;  break;
+        case usb_redir_speed_super: config.speed = LIBUSB_SPEED_SUPER; break;
+        }
+    } else if (device_connect) {
+        fprintf(stderr, "capture was not made against a usbredirsim "
+                "device, replaying against the default simulated device\n");
+    }
+    usbredirsim_set_config(&config);
+
+    if (libusb_init(&ctx)) {
+        fprintf(stderr, "Could not init libusb\n");
+        exit(1);
+    }
+    handle = libusb_open_device_with_vid_pid(ctx, 0x1209,
+                                             0x0001 + config.device);
+    if (!handle) {
+        fprintf(stderr, "Could not open simulated device\n");
+        exit(1);
+    }
+
+    replay->start_time = replay_now();
+    host = usbredirhost_open(ctx, handle, replay_log, replay_read,
+                             replay_write, replay, REPLAY_VERSION, verbose, 0);
+    if (!host) {
+        fprintf(stderr, "Could not open usbredirhost\n");
+        exit(1);
+    }
+
+    replay_host_main_loop(replay, host, ctx);
+
+    usbredirhost_close(host);
+    libusb_exit(ctx);
+}
+
+/****** Main ******/
+
+static void usage(int exit_code, char *argv0)
+{
+    fprintf(exit_code? stderr:stdout,
+        "Usage: %s [--host] [-s|--speed original|max] [-v|--verbose <0-5>]\n"
+        "          <capture.pcap>\n", argv0);
+    exit(exit_code);
+}
+
+static const struct option longopts[] = {
+    { "host", no_argument, NULL, 'H' },
+    { "speed", required_argument, NULL, 's' },
+    { "verbose", required_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+    struct replay replay;
+    int o, host = 0;
+    double secs;
+    char *endptr;
+
+    while ((o = getopt_long(argc, argv, "hs:v:", longopts, NULL)) != -1) {
+        switch (o) {
+        case 'H':
+            host = 1;
+            break;
+        case 's':
+            if (!strcmp(optarg, "max")) {
+                max_speed = 1;
+            } else if (!strcmp(optarg, "original")) {
+                max_speed = 0;
+            } else {
+                fprintf(stderr, "Invalid value for --speed: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'v':
+            verbose = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "Invalid value for --verbose: '%s'\n",
+                        optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case '?':
+        case 'h':
+            usage(o == '?', argv[0]);
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Expecting exactly one capture file argument\n");
+        usage(1, argv[0]);
+    }
+
+    memset(&replay, 0, sizeof(replay));
+    replay_load(&replay, argv[optind]);
+
+    if (host)
+        replay_host(&replay);
+    else
+        replay_parser(&replay);
+
+    secs = (replay.end_time - replay.start_time) / 1e6;
+    printf("replayed %"PRIu64" packets, %"PRIu64" bytes in %.3f s: "
+           "%.0f pkts/s, %.1f MB/s\n", replay.packets, replay.bytes, secs,
+           secs > 0 ? replay.packets / secs : 0.0,
+           secs > 0 ? replay.bytes / secs / 1e6 : 0.0);
+    if (host)
+        printf("usbredirhost send %"PRIu64" bytes\n", replay.written);
+
+    for (o = 0; o < replay.record_count; o++)
+        free(replay.records[o].data);
+    free(replay.records);
+    exit(0);
+}
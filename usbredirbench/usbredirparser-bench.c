@@ -0,0 +1,615 @@
+/* usbredirparser-bench.c usbredirparser throughput benchmark
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This benchmark drives usbredirparser_do_write and usbredirparser_do_read
+   through in-memory read / write callbacks, using packet mixes modelled after
+   real devices, and reports packets/s, MB/s, allocations per packet and
+   cycles per packet for both the sending (queue + do_write) and the
+   receiving (do_read + packet callbacks) side. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "usbredirparser.h"
+
+#define BENCH_VERSION "usbredirparser-bench " PACKAGE_VERSION
+
+/* Packets queued per batch before calling do_write / do_read, this bounds
+   the size of the in memory stream */
+#define BATCH_SIZE 256
+
+struct bench_packet {
+    int to_guest;   /* 1: host -> guest, 0: guest -> host */
+    int type;       /* usb_redir_*_packet */
+    uint8_t endpoint;
+    int length;     /* length field of the packet */
+};
+
+struct bench_workload {
+    const char *name;
+    const char *desc;
+    const struct bench_packet *packets;
+    int packet_count;
+};
+
+static const struct bench_packet hid_packets[] = {
+    { 1, usb_redir_interrupt_packet, 0x81, 8 },
+};
+
+static const struct bench_packet iso_audio_packets[] = {
+    { 1, usb_redir_iso_packet, 0x82, 192 },
+    { 0, usb_redir_iso_packet, 0x02, 192 },
+};
+
+static const struct bench_packet iso_video_packets[] = {
+    { 1, usb_redir_iso_packet, 0x83, 3072 },
+};
+
+static const struct bench_packet bulk_storage_packets[] = {
+    /* READ(10) of 64k: CBW, data-in, CSW */
+    { 0, usb_redir_bulk_packet, 0x04, 31 },
+    { 1, usb_redir_bulk_packet, 0x04, 31 },
+    { 0, usb_redir_bulk_packet, 0x85, 65536 },
+    { 1, usb_redir_bulk_packet, 0x85, 65536 },
+    { 0, usb_redir_bulk_packet, 0x85, 13 },
+    { 1, usb_redir_bulk_packet, 0x85, 13 },
+};
+
+static const struct bench_packet control_enum_packets[] = {
+    /* GET_DESCRIPTOR device, config (short + full), string */
+    { 0, usb_redir_control_packet, 0x80, 18 },
+    { 1, usb_redir_control_packet, 0x80, 18 },
+    { 0, usb_redir_control_packet, 0x80, 9 },
+    { 1, usb_redir_control_packet, 0x80, 9 },
+    { 0, usb_redir_control_packet, 0x80, 98 },
+    { 1, usb_redir_control_packet, 0x80, 98 },
+    { 0, usb_redir_control_packet, 0x80, 255 },
+    { 1, usb_redir_control_packet, 0x80, 34 },
+    /* SET_CONFIGURATION style no data request */
+    { 0, usb_redir_control_packet, 0x00, 0 },
+    { 1, usb_redir_control_packet, 0x00, 0 },
+};
+
+#define WORKLOAD(name, desc, packets) \
+    { name, desc, packets, sizeof(packets) / sizeof(packets[0]) }
+
+static const struct bench_workload workloads[] = {
+    WORKLOAD("hid", "interrupt-in 8 byte reports", hid_packets),
+    WORKLOAD("iso-audio", "iso in + out 192 byte packets",
+             iso_audio_packets),
+    WORKLOAD("iso-video", "iso in 3072 byte packets", iso_video_packets),
+    WORKLOAD("bulk-storage", "mass-storage 64k reads (CBW/data/CSW)",
+             bulk_storage_packets),
+    WORKLOAD("control-enum", "enumeration control transfers",
+             control_enum_packets),
+};
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+/* One direction of the connection, with the parser writing into and the
+   parser on the other side reading from an in memory stream */
+struct bench_stream {
+    uint8_t *buf;
+    int size;
+    int len;
+    int pos;
+    /* The parser reading from the stream, for freeing packet data */
+    struct usbredirparser *reader;
+};
+
+struct bench_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t allocs;
+    uint64_t nsecs;
+    uint64_t cycles;
+};
+
+static int verbose = usbredirparser_warning;
+static int read_chunk = 65536;
+static uint8_t payload[65536];
+
+/****** Allocation counting ******/
+
+/* Override the libc allocation functions so that we can count the
+   allocations done by libusbredirparser, this only works with glibc */
+static uint64_t alloc_count;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+#define HAVE_ALLOC_COUNT 1
+#endif
+
+/****** Timing ******/
+
+static uint64_t bench_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t bench_cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct bench_mark {
+    uint64_t nsecs;
+    uint64_t cycles;
+    uint64_t allocs;
+};
+
+static void bench_mark_start(struct bench_mark *mark)
+{
+    mark->allocs = alloc_count;
+    mark->cycles = bench_cycles();
+    mark->nsecs = bench_nsecs();
+}
+
+static void bench_mark_stop(struct bench_mark *mark, struct bench_stats *stats)
+{
+    stats->nsecs += bench_nsecs() - mark->nsecs;
+    stats->cycles += bench_cycles() - mark->cycles;
+    stats->allocs += alloc_count - mark->allocs;
+}
+
+/****** Parser callbacks ******/
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= verbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+static int bench_read(void *priv, uint8_t *data, int count)
+{
+    struct bench_stream *stream = priv;
+    int n = stream->len - stream->pos;
+
+    if (n > count)
+        n = count;
+    if (n > read_chunk)
+        n = read_chunk;
+    memcpy(data, stream->buf + stream->pos, n);
+    stream->pos += n;
+    return n;
+}
+
+static int bench_write(void *priv, uint8_t *data, int count)
+{
+    struct bench_stream *stream = priv;
+
+    if (stream->len + count > stream->size) {
+        int size = stream->size ? stream->size : 65536;
+        uint8_t *buf;
+
+        while (stream->len + count > size)
+            size *= 2;
+        buf = realloc(stream->buf, size);
+        if (!buf) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        stream->buf = buf;
+        stream->size = size;
+    }
+    memcpy(stream->buf + stream->len, data, count);
+    stream->len += count;
+    return count;
+}
+
+static void bench_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench_stream *stream = priv;
+
+    usbredirparser_free_packet_data(stream->reader, data);
+}
+
+static void bench_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench_stream *stream = priv;
+
+    usbredirparser_free_packet_data(stream->reader, data);
+}
+
+static void bench_iso_packet(void *priv, uint64_t id,
+    struct usb_redir_iso_packet_header *iso_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench_stream *stream = priv;
+
+    usbredirparser_free_packet_data(stream->reader, data);
+}
+
+static void bench_interrupt_packet(void *priv, uint64_t id,
+    struct usb_redir_interrupt_packet_header *interrupt_packet,
+    uint8_t *data, int data_len)
+{
+    struct bench_stream *stream = priv;
+
+    usbredirparser_free_packet_data(stream->reader, data);
+}
+
+static void bench_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static struct usbredirparser *bench_create_parser(int flags)
+{
+    struct usbredirparser *parser;
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    parser = usbredirparser_create();
+    if (!parser) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    parser->log_func = bench_log;
+    parser->read_func = bench_read;
+    parser->write_func = bench_write;
+    parser->control_packet_func = bench_control_packet;
+    parser->bulk_packet_func = bench_bulk_packet;
+    parser->iso_packet_func = bench_iso_packet;
+    parser->interrupt_packet_func = bench_interrupt_packet;
+    parser->ep_info_func = bench_ep_info;
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
+    usbredirparser_init(parser, BENCH_VERSION, caps, USB_REDIR_CAPS_SIZE,
+                        flags);
+    return parser;
+}
+
+/* The read and write callbacks get the stream through the parser priv,
+   since a parser reads from one and writes to the other stream we switch
+   priv around before calling do_read / do_write */
+static void bench_do_write(struct usbredirparser *parser,
+                           struct bench_stream *stream)
+{
+    parser->priv = stream;
+    if (usbredirparser_do_write(parser)) {
+        fprintf(stderr, "Error writing packets\n");
+        exit(1);
+    }
+}
+
+static void bench_do_read(struct usbredirparser *parser,
+                          struct bench_stream *stream)
+{
+    parser->priv = stream;
+    stream->reader = parser;
+    while (stream->pos < stream->len) {
+        if (usbredirparser_do_read(parser)) {
+            fprintf(stderr, "Error parsing packets\n");
+            exit(1);
+        }
+    }
+    stream->len = stream->pos = 0;
+}
+
+static void bench_send_packet(struct usbredirparser *parser,
+    const struct bench_packet *pkt, uint64_t id)
+{
+    uint8_t *data = NULL;
+    int data_len = 0;
+
+    /* Only send data in the direction the data flows for the ep */
+    if (!!(pkt->endpoint & 0x80) == !!pkt->to_guest && pkt->length) {
+        data = payload;
+        data_len = pkt->length;
+    }
+
+    switch (pkt->type) {
+    case usb_redir_control_packet: {
+        struct usb_redir_control_packet_header control_packet = {
+            .endpoint    = pkt->endpoint,
+            .request     = 0x06, /* GET_DESCRIPTOR */
+            .requesttype = pkt->endpoint,
+            .value       = 0x0100,
+            .length      = pkt->length,
+        };
+        usbredirparser_send_control_packet(parser, id, &control_packet,
+                                           data, data_len);
+        break;
+    }
+    case usb_redir_bulk_packet: {
+        struct usb_redir_bulk_packet_header bulk_packet = {
+            .endpoint    = pkt->endpoint,
+            .length      = pkt->length,
+            .length_high = pkt->length >> 16,
+        };
+        usbredirparser_send_bulk_packet(parser, id, &bulk_packet,
+                                        data, data_len);
+        break;
+    }
+    case usb_redir_iso_packet: {
+        struct usb_redir_iso_packet_header iso_packet = {
+            .endpoint = pkt->endpoint,
+            .length   = pkt->length,
+        };
+        usbredirparser_send_iso_packet(parser, id, &iso_packet,
+                                       data, data_len);
+        break;
+    }
+    case usb_redir_interrupt_packet: {
+        struct usb_redir_interrupt_packet_header interrupt_packet = {
+            .endpoint = pkt->endpoint,
+            .length   = pkt->length,
+        };
+        usbredirparser_send_interrupt_packet(parser, id, &interrupt_packet,
+                                             data, data_len);
+        break;
+    }
+    }
+}
+
+static int bench_wire_len(const struct bench_packet *pkt)
+{
+    int len = sizeof(struct usb_redir_header);
+
+    switch (pkt->type) {
+    case usb_redir_control_packet:
+        len += sizeof(struct usb_redir_control_packet_header);
+        break;
+    case usb_redir_bulk_packet:
+        len += sizeof(struct usb_redir_bulk_packet_header);
+        break;
+    case usb_redir_iso_packet:
+        len += sizeof(struct usb_redir_iso_packet_header);
+        break;
+    case usb_redir_interrupt_packet:
+        len += sizeof(struct usb_redir_interrupt_packet_header);
+        break;
+    }
+    if (!!(pkt->endpoint & 0x80) == !!pkt->to_guest)
+        len += pkt->length;
+
+    return len;
+}
+
+static void bench_print(const char *name, const char *op,
+                        struct bench_stats *stats)
+{
+    double secs = stats->nsecs / 1e9;
+    double pkts = stats->packets;
+
+    printf("%-14s %-6s %12.0f %10.1f", name, op,
+           secs ? pkts / secs : 0.0,
+           secs ? stats->bytes / secs / 1e6 : 0.0);
+#ifdef HAVE_ALLOC_COUNT
+    printf(" %11.2f", stats->allocs / pkts);
+#else
+    printf(" %11s", "-");
+#endif
+    if (stats->cycles)
+        printf(" %11.0f\n", stats->cycles / pkts);
+    else
+        printf(" %11s\n", "-");
+}
+
+static void bench_run(const struct bench_workload *workload,
+                      uint64_t packet_count)
+{
+    struct bench_stream to_guest = { NULL, }, to_host = { NULL, };
+    struct bench_stats write_stats = { 0, }, read_stats = { 0, };
+    struct usbredirparser *host, *guest;
+    struct usb_redir_ep_info_header ep_info;
+    struct bench_mark mark;
+    uint64_t id = 0;
+    int i, n;
+
+    host = bench_create_parser(usbredirparser_fl_usb_host);
+    guest = bench_create_parser(0);
+
+    /* Exchange hello-s so that both sides use 64 bit ids, etc. */
+    bench_do_write(host, &to_guest);
+    bench_do_write(guest, &to_host);
+    bench_do_read(host, &to_host);
+    bench_do_read(guest, &to_guest);
+
+    /* Let the guest know the max packet sizes of the eps used */
+    memset(&ep_info, 0, sizeof(ep_info));
+    for (i = 0; i < 32; i++) {
+        ep_info.type[i] = usb_redir_type_invalid;
+    }
+    for (i = 0; i < workload->packet_count; i++) {
+        uint8_t ep = workload->packets[i].endpoint;
+        int idx = ((ep & 0x80) >> 3) | (ep & 0x0f);
+
+        ep_info.type[idx] = workload->packets[i].type - usb_redir_control_packet;
+        ep_info.max_packet_size[idx] = 1024;
+        if (workload->packets[i].type == usb_redir_iso_packet)
+            ep_info.max_packet_size[idx] = 3072;
+    }
+    usbredirparser_send_ep_info(host, &ep_info);
+    bench_do_write(host, &to_guest);
+    bench_do_read(guest, &to_guest);
+
+    while (write_stats.packets < packet_count) {
+        /* Queue and write a batch in each direction */
+        for (n = 0; n < 2; n++) {
+            struct usbredirparser *sender = n ? host : guest;
+            struct usbredirparser *receiver = n ? guest : host;
+            struct bench_stream *stream = n ? &to_guest : &to_host;
+            uint64_t pkts = 0, bytes = 0;
+
+            bench_mark_start(&mark);
+            for (i = 0; i < BATCH_SIZE; i++) {
+                const struct bench_packet *pkt =
+                    &workload->packets[(id + i) % workload->packet_count];
+
+                if (pkt->to_guest != n)
+                    continue;
+                bench_send_packet(sender, pkt, id + i);
+                pkts++;
+                bytes += bench_wire_len(pkt);
+            }
+            bench_do_write(sender, stream);
+            bench_mark_stop(&mark, &write_stats);
+            write_stats.packets += pkts;
+            write_stats.bytes += bytes;
+
+            bench_mark_start(&mark);
+            bench_do_read(receiver, stream);
+            bench_mark_stop(&mark, &read_stats);
+            read_stats.packets += pkts;
+            read_stats.bytes += bytes;
+        }
+        id += BATCH_SIZE;
+    }
+
+    bench_print(workload->name, "write", &write_stats);
+    bench_print(workload->name, "read", &read_stats);
+
+    usbredirparser_destroy(host);
+    usbredirparser_destroy(guest);
+    free(to_guest.buf);
+    free(to_host.buf);
+}
+
+static void usage(int exit_code, char *argv0)
+{
+    int i;
+
+    fprintf(exit_code? stderr:stdout,
+        "Usage: %s [-w|--workload <name>] [-n|--packets <count>]\n"
+        "          [-c|--chunk <bytes>] [-v|--verbose <0-5>]\n"
+        "Workloads:\n", argv0);
+    for (i = 0; i < WORKLOAD_COUNT; i++) {
+        fprintf(exit_code? stderr:stdout, "  %-14s %s\n",
+                workloads[i].name, workloads[i].desc);
+    }
+    exit(exit_code);
+}
+
+static const struct option longopts[] = {
+    { "workload", required_argument, NULL, 'w' },
+    { "packets", required_argument, NULL, 'n' },
+    { "chunk", required_argument, NULL, 'c' },
+    { "verbose", required_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+    int i, o, found = 0;
+    char *endptr, *workload = NULL;
+    uint64_t packet_count = 1000000;
+
+    while ((o = getopt_long(argc, argv, "hw:n:c:v:", longopts, NULL)) != -1) {
+        switch (o) {
+        case 'w':
+            workload = optarg;
+            break;
+        case 'n':
+            packet_count = strtoull(optarg, &endptr, 10);
+            if (*endptr != '\0' || packet_count == 0) {
+                fprintf(stderr, "Invalid value for --packets: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'c':
+            read_chunk = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || read_chunk <= 0) {
+                fprintf(stderr, "Invalid value for --chunk: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'v':
+            verbose = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "Invalid value for --verbose: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case '?':
+        case 'h':
+            usage(o == '?', argv[0]);
+            break;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "Excess non option arguments\n");
+        usage(1, argv[0]);
+    }
+
+    memset(payload, 0xa5, sizeof(payload));
+
+    printf("%-14s %-6s %12s %10s %11s %11s\n", "workload", "op",
+           "packets/s", "MB/s", "allocs/pkt", "cycles/pkt");
+    for (i = 0; i < WORKLOAD_COUNT; i++) {
+        if (workload && strcmp(workload, workloads[i].name))
+            continue;
+        bench_run(&workloads[i], packet_count);
+        found = 1;
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown workload: '%s'\n", workload);
+        usage(1, argv[0]);
+    }
+
+    exit(0);
+}
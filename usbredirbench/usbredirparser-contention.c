@@ -0,0 +1,512 @@
+/* usbredirparser-contention.c usbredirparser write queue contention benchmark
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This benchmark has a number of producer threads sending bulk packets
+   through a single usbredirparser, while one writer thread drains it with
+   usbredirparser_do_write into a write callback which discards the data
+   (optionally after a busy wait, to simulate a slow connection). It reports
+   the total packet rate and the time spent in usbredirparser_send_*, with
+   the default locked write queue and with
+   usbredirparser_fl_lockfree_write_queue, using either pthread mutexes
+   through the lock callbacks or usbredirparser_fl_builtin_lock.
+
+   With --interrupt an extra thread sends an interrupt packet every 100 us,
+   and the time from queueing these to them getting written is reported,
+   this shows the effect of --priority (usbredirparser_fl_write_priority)
+   when the bulk packets build up a backlog (see --write-delay).
+
+   With --endpoints each producer sends to its own endpoint, producer n
+   sending packets of --size / (n + 1) bytes, and the share of the written
+   bytes each endpoint got while all producers were running is reported.
+   With --priority the endpoints share the bandwidth by bytes (see
+   usbredirparser_set_endpoint_weight and --weight), rather than the
+   producer of the largest packets getting most of it. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "usbredirparser.h"
+
+#define BENCH_VERSION "usbredirparser-contention " PACKAGE_VERSION
+
+#define MAX_THREADS 64
+/* Producers back off when this many packets are queued */
+#define MAX_QUEUED 4096
+/* Max number of interrupt packet latencies recorded */
+#define MAX_INTERRUPT_SAMPLES 100000
+/* With --endpoints producer n uses endpoint FIRST_ENDPOINT + n */
+#define FIRST_ENDPOINT 0x84
+#define MAX_ENDPOINT_THREADS (0x90 - FIRST_ENDPOINT)
+
+struct bench_thread {
+    pthread_t thread;
+    struct bench *bench;
+    int index;
+    uint32_t *latencies;
+};
+
+struct bench {
+    struct usbredirparser *parser;
+    struct bench_thread threads[MAX_THREADS];
+    int thread_count;
+    int producers_done;
+    uint64_t bytes_written;
+    /* Only accessed from the writer thread */
+    uint32_t *interrupt_latencies;
+    int interrupt_count;
+    uint64_t endpoint_bytes[MAX_THREADS];
+};
+
+static int verbose = usbredirparser_warning;
+static uint64_t packet_count = 200000; /* per producer */
+static int packet_size = 64;
+static int write_delay; /* ns */
+static int interrupt;
+static int priority;
+static int endpoints;
+static int weight = 1;
+static uint8_t payload[65536];
+
+static uint64_t bench_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/****** Parser callbacks ******/
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= verbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+static int bench_read(void *priv, uint8_t *data, int count)
+{
+    return 0;
+}
+
+static int bench_write(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+    uint64_t end;
+
+    if (write_delay) {
+        end = bench_nsecs() + write_delay;
+        while (bench_nsecs() < end)
+            ;
+    }
+    bench->bytes_written += count;
+
+    /* Interrupt packets carry their queueing time as (last 8 bytes of)
+       data, bench_writer's do_write always writes whole packets */
+    if (*(uint32_t *)data == usb_redir_interrupt_packet &&
+            bench->interrupt_count < MAX_INTERRUPT_SAMPLES) {
+        uint64_t queued;
+
+        memcpy(&queued, data + count - sizeof(queued), sizeof(queued));
+        bench->interrupt_latencies[bench->interrupt_count++] =
+            bench_nsecs() - queued;
+    }
+
+    /* Without a hello from the peer the parser uses 32 bit ids, so the
+       bulk packet header, starting with the endpoint, is at offset 12 */
+    if (endpoints && *(uint32_t *)data == usb_redir_bulk_packet &&
+            !__atomic_load_n(&bench->producers_done, __ATOMIC_ACQUIRE))
+        bench->endpoint_bytes[data[12] - FIRST_ENDPOINT] += count;
+    return count;
+}
+
+static void *bench_alloc_lock(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(*mutex));
+
+    if (!mutex) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    pthread_mutex_init(mutex, NULL);
+    return mutex;
+}
+
+static void bench_lock(void *lock)
+{
+    pthread_mutex_lock(lock);
+}
+
+static void bench_unlock(void *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+static void bench_free_lock(void *lock)
+{
+    pthread_mutex_destroy(lock);
+    free(lock);
+}
+
+/****** Threads ******/
+
+static void *bench_producer(void *arg)
+{
+    struct bench_thread *thread = arg;
+    struct usbredirparser *parser = thread->bench->parser;
+    int size = endpoints ? packet_size / (thread->index + 1) : packet_size;
+    struct usb_redir_bulk_packet_header bulk_packet = {
+        .endpoint    = endpoints ? FIRST_ENDPOINT + thread->index : 0x81,
+        .status      = usb_redir_success,
+        .length      = size,
+        .length_high = size >> 16,
+    };
+    uint64_t i, start;
+
+    for (i = 0; i < packet_count; i++) {
+        while (usbredirparser_has_data_to_write(parser) > MAX_QUEUED)
+            sched_yield();
+
+        start = bench_nsecs();
+        usbredirparser_send_bulk_packet(parser,
+                                        (uint64_t)thread->index << 32 | i,
+                                        &bulk_packet, payload, size);
+        thread->latencies[i] = bench_nsecs() - start;
+    }
+    __atomic_add_fetch(&thread->bench->producers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *bench_interrupt(void *arg)
+{
+    struct bench *bench = arg;
+    struct usb_redir_interrupt_packet_header interrupt_packet = {
+        .endpoint = 0x83,
+        .status   = usb_redir_success,
+        .length   = sizeof(uint64_t),
+    };
+    struct timespec delay = { 0, 100000 };
+    uint64_t id = 0, now;
+
+    while (__atomic_load_n(&bench->producers_done, __ATOMIC_ACQUIRE) <
+                bench->thread_count) {
+        now = bench_nsecs();
+        usbredirparser_send_interrupt_packet(bench->parser, id++,
+                                             &interrupt_packet,
+                                             (uint8_t *)&now, sizeof(now));
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+static void *bench_writer(void *arg)
+{
+    struct bench *bench = arg;
+
+    while (__atomic_load_n(&bench->producers_done, __ATOMIC_ACQUIRE) <
+                bench->thread_count ||
+            usbredirparser_has_data_to_write(bench->parser)) {
+        if (usbredirparser_do_write(bench->parser)) {
+            fprintf(stderr, "Error writing\n");
+            exit(1);
+        }
+        if (!usbredirparser_has_data_to_write(bench->parser))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+    uint32_t l1 = *(const uint32_t *)a, l2 = *(const uint32_t *)b;
+
+    return (l1 > l2) - (l1 < l2);
+}
+
+static void bench_run(int threads, int lockfree, int builtin_lock)
+{
+    struct usbredirparser_lock_stats lock_stats;
+    struct bench bench;
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+    uint32_t *latencies;
+    uint64_t i, total, sum = 0, start, nsecs;
+    pthread_t writer, interrupt_thread;
+    int t, flags;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.thread_count = threads;
+
+    bench.parser = usbredirparser_create();
+    if (!bench.parser) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    bench.parser->priv = &bench;
+    bench.parser->log_func = bench_log;
+    bench.parser->read_func = bench_read;
+    bench.parser->write_func = bench_write;
+    if (!builtin_lock) {
+        bench.parser->alloc_lock_func = bench_alloc_lock;
+        bench.parser->lock_func = bench_lock;
+        bench.parser->unlock_func = bench_unlock;
+        bench.parser->free_lock_func = bench_free_lock;
+    }
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    flags = usbredirparser_fl_usb_host | usbredirparser_fl_no_hello;
+    if (lockfree)
+        flags |= usbredirparser_fl_lockfree_write_queue;
+    if (builtin_lock)
+        flags |= usbredirparser_fl_builtin_lock;
+    if (priority)
+        flags |= usbredirparser_fl_write_priority;
+    usbredirparser_init(bench.parser, BENCH_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE, flags);
+    if (endpoints)
+        usbredirparser_set_endpoint_weight(bench.parser, FIRST_ENDPOINT,
+                                           weight);
+
+    total = packet_count * threads;
+    latencies = malloc(total * sizeof(uint32_t));
+    bench.interrupt_latencies =
+        malloc(MAX_INTERRUPT_SAMPLES * sizeof(uint32_t));
+    if (!latencies || !bench.interrupt_latencies) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+
+    start = bench_nsecs();
+    for (t = 0; t < threads; t++) {
+        bench.threads[t].bench = &bench;
+        bench.threads[t].index = t;
+        bench.threads[t].latencies = latencies + t * packet_count;
+        if (pthread_create(&bench.threads[t].thread, NULL, bench_producer,
+                           &bench.threads[t])) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(1);
+        }
+    }
+    if (pthread_create(&writer, NULL, bench_writer, &bench) ||
+            (interrupt && pthread_create(&interrupt_thread, NULL,
+                                         bench_interrupt, &bench))) {
+        fprintf(stderr, "Error creating thread\n");
+        exit(1);
+    }
+    for (t = 0; t < threads; t++)
+        pthread_join(bench.threads[t].thread, NULL);
+    if (interrupt)
+        pthread_join(interrupt_thread, NULL);
+    pthread_join(writer, NULL);
+    nsecs = bench_nsecs() - start;
+
+    for (i = 0; i < total; i++)
+        sum += latencies[i];
+    qsort(latencies, total, sizeof(uint32_t), bench_cmp_latency);
+
+    printf("%-9s %-8s %7d %12.0f %10.1f %9.0f %9u %9u %10u\n",
+           lockfree ? "lockfree" : "locked",
+           builtin_lock ? "builtin" : "pthread", threads,
+           total * 1e9 / nsecs, bench.bytes_written * 1e3 / nsecs,
+           (double)sum / total, latencies[total / 2],
+           latencies[total * 99 / 100], latencies[total - 1]);
+    if (usbredirparser_get_lock_stats(bench.parser, &lock_stats) == 0 &&
+            lock_stats.acquired)
+        printf("  lock: %" PRIu64 " acquired, %" PRIu64 " contended "
+               "(%.2f%%), wait avg %.0f ns, hold avg %.0f ns max %" PRIu64
+               " ns\n", lock_stats.acquired, lock_stats.contended,
+               lock_stats.contended * 100.0 / lock_stats.acquired,
+               lock_stats.contended ?
+                   (double)lock_stats.wait_ns / lock_stats.contended : 0.0,
+               (double)lock_stats.hold_ns / lock_stats.acquired,
+               lock_stats.max_hold_ns);
+    if (bench.interrupt_count) {
+        qsort(bench.interrupt_latencies, bench.interrupt_count,
+              sizeof(uint32_t), bench_cmp_latency);
+        printf("  interrupt: %d packets, queued to written p50 %u ns "
+               "p99 %u ns max %u ns\n", bench.interrupt_count,
+               bench.interrupt_latencies[bench.interrupt_count / 2],
+               bench.interrupt_latencies[bench.interrupt_count * 99 / 100],
+               bench.interrupt_latencies[bench.interrupt_count - 1]);
+    }
+    if (endpoints) {
+        for (i = 0, sum = 0; i < threads; i++)
+            sum += bench.endpoint_bytes[i];
+        printf("  endpoints: share of bytes written");
+        for (i = 0; i < threads && sum; i++)
+            printf(" %02x %.1f%%", (unsigned)(FIRST_ENDPOINT + i),
+                   bench.endpoint_bytes[i] * 100.0 / sum);
+        printf("\n");
+    }
+
+    free(latencies);
+    free(bench.interrupt_latencies);
+    usbredirparser_destroy(bench.parser);
+}
+
+static void usage(int exit_code, char *argv0)
+{
+    fprintf(exit_code? stderr:stdout,
+        "Usage: %s [-t|--threads <n>] [-n|--packets <count>]\n"
+        "          [-s|--size <bytes>] [-d|--write-delay <ns>]\n"
+        "          [-m|--mode <locked|lockfree>]\n"
+        "          [-l|--lock <pthread|builtin>] [-i|--interrupt]\n"
+        "          [-p|--priority] [-e|--endpoints] [-w|--weight <n>]\n"
+        "          [-v|--verbose <0-5>]\n"
+        "Without --threads runs with 1, 2, 4 and 8 producer threads, without\n"
+        "--mode / --lock runs all combinations, --packets is the count per\n"
+        "producer. Lock statistics for the builtin lock are printed when\n"
+        "usbredir is configured with --enable-lock-stats. --weight sets the\n"
+        "endpoint weight of the first producer with --endpoints\n",
+        argv0);
+    exit(exit_code);
+}
+
+static const struct option longopts[] = {
+    { "threads", required_argument, NULL, 't' },
+    { "packets", required_argument, NULL, 'n' },
+    { "size", required_argument, NULL, 's' },
+    { "write-delay", required_argument, NULL, 'd' },
+    { "mode", required_argument, NULL, 'm' },
+    { "lock", required_argument, NULL, 'l' },
+    { "interrupt", no_argument, NULL, 'i' },
+    { "priority", no_argument, NULL, 'p' },
+    { "endpoints", no_argument, NULL, 'e' },
+    { "weight", required_argument, NULL, 'w' },
+    { "verbose", required_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static long parse_int(const char *opt, const char *arg, long max, char *argv0)
+{
+    char *endptr;
+    long l = strtol(arg, &endptr, 10);
+
+    if (*endptr != '\0' || l < 0 || l > max) {
+        fprintf(stderr, "Invalid value for --%s: '%s'\n", opt, arg);
+        usage(1, argv0);
+    }
+    return l;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int default_threads[] = { 1, 2, 4, 8 };
+    int i, o, mode, lock, threads = 0;
+    int modes = 3; /* bit 0 locked, bit 1 lockfree */
+    int locks = 3; /* bit 0 pthread, bit 1 builtin */
+
+    while ((o = getopt_long(argc, argv, "ht:n:s:d:m:l:ipew:v:", longopts,
+                            NULL)) != -1) {
+        switch (o) {
+        case 't':
+            threads = parse_int("threads", optarg, MAX_THREADS, argv[0]);
+            break;
+        case 'n':
+            packet_count = parse_int("packets", optarg, 100000000, argv[0]);
+            break;
+        case 's':
+            packet_size = parse_int("size", optarg, sizeof(payload), argv[0]);
+            break;
+        case 'd':
+            write_delay = parse_int("write-delay", optarg, 1000000000,
+                                    argv[0]);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "locked")) {
+                modes = 1;
+            } else if (!strcmp(optarg, "lockfree")) {
+                modes = 2;
+            } else {
+                fprintf(stderr, "Invalid value for --mode: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'l':
+            if (!strcmp(optarg, "pthread")) {
+                locks = 1;
+            } else if (!strcmp(optarg, "builtin")) {
+                locks = 2;
+            } else {
+                fprintf(stderr, "Invalid value for --lock: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'i':
+            interrupt = 1;
+            break;
+        case 'p':
+            priority = 1;
+            break;
+        case 'e':
+            endpoints = 1;
+            break;
+        case 'w':
+            weight = parse_int("weight", optarg, 256, argv[0]);
+            break;
+        case 'v':
+            verbose = parse_int("verbose", optarg, 5, argv[0]);
+            break;
+        case '?':
+        case 'h':
+            usage(o == '?', argv[0]);
+            break;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "Excess non option arguments\n");
+        usage(1, argv[0]);
+    }
+    if (!packet_count) {
+        fprintf(stderr, "--packets must be at least 1\n");
+        usage(1, argv[0]);
+    }
+    if (!weight) {
+        fprintf(stderr, "--weight must be at least 1\n");
+        usage(1, argv[0]);
+    }
+    if (endpoints && threads > MAX_ENDPOINT_THREADS) {
+        fprintf(stderr, "--endpoints supports at most %d threads\n",
+                MAX_ENDPOINT_THREADS);
+        usage(1, argv[0]);
+    }
+
+    printf("%-9s %-8s %7s %12s %10s %9s %9s %9s %10s\n", "queue", "lock",
+           "threads", "packets/s", "MB/s", "send ns", "p50 ns", "p99 ns",
+           "max ns");
+    for (i = 0; i < 4; i++) {
+        int t = threads ? threads : default_threads[i];
+
+        for (mode = 0; mode < 2; mode++) {
+            for (lock = 0; lock < 2; lock++) {
+                if ((modes & (1 << mode)) && (locks & (1 << lock)))
+                    bench_run(t, mode, lock);
+            }
+        }
+        if (threads)
+            break;
+    }
+
+    exit(0);
+}
@@ -0,0 +1,529 @@
+/* usbredirparserfuzz.c usbredirparser_do_read fuzz target
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* libFuzzer target for usbredirparser_do_read and the packet verification
+   code behind it. The input is fed to the parser through a read callback
+   which splits it at (pseudo) random boundaries, and which now and then
+   returns 0 (would block), so that all the partial read states of the
+   parser get exercised.
+
+   Input layout:
+   byte 0:    bit 0: parse as usb-host (else as usb-guest)
+              bit 1: serialize + unserialize the parser after each read
+              bit 2: read packet data into get_data_buffer_func buffers
+   byte 1:    log2 of the max read fragment size (0 - 16)
+   bytes 2-3: seed for the fragmentation
+   bytes 4-7: caps[0] of the parser, this controls the header len, etc.
+   remainder: the usbredir stream as received from the peer
+
+   When configured with --enable-fuzzing this is linked against libFuzzer.
+   Otherwise a standalone driver is build, which runs the given inputs once
+   (to reproduce crashes), or with --bench reports the parse throughput for
+   a range of fixed read fragment sizes, to check the sensitivity of the
+   read path to fragmentation. The driver can also turn a capture made with
+   usbredirparser_start_capture() into a corpus file, see --from-capture. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#ifndef USBREDIR_FUZZING_ENGINE
+#include <getopt.h>
+#endif
+#include "usbredirparser.h"
+
+#define FUZZ_VERSION "usbredirparserfuzz " PACKAGE_VERSION
+#define FUZZ_HEADER_LEN 8
+
+#define FUZZ_FL_USB_HOST  0x01
+#define FUZZ_FL_SERIALIZE 0x02
+#define FUZZ_FL_DATA_BUFFER 0x04
+
+struct fuzz {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    uint32_t seed;
+    int max_fragment;
+    int would_block;
+    int use_data_buffer;
+};
+
+/* Packet data buffer handed out by fuzz_get_data_buffer */
+static uint8_t fuzz_data_buffer[65536];
+
+/* 0 for the fragmentation from the input, or a fixed read size */
+static int fixed_fragment;
+
+static uint32_t fuzz_random(struct fuzz *fuzz)
+{
+    /* xorshift32, seed must be non 0 */
+    fuzz->seed ^= fuzz->seed << 13;
+    fuzz->seed ^= fuzz->seed >> 17;
+    fuzz->seed ^= fuzz->seed << 5;
+    return fuzz->seed;
+}
+
+static void fuzz_log(void *priv, int level, const char *msg)
+{
+}
+
+static int fuzz_read(void *priv, uint8_t *data, int count)
+{
+    struct fuzz *fuzz = priv;
+    int len;
+
+    if (fixed_fragment) {
+        len = fixed_fragment;
+    } else {
+        /* Now and then pretend the read would block */
+        if (!fuzz->would_block && (fuzz_random(fuzz) & 7) == 0) {
+            fuzz->would_block = 1;
+            return 0;
+        }
+        fuzz->would_block = 0;
+        len = 1 + fuzz_random(fuzz) % fuzz->max_fragment;
+    }
+
+    if (len > count)
+        len = count;
+    if (len > fuzz->len - fuzz->pos)
+        len = fuzz->len - fuzz->pos;
+    memcpy(data, fuzz->data + fuzz->pos, len);
+    fuzz->pos += len;
+    return len;
+}
+
+static int fuzz_write(void *priv, uint8_t *data, int count)
+{
+    return count;
+}
+
+/* The packets are only parsed, so all callbacks are no-ops */
+#define FUZZ_STUB(name, header_type) \
+static void fuzz_##name(void *priv, uint64_t id, \
+    struct header_type *header) {}
+#define FUZZ_DATA_STUB(name, header_type) \
+static void fuzz_##name(void *priv, uint64_t id, \
+    struct header_type *header, uint8_t *data, int data_len) \
+{ \
+    if (data != fuzz_data_buffer) \
+        free(data); \
+}
+
+FUZZ_STUB(set_configuration, usb_redir_set_configuration_header)
+FUZZ_STUB(configuration_status, usb_redir_configuration_status_header)
+FUZZ_STUB(set_alt_setting, usb_redir_set_alt_setting_header)
+FUZZ_STUB(get_alt_setting, usb_redir_get_alt_setting_header)
+FUZZ_STUB(alt_setting_status, usb_redir_alt_setting_status_header)
+FUZZ_STUB(start_iso_stream, usb_redir_start_iso_stream_header)
+FUZZ_STUB(stop_iso_stream, usb_redir_stop_iso_stream_header)
+FUZZ_STUB(iso_stream_status, usb_redir_iso_stream_status_header)
+FUZZ_STUB(start_interrupt_receiving,
+          usb_redir_start_interrupt_receiving_header)
+FUZZ_STUB(stop_interrupt_receiving,
+          usb_redir_stop_interrupt_receiving_header)
+FUZZ_STUB(interrupt_receiving_status,
+          usb_redir_interrupt_receiving_status_header)
+FUZZ_STUB(alloc_bulk_streams, usb_redir_alloc_bulk_streams_header)
+FUZZ_STUB(free_bulk_streams, usb_redir_free_bulk_streams_header)
+FUZZ_STUB(bulk_streams_status, usb_redir_bulk_streams_status_header)
+FUZZ_STUB(start_bulk_receiving, usb_redir_start_bulk_receiving_header)
+FUZZ_STUB(stop_bulk_receiving, usb_redir_stop_bulk_receiving_header)
+FUZZ_STUB(bulk_receiving_status, usb_redir_bulk_receiving_status_header)
+FUZZ_DATA_STUB(control_packet, usb_redir_control_packet_header)
+FUZZ_DATA_STUB(bulk_packet, usb_redir_bulk_packet_header)
+FUZZ_DATA_STUB(iso_packet, usb_redir_iso_packet_header)
+FUZZ_DATA_STUB(interrupt_packet, usb_redir_interrupt_packet_header)
+FUZZ_DATA_STUB(buffered_bulk_packet, usb_redir_buffered_bulk_packet_header)
+
+static void fuzz_void(void *priv) {}
+static void fuzz_id(void *priv, uint64_t id) {}
+
+static void fuzz_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect) {}
+static void fuzz_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info) {}
+static void fuzz_ep_info(void *priv,
+    struct usb_redir_ep_info_header *ep_info) {}
+static void fuzz_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count) { free(rules); }
+static void fuzz_descriptors(void *priv,
+    struct usb_redir_descriptors_header *descriptors,
+    uint8_t *data, int data_len) { free(data); }
+
+static uint8_t *fuzz_get_data_buffer(void *priv, uint64_t id,
+    uint32_t type, void *type_header, int data_len)
+{
+    struct fuzz *fuzz = priv;
+
+    if (!fuzz->use_data_buffer || data_len > sizeof(fuzz_data_buffer))
+        return NULL;
+    return fuzz_data_buffer;
+}
+
+static struct usbredirparser *fuzz_create_parser(struct fuzz *fuzz)
+{
+    struct usbredirparser *parser;
+
+    parser = usbredirparser_create();
+    if (!parser)
+        return NULL;
+
+    parser->priv = fuzz;
+    parser->log_func = fuzz_log;
+    parser->read_func = fuzz_read;
+    parser->write_func = fuzz_write;
+    parser->device_connect_func = fuzz_device_connect;
+    parser->device_disconnect_func = fuzz_void;
+    parser->reset_func = fuzz_void;
+    parser->interface_info_func = fuzz_interface_info;
+    parser->ep_info_func = fuzz_ep_info;
+    parser->set_configuration_func = fuzz_set_configuration;
+    parser->get_configuration_func = fuzz_id;
+    parser->configuration_status_func = fuzz_configuration_status;
+    parser->set_alt_setting_func = fuzz_set_alt_setting;
+    parser->get_alt_setting_func = fuzz_get_alt_setting;
+    parser->alt_setting_status_func = fuzz_alt_setting_status;
+    parser->start_iso_stream_func = fuzz_start_iso_stream;
+    parser->stop_iso_stream_func = fuzz_stop_iso_stream;
+    parser->iso_stream_status_func = fuzz_iso_stream_status;
+    parser->start_interrupt_receiving_func = fuzz_start_interrupt_receiving;
+    parser->stop_interrupt_receiving_func = fuzz_stop_interrupt_receiving;
+    parser->interrupt_receiving_status_func = fuzz_interrupt_receiving_status;
+    parser->alloc_bulk_streams_func = fuzz_alloc_bulk_streams;
+    parser->free_bulk_streams_func = fuzz_free_bulk_streams;
+    parser->bulk_streams_status_func = fuzz_bulk_streams_status;
+    parser->cancel_data_packet_func = fuzz_id;
+    parser->control_packet_func = fuzz_control_packet;
+    parser->bulk_packet_func = fuzz_bulk_packet;
+    parser->iso_packet_func = fuzz_iso_packet;
+    parser->interrupt_packet_func = fuzz_interrupt_packet;
+    parser->filter_reject_func = fuzz_void;
+    parser->filter_filter_func = fuzz_filter_filter;
+    parser->device_disconnect_ack_func = fuzz_void;
+    parser->start_bulk_receiving_func = fuzz_start_bulk_receiving;
+    parser->stop_bulk_receiving_func = fuzz_stop_bulk_receiving;
+    parser->bulk_receiving_status_func = fuzz_bulk_receiving_status;
+    parser->buffered_bulk_packet_func = fuzz_buffered_bulk_packet;
+    parser->get_data_buffer_func = fuzz_get_data_buffer;
+    parser->descriptors_func = fuzz_descriptors;
+    /* coalesced_interrupt_packet_func is left unset, so that coalesced
+       interrupt packets go through the parser's splitting into
+       interrupt_packet_func calls */
+    return parser;
+}
+
+/* Serialize the parser and replace it with a newly unserialized one */
+static struct usbredirparser *fuzz_reserialize(struct usbredirparser *parser,
+    struct fuzz *fuzz, uint32_t *caps, int flags)
+{
+    struct usbredirparser *new_parser;
+    uint8_t *state;
+    int len;
+
+    if (usbredirparser_serialize(parser, &state, &len))
+        return parser;
+
+    new_parser = fuzz_create_parser(fuzz);
+    if (!new_parser) {
+        free(state);
+        return parser;
+    }
+    usbredirparser_init(new_parser, FUZZ_VERSION, caps, USB_REDIR_CAPS_SIZE,
+                        flags | usbredirparser_fl_no_hello);
+    if (usbredirparser_unserialize(new_parser, state, len)) {
+        /* Unserializing our own state should never fail */
+        abort();
+    }
+    free(state);
+    usbredirparser_destroy(parser);
+    return new_parser;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+    struct usbredirparser *parser;
+    struct fuzz fuzz;
+    int r, flags = 0, reads = 0;
+
+    if (size < FUZZ_HEADER_LEN)
+        return 0;
+
+    memset(&fuzz, 0, sizeof(fuzz));
+    fuzz.data = data + FUZZ_HEADER_LEN;
+    fuzz.len = size - FUZZ_HEADER_LEN;
+    fuzz.max_fragment = 1 << (data[1] % 17);
+    fuzz.seed = (data[2] | (data[3] << 8)) + 1;
+    memcpy(&caps[0], data + 4, sizeof(uint32_t));
+    if (data[0] & FUZZ_FL_USB_HOST)
+        flags |= usbredirparser_fl_usb_host;
+    fuzz.use_data_buffer = !!(data[0] & FUZZ_FL_DATA_BUFFER);
+
+    parser = fuzz_create_parser(&fuzz);
+    if (!parser)
+        return 0;
+    usbredirparser_init(parser, FUZZ_VERSION, caps, USB_REDIR_CAPS_SIZE,
+                        flags);
+
+    while (fuzz.pos < fuzz.len) {
+        r = usbredirparser_do_read(parser);
+        if (r == -1)
+            break;
+        /* -2 means a parse error, the parser skips the bad packet so
+           we can simply continue */
+        usbredirparser_do_write(parser);
+        if ((data[0] & FUZZ_FL_SERIALIZE) && ++reads < 256)
+            parser = fuzz_reserialize(parser, &fuzz, caps, flags);
+    }
+
+    usbredirparser_destroy(parser);
+    return 0;
+}
+
+#ifndef USBREDIR_FUZZING_ENGINE
+
+/* See usbredirparser_start_capture() */
+#define CAPTURE_LINKTYPE 147
+#define CAPTURE_PSEUDO_HEADER_LEN 4
+
+static uint8_t *read_file(const char *filename, size_t *len)
+{
+    uint8_t *buf = NULL;
+    size_t size = 0, r;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    *len = 0;
+    do {
+        if (*len == size) {
+            size = size ? size * 2 : 65536;
+            buf = realloc(buf, size);
+            if (!buf) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(1);
+            }
+        }
+        r = fread(buf + *len, 1, size - *len, f);
+        *len += r;
+    } while (r);
+    if (ferror(f)) {
+        perror(filename);
+        exit(1);
+    }
+    fclose(f);
+    return buf;
+}
+
+/* Turn the received packets of a capture into a corpus file */
+static void from_capture(const char *capture, const char *out)
+{
+    uint8_t fuzz_header[FUZZ_HEADER_LEN] = { 0, 16, 0, 0 };
+    uint32_t *file_header, *record_header;
+    uint8_t *buf, *pseudo_header, *packet;
+    size_t len, pos, packet_len, skipped;
+    int have_caps = 0;
+    FILE *f;
+
+    buf = read_file(capture, &len);
+    file_header = (uint32_t *)buf;
+    if (len < 24 || file_header[0] != 0xa1b2c3d4 ||
+            file_header[5] != CAPTURE_LINKTYPE) {
+        fprintf(stderr, "%s: not a usbredir capture\n", capture);
+        exit(1);
+    }
+
+    f = fopen(out, "wb");
+    if (!f) {
+        perror(out);
+        exit(1);
+    }
+    if (fwrite(fuzz_header, sizeof(fuzz_header), 1, f) != 1)
+        goto write_error;
+
+    for (pos = 24; pos + 16 + CAPTURE_PSEUDO_HEADER_LEN <= len;
+            pos += 16 + record_header[2]) {
+        record_header = (uint32_t *)(buf + pos);
+        pseudo_header = buf + pos + 16;
+        packet = pseudo_header + CAPTURE_PSEUDO_HEADER_LEN;
+        if (record_header[2] < CAPTURE_PSEUDO_HEADER_LEN ||
+                record_header[2] > record_header[3] ||
+                pos + 16 + record_header[2] > len) {
+            fprintf(stderr, "%s: truncated capture\n", capture);
+            break;
+        }
+        packet_len = record_header[2] - CAPTURE_PSEUDO_HEADER_LEN;
+
+        /* Take our caps from our hello */
+        if (pseudo_header[0] == 1 && !have_caps &&
+                packet_len >= pseudo_header[2] +
+                    sizeof(struct usb_redir_hello_header) + sizeof(uint32_t) &&
+                ((struct usb_redir_header *)packet)->type == usb_redir_hello) {
+            fuzz_header[0] = pseudo_header[1] ? FUZZ_FL_USB_HOST : 0;
+            memcpy(fuzz_header + 4, packet + pseudo_header[2] +
+                   sizeof(struct usb_redir_hello_header), sizeof(uint32_t));
+            have_caps = 1;
+        }
+        if (pseudo_header[0] == 0 &&
+                fwrite(packet, packet_len, 1, f) != 1)
+            goto write_error;
+        /* Truncated records are packets whose data the capturing parser
+           skipped, pad them with zeros to keep the stream in sync */
+        for (skipped = record_header[3] - record_header[2];
+                pseudo_header[0] == 0 && skipped; skipped--) {
+            if (fputc(0, f) == EOF)
+                goto write_error;
+        }
+    }
+    if (!have_caps)
+        fprintf(stderr, "%s: warning no hello found, using no caps\n",
+                capture);
+
+    rewind(f);
+    if (fwrite(fuzz_header, sizeof(fuzz_header), 1, f) != 1)
+        goto write_error;
+    if (fclose(f)) {
+        perror(out);
+        exit(1);
+    }
+    free(buf);
+    return;
+
+write_error:
+    perror(out);
+    exit(1);
+}
+
+static uint64_t fuzz_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench(const char *filename, int iterations)
+{
+    static const int fragments[] = { 1, 7, 64, 512, 4096, 65536, 0 };
+    uint64_t start, elapsed;
+    uint8_t *data;
+    size_t len;
+    int i, j;
+
+    data = read_file(filename, &len);
+    printf("%s (%zu bytes)\n", filename, len);
+    for (i = 0; i < sizeof(fragments) / sizeof(fragments[0]); i++) {
+        fixed_fragment = fragments[i];
+        start = fuzz_now();
+        for (j = 0; j < iterations; j++)
+            LLVMFuzzerTestOneInput(data, len);
+        elapsed = fuzz_now() - start;
+        if (fixed_fragment)
+            printf("  fragment %6d", fixed_fragment);
+        else
+            printf("  fragment random");
+        printf(" %9.1f MB/s %9.0f ns/input\n",
+               elapsed ? (double)len * iterations * 1000 / elapsed : 0.0,
+               (double)elapsed / iterations);
+    }
+    fixed_fragment = 0;
+    free(data);
+}
+
+static void usage(int exit_code, char *argv0)
+{
+    fprintf(exit_code? stderr:stdout,
+        "Usage: %s [-b|--bench] [-n|--iterations <n>] <input>...\n"
+        "       %s --from-capture <capture.pcap> <output>\n"
+        "Without --bench each input is run once (to reproduce crashes)\n",
+        argv0, argv0);
+    exit(exit_code);
+}
+
+static const struct option longopts[] = {
+    { "bench", no_argument, NULL, 'b' },
+    { "iterations", required_argument, NULL, 'n' },
+    { "from-capture", no_argument, NULL, 'c' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+    int i, o, do_bench = 0, capture = 0, iterations = 1000;
+    uint8_t *data;
+    size_t len;
+    char *endptr;
+
+    while ((o = getopt_long(argc, argv, "hbn:", longopts, NULL)) != -1) {
+        switch (o) {
+        case 'b':
+            do_bench = 1;
+            break;
+        case 'n':
+            iterations = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || iterations <= 0) {
+                fprintf(stderr, "Invalid value for --iterations: '%s'\n",
+                        optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'c':
+            capture = 1;
+            break;
+        case '?':
+        case 'h':
+            usage(o == '?', argv[0]);
+            break;
+        }
+    }
+
+    if (capture) {
+        if (optind != argc - 2)
+            usage(1, argv[0]);
+        from_capture(argv[optind], argv[optind + 1]);
+        exit(0);
+    }
+
+    if (optind == argc) {
+        fprintf(stderr, "No inputs given\n");
+        usage(1, argv[0]);
+    }
+    for (i = optind; i < argc; i++) {
+        if (do_bench) {
+            bench(argv[i], iterations);
+        } else {
+            data = read_file(argv[i], &len);
+            LLVMFuzzerTestOneInput(data, len);
+            free(data);
+        }
+    }
+    exit(0);
+}
+
+#endif
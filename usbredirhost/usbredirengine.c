@@ -0,0 +1,199 @@
+/* usbredirengine.c libusb event engine shared by usbredirhost instances
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "usbredirhost.h"
+#include "usbredirengine.h"
+
+/* How long an event thread waits for events, before checking for quit */
+#define ENGINE_EVENT_TIMEOUT 100000 /* us */
+
+struct usbredir_engine_ctx {
+    struct usbredirhost_engine *engine;
+    libusb_context *ctx;
+    pthread_t thread;
+    int thread_started;
+    uint64_t events;            /* Protected by the engine mutex */
+};
+
+struct usbredirhost_engine {
+    struct usbredirhost_engine *next;   /* List of all engines */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* Signalled when any ctx handled events */
+    int quit;
+    int ctx_count;
+    int next_ctx;               /* Round robin index for get_context */
+    struct usbredir_engine_ctx ctxs[];
+};
+
+/* All engines, so that usbredirhost_open can find the engine of a ctx */
+static pthread_mutex_t usbredir_engines_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct usbredirhost_engine *usbredir_engines;
+
+static void *usbredir_engine_thread(void *arg)
+{
+    struct usbredir_engine_ctx *ectx = arg;
+    struct usbredirhost_engine *engine = ectx->engine;
+    struct timeval tv;
+
+    while (!engine->quit) {
+        tv.tv_sec = 0;
+        tv.tv_usec = ENGINE_EVENT_TIMEOUT;
+        libusb_handle_events_timeout_completed(ectx->ctx, &tv, &engine->quit);
+
+        pthread_mutex_lock(&engine->mutex);
+        ectx->events++;
+        pthread_cond_broadcast(&engine->cond);
+        pthread_mutex_unlock(&engine->mutex);
+    }
+    return NULL;
+}
+
+struct usbredirhost_engine *usbredirhost_engine_create(int threads)
+{
+    struct usbredirhost_engine *engine;
+    int i;
+
+    if (threads < 1)
+        return NULL;
+
+    engine = calloc(1, sizeof(*engine) + threads * sizeof(engine->ctxs[0]));
+    if (!engine)
+        return NULL;
+
+    pthread_mutex_init(&engine->mutex, NULL);
+    pthread_cond_init(&engine->cond, NULL);
+
+    for (i = 0; i < threads; i++) {
+        engine->ctxs[i].engine = engine;
+        if (libusb_init(&engine->ctxs[i].ctx) != 0)
+            break;
+        engine->ctx_count++;
+        if (pthread_create(&engine->ctxs[i].thread, NULL,
+                           usbredir_engine_thread, &engine->ctxs[i]) != 0)
+            break;
+        engine->ctxs[i].thread_started = 1;
+    }
+    if (i != threads) {
+        usbredirhost_engine_destroy(engine);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&usbredir_engines_mutex);
+    engine->next = usbredir_engines;
+    usbredir_engines = engine;
+    pthread_mutex_unlock(&usbredir_engines_mutex);
+
+    return engine;
+}
+
+void usbredirhost_engine_destroy(struct usbredirhost_engine *engine)
+{
+    struct usbredirhost_engine **e;
+    int i;
+
+    if (!engine)
+        return;
+
+    pthread_mutex_lock(&usbredir_engines_mutex);
+    for (e = &usbredir_engines; *e; e = &(*e)->next) {
+        if (*e == engine) {
+            *e = engine->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&usbredir_engines_mutex);
+
+    pthread_mutex_lock(&engine->mutex);
+    engine->quit = 1;
+    pthread_mutex_unlock(&engine->mutex);
+
+    for (i = 0; i < engine->ctx_count; i++) {
+        if (!engine->ctxs[i].thread_started)
+            continue;
+#if LIBUSB_API_VERSION >= 0x01000105
+        libusb_interrupt_event_handler(engine->ctxs[i].ctx);
+#endif
+        pthread_join(engine->ctxs[i].thread, NULL);
+    }
+    for (i = 0; i < engine->ctx_count; i++)
+        libusb_exit(engine->ctxs[i].ctx);
+
+    pthread_cond_destroy(&engine->cond);
+    pthread_mutex_destroy(&engine->mutex);
+    free(engine);
+}
+
+libusb_context *usbredirhost_engine_get_context(
+    struct usbredirhost_engine *engine)
+{
+    libusb_context *ctx;
+
+    pthread_mutex_lock(&engine->mutex);
+    ctx = engine->ctxs[engine->next_ctx].ctx;
+    engine->next_ctx = (engine->next_ctx + 1) % engine->ctx_count;
+    pthread_mutex_unlock(&engine->mutex);
+    return ctx;
+}
+
+struct usbredir_engine_ctx *usbredir_engine_find(libusb_context *ctx)
+{
+    struct usbredirhost_engine *engine;
+    struct usbredir_engine_ctx *ectx = NULL;
+    int i;
+
+    pthread_mutex_lock(&usbredir_engines_mutex);
+    for (engine = usbredir_engines; engine && !ectx; engine = engine->next) {
+        for (i = 0; i < engine->ctx_count; i++) {
+            if (engine->ctxs[i].ctx == ctx) {
+                ectx = &engine->ctxs[i];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&usbredir_engines_mutex);
+    return ectx;
+}
+
+uint64_t usbredir_engine_events(struct usbredir_engine_ctx *ectx)
+{
+    uint64_t events;
+
+    pthread_mutex_lock(&ectx->engine->mutex);
+    events = ectx->events;
+    pthread_mutex_unlock(&ectx->engine->mutex);
+    return events;
+}
+
+void usbredir_engine_wait(struct usbredir_engine_ctx *ectx, uint64_t events)
+{
+    struct usbredirhost_engine *engine = ectx->engine;
+
+    pthread_mutex_lock(&engine->mutex);
+    while (ectx->events == events && !engine->quit)
+        pthread_cond_wait(&engine->cond, &engine->mutex);
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+int usbredir_engine_is_current(struct usbredir_engine_ctx *ectx)
+{
+    return pthread_equal(pthread_self(), ectx->thread);
+}
@@ -0,0 +1,42 @@
+/* usbredirengine.h usbredirhost internal libusb event engine interface
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRENGINE_H
+#define __USBREDIRENGINE_H
+
+/* The public part of the engine api lives in usbredirhost.h, these are
+   the functions used by usbredirhost itself. */
+
+#include <stdint.h>
+#include <libusb.h>
+
+/* One libusb context of an engine, with the thread handling its events */
+struct usbredir_engine_ctx;
+
+/* Returns the engine context for ctx, or NULL if ctx is not owned by an
+   usbredirhost_engine */
+struct usbredir_engine_ctx *usbredir_engine_find(libusb_context *ctx);
+/* Returns a counter which gets incremented each time the event thread has
+   handled events, pass this to usbredir_engine_wait */
+uint64_t usbredir_engine_events(struct usbredir_engine_ctx *ectx);
+/* Wait until the event thread has handled events since
+   usbredir_engine_events returned events */
+void usbredir_engine_wait(struct usbredir_engine_ctx *ectx, uint64_t events);
+/* Returns true when called from the event thread (from a libusb callback) */
+int usbredir_engine_is_current(struct usbredir_engine_ctx *ectx);
+
+#endif
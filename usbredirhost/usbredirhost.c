@@ -28,7 +28,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <time.h>
 #include "usbredirhost.h"
+#include "usbredirtrace.h"
+#include "usbrediralloc.h"
+#include "usbredirlock.h"
+#include "usbredirworker.h"
+#include "usbredirquirks.h"
+#include "usbredirengine.h"
 
 #define MAX_ENDPOINTS        32
 #define MAX_INTERFACES       32 /* Max 32 endpoints and thus interfaces */
@@ -36,31 +43,53 @@
 #define BULK_TIMEOUT          0 /* No timeout for bulk transfers */
 #define ISO_TIMEOUT        1000
 #define INTERRUPT_TIMEOUT     0 /* No timeout for interrupt transfers */
+/* USB-2 is max 8000 packets / sec, if we've queued up more then 0.1 sec,
+   assume our connection is not keeping up and start dropping packets. */
+#define MAX_QUEUED_PACKETS    800
 
 #define MAX_TRANSFER_COUNT        16
 #define MAX_PACKETS_PER_TRANSFER  32
-#define INTERRUPT_TRANSFER_COUNT   5
+/* Interrupt receiving keeps enough transfers in flight to cover this much
+   time, see usbredirhost_interrupt_resubmit_unlocked */
+#define INTERRUPT_BUFFER_US     8000
+#define INTERRUPT_MIN_DEPTH        2
+/* Shrink the interrupt depth by 1 at most this often */
+#define INTERRUPT_SHRINK_US  1000000
+/* Defaults / limits for coalescing interrupt reports, see
+   usbredirhost_send_interrupt_report */
+#define COALESCE_WINDOW_US      1000
+#define COALESCE_MAX_REPORTS      32
 /* Special packet_idx value indicating a submitted transfer */
 #define SUBMITTED_IDX             -1
-
-/* quirk flags */
-#define QUIRK_DO_NOT_RESET    0x01
+/* Max number of standard descriptors cached, see usbredirhost_desc_cache */
+#define DESC_CACHE_SIZE           32
+/* Not defined by libusb versions older then 1.0.16 */
+#define USB_DT_BOS              0x0f
+/* UVC video streaming interfaces and payload header bits, see
+   usbredirhost_uvc_send_packet */
+#define USB_CLASS_VIDEO         0x0e
+#define UVC_SC_VIDEOSTREAMING   0x02
+#define UVC_STREAM_FID          0x01
+#define UVC_STREAM_EOF          0x02
 
 /* Macros to go from an endpoint address to an index for our ep array */
 #define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
 #define I2EP(i) (((i & 0x10) << 3) | (i & 0x0f))
+/* Endpoint masks for worker ops, see usbredirhost_queue_op */
+#define EP_MASK(ep_address) (1u << EP2I(ep_address))
+#define ALL_ENDPOINTS 0xffffffffu
 
 /* Locking convenience macros */
 #define LOCK(host) \
     do { \
         if ((host)->lock) \
-            (host)->parser->lock_func((host)->lock); \
+            usbredirhost_lock_acquire((host), (host)->lock); \
     } while (0)
 
 #define UNLOCK(host) \
     do { \
         if ((host)->lock) \
-            (host)->parser->unlock_func((host)->lock); \
+            usbredirhost_lock_release((host), (host)->lock); \
     } while (0)
 
 #define FLUSH(host) \
@@ -91,6 +120,7 @@ struct usbredirhost_ep {
     uint8_t interface;
     uint8_t warn_on_drop;
     uint8_t stream_started;
+    uint8_t uvc;                        /* On a video streaming interface */
     uint8_t pkts_per_transfer;
     uint8_t transfer_count;
     int out_idx;
@@ -98,13 +128,45 @@ struct usbredirhost_ep {
     int max_packetsize;
     unsigned int max_streams;
     struct usbredirtransfer *transfer[MAX_TRANSFER_COUNT];
+    /* Interrupt receiving only, transfers beyond depth are kept unsubmitted */
+    uint8_t depth;
+    uint64_t next_id;
+    uint64_t last_complete;             /* us */
+    uint64_t last_adjust;               /* us */
+    uint32_t avg_interval;              /* us, between completions */
+    uint32_t period;                    /* us, from bInterval */
+    int burst;                          /* Completions handled back to back */
+    struct usbredirhost_interrupt_stats interrupt_stats;
+    /* Interrupt reports waiting to be send in one coalesced packet */
+    uint8_t *coalesce_buf;
+    int coalesce_len;
+    int coalesce_count;
+    uint64_t coalesce_id;
+    uint64_t coalesce_start;            /* us */
+    /* UVC iso in frame tracking, for usbredirhost_fl_uvc_frame_drop */
+    uint8_t uvc_fid;
+    uint8_t uvc_frame_done;             /* The next payload starts a frame */
+    uint8_t uvc_drop;                   /* Dropping the current frame */
+    int uvc_packets;                    /* Packets in the current frame */
+    int uvc_frame_packets;              /* Packets in the previous frame */
+};
+
+struct usbredirhost_desc {
+    uint8_t type;
+    uint8_t index;
+    uint16_t langid;
+    int length;                       /* 0 for an unused cache slot */
+    uint8_t *data;
 };
 
 struct usbredirhost {
     struct usbredirparser *parser;
+    /* Shared with the parser, since buffers get passed between the 2 */
+    struct usbredirparser_allocator allocator;
 
     void *lock;
     void *disconnect_lock;
+    int builtin_lock;
 
     usbredirparser_log log_func;
     usbredirparser_read read_func;
@@ -114,6 +176,7 @@ struct usbredirhost {
     void *func_priv;
     int verbose;
     libusb_context *ctx;
+    struct usbredir_engine_ctx *engine; /* NULL if the app handles events */
     libusb_device *dev;
     libusb_device_handle *handle;
     struct libusb_device_descriptor desc;
@@ -130,6 +193,13 @@ struct usbredirhost {
     struct usbredirhost_ep endpoint[MAX_ENDPOINTS];
     uint8_t alt_setting[MAX_INTERFACES];
     struct usbredirtransfer transfers_head;
+    struct usbredirhost_desc desc_cache[DESC_CACHE_SIZE];
+    int desc_cache_next;
+    int desc_cache_filled;
+    /* The iso out transfer the parser is reading packet data into, and the
+       packet buffer in it, see usbredirhost_get_data_buffer */
+    struct usbredirtransfer *read_transfer;
+    uint8_t *read_buffer;
     struct usbredirfilter_rule *filter_rules;
     int filter_rules_count;
     struct {
@@ -137,19 +207,95 @@ struct usbredirhost {
         uint64_t lower;
         bool dropping;
     } iso_threshold;
+    int uvc_frame_drop;
+    int coalesce_window;                /* us, 0 to not coalesce */
+    int coalesce_pending;               /* Endpoints with reports waiting */
+    /* See usbredirhost_queue_op, the counts are protected by the lock. The
+       worker also runs usbredirhost_set_device_async attaches. */
+    struct usbredir_worker *worker;
+    int async_ops;
+    int worker_ops;
+    int worker_pending[MAX_ENDPOINTS];
+    int attach_pending;
 };
 
-struct usbredirhost_dev_ids {
-    int vendor_id;
-    int product_id;
+/* A guest packet which gets handled by the worker thread */
+struct usbredirhost_op {
+    struct usbredir_worker_job job; /* Must be first */
+    struct usbredirhost *host;
+    uint32_t ep_mask;
+    int type;
+    uint64_t id;
+    uint8_t *data;
+    int data_len;
+    union {
+        struct usb_redir_set_configuration_header set_configuration;
+        struct usb_redir_set_alt_setting_header set_alt_setting;
+        struct usb_redir_get_alt_setting_header get_alt_setting;
+        struct usb_redir_start_iso_stream_header start_iso_stream;
+        struct usb_redir_stop_iso_stream_header stop_iso_stream;
+        struct usb_redir_start_interrupt_receiving_header
+            start_interrupt_receiving;
+        struct usb_redir_stop_interrupt_receiving_header
+            stop_interrupt_receiving;
+        struct usb_redir_alloc_bulk_streams_header alloc_bulk_streams;
+        struct usb_redir_free_bulk_streams_header free_bulk_streams;
+        struct usb_redir_start_bulk_receiving_header start_bulk_receiving;
+        struct usb_redir_stop_bulk_receiving_header stop_bulk_receiving;
+        struct usb_redir_control_packet_header control_packet;
+        struct usb_redir_bulk_packet_header bulk_packet;
+        struct usb_redir_iso_packet_header iso_packet;
+        struct usb_redir_interrupt_packet_header interrupt_packet;
+    } header;
 };
 
-static const struct usbredirhost_dev_ids usbredirhost_reset_blacklist[] = {
-    { 0x1210, 0x001c },
-    { 0x2798, 0x0001 },
-    { -1, -1 } /* Terminating Entry */
+/* An usbredirhost_set_device_async call, run by the worker thread */
+struct usbredirhost_attach {
+    struct usbredir_worker_job job; /* Must be first */
+    struct usbredirhost *host;
+    libusb_device_handle *handle;
+    usbredirhost_set_device_done done_func;
+    void *done_priv;
 };
 
+/* Lock helpers, see the usbredirparser equivalents */
+static void *usbredirhost_lock_alloc(struct usbredirhost *host)
+{
+    if (host->builtin_lock)
+        return usbredir_lock_alloc(&host->allocator);
+    if (host->parser->alloc_lock_func)
+        return host->parser->alloc_lock_func();
+    return NULL;
+}
+
+static inline void usbredirhost_lock_acquire(struct usbredirhost *host,
+                                             void *lock)
+{
+    if (host->builtin_lock)
+        usbredir_lock_acquire(lock);
+    else
+        host->parser->lock_func(lock);
+}
+
+static inline void usbredirhost_lock_release(struct usbredirhost *host,
+                                             void *lock)
+{
+    if (host->builtin_lock)
+        usbredir_lock_release(lock);
+    else
+        host->parser->unlock_func(lock);
+}
+
+static void usbredirhost_lock_free(struct usbredirhost *host, void *lock)
+{
+    if (!lock)
+        return;
+    if (host->builtin_lock)
+        usbredir_lock_free(&host->allocator, lock);
+    else
+        host->parser->free_lock_func(lock);
+}
+
 static void
 #if defined __GNUC__
 __attribute__((format(printf, 3, 4)))
@@ -222,6 +368,8 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
 static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
     struct usb_redir_interrupt_packet_header *interrupt_packet,
     uint8_t *data, int data_len);
+static uint8_t *usbredirhost_get_data_buffer(void *priv, uint64_t id,
+    uint32_t type, void *type_header, int data_len);
 
 static void LIBUSB_CALL usbredirhost_iso_packet_complete(
     struct libusb_transfer *libusb_transfer);
@@ -231,6 +379,14 @@ static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host,
                                             int notify_guest);
 static void usbredirhost_wait_for_cancel_completion(struct usbredirhost *host);
 static void usbredirhost_clear_device(struct usbredirhost *host);
+static void usbredirhost_release_read_transfer(struct usbredirhost *host);
+static void usbredirhost_desc_cache_reset(struct usbredirhost *host);
+static void usbredirhost_desc_cache_clear(struct usbredirhost *host);
+static void usbredirhost_desc_cache_fill(struct usbredirhost *host);
+static void usbredirhost_send_coalesced_unlocked(struct usbredirhost *host,
+    uint8_t ep);
+static void usbredirhost_send_all_coalesced(struct usbredirhost *host);
+static void usbredirhost_send_descriptors(struct usbredirhost *host);
 
 static void usbredirhost_log(void *priv, int level, const char *msg)
 {
@@ -265,7 +421,7 @@ static void usbredirhost_handle_disconnect(struct usbredirhost *host)
 {
     /* Disconnect uses its own lock to avoid needing nesting capable locks */
     if (host->disconnect_lock) {
-        host->parser->lock_func(host->disconnect_lock);
+        usbredirhost_lock_acquire(host, host->disconnect_lock);
     }
     if (!host->disconnected) {
         INFO("device disconnected");
@@ -276,7 +432,7 @@ static void usbredirhost_handle_disconnect(struct usbredirhost *host)
         host->disconnected = 1;
     }
     if (host->disconnect_lock) {
-        host->parser->unlock_func(host->disconnect_lock);
+        usbredirhost_lock_release(host, host->disconnect_lock);
     }
 }
 
@@ -400,11 +556,23 @@ static void usbredirhost_send_device_connect(struct usbredirhost *host)
         return;
     }
 
+    /* With usbredirhost_set_device_async we get called from the worker,
+       while the parser may be handling the hello / disconnect_ack */
+    if (host->disconnect_lock) {
+        usbredirhost_lock_acquire(host, host->disconnect_lock);
+    }
     if (!usbredirparser_have_peer_caps(host->parser) ||
             host->wait_disconnect) {
         host->connect_pending = 1;
+        if (host->disconnect_lock) {
+            usbredirhost_lock_release(host, host->disconnect_lock);
+        }
         return;
     }
+    host->connect_pending = 0;
+    if (host->disconnect_lock) {
+        usbredirhost_lock_release(host, host->disconnect_lock);
+    }
 
     speed = libusb_get_device_speed(host->dev);
     switch (speed) {
@@ -427,13 +595,36 @@ static void usbredirhost_send_device_connect(struct usbredirhost *host)
     device_connect.device_version_bcd = host->desc.bcdDevice;
 
     usbredirhost_send_interface_n_ep_info(host);
+    if (usbredirparser_peer_has_cap(host->parser, usb_redir_cap_descriptors))
+        usbredirhost_send_descriptors(host);
     usbredirparser_send_device_connect(host->parser, &device_connect);
-    host->connect_pending = 0;
-    host->disconnected = 0; /* The guest may now use the device */
+    /* The guest may now use the device, the lock orders this after setting
+       up the device with usbredirhost_set_device_async */
+    LOCK(host);
+    host->disconnected = 0;
+    UNLOCK(host);
 
     FLUSH(host);
 }
 
+/* Called from the hello and disconnect_ack parser read callbacks */
+static void usbredirhost_send_pending_connect(struct usbredirhost *host)
+{
+    int connect_pending;
+
+    if (host->disconnect_lock) {
+        usbredirhost_lock_acquire(host, host->disconnect_lock);
+    }
+    connect_pending = host->connect_pending;
+    host->connect_pending = 0;
+    if (host->disconnect_lock) {
+        usbredirhost_lock_release(host, host->disconnect_lock);
+    }
+
+    if (connect_pending)
+        usbredirhost_send_device_connect(host);
+}
+
 /* Called from open/close and parser read callbacks */
 static void usbredirhost_parse_interface(struct usbredirhost *host, int i)
 {
@@ -452,6 +643,9 @@ static void usbredirhost_parse_interface(struct usbredirhost *host, int i)
             intf_desc->endpoint[j].bInterval;
         host->endpoint[EP2I(ep_address)].interface =
             intf_desc->bInterfaceNumber;
+        host->endpoint[EP2I(ep_address)].uvc =
+            intf_desc->bInterfaceClass == USB_CLASS_VIDEO &&
+            intf_desc->bInterfaceSubClass == UVC_SC_VIDEOSTREAMING;
         usbredirhost_set_max_packetsize(host, ep_address,
                                         intf_desc->endpoint[j].wMaxPacketSize);
         usbredirhost_set_max_streams(host, &intf_desc->endpoint[j]);
@@ -471,6 +665,7 @@ static void usbredirhost_parse_config(struct usbredirhost *host)
         }
         host->endpoint[i].interval = 0;
         host->endpoint[i].interface = 0;
+        host->endpoint[i].uvc = 0;
         host->endpoint[i].max_packetsize = 0;
         host->endpoint[i].max_streams = 0;
     }
@@ -495,6 +690,7 @@ static int usbredirhost_claim(struct usbredirhost *host, int initial_claim)
         ERROR("could not get device descriptor: %s", libusb_error_name(r));
         return libusb_status_or_error_to_redir_status(host, r);
     }
+    usbredirhost_desc_cache_reset(host);
 
     r = libusb_get_active_config_descriptor(host->dev, &host->config);
     if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND) {
@@ -600,8 +796,11 @@ static void usbredirhost_release(struct usbredirhost *host, int attach_drivers)
     host->claimed = 0;
 
     /* reset the device before re-binding the kernel drivers, so that the
-       kernel drivers get the device in a clean state. */
-    if (!(host->quirks & QUIRK_DO_NOT_RESET)) {
+       kernel drivers get the device in a clean state. Unless the guest has
+       not used the device since our last reset, then it already is. */
+    if (host->reset && !(host->quirks & QUIRK_ALWAYS_RESET)) {
+        DEBUG("device unused since last reset, skipping release reset");
+    } else if (!(host->quirks & QUIRK_DO_NOT_RESET)) {
         r = libusb_reset_device(host->handle);
         if (r != 0) {
             ERROR("error resetting device: %s", libusb_error_name(r));
@@ -660,11 +859,42 @@ struct usbredirhost *usbredirhost_open_full(
     usbredirparser_free_lock free_lock_func,
     void *func_priv, const char *version, int verbose, int flags)
 {
+    return usbredirhost_open_with_allocator(usb_ctx, usb_dev_handle, log_func,
+                                  read_guest_data_func, write_guest_data_func,
+                                  flush_writes_func, alloc_lock_func,
+                                  lock_func, unlock_func, free_lock_func,
+                                  func_priv, version, verbose, flags, NULL);
+}
+
+struct usbredirhost *usbredirhost_open_with_allocator(
+    libusb_context *usb_ctx,
+    libusb_device_handle *usb_dev_handle,
+    usbredirparser_log log_func,
+    usbredirparser_read  read_guest_data_func,
+    usbredirparser_write write_guest_data_func,
+    usbredirhost_flush_writes flush_writes_func,
+    usbredirparser_alloc_lock alloc_lock_func,
+    usbredirparser_lock lock_func,
+    usbredirparser_unlock unlock_func,
+    usbredirparser_free_lock free_lock_func,
+    void *func_priv, const char *version, int verbose, int flags,
+    const struct usbredirparser_allocator *allocator)
+{
+    const struct usbredirparser_allocator default_allocator = { NULL, };
     struct usbredirhost *host;
     int parser_flags = usbredirparser_fl_usb_host;
     uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
 
-    host = calloc(1, sizeof(*host));
+    if (!allocator) {
+        allocator = &default_allocator;
+    } else if (!allocator->malloc_func != !allocator->free_func) {
+        log_func(func_priv, usbredirparser_error,
+            "usbredirhost error: incomplete allocator");
+        libusb_close(usb_dev_handle);
+        return NULL;
+    }
+
+    host = usbredir_calloc(allocator, sizeof(*host));
     if (!host) {
         log_func(func_priv, usbredirparser_error,
             "usbredirhost error: Out of memory allocating usbredirhost");
@@ -673,6 +903,7 @@ struct usbredirhost *usbredirhost_open_full(
     }
 
     host->ctx = usb_ctx;
+    host->engine = usbredir_engine_find(usb_ctx);
     host->log_func = log_func;
     host->read_func = read_guest_data_func;
     host->write_func = write_guest_data_func;
@@ -680,7 +911,9 @@ struct usbredirhost *usbredirhost_open_full(
     host->func_priv = func_priv;
     host->verbose = verbose;
     host->disconnected = 1; /* No device is connected initially */
-    host->parser = usbredirparser_create();
+    host->coalesce_window = COALESCE_WINDOW_US;
+    host->allocator = *allocator;
+    host->parser = usbredirparser_create_with_allocator(allocator);
     if (!host->parser) {
         log_func(func_priv, usbredirparser_error,
             "usbredirhost error: Out of memory allocating usbredirparser");
@@ -718,19 +951,46 @@ struct usbredirhost *usbredirhost_open_full(
     host->parser->bulk_packet_func = usbredirhost_bulk_packet;
     host->parser->iso_packet_func = usbredirhost_iso_packet;
     host->parser->interrupt_packet_func = usbredirhost_interrupt_packet;
+    host->parser->get_data_buffer_func = usbredirhost_get_data_buffer;
     host->parser->alloc_lock_func = alloc_lock_func;
     host->parser->lock_func = lock_func;
     host->parser->unlock_func = unlock_func;
     host->parser->free_lock_func = free_lock_func;
 
-    if (host->parser->alloc_lock_func) {
-        host->lock = host->parser->alloc_lock_func();
-        host->disconnect_lock = host->parser->alloc_lock_func();
+    if (flags & usbredirhost_fl_builtin_lock) {
+        host->builtin_lock = 1;
+        parser_flags |= usbredirparser_fl_builtin_lock;
+    }
+    host->lock = usbredirhost_lock_alloc(host);
+    host->disconnect_lock = usbredirhost_lock_alloc(host);
+
+    if (host->engine && !host->lock)
+        WARNING("using an engine without locking is not thread safe");
+
+    if (flags & usbredirhost_fl_uvc_frame_drop) {
+        host->uvc_frame_drop = 1;
+    }
+
+    /* The worker is also used by usbredirhost_set_device_async, so always
+       create it when locking is enabled */
+    if (host->lock)
+        host->worker = usbredir_worker_create(&host->allocator);
+    if (flags & usbredirhost_fl_async_ops) {
+        if (host->worker)
+            host->async_ops = 1;
+        else
+            WARNING("async ops need a lock and a worker thread, disabled");
     }
 
     if (flags & usbredirhost_fl_write_cb_owns_buffer) {
         parser_flags |= usbredirparser_fl_write_cb_owns_buffer;
     }
+    if (flags & usbredirhost_fl_lockfree_write_queue) {
+        parser_flags |= usbredirparser_fl_lockfree_write_queue;
+    }
+    if (flags & usbredirhost_fl_write_priority) {
+        parser_flags |= usbredirparser_fl_write_priority;
+    }
 
     usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
     usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
@@ -739,6 +999,8 @@ struct usbredirhost *usbredirhost_open_full(
     usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
     usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
     usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_descriptors);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_coalesced_interrupt);
 #if LIBUSBX_API_VERSION >= 0x01000103
     usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_streams);
 #endif
@@ -760,19 +1022,19 @@ struct usbredirhost *usbredirhost_open_full(
 
 void usbredirhost_close(struct usbredirhost *host)
 {
+    struct usbredirparser_allocator allocator = host->allocator;
+
     usbredirhost_clear_device(host);
+    usbredirhost_release_read_transfer(host);
+    usbredir_worker_destroy(&allocator, host->worker);
 
-    if (host->lock) {
-        host->parser->free_lock_func(host->lock);
-    }
-    if (host->disconnect_lock) {
-        host->parser->free_lock_func(host->disconnect_lock);
-    }
     if (host->parser) {
+        usbredirhost_lock_free(host, host->lock);
+        usbredirhost_lock_free(host, host->disconnect_lock);
         usbredirparser_destroy(host->parser);
     }
     free(host->filter_rules);
-    free(host);
+    usbredir_free(&allocator, host);
 }
 
 static int usbredirhost_reset_device(struct usbredirhost *host)
@@ -791,13 +1053,15 @@ static int usbredirhost_reset_device(struct usbredirhost *host)
     }
 
     host->reset = 1;
+    usbredirhost_desc_cache_reset(host);
     return 0;
 }
 
-int usbredirhost_set_device(struct usbredirhost *host,
-                             libusb_device_handle *usb_dev_handle)
+/* Claim and reset the device, the caller sends the device_connect */
+static int usbredirhost_prepare_device(struct usbredirhost *host,
+                                       libusb_device_handle *usb_dev_handle)
 {
-    int i, r, status;
+    int r, status;
 
     usbredirhost_clear_device(host);
 
@@ -813,14 +1077,8 @@ int usbredirhost_set_device(struct usbredirhost *host,
         return status;
     }
 
-    for (i = 0; usbredirhost_reset_blacklist[i].vendor_id != -1; i++) {
-        if (host->desc.idVendor == usbredirhost_reset_blacklist[i].vendor_id &&
-            host->desc.idProduct ==
-                                usbredirhost_reset_blacklist[i].product_id) {
-            host->quirks |= QUIRK_DO_NOT_RESET;
-            break;
-        }
-    }
+    host->quirks = usbredir_quirks_lookup(host->desc.idVendor,
+                                          host->desc.idProduct);
 
     /* The first thing almost any usb-guest does is a (slow) device-reset
        so lets do that before hand */
@@ -829,13 +1087,94 @@ int usbredirhost_set_device(struct usbredirhost *host,
         return libusb_status_or_error_to_redir_status(host, r);
     }
 
-    usbredirhost_send_device_connect(host);
-
     return usb_redir_success;
 }
 
+int usbredirhost_set_device(struct usbredirhost *host,
+                             libusb_device_handle *usb_dev_handle)
+{
+    int status;
+
+    status = usbredirhost_prepare_device(host, usb_dev_handle);
+    if (status == usb_redir_success && host->dev)
+        usbredirhost_send_device_connect(host);
+
+    return status;
+}
+
+static void usbredirhost_attach_run(struct usbredir_worker_job *job)
+{
+    struct usbredirhost_attach *attach = (struct usbredirhost_attach *)job;
+    struct usbredirhost *host = attach->host;
+    int status;
+
+    status = usbredirhost_prepare_device(host, attach->handle);
+    if (status == usb_redir_success && host->dev) {
+        /* Read the descriptors now, rather then when the guest connects */
+        usbredirhost_desc_cache_fill(host);
+        usbredirhost_send_device_connect(host);
+    }
+    FLUSH(host);
+
+    LOCK(host);
+    host->attach_pending--;
+    UNLOCK(host);
+
+    attach->done_func(attach->done_priv, status);
+    usbredir_free(&host->allocator, attach);
+}
+
+void usbredirhost_set_device_async(struct usbredirhost *host,
+    libusb_device_handle *usb_dev_handle,
+    usbredirhost_set_device_done done_func, void *done_priv)
+{
+    struct usbredirhost_attach *attach;
+    int busy;
+
+    if (!host->worker) {
+        WARNING("async set_device needs a lock and a worker thread, "
+                "attaching synchronously");
+        done_func(done_priv, usbredirhost_set_device(host, usb_dev_handle));
+        return;
+    }
+
+    /* The worker sets up the device without holding the lock, this is only
+       safe while the host is disconnected (so the guest's packets do not
+       touch the device state), and stays so until the device_connect is
+       sent. So replacing an attached (or being attached) device is done
+       synchronously, usbredirhost_set_device waits for a pending attach. */
+    LOCK(host);
+    busy = host->dev || host->attach_pending;
+    UNLOCK(host);
+    if (busy || !usb_dev_handle) {
+        done_func(done_priv, usbredirhost_set_device(host, usb_dev_handle));
+        return;
+    }
+
+    attach = usbredir_malloc(&host->allocator, sizeof(*attach));
+    if (!attach) {
+        ERROR("out of memory allocating attach, attaching synchronously");
+        done_func(done_priv, usbredirhost_set_device(host, usb_dev_handle));
+        return;
+    }
+    attach->host = host;
+    attach->handle = usb_dev_handle;
+    attach->done_func = done_func;
+    attach->done_priv = done_priv;
+    LOCK(host);
+    host->attach_pending++;
+    usbredir_worker_queue(host->worker, &attach->job,
+                          usbredirhost_attach_run);
+    UNLOCK(host);
+}
+
 static void usbredirhost_clear_device(struct usbredirhost *host)
 {
+    /* Let the worker finish any queued ops / attach first, unless we are
+       called by one of those (when it failed to (re-)claim the device) */
+    if (host->worker && !usbredir_worker_is_current(host->worker))
+        usbredir_worker_flush(host->worker);
+
     if (!host->dev)
         return;
 
@@ -855,7 +1194,9 @@ static void usbredirhost_clear_device(struct usbredirhost *host)
 
     host->connect_pending = 0;
     host->quirks = 0;
+    host->reset = 0;
     host->dev = NULL;
+    usbredirhost_desc_cache_clear(host);
 
     usbredirhost_handle_disconnect(host);
     FLUSH(host);
@@ -868,19 +1209,70 @@ int usbredirhost_read_guest_data(struct usbredirhost *host)
 
 int usbredirhost_has_data_to_write(struct usbredirhost *host)
 {
-    return usbredirparser_has_data_to_write(host->parser);
+    return usbredirparser_has_data_to_write(host->parser) +
+           __atomic_load_n(&host->coalesce_pending, __ATOMIC_RELAXED);
 }
 
 int usbredirhost_write_guest_data(struct usbredirhost *host)
 {
+    if (__atomic_load_n(&host->coalesce_pending, __ATOMIC_RELAXED))
+        usbredirhost_send_all_coalesced(host);
     return usbredirparser_do_write(host->parser);
 }
 
+void usbredirhost_set_interrupt_coalescing(struct usbredirhost *host,
+                                           int window_us)
+{
+    LOCK(host);
+    host->coalesce_window = window_us > 0 ? window_us : 0;
+    UNLOCK(host);
+}
+
 void usbredirhost_free_write_buffer(struct usbredirhost *host, uint8_t *data)
 {
     usbredirparser_free_write_buffer(host->parser, data);
 }
 
+int usbredirhost_set_endpoint_weight(struct usbredirhost *host,
+                                     uint8_t ep, int weight)
+{
+    return usbredirparser_set_endpoint_weight(host->parser, ep, weight);
+}
+
+int usbredirhost_start_capture(struct usbredirhost *host,
+                               const char *filename)
+{
+    return usbredirparser_start_capture(host->parser, filename);
+}
+
+void usbredirhost_stop_capture(struct usbredirhost *host)
+{
+    usbredirparser_stop_capture(host->parser);
+}
+
+int usbredirhost_get_lock_stats(struct usbredirhost *host,
+                                struct usbredirparser_lock_stats *stats)
+{
+    if (usbredirparser_get_lock_stats(host->parser, stats))
+        return -1;
+    usbredir_lock_add_stats(host->lock, stats);
+    usbredir_lock_add_stats(host->disconnect_lock, stats);
+    return 0;
+}
+
+int usbredirhost_get_interrupt_stats(struct usbredirhost *host, uint8_t ep,
+                                     struct usbredirhost_interrupt_stats *stats)
+{
+    if (!(ep & LIBUSB_ENDPOINT_IN) ||
+            host->endpoint[EP2I(ep)].type != usb_redir_type_interrupt)
+        return -1;
+
+    LOCK(host);
+    *stats = host->endpoint[EP2I(ep)].interrupt_stats;
+    UNLOCK(host);
+    return 0;
+}
+
 /**************************************************************************/
 
 static struct usbredirtransfer *usbredirhost_alloc_transfer(
@@ -889,11 +1281,12 @@ static struct usbredirtransfer *usbredirhost_alloc_transfer(
     struct usbredirtransfer *redir_transfer;
     struct libusb_transfer *libusb_transfer;
 
-    redir_transfer  = calloc(1, sizeof(*redir_transfer));
+    redir_transfer  = usbredir_calloc(&host->allocator,
+                                      sizeof(*redir_transfer));
     libusb_transfer = libusb_alloc_transfer(iso_packets);
     if (!redir_transfer || !libusb_transfer) {
         ERROR("out of memory allocating usb transfer, dropping packet");
-        free(redir_transfer);
+        usbredir_free(&host->allocator, redir_transfer);
         libusb_free_transfer(libusb_transfer);
         return NULL;
     }
@@ -906,14 +1299,26 @@ static struct usbredirtransfer *usbredirhost_alloc_transfer(
 
 static void usbredirhost_free_transfer(struct usbredirtransfer *transfer)
 {
+    struct usbredirhost *host;
+
     if (!transfer)
         return;
 
     /* In certain cases this should really be a usbredirparser_free_packet_data
-       but since we use the same malloc impl. as usbredirparser this is ok. */
-    free(transfer->transfer->buffer);
+       but since we use the same allocator as usbredirparser this is ok. */
+    host = transfer->host;
+    usbredir_free(&host->allocator, transfer->transfer->buffer);
     libusb_free_transfer(transfer->transfer);
-    free(transfer);
+    usbredir_free(&host->allocator, transfer);
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_release_read_transfer(struct usbredirhost *host)
+{
+    if (host->read_transfer && host->read_transfer->cancelled)
+        usbredirhost_free_transfer(host->read_transfer);
+    host->read_transfer = NULL;
+    host->read_buffer = NULL;
 }
 
 static void usbredirhost_add_transfer(struct usbredirhost *host,
@@ -951,12 +1356,21 @@ static void usbredirhost_cancel_stream_unlocked(struct usbredirhost *host,
     int i;
     struct usbredirtransfer *transfer;
 
+    /* Reports received before the cancel still go to the guest */
+    usbredirhost_send_coalesced_unlocked(host, ep);
+    usbredir_free(&host->allocator, host->endpoint[EP2I(ep)].coalesce_buf);
+    host->endpoint[EP2I(ep)].coalesce_buf = NULL;
+
     for (i = 0; i < host->endpoint[EP2I(ep)].transfer_count; i++) {
         transfer = host->endpoint[EP2I(ep)].transfer[i];
         if (transfer->packet_idx == SUBMITTED_IDX) {
             libusb_cancel_transfer(transfer->transfer);
             transfer->cancelled = 1;
             host->cancels_pending++;
+        } else if (transfer == host->read_transfer) {
+            /* The parser may still be reading into it, this gets freed by
+               usbredirhost_release_read_transfer */
+            transfer->cancelled = 1;
         } else {
             usbredirhost_free_transfer(transfer);
         }
@@ -1034,37 +1448,167 @@ static int usbredirhost_can_write_iso_package(struct usbredirhost *host)
     return !host->iso_threshold.dropping;
 }
 
-static void usbredirhost_send_stream_data(struct usbredirhost *host,
+/* Send the interrupt reports waiting on ep, if any. Called with the host
+   lock held. */
+static void usbredirhost_send_coalesced_unlocked(struct usbredirhost *host,
+    uint8_t ep)
+{
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+    struct usb_redir_interrupt_report *report =
+        (struct usb_redir_interrupt_report *)endp->coalesce_buf;
+
+    if (!endp->coalesce_count)
+        return;
+
+    if (endp->coalesce_count == 1) {
+        /* No point in the extra header for a single report */
+        struct usb_redir_interrupt_packet_header interrupt_packet = {
+            .endpoint = ep,
+            .status   = report->status,
+            .length   = report->length,
+        };
+        usbredirparser_send_interrupt_packet(host->parser, endp->coalesce_id,
+            &interrupt_packet, endp->coalesce_buf + sizeof(*report),
+            report->length);
+    } else {
+        struct usb_redir_coalesced_interrupt_packet_header coalesced = {
+            .endpoint = ep,
+            .count    = endp->coalesce_count,
+            .length   = endp->coalesce_len,
+        };
+        usbredirparser_send_coalesced_interrupt_packet(host->parser,
+            endp->coalesce_id, &coalesced, endp->coalesce_buf,
+            endp->coalesce_len);
+    }
+    endp->interrupt_stats.packets++;
+    endp->coalesce_count = 0;
+    endp->coalesce_len = 0;
+    __atomic_sub_fetch(&host->coalesce_pending, 1, __ATOMIC_RELAXED);
+}
+
+static void usbredirhost_send_all_coalesced(struct usbredirhost *host)
+{
+    int i;
+
+    LOCK(host);
+    for (i = 0; i < MAX_ENDPOINTS; i++)
+        usbredirhost_send_coalesced_unlocked(host, I2EP(i));
+    UNLOCK(host);
+}
+
+static uint64_t usbredirhost_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Returns true if the interrupt report with id should be added to the
+   reports waiting on endpoint endp, allocating the buffer for these if
+   necessary */
+static int usbredirhost_coalesce_report(struct usbredirhost *host,
+    struct usbredirhost_ep *endp, uint64_t id, int size)
+{
+    if (endp->coalesce_count)
+        return 1;
+    if (!host->coalesce_window ||
+            !usbredirparser_peer_has_cap(host->parser,
+                                         usb_redir_cap_coalesced_interrupt) ||
+            !usbredirparser_has_data_to_write(host->parser))
+        return 0;
+
+    if (!endp->coalesce_buf) {
+        endp->coalesce_buf = usbredir_malloc(&host->allocator, size);
+        if (!endp->coalesce_buf) {
+            ERROR("out of memory allocating interrupt coalesce buffer");
+            return 0;
+        }
+    }
+    endp->coalesce_id = id;
+    endp->coalesce_start = usbredirhost_now();
+    __atomic_add_fetch(&host->coalesce_pending, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Interrupt in reports are send right away when nothing is waiting to be
+   written to the guest. Otherwise, with usb_redir_cap_coalesced_interrupt,
+   they get collected and send as one packet when the app next calls
+   usbredirhost_write_guest_data, or once the first waiting report is
+   coalesce_window old, or COALESCE_MAX_REPORTS reports are waiting. So
+   reports only wait for a write which is pending anyway. */
+static void usbredirhost_send_interrupt_report(struct usbredirhost *host,
     uint64_t id, uint8_t ep, uint8_t status, uint8_t *data, int len)
 {
-    /* USB-2 is max 8000 packets / sec, if we've queued up more then 0.1 sec,
-       assume our connection is not keeping up and start dropping packets. */
-    if (usbredirparser_has_data_to_write(host->parser) > 800) {
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+    struct usb_redir_interrupt_report report = {
+        .status = status,
+        .length = len,
+    };
+    int size = COALESCE_MAX_REPORTS *
+               (sizeof(report) + endp->transfer[0]->transfer->length);
+
+    if (endp->coalesce_count &&
+            (id != endp->coalesce_id + endp->coalesce_count ||
+             endp->coalesce_len + (int)sizeof(report) + len > size))
+        usbredirhost_send_coalesced_unlocked(host, ep);
+
+    if (!usbredirhost_coalesce_report(host, endp, id, size)) {
+        struct usb_redir_interrupt_packet_header interrupt_packet = {
+            .endpoint = ep,
+            .status   = status,
+            .length   = len,
+        };
+        usbredirparser_send_interrupt_packet(host->parser, id,
+                                             &interrupt_packet, data, len);
+        endp->interrupt_stats.packets++;
+        return;
+    }
+
+    memcpy(endp->coalesce_buf + endp->coalesce_len, &report, sizeof(report));
+    if (len)
+        memcpy(endp->coalesce_buf + endp->coalesce_len + sizeof(report),
+               data, len);
+    endp->coalesce_len += sizeof(report) + len;
+    endp->coalesce_count++;
+
+    if (endp->coalesce_count == COALESCE_MAX_REPORTS ||
+            usbredirhost_now() - endp->coalesce_start >=
+                (uint64_t)host->coalesce_window)
+        usbredirhost_send_coalesced_unlocked(host, ep);
+}
+
+/* Returns false when the connection to the guest is not keeping up, in
+   which case stream data for ep should be dropped */
+static int usbredirhost_can_send_stream_data(struct usbredirhost *host,
+    uint8_t ep)
+{
+    if (usbredirparser_has_data_to_write(host->parser) > MAX_QUEUED_PACKETS) {
         if (host->endpoint[EP2I(ep)].warn_on_drop) {
             WARNING("buffered stream on endpoint %02X, connection too slow, "
                     "dropping packets", ep);
             host->endpoint[EP2I(ep)].warn_on_drop = 0;
         }
+        return false;
+    }
+    return true;
+}
+
+/* Note iso data does not go through here, usbredirhost_iso_packet_complete
+   decides whether to send or drop the packets once per urb */
+static void usbredirhost_send_stream_data(struct usbredirhost *host,
+    uint64_t id, uint8_t ep, uint8_t status, uint8_t *data, int len)
+{
+    if (!usbredirhost_can_send_stream_data(host, ep)) {
         DEBUG("buffered complete ep %02X dropping packet status %d len %d",
               ep, status, len);
+        USBREDIR_TRACE3(packet_drop, ep, id, len);
         return;
     }
 
     DEBUG("buffered complete ep %02X status %d len %d", ep, status, len);
 
     switch (host->endpoint[EP2I(ep)].type) {
-    case usb_redir_type_iso: {
-        struct usb_redir_iso_packet_header iso_packet = {
-            .endpoint = ep,
-            .status   = status,
-            .length   = len,
-        };
-
-        if (usbredirhost_can_write_iso_package(host))
-            usbredirparser_send_iso_packet(host->parser, id, &iso_packet,
-                                           data, len);
-        break;
-    }
     case usb_redir_type_bulk: {
         struct usb_redir_buffered_bulk_packet_header bulk_packet = {
             .endpoint = ep,
@@ -1075,17 +1619,10 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
                                                  &bulk_packet, data, len);
         break;
     }
-    case usb_redir_type_interrupt: {
-        struct usb_redir_interrupt_packet_header interrupt_packet = {
-            .endpoint = ep,
-            .status   = status,
-            .length   = len,
-        };
-        usbredirparser_send_interrupt_packet(host->parser, id,
-                                             &interrupt_packet, data, len);
+    case usb_redir_type_interrupt:
+        usbredirhost_send_interrupt_report(host, id, ep, status, data, len);
         break;
     }
-    }
 }
 
 /* Called from both parser read and packet complete callbacks */
@@ -1096,6 +1633,9 @@ static int usbredirhost_submit_stream_transfer_unlocked(
 
     host->reset = 0;
 
+    USBREDIR_TRACE4(urb_submit, transfer->transfer->endpoint,
+                    transfer->transfer->type, transfer->id,
+                    transfer->transfer->length);
     r = libusb_submit_transfer(transfer->transfer);
     if (r < 0) {
         uint8_t ep = transfer->transfer->endpoint;
@@ -1126,6 +1666,11 @@ static int usbredirhost_start_stream_unlocked(struct usbredirhost *host,
     if (!(ep & LIBUSB_ENDPOINT_IN)) {
         count /= 2;
     }
+    /* And interrupt receiving submits only depth transfers */
+    if (host->endpoint[EP2I(ep)].type == usb_redir_type_interrupt) {
+        count = host->endpoint[EP2I(ep)].depth;
+        host->endpoint[EP2I(ep)].next_id = count;
+    }
     for (i = 0; i < count; i++) {
         if (ep & LIBUSB_ENDPOINT_IN) {
             host->endpoint[EP2I(ep)].transfer[i]->id =
@@ -1153,6 +1698,184 @@ static void usbredirhost_stop_stream(struct usbredirhost *host,
     FLUSH(host);
 }
 
+/* Returns the polling period of interrupt endpoint ep in us */
+static uint32_t usbredirhost_interrupt_period(struct usbredirhost *host,
+    uint8_t ep)
+{
+    int b_interval = host->endpoint[EP2I(ep)].interval;
+
+    switch (libusb_get_device_speed(host->dev)) {
+    case LIBUSB_SPEED_HIGH:
+    case LIBUSB_SPEED_SUPER:
+        /* 2^(bInterval-1) microframes */
+        if (b_interval < 1)
+            b_interval = 1;
+        if (b_interval > 16)
+            b_interval = 16;
+        return 125u << (b_interval - 1);
+    default:
+        /* bInterval frames */
+        return (b_interval ? b_interval : 1) * 1000;
+    }
+}
+
+/* Returns the number of interrupt transfers needed to cover
+   INTERRUPT_BUFFER_US, for completions every interval us, or at the
+   endpoint's polling period if that is longer */
+static int usbredirhost_interrupt_depth(struct usbredirhost *host,
+    uint8_t ep, uint32_t interval)
+{
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+    int depth;
+
+    if (interval < endp->period)
+        interval = endp->period;
+
+    depth = (INTERRUPT_BUFFER_US + interval - 1) / interval;
+    if (depth < INTERRUPT_MIN_DEPTH)
+        depth = INTERRUPT_MIN_DEPTH;
+    if (depth > endp->transfer_count)
+        depth = endp->transfer_count;
+    return depth;
+}
+
+/* Called from usbredirhost_alloc_stream_unlocked */
+static void usbredirhost_interrupt_init_unlocked(struct usbredirhost *host,
+    uint8_t ep)
+{
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+
+    endp->period = usbredirhost_interrupt_period(host, ep);
+    endp->depth = usbredirhost_interrupt_depth(host, ep, 0);
+    endp->burst = 0;
+    endp->next_id = 0;
+    endp->last_complete = 0;
+    endp->last_adjust = usbredirhost_now();
+    endp->avg_interval = 0;
+    memset(&endp->interrupt_stats, 0, sizeof(endp->interrupt_stats));
+    endp->interrupt_stats.depth = endp->depth;
+    endp->interrupt_stats.max_depth = endp->depth;
+    DEBUG("interrupt ep %02X depth %d", ep, endp->depth);
+}
+
+/* Called from the interrupt in completion callback, instead of simply
+   resubmitting the transfer. The number of transfers kept in flight (the
+   depth) starts out based on bInterval and then follows the observed
+   completion rate. The device completes at most one transfer per polling
+   period, so completions which get handled less then half a period apart
+   had all completed before we got to them (the event loop ran late). If
+   depth completions get handled back to back like that, all transfers had
+   completed before one could be resubmitted and the device may have had
+   reports for which there was no transfer, then the depth gets doubled. */
+static void usbredirhost_interrupt_resubmit_unlocked(
+    struct usbredirhost *host, struct usbredirtransfer *transfer)
+{
+    uint8_t ep = transfer->transfer->endpoint;
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+    struct usbredirhost_interrupt_stats *stats = &endp->interrupt_stats;
+    uint64_t now = usbredirhost_now();
+    int i, target, in_flight = 0;
+    struct usbredirtransfer *t;
+
+    for (i = 0; i < endp->transfer_count; i++) {
+        if (endp->transfer[i]->packet_idx == SUBMITTED_IDX)
+            in_flight++;
+    }
+
+    stats->completions++;
+    if (endp->last_complete) {
+        int64_t delta = now - endp->last_complete;
+        endp->avg_interval += (delta - (int64_t)endp->avg_interval) / 8;
+        if (delta < endp->period / 2)
+            endp->burst++;
+        else
+            endp->burst = 1;
+    } else {
+        endp->avg_interval = now - endp->last_adjust;
+        endp->burst = 1;
+    }
+    endp->last_complete = now;
+
+    if (endp->burst >= endp->depth) {
+        stats->underruns++;
+        endp->burst = 0;
+        if (endp->depth < endp->transfer_count) {
+            endp->depth *= 2;
+            if (endp->depth > endp->transfer_count)
+                endp->depth = endp->transfer_count;
+            DEBUG("interrupt ep %02X underrun, depth %d", ep, endp->depth);
+        }
+        endp->last_adjust = now;
+    } else if (now - endp->last_adjust > INTERRUPT_SHRINK_US) {
+        target = usbredirhost_interrupt_depth(host, ep, endp->avg_interval);
+        if (endp->depth > target) {
+            endp->depth--;
+            DEBUG("interrupt ep %02X depth %d", ep, endp->depth);
+        }
+        endp->last_adjust = now;
+    }
+    stats->depth = endp->depth;
+    if (endp->depth > stats->max_depth)
+        stats->max_depth = endp->depth;
+
+    /* Resubmit, including any transfers not in flight after a depth
+       increase, in id order so that the guest gets them in order */
+    for (i = 0; i < endp->transfer_count && in_flight < endp->depth; i++) {
+        t = endp->transfer[i];
+        if (t->packet_idx == SUBMITTED_IDX)
+            continue;
+        t->id = endp->next_id++;
+        if (usbredirhost_submit_stream_transfer_unlocked(host, t) !=
+                usb_redir_success)
+            return; /* This has cancelled the stream */
+        in_flight++;
+    }
+}
+
+/* With usbredirhost_fl_uvc_frame_drop the iso threshold check is done at
+   the start of each video frame, as found from the FID / EOF bits in the
+   uvc payload headers, and the whole frame then gets send or dropped. So
+   the guest gets fewer, but complete, frames when the connection cannot
+   keep up. A frame is also only started when the write queue has room for
+   as many packets as the previous frame had, so that it does not get cut
+   short by MAX_QUEUED_PACKETS. When congested (the write queue is full)
+   the rest of the frame gets dropped regardless. Returns true if the
+   packet should be send. */
+static int usbredirhost_uvc_send_packet(struct usbredirhost *host,
+    uint8_t ep, int congested, uint8_t *data, int len)
+{
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+    int frame_packets;
+    uint8_t fid;
+
+    /* Packets without a (valid) payload header belong to the current frame */
+    if (len >= 2 && data[0] >= 2 && data[0] <= len) {
+        fid = data[1] & UVC_STREAM_FID;
+        if (endp->uvc_frame_done || fid != endp->uvc_fid) {
+            if (endp->uvc_packets)
+                endp->uvc_frame_packets = endp->uvc_packets;
+            endp->uvc_packets = 0;
+            /* Frames larger then the queue only start on an empty queue */
+            frame_packets = endp->uvc_frame_packets;
+            if (frame_packets > MAX_QUEUED_PACKETS)
+                frame_packets = MAX_QUEUED_PACKETS;
+            endp->uvc_drop = congested ||
+                usbredirparser_has_data_to_write(host->parser) +
+                    frame_packets > MAX_QUEUED_PACKETS ||
+                !usbredirhost_can_write_iso_package(host);
+            if (endp->uvc_drop)
+                DEBUG("uvc ep %02X dropping frame", ep);
+        }
+        endp->uvc_fid = fid;
+        endp->uvc_frame_done = !!(data[1] & UVC_STREAM_EOF);
+    }
+    endp->uvc_packets++;
+    if (congested)
+        endp->uvc_drop = 1;
+
+    return !endp->uvc_drop;
+}
+
 static void usbredirhost_set_iso_threshold(struct usbredirhost *host,
     uint8_t pkts_per_transfer, uint8_t transfer_count, uint16_t max_packetsize)
 {
@@ -1208,7 +1931,7 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
         }
 
         buf_size = pkt_size * pkts_per_transfer;
-        buffer = malloc(buf_size);
+        buffer = usbredir_malloc(&host->allocator, buf_size);
         if (!buffer) {
             goto alloc_error;
         }
@@ -1242,8 +1965,14 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
     }
     host->endpoint[EP2I(ep)].out_idx = 0;
     host->endpoint[EP2I(ep)].drop_packets = 0;
+    host->endpoint[EP2I(ep)].uvc_frame_done = 1;
+    host->endpoint[EP2I(ep)].uvc_drop = 0;
+    host->endpoint[EP2I(ep)].uvc_packets = 0;
+    host->endpoint[EP2I(ep)].uvc_frame_packets = 0;
     host->endpoint[EP2I(ep)].pkts_per_transfer = pkts_per_transfer;
     host->endpoint[EP2I(ep)].transfer_count = transfer_count;
+    if (type == usb_redir_type_interrupt)
+        usbredirhost_interrupt_init_unlocked(host, ep);
 
     /* For input endpoints submit the transfers now */
     if (ep & LIBUSB_ENDPOINT_IN) {
@@ -1310,8 +2039,10 @@ static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host,
 
     LOCK(host);
     for (i = 0; i < MAX_ENDPOINTS; i++) {
-        if (notify_guest && host->endpoint[i].transfer_count)
+        if (notify_guest && host->endpoint[i].transfer_count) {
+            usbredirhost_send_coalesced_unlocked(host, I2EP(i));
             usbredirhost_send_stream_status(host, 0, I2EP(i), usb_redir_stall);
+        }
         usbredirhost_cancel_stream_unlocked(host, I2EP(i));
     }
 
@@ -1332,8 +2063,23 @@ static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host,
 void usbredirhost_wait_for_cancel_completion(struct usbredirhost *host)
 {
     int wait;
+    uint64_t events;
     struct timeval tv;
 
+    /* Let the engine thread complete the cancelled transfers, rather then
+       handling events (and running other hosts' callbacks) ourselves */
+    if (host->engine && !usbredir_engine_is_current(host->engine)) {
+        do {
+            events = usbredir_engine_events(host->engine);
+            LOCK(host);
+            wait = host->cancels_pending || host->transfers_head.next;
+            UNLOCK(host);
+            if (wait)
+                usbredir_engine_wait(host->engine, events);
+        } while (wait);
+        return;
+    }
+
     do {
         memset(&tv, 0, sizeof(tv));
         tv.tv_usec = 2500;
@@ -1453,9 +2199,13 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
     struct usbredirtransfer *transfer = libusb_transfer->user_data;
     uint8_t ep = libusb_transfer->endpoint;
     struct usbredirhost *host = transfer->host;
-    int i, r, len, status;
+    int i, r, len, status, send = 0, uvc = 0;
+    uint8_t *data;
 
     LOCK(host);
+    USBREDIR_TRACE5(urb_complete, libusb_transfer->endpoint,
+                    libusb_transfer->type, transfer->id,
+                    libusb_transfer->status, libusb_transfer->actual_length);
     if (transfer->cancelled) {
         host->cancels_pending--;
         usbredirhost_free_transfer(transfer);
@@ -1491,6 +2241,16 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
         goto unlock;
     }
 
+    /* Decide once for the whole urb if we can send its packets, rather then
+       asking the app for its buffered output size for each packet. For
+       uvc this is decided per video frame instead. */
+    if (ep & LIBUSB_ENDPOINT_IN) {
+        uvc = host->uvc_frame_drop && host->endpoint[EP2I(ep)].uvc;
+        send = usbredirhost_can_send_stream_data(host, ep);
+        if (send && !uvc)
+            send = usbredirhost_can_write_iso_package(host);
+    }
+
     /* Check per packet status and send ok input packets to usb-guest */
     for (i = 0; i < libusb_transfer->num_iso_packets; i++) {
         r   = libusb_transfer->iso_packet_desc[i].status;
@@ -1512,8 +2272,23 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
             goto unlock;
         }
         if (ep & LIBUSB_ENDPOINT_IN) {
-            usbredirhost_send_stream_data(host, transfer->id, ep, status,
-                   libusb_get_iso_packet_buffer(libusb_transfer, i), len);
+            data = libusb_get_iso_packet_buffer(libusb_transfer, i);
+            if (uvc ? usbredirhost_uvc_send_packet(host, ep, !send, data, len)
+                    : send) {
+                struct usb_redir_iso_packet_header iso_packet = {
+                    .endpoint = ep,
+                    .status   = status,
+                    .length   = len,
+                };
+                DEBUG("iso-in complete ep %02X pkt %d status %d len %d",
+                      ep, i, status, len);
+                usbredirparser_send_iso_packet(host->parser, transfer->id,
+                    &iso_packet, data, len);
+            } else {
+                DEBUG("iso-in complete ep %02X dropping pkt %d len %d",
+                      ep, i, len);
+                USBREDIR_TRACE3(packet_drop, ep, transfer->id, len);
+            }
             transfer->id++;
         } else {
             DEBUG("iso-in complete ep %02X pkt %d len %d id %"PRIu64,
@@ -1560,6 +2335,9 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
     int r, len = libusb_transfer->actual_length;
 
     LOCK(host);
+    USBREDIR_TRACE5(urb_complete, libusb_transfer->endpoint,
+                    libusb_transfer->type, transfer->id,
+                    libusb_transfer->status, libusb_transfer->actual_length);
 
     if (transfer->cancelled) {
         host->cancels_pending--;
@@ -1591,8 +2369,12 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
     usbredirhost_log_data(host, "buffered data in:",
                           transfer->transfer->buffer, len);
 
-    transfer->id += host->endpoint[EP2I(ep)].transfer_count;
-    usbredirhost_submit_stream_transfer_unlocked(host, transfer);
+    if (host->endpoint[EP2I(ep)].type == usb_redir_type_interrupt) {
+        usbredirhost_interrupt_resubmit_unlocked(host, transfer);
+    } else {
+        transfer->id += host->endpoint[EP2I(ep)].transfer_count;
+        usbredirhost_submit_stream_transfer_unlocked(host, transfer);
+    }
 unlock:
     UNLOCK(host);
     FLUSH(host);
@@ -1600,12 +2382,216 @@ unlock:
 
 /**************************************************************************/
 
+/* With usbredirhost_fl_async_ops set_configuration, set_alt_setting, reset
+   and clear halt requests get handled by the worker thread, as the libusb
+   calls for these block, and the parser should keep reading packets for
+   other endpoints in the mean time.
+
+   Each op marks the endpoints it affects as having worker ops pending,
+   any later packet for such an endpoint is queued to the worker too, so
+   that packets for the same endpoint still get handled in order. Packets
+   without an endpoint (get_configuration, stream start / stop, etc.) wait
+   for all ops, and are treated as affecting all endpoints themselves. */
+static uint32_t usbredirhost_op_ep_mask(struct usbredirhost *host, int type,
+    void *header, int *always)
+{
+    struct usb_redir_control_packet_header *control_packet = header;
+    const struct libusb_interface *intf;
+    uint32_t ep_mask = 0;
+    int i, j, k;
+
+    *always = 0;
+    switch (type) {
+    case usb_redir_reset:
+        *always = 1;
+        return ALL_ENDPOINTS;
+    case usb_redir_set_configuration:
+        *always = 1;
+        return ALL_ENDPOINTS;
+    case usb_redir_set_alt_setting:
+        *always = 1;
+        /* host->config may be changing under us while other ops run, or
+           while usbredirhost_set_device_async is attaching the device */
+        if (host->worker_ops || host->disconnected)
+            return ALL_ENDPOINTS;
+        for (i = 0; host->config && i < host->config->bNumInterfaces; i++) {
+            intf = &host->config->interface[i];
+            if (intf->altsetting[0].bInterfaceNumber !=
+                    ((struct usb_redir_set_alt_setting_header *)header)->
+                    interface)
+                continue;
+            for (j = 0; j < intf->num_altsetting; j++) {
+                for (k = 0; k < intf->altsetting[j].bNumEndpoints; k++)
+                    ep_mask |= EP_MASK(
+                        intf->altsetting[j].endpoint[k].bEndpointAddress);
+            }
+        }
+        return ep_mask;
+    case usb_redir_control_packet:
+        if (control_packet->requesttype == LIBUSB_RECIPIENT_ENDPOINT &&
+                control_packet->request == LIBUSB_REQUEST_CLEAR_FEATURE &&
+                control_packet->value == 0x00 && control_packet->length == 0) {
+            *always = 1;
+            return EP_MASK(control_packet->index);
+        }
+        return EP_MASK(control_packet->endpoint);
+    case usb_redir_bulk_packet:
+        return EP_MASK(((struct usb_redir_bulk_packet_header *)header)->
+                       endpoint);
+    case usb_redir_iso_packet:
+        return EP_MASK(((struct usb_redir_iso_packet_header *)header)->
+                       endpoint);
+    case usb_redir_interrupt_packet:
+        return EP_MASK(((struct usb_redir_interrupt_packet_header *)header)->
+                       endpoint);
+    }
+    return ALL_ENDPOINTS;
+}
+
+static void usbredirhost_run_op(struct usbredir_worker_job *job)
+{
+    struct usbredirhost_op *op = (struct usbredirhost_op *)job;
+    struct usbredirhost *host = op->host;
+    int i;
+
+    switch (op->type) {
+    case usb_redir_reset:
+        usbredirhost_reset(host);
+        break;
+    case usb_redir_set_configuration:
+        usbredirhost_set_configuration(host, op->id,
+                                       &op->header.set_configuration);
+        break;
+    case usb_redir_get_configuration:
+        usbredirhost_get_configuration(host, op->id);
+        break;
+    case usb_redir_set_alt_setting:
+        usbredirhost_set_alt_setting(host, op->id,
+                                     &op->header.set_alt_setting);
+        break;
+    case usb_redir_get_alt_setting:
+        usbredirhost_get_alt_setting(host, op->id,
+                                     &op->header.get_alt_setting);
+        break;
+    case usb_redir_start_iso_stream:
+        usbredirhost_start_iso_stream(host, op->id,
+                                      &op->header.start_iso_stream);
+        break;
+    case usb_redir_stop_iso_stream:
+        usbredirhost_stop_iso_stream(host, op->id,
+                                     &op->header.stop_iso_stream);
+        break;
+    case usb_redir_start_interrupt_receiving:
+        usbredirhost_start_interrupt_receiving(host, op->id,
+            &op->header.start_interrupt_receiving);
+        break;
+    case usb_redir_stop_interrupt_receiving:
+        usbredirhost_stop_interrupt_receiving(host, op->id,
+            &op->header.stop_interrupt_receiving);
+        break;
+    case usb_redir_alloc_bulk_streams:
+        usbredirhost_alloc_bulk_streams(host, op->id,
+                                        &op->header.alloc_bulk_streams);
+        break;
+    case usb_redir_free_bulk_streams:
+        usbredirhost_free_bulk_streams(host, op->id,
+                                       &op->header.free_bulk_streams);
+        break;
+    case usb_redir_cancel_data_packet:
+        usbredirhost_cancel_data_packet(host, op->id);
+        break;
+    case usb_redir_start_bulk_receiving:
+        usbredirhost_start_bulk_receiving(host, op->id,
+                                          &op->header.start_bulk_receiving);
+        break;
+    case usb_redir_stop_bulk_receiving:
+        usbredirhost_stop_bulk_receiving(host, op->id,
+                                         &op->header.stop_bulk_receiving);
+        break;
+    case usb_redir_control_packet:
+        usbredirhost_control_packet(host, op->id, &op->header.control_packet,
+                                    op->data, op->data_len);
+        break;
+    case usb_redir_bulk_packet:
+        usbredirhost_bulk_packet(host, op->id, &op->header.bulk_packet,
+                                 op->data, op->data_len);
+        break;
+    case usb_redir_iso_packet:
+        usbredirhost_iso_packet(host, op->id, &op->header.iso_packet,
+                                op->data, op->data_len);
+        break;
+    case usb_redir_interrupt_packet:
+        usbredirhost_interrupt_packet(host, op->id,
+                                      &op->header.interrupt_packet,
+                                      op->data, op->data_len);
+        break;
+    }
+
+    LOCK(host);
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        if (op->ep_mask & (1u << i))
+            host->worker_pending[i]--;
+    }
+    host->worker_ops--;
+    UNLOCK(host);
+    usbredir_free(&host->allocator, op);
+}
+
+/* Returns 1 if the packet has been queued to the worker, which will call the
+   packet handler for it later. 0 if the packet handler should handle the
+   packet itself, which is always the case when called from the worker. */
+static int usbredirhost_queue_op(struct usbredirhost *host, int type,
+    uint64_t id, void *header, size_t header_len, uint8_t *data, int data_len)
+{
+    struct usbredirhost_op *op;
+    uint32_t ep_mask;
+    int i, queue;
+
+    if (!host->async_ops || usbredir_worker_is_current(host->worker))
+        return 0;
+
+    LOCK(host);
+    ep_mask = usbredirhost_op_ep_mask(host, type, header, &queue);
+    if (ep_mask == ALL_ENDPOINTS && host->worker_ops)
+        queue = 1;
+    for (i = 0; i < MAX_ENDPOINTS && !queue; i++) {
+        if ((ep_mask & (1u << i)) && host->worker_pending[i])
+            queue = 1;
+    }
+    if (!queue)
+        goto leave;
+
+    op = usbredir_malloc(&host->allocator, sizeof(*op));
+    if (!op) {
+        ERROR("out of memory allocating worker op, handling it directly");
+        queue = 0;
+        goto leave;
+    }
+    op->host = host;
+    op->ep_mask = ep_mask;
+    op->type = type;
+    op->id = id;
+    op->data = data;
+    op->data_len = data_len;
+    if (header_len)
+        memcpy(&op->header, header, header_len);
+
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        if (ep_mask & (1u << i))
+            host->worker_pending[i]++;
+    }
+    host->worker_ops++;
+    usbredir_worker_queue(host->worker, &op->job, usbredirhost_run_op);
+leave:
+    UNLOCK(host);
+    return queue;
+}
+
 static void usbredirhost_hello(void *priv, struct usb_redir_hello_header *h)
 {
     struct usbredirhost *host = priv;
 
-    if (host->connect_pending)
-        usbredirhost_send_device_connect(host);
+    usbredirhost_send_pending_connect(host);
 }
 
 static void usbredirhost_reset(void *priv)
@@ -1613,6 +2599,9 @@ static void usbredirhost_reset(void *priv)
     struct usbredirhost *host = priv;
     int r;
 
+    if (usbredirhost_queue_op(host, usb_redir_reset, 0, NULL, 0, NULL, 0))
+        return;
+
     if (host->disconnected || host->reset) {
         return;
     }
@@ -1643,6 +2632,10 @@ static void usbredirhost_set_configuration(void *priv, uint64_t id,
         .status = usb_redir_success,
     };
 
+    if (usbredirhost_queue_op(host, usb_redir_set_configuration, id,
+                              set_config, sizeof(*set_config), NULL, 0))
+        return;
+
     if (host->disconnected) {
         status.status = usb_redir_ioerror;
         goto exit;
@@ -1686,11 +2679,20 @@ static void usbredirhost_get_configuration(void *priv, uint64_t id)
     struct usbredirhost *host = priv;
     struct usb_redir_configuration_status_header status;
 
-    if (host->disconnected)
+    if (usbredirhost_queue_op(host, usb_redir_get_configuration, id,
+                              NULL, 0, NULL, 0))
+        return;
+
+    /* Note host->config may be changing while we are disconnected, see
+       usbredirhost_set_device_async */
+    if (host->disconnected) {
         status.status = usb_redir_ioerror;
-    else
+        status.configuration = 0;
+    } else {
         status.status = usb_redir_success;
-    status.configuration = host->config ? host->config->bConfigurationValue:0;
+        status.configuration = host->config ?
+                               host->config->bConfigurationValue : 0;
+    }
     usbredirparser_send_configuration_status(host->parser, id, &status);
     FLUSH(host);
 }
@@ -1704,6 +2706,11 @@ static void usbredirhost_set_alt_setting(void *priv, uint64_t id,
         .status = usb_redir_success,
     };
 
+    if (usbredirhost_queue_op(host, usb_redir_set_alt_setting, id,
+                              set_alt_setting, sizeof(*set_alt_setting),
+                              NULL, 0))
+        return;
+
     if (host->disconnected) {
         status.status = usb_redir_ioerror;
         status.alt = -1;
@@ -1746,6 +2753,7 @@ static void usbredirhost_set_alt_setting(void *priv, uint64_t id,
         }
         host->endpoint[j].interval = 0;
         host->endpoint[j].interface = 0;
+        host->endpoint[j].uvc = 0;
         host->endpoint[j].max_packetsize = 0;
     }
 
@@ -1768,6 +2776,11 @@ static void usbredirhost_get_alt_setting(void *priv, uint64_t id,
     struct usb_redir_alt_setting_status_header status;
     int i;
 
+    if (usbredirhost_queue_op(host, usb_redir_get_alt_setting, id,
+                              get_alt_setting, sizeof(*get_alt_setting),
+                              NULL, 0))
+        return;
+
     if (host->disconnected) {
         status.status = usb_redir_ioerror;
         status.alt = -1;
@@ -1796,6 +2809,11 @@ static void usbredirhost_start_iso_stream(void *priv, uint64_t id,
     struct usbredirhost *host = priv;
     uint8_t ep = start_iso_stream->endpoint;
 
+    if (usbredirhost_queue_op(host, usb_redir_start_iso_stream, id,
+                              start_iso_stream, sizeof(*start_iso_stream),
+                              NULL, 0))
+        return;
+
     usbredirhost_alloc_stream(host, id, ep, usb_redir_type_iso,
                               start_iso_stream->pkts_per_urb,
                               host->endpoint[EP2I(ep)].max_packetsize,
@@ -1806,6 +2824,11 @@ static void usbredirhost_start_iso_stream(void *priv, uint64_t id,
 static void usbredirhost_stop_iso_stream(void *priv, uint64_t id,
     struct usb_redir_stop_iso_stream_header *stop_iso_stream)
 {
+    if (usbredirhost_queue_op(priv, usb_redir_stop_iso_stream, id,
+                              stop_iso_stream, sizeof(*stop_iso_stream),
+                              NULL, 0))
+        return;
+
     usbredirhost_stop_stream(priv, id, stop_iso_stream->endpoint);
 }
 
@@ -1815,15 +2838,27 @@ static void usbredirhost_start_interrupt_receiving(void *priv, uint64_t id,
     struct usbredirhost *host = priv;
     uint8_t ep = start_interrupt_receiving->endpoint;
 
+    if (usbredirhost_queue_op(host, usb_redir_start_interrupt_receiving, id,
+                              start_interrupt_receiving,
+                              sizeof(*start_interrupt_receiving), NULL, 0))
+        return;
+
+    /* Allocate the max, usbredirhost_interrupt_init_unlocked decides how
+       many of these get submitted */
     usbredirhost_alloc_stream(host, id, ep, usb_redir_type_interrupt, 1,
                               host->endpoint[EP2I(ep)].max_packetsize,
-                              INTERRUPT_TRANSFER_COUNT, 1);
+                              MAX_TRANSFER_COUNT, 1);
     FLUSH(host);
 }
 
 static void usbredirhost_stop_interrupt_receiving(void *priv, uint64_t id,
     struct usb_redir_stop_interrupt_receiving_header *stop_interrupt_receiving)
 {
+    if (usbredirhost_queue_op(priv, usb_redir_stop_interrupt_receiving, id,
+                              stop_interrupt_receiving,
+                              sizeof(*stop_interrupt_receiving), NULL, 0))
+        return;
+
     usbredirhost_stop_stream(priv, id, stop_interrupt_receiving->endpoint);
 }
 
@@ -1844,6 +2879,11 @@ static int usbredirhost_ep_mask_to_eps(uint32_t ep_mask, unsigned char *eps)
 static void usbredirhost_alloc_bulk_streams(void *priv, uint64_t id,
     struct usb_redir_alloc_bulk_streams_header *alloc_bulk_streams)
 {
+    if (usbredirhost_queue_op(priv, usb_redir_alloc_bulk_streams, id,
+                              alloc_bulk_streams, sizeof(*alloc_bulk_streams),
+                              NULL, 0))
+        return;
+
 #if LIBUSBX_API_VERSION >= 0x01000103
     struct usbredirhost *host = priv;
     unsigned char eps[MAX_ENDPOINTS];
@@ -1875,6 +2915,11 @@ static void usbredirhost_alloc_bulk_streams(void *priv, uint64_t id,
 static void usbredirhost_free_bulk_streams(void *priv, uint64_t id,
     struct usb_redir_free_bulk_streams_header *free_bulk_streams)
 {
+    if (usbredirhost_queue_op(priv, usb_redir_free_bulk_streams, id,
+                              free_bulk_streams, sizeof(*free_bulk_streams),
+                              NULL, 0))
+        return;
+
 #if LIBUSBX_API_VERSION >= 0x01000103
     struct usbredirhost *host = priv;
     unsigned char eps[MAX_ENDPOINTS];
@@ -1928,10 +2973,15 @@ static void usbredirhost_device_disconnect_ack(void *priv)
         return;
     }
 
+    if (host->disconnect_lock) {
+        usbredirhost_lock_acquire(host, host->disconnect_lock);
+    }
     host->wait_disconnect = 0;
+    if (host->disconnect_lock) {
+        usbredirhost_lock_release(host, host->disconnect_lock);
+    }
 
-    if (host->connect_pending)
-        usbredirhost_send_device_connect(host);
+    usbredirhost_send_pending_connect(host);
 }
 
 static void usbredirhost_start_bulk_receiving(void *priv, uint64_t id,
@@ -1940,6 +2990,11 @@ static void usbredirhost_start_bulk_receiving(void *priv, uint64_t id,
     struct usbredirhost *host = priv;
     uint8_t ep = start_bulk_receiving->endpoint;
 
+    if (usbredirhost_queue_op(host, usb_redir_start_bulk_receiving, id,
+                              start_bulk_receiving,
+                              sizeof(*start_bulk_receiving), NULL, 0))
+        return;
+
     usbredirhost_alloc_stream(host, id, ep, usb_redir_type_bulk, 1,
                               start_bulk_receiving->bytes_per_transfer,
                               start_bulk_receiving->no_transfers, 1);
@@ -1949,6 +3004,11 @@ static void usbredirhost_start_bulk_receiving(void *priv, uint64_t id,
 static void usbredirhost_stop_bulk_receiving(void *priv, uint64_t id,
     struct usb_redir_stop_bulk_receiving_header *stop_bulk_receiving)
 {
+    if (usbredirhost_queue_op(priv, usb_redir_stop_bulk_receiving, id,
+                              stop_bulk_receiving,
+                              sizeof(*stop_bulk_receiving), NULL, 0))
+        return;
+
     usbredirhost_stop_stream(priv, id, stop_bulk_receiving->endpoint);
 }
 
@@ -1962,6 +3022,10 @@ static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
     struct usb_redir_bulk_packet_header      bulk_packet;
     struct usb_redir_interrupt_packet_header interrupt_packet;
 
+    if (usbredirhost_queue_op(host, usb_redir_cancel_data_packet, id,
+                              NULL, 0, NULL, 0))
+        return;
+
     /*
      * This is a bit tricky, we are run from a parser read callback, while
      * at the same time the packet completion callback may run from another
@@ -1988,6 +3052,8 @@ static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
         }
     }
 
+    USBREDIR_TRACE2(cancel, t ? t->transfer->endpoint : 0, id);
+
     /*
      * Note not finding the transfer is not an error, the transfer may have
      * completed by the time we receive the cancel.
@@ -2034,6 +3100,344 @@ static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
     FLUSH(host);
 }
 
+/* A guest enumerating a device asks for the same standard descriptors many
+   times over, often first for a header and then for the whole descriptor.
+   To avoid a device round trip for each of these, we cache the device,
+   config, string and BOS descriptors returned by the device and answer
+   identical (or shorter) requests from the cache. The cache gets flushed
+   on reset, configuration change and when the device goes away.
+   Note the desc_cache_find / _store / _free helpers must be called with
+   the host lock held. */
+static int usbredirhost_desc_cacheable(
+    struct usb_redir_control_packet_header *control_packet)
+{
+    if (control_packet->endpoint != 0x80 ||
+            control_packet->requesttype != (LIBUSB_ENDPOINT_IN |
+                                            LIBUSB_REQUEST_TYPE_STANDARD |
+                                            LIBUSB_RECIPIENT_DEVICE) ||
+            control_packet->request != LIBUSB_REQUEST_GET_DESCRIPTOR)
+        return 0;
+
+    switch (control_packet->value >> 8) {
+    case LIBUSB_DT_DEVICE:
+    case LIBUSB_DT_CONFIG:
+    case LIBUSB_DT_STRING:
+    case USB_DT_BOS:
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns true if desc holds the entire descriptor, rather then just
+   the first part of it */
+static int usbredirhost_desc_complete(struct usbredirhost_desc *desc)
+{
+    int total;
+
+    if (desc->type == LIBUSB_DT_CONFIG || desc->type == USB_DT_BOS) {
+        if (desc->length < 4)
+            return 0;
+        total = desc->data[2] | (desc->data[3] << 8);
+    } else {
+        total = desc->data[0];
+    }
+    return desc->length >= total;
+}
+
+static struct usbredirhost_desc *usbredirhost_desc_cache_find(
+    struct usbredirhost *host, uint8_t type, uint8_t index, uint16_t langid)
+{
+    struct usbredirhost_desc *desc;
+    int i;
+
+    for (i = 0; i < DESC_CACHE_SIZE; i++) {
+        desc = &host->desc_cache[i];
+        if (desc->length && desc->type == type && desc->index == index &&
+                desc->langid == langid)
+            return desc;
+    }
+    return NULL;
+}
+
+static void usbredirhost_desc_cache_store(struct usbredirhost *host,
+    uint8_t type, uint8_t index, uint16_t langid, const uint8_t *data,
+    int length)
+{
+    struct usbredirhost_desc *desc;
+    uint8_t *copy;
+
+    if (length < 2 || data[1] != type)
+        return;
+
+    desc = usbredirhost_desc_cache_find(host, type, index, langid);
+    if (desc && desc->length >= length)
+        return;
+    if (!desc) {
+        desc = &host->desc_cache[host->desc_cache_next];
+        host->desc_cache_next = (host->desc_cache_next + 1) % DESC_CACHE_SIZE;
+    }
+
+    copy = usbredir_malloc(&host->allocator, length);
+    if (!copy)
+        return;
+    memcpy(copy, data, length);
+
+    usbredir_free(&host->allocator, desc->data);
+    desc->type = type;
+    desc->index = index;
+    desc->langid = langid;
+    desc->length = length;
+    desc->data = copy;
+}
+
+static void usbredirhost_desc_cache_free(struct usbredirhost *host)
+{
+    int i;
+
+    for (i = 0; i < DESC_CACHE_SIZE; i++) {
+        usbredir_free(&host->allocator, host->desc_cache[i].data);
+        host->desc_cache[i].data = NULL;
+        host->desc_cache[i].length = 0;
+    }
+    host->desc_cache_next = 0;
+    host->desc_cache_filled = 0;
+}
+
+static void usbredirhost_desc_cache_clear(struct usbredirhost *host)
+{
+    LOCK(host);
+    usbredirhost_desc_cache_free(host);
+    UNLOCK(host);
+}
+
+/* Flush the cache, and seed it with the device descriptor we already
+   got from libusb (which does not require any device I/O) */
+static void usbredirhost_desc_cache_reset(struct usbredirhost *host)
+{
+    const struct libusb_device_descriptor *d = &host->desc;
+    const uint8_t desc[LIBUSB_DT_DEVICE_SIZE] = {
+        LIBUSB_DT_DEVICE_SIZE, LIBUSB_DT_DEVICE,
+        d->bcdUSB & 0xff, d->bcdUSB >> 8,
+        d->bDeviceClass, d->bDeviceSubClass, d->bDeviceProtocol,
+        d->bMaxPacketSize0,
+        d->idVendor & 0xff, d->idVendor >> 8,
+        d->idProduct & 0xff, d->idProduct >> 8,
+        d->bcdDevice & 0xff, d->bcdDevice >> 8,
+        d->iManufacturer, d->iProduct, d->iSerialNumber,
+        d->bNumConfigurations
+    };
+
+    LOCK(host);
+    usbredirhost_desc_cache_free(host);
+    usbredirhost_desc_cache_store(host, LIBUSB_DT_DEVICE, 0, 0,
+                                  desc, sizeof(desc));
+    UNLOCK(host);
+}
+
+/* Read a descriptor which starts with a wTotalLength (config / BOS) from
+   the device and add it to the cache */
+static void usbredirhost_desc_cache_read(struct usbredirhost *host,
+    uint8_t type, uint8_t index, int header_len)
+{
+    uint8_t header[LIBUSB_DT_CONFIG_SIZE];
+    uint8_t *buf;
+    int r, total;
+
+    r = libusb_get_descriptor(host->handle, type, index, header, header_len);
+    if (r < 4 || header[1] != type)
+        return;
+
+    total = header[2] | (header[3] << 8);
+    buf = usbredir_malloc(&host->allocator, total);
+    if (!buf)
+        return;
+
+    r = libusb_get_descriptor(host->handle, type, index, buf, total);
+    if (r == total) {
+        LOCK(host);
+        usbredirhost_desc_cache_store(host, type, index, 0, buf, total);
+        UNLOCK(host);
+    }
+    usbredir_free(&host->allocator, buf);
+}
+
+static void usbredirhost_desc_mark_string(uint8_t *strings, uint8_t index)
+{
+    strings[index / 8] |= 1 << (index % 8);
+}
+
+/* Mark the strings referenced by config descriptor index in the strings
+   bitmap, called with the host lock held */
+static void usbredirhost_desc_config_strings(struct usbredirhost *host,
+    uint8_t index, uint8_t *strings)
+{
+    struct usbredirhost_desc *desc;
+    int pos;
+
+    desc = usbredirhost_desc_cache_find(host, LIBUSB_DT_CONFIG, index, 0);
+    if (!desc || desc->length < LIBUSB_DT_CONFIG_SIZE)
+        return;
+
+    /* iConfiguration */
+    usbredirhost_desc_mark_string(strings, desc->data[6]);
+    for (pos = 0; pos + 2 <= desc->length && desc->data[pos] >= 2;
+            pos += desc->data[pos]) {
+        if (desc->data[pos + 1] == LIBUSB_DT_INTERFACE &&
+                pos + LIBUSB_DT_INTERFACE_SIZE <= desc->length)
+            /* iInterface */
+            usbredirhost_desc_mark_string(strings, desc->data[pos + 8]);
+    }
+}
+
+/* Read all standard descriptors the guest is going to ask for during
+   enumeration into the cache. We stop once the cache is full, rather then
+   evicting the entries we have just read. */
+static void usbredirhost_desc_cache_fill(struct usbredirhost *host)
+{
+    const struct libusb_device_descriptor *d = &host->desc;
+    uint8_t strings[32] = { 0, }; /* Bitmap of referenced string indexes */
+    uint8_t langids[255], buf[255];
+    int i, j, r, langids_len;
+    uint16_t langid;
+
+    /* Already done by usbredirhost_set_device_async ? */
+    if (host->desc_cache_filled)
+        return;
+    host->desc_cache_filled = 1;
+
+#define DESC_CACHE_FULL(host) \
+    ((host)->desc_cache[(host)->desc_cache_next].length != 0)
+
+    usbredirhost_desc_mark_string(strings, d->iManufacturer);
+    usbredirhost_desc_mark_string(strings, d->iProduct);
+    usbredirhost_desc_mark_string(strings, d->iSerialNumber);
+
+    for (i = 0; i < d->bNumConfigurations && !DESC_CACHE_FULL(host); i++) {
+        usbredirhost_desc_cache_read(host, LIBUSB_DT_CONFIG, i,
+                                     LIBUSB_DT_CONFIG_SIZE);
+        LOCK(host);
+        usbredirhost_desc_config_strings(host, i, strings);
+        UNLOCK(host);
+    }
+
+    if (d->bcdUSB >= 0x0201 && !DESC_CACHE_FULL(host))
+        usbredirhost_desc_cache_read(host, USB_DT_BOS, 0, 5);
+
+    strings[0] &= ~1; /* Index 0 means no string */
+    for (i = 0; i < 32 && strings[i] == 0; i++);
+    if (i == 32 || DESC_CACHE_FULL(host))
+        return;
+
+    r = libusb_get_string_descriptor(host->handle, 0, 0,
+                                     langids, sizeof(langids));
+    if (r < 4 || langids[1] != LIBUSB_DT_STRING)
+        return;
+    langids_len = r;
+    LOCK(host);
+    usbredirhost_desc_cache_store(host, LIBUSB_DT_STRING, 0, 0,
+                                  langids, langids_len);
+    UNLOCK(host);
+
+    for (i = 2; i + 1 < langids_len; i += 2) {
+        langid = langids[i] | (langids[i + 1] << 8);
+        for (j = 1; j < 256; j++) {
+            if (!(strings[j / 8] & (1 << (j % 8))))
+                continue;
+            if (DESC_CACHE_FULL(host))
+                return;
+            r = libusb_get_string_descriptor(host->handle, j, langid,
+                                             buf, sizeof(buf));
+            if (r < 2)
+                continue;
+            LOCK(host);
+            usbredirhost_desc_cache_store(host, LIBUSB_DT_STRING, j, langid,
+                                          buf, r);
+            UNLOCK(host);
+        }
+    }
+#undef DESC_CACHE_FULL
+}
+
+/* Push the contents of the (filled) descriptor cache to the guest */
+static void usbredirhost_send_descriptors(struct usbredirhost *host)
+{
+    struct usb_redir_descriptors_header descriptors = { 0 };
+    struct usb_redir_descriptor_entry entry;
+    struct usbredirhost_desc *desc;
+    uint8_t *data;
+    int i, pos = 0, data_len = 0;
+
+    usbredirhost_desc_cache_fill(host);
+
+    LOCK(host);
+    for (i = 0; i < DESC_CACHE_SIZE; i++) {
+        desc = &host->desc_cache[i];
+        if (desc->length && usbredirhost_desc_complete(desc))
+            data_len += sizeof(entry) + desc->length;
+    }
+    data = usbredir_malloc(&host->allocator, data_len);
+    if (!data) {
+        UNLOCK(host);
+        ERROR("out of memory allocating descriptors");
+        return;
+    }
+    for (i = 0; i < DESC_CACHE_SIZE; i++) {
+        desc = &host->desc_cache[i];
+        if (!desc->length || !usbredirhost_desc_complete(desc))
+            continue;
+        entry.type = desc->type;
+        entry.index = desc->index;
+        entry.langid = desc->langid;
+        entry.length = desc->length;
+        memcpy(data + pos, &entry, sizeof(entry));
+        pos += sizeof(entry);
+        memcpy(data + pos, desc->data, desc->length);
+        pos += desc->length;
+        descriptors.count++;
+    }
+    UNLOCK(host);
+
+    DEBUG("sending %u descriptors, %d bytes", descriptors.count, data_len);
+    usbredirparser_send_descriptors(host->parser, &descriptors,
+                                    data, data_len);
+    usbredir_free(&host->allocator, data);
+}
+
+/* Returns 1 if the control packet was answered from the descriptor cache */
+static int usbredirhost_send_cached_descriptor(struct usbredirhost *host,
+    uint64_t id, struct usb_redir_control_packet_header *control_packet)
+{
+    struct usbredirhost_desc *desc;
+    int length = control_packet->length, sent = 0;
+
+    if (!usbredirhost_desc_cacheable(control_packet))
+        return 0;
+
+    LOCK(host);
+    desc = usbredirhost_desc_cache_find(host, control_packet->value >> 8,
+                                        control_packet->value & 0xff,
+                                        control_packet->index);
+    if (!desc)
+        goto leave;
+    if (length > desc->length) {
+        /* The device would have returned a short packet */
+        if (!usbredirhost_desc_complete(desc))
+            goto leave;
+        length = desc->length;
+    }
+
+    DEBUG("control descriptor %04X index %04X len %d from cache id %"PRIu64,
+          control_packet->value, control_packet->index, length, id);
+    control_packet->status = usb_redir_success;
+    control_packet->length = length;
+    usbredirparser_send_control_packet(host->parser, id, control_packet,
+                                       desc->data, length);
+    sent = 1;
+leave:
+    UNLOCK(host);
+    return sent;
+}
+
 static void LIBUSB_CALL usbredirhost_control_packet_complete(
     struct libusb_transfer *libusb_transfer)
 {
@@ -2042,6 +3446,9 @@ static void LIBUSB_CALL usbredirhost_control_packet_complete(
     struct usbredirhost *host = transfer->host;
 
     LOCK(host);
+    USBREDIR_TRACE5(urb_complete, libusb_transfer->endpoint,
+                    libusb_transfer->type, transfer->id,
+                    libusb_transfer->status, libusb_transfer->actual_length);
 
     control_packet = transfer->control_packet;
     control_packet.status = libusb_status_or_error_to_redir_status(host,
@@ -2057,6 +3464,13 @@ static void LIBUSB_CALL usbredirhost_control_packet_complete(
             usbredirhost_log_data(host, "ctrl data in:",
                          libusb_transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
                          libusb_transfer->actual_length);
+            if (control_packet.status == usb_redir_success &&
+                    usbredirhost_desc_cacheable(&control_packet))
+                usbredirhost_desc_cache_store(host,
+                         control_packet.value >> 8,
+                         control_packet.value & 0xff, control_packet.index,
+                         libusb_transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+                         libusb_transfer->actual_length);
             usbredirparser_send_control_packet(host->parser, transfer->id,
                                                &control_packet,
                                                libusb_transfer->buffer +
@@ -2093,6 +3507,11 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
     unsigned char *buffer;
     int r;
 
+    if (usbredirhost_queue_op(host, usb_redir_control_packet, id,
+                              control_packet, sizeof(*control_packet),
+                              data, data_len))
+        return;
+
     DEBUG("control submit ep %02X len %d id %"PRIu64, ep,
           control_packet->length, id);
 
@@ -2114,14 +3533,13 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
         return;
     }
 
-    host->reset = 0;
-
     /* If it is a clear stall, we need to do an actual clear stall, rather then
        just forward the control packet, so that the usbhost usbstack knows
        the stall is cleared */
     if (control_packet->requesttype == LIBUSB_RECIPIENT_ENDPOINT &&
             control_packet->request == LIBUSB_REQUEST_CLEAR_FEATURE &&
             control_packet->value == 0x00 && data_len == 0) {
+        host->reset = 0;
         r = libusb_clear_halt(host->handle, control_packet->index);
         r = libusb_status_or_error_to_redir_status(host, r);
         DEBUG("clear halt ep %02X status %d", control_packet->index, r);
@@ -2130,7 +3548,22 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
         return;
     }
 
-    buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
+    if (usbredirhost_send_cached_descriptor(host, id, control_packet)) {
+        FLUSH(host);
+        return;
+    }
+    /* Reading descriptors does not change the device state */
+    if (control_packet->requesttype != LIBUSB_ENDPOINT_IN ||
+            control_packet->request != LIBUSB_REQUEST_GET_DESCRIPTOR)
+        host->reset = 0;
+
+    /* The guest changing the configuration behind our back */
+    if (control_packet->requesttype == LIBUSB_RECIPIENT_DEVICE &&
+            control_packet->request == LIBUSB_REQUEST_SET_CONFIGURATION)
+        usbredirhost_desc_cache_clear(host);
+
+    buffer = usbredir_malloc(&host->allocator,
+                             LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
     if (!buffer) {
         ERROR("out of memory allocating transfer buffer, dropping packet");
         usbredirparser_free_packet_data(host->parser, data);
@@ -2139,7 +3572,7 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
 
     transfer = usbredirhost_alloc_transfer(host, 0);
     if (!transfer) {
-        free(buffer);
+        usbredir_free(&host->allocator, buffer);
         usbredirparser_free_packet_data(host->parser, data);
         return;
     }
@@ -2165,6 +3598,8 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
 
     usbredirhost_add_transfer(host, transfer);
 
+    USBREDIR_TRACE4(urb_submit, transfer->transfer->endpoint,
+                    transfer->transfer->type, id, transfer->transfer->length);
     r = libusb_submit_transfer(transfer->transfer);
     if (r < 0) {
         ERROR("error submitting control transfer on ep %02X: %s",
@@ -2183,6 +3618,9 @@ static void LIBUSB_CALL usbredirhost_bulk_packet_complete(
     struct usbredirhost *host = transfer->host;
 
     LOCK(host);
+    USBREDIR_TRACE5(urb_complete, libusb_transfer->endpoint,
+                    libusb_transfer->type, transfer->id,
+                    libusb_transfer->status, libusb_transfer->actual_length);
 
     bulk_packet = transfer->bulk_packet;
     bulk_packet.status = libusb_status_or_error_to_redir_status(host,
@@ -2230,10 +3668,16 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
 {
     struct usbredirhost *host = priv;
     uint8_t ep = bulk_packet->endpoint;
-    int len = (bulk_packet->length_high << 16) | bulk_packet->length;
+    int len = ((uint32_t)bulk_packet->length_high << 16) |
+              bulk_packet->length;
     struct usbredirtransfer *transfer;
     int r;
 
+    if (usbredirhost_queue_op(host, usb_redir_bulk_packet, id,
+                              bulk_packet, sizeof(*bulk_packet),
+                              data, data_len))
+        return;
+
     DEBUG("bulk submit ep %02X len %d id %"PRIu64, ep, len, id);
 
     if (host->disconnected) {
@@ -2253,7 +3697,7 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     }
 
     if (ep & LIBUSB_ENDPOINT_IN) {
-        data = malloc(len);
+        data = usbredir_malloc(&host->allocator, len);
         if (!data) {
             ERROR("out of memory allocating bulk buffer, dropping packet");
             return;
@@ -2266,7 +3710,7 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
 
     transfer = usbredirhost_alloc_transfer(host, 0);
     if (!transfer) {
-        free(data);
+        usbredir_free(&host->allocator, data);
         return;
     }
 
@@ -2292,6 +3736,8 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
 
     usbredirhost_add_transfer(host, transfer);
 
+    USBREDIR_TRACE4(urb_submit, transfer->transfer->endpoint,
+                    transfer->transfer->type, id, transfer->transfer->length);
     r = libusb_submit_transfer(transfer->transfer);
     if (r < 0) {
 #if LIBUSBX_API_VERSION < 0x01000103
@@ -2312,10 +3758,17 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
     struct usbredirhost *host = priv;
     uint8_t ep = iso_packet->endpoint;
     struct usbredirtransfer *transfer;
-    int i, j, status = usb_redir_success;
+    int i, j, in_place, status = usb_redir_success;
+
+    if (usbredirhost_queue_op(host, usb_redir_iso_packet, id,
+                              iso_packet, sizeof(*iso_packet), data, data_len))
+        return;
 
     LOCK(host);
 
+    /* See usbredirhost_get_data_buffer */
+    in_place = data && data == host->read_buffer;
+
     if (host->disconnected) {
         status = usb_redir_ioerror;
         goto leave;
@@ -2333,7 +3786,10 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
         goto leave;
     }
 
-    if (data_len > host->endpoint[EP2I(ep)].max_packetsize) {
+    /* The parser passes on packets which it finds too large without their
+       data, so check the length from the header too */
+    if (data_len > host->endpoint[EP2I(ep)].max_packetsize ||
+            iso_packet->length > host->endpoint[EP2I(ep)].max_packetsize) {
         ERROR("error received iso out packet is larger than wMaxPacketSize");
         status = usb_redir_inval;
         goto leave;
@@ -2341,6 +3797,7 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
 
     if (host->endpoint[EP2I(ep)].drop_packets) {
         host->endpoint[EP2I(ep)].drop_packets--;
+        USBREDIR_TRACE3(packet_drop, ep, id, data_len);
         goto leave;
     }
 
@@ -2354,6 +3811,7 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
         host->endpoint[EP2I(ep)].drop_packets =
                      (host->endpoint[EP2I(ep)].pkts_per_transfer *
                       host->endpoint[EP2I(ep)].transfer_count) / 2;
+        USBREDIR_TRACE3(packet_drop, ep, id, data_len);
         goto leave;
     }
 
@@ -2361,8 +3819,11 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
     if (j == 0) {
         transfer->id = id;
     }
-    memcpy(libusb_get_iso_packet_buffer(transfer->transfer, j),
-           data, data_len);
+    /* Unless the stream got restarted while the parser was reading the
+       data, the data already is where it needs to be */
+    if (!in_place || transfer != host->read_transfer)
+        memcpy(libusb_get_iso_packet_buffer(transfer->transfer, j),
+               data, data_len);
     transfer->transfer->iso_packet_desc[j].length = data_len;
     DEBUG("iso-in queue ep %02X urb %d pkt %d len %d id %"PRIu64,
            ep, i, j, data_len, transfer->id);
@@ -2393,14 +3854,68 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
     }
 
 leave:
+    if (in_place)
+        usbredirhost_release_read_transfer(host);
     UNLOCK(host);
-    usbredirparser_free_packet_data(host->parser, data);
+    if (!in_place)
+        usbredirparser_free_packet_data(host->parser, data);
     if (status != usb_redir_success) {
         usbredirhost_send_stream_status(host, id, ep, status);
     }
     FLUSH(host);
 }
 
+/* Have the parser read iso out data straight into the next free packet
+   of the stream's current transfer, saving an allocation and a copy per
+   packet. This only hands out the packet buffer when usbredirhost_iso_packet
+   would store the packet there. The transfer does not get freed while the
+   parser may still be reading into it, see usbredirhost_cancel_stream.
+   Bulk out packets need no help here, their data buffer gets used as the
+   transfer buffer as is. */
+static uint8_t *usbredirhost_get_data_buffer(void *priv, uint64_t id,
+    uint32_t type, void *type_header, int data_len)
+{
+    struct usbredirhost *host = priv;
+    struct usb_redir_iso_packet_header *iso_packet = type_header;
+    struct usbredirhost_ep *endpoint;
+    struct usbredirtransfer *transfer;
+    uint8_t *buf = NULL;
+    uint8_t ep;
+    int j;
+
+    if (type != usb_redir_iso_packet)
+        return NULL;
+
+    ep = iso_packet->endpoint;
+    endpoint = &host->endpoint[EP2I(ep)];
+
+    LOCK(host);
+    /* The previous packet may have been invalid */
+    usbredirhost_release_read_transfer(host);
+
+    /* Packets which get queued to the worker need a buffer of their own */
+    if (host->disconnected || (ep & LIBUSB_ENDPOINT_IN) ||
+            host->worker_pending[EP2I(ep)] ||
+            endpoint->type != usb_redir_type_iso ||
+            endpoint->transfer_count == 0 ||
+            data_len > endpoint->max_packetsize ||
+            endpoint->drop_packets)
+        goto leave;
+
+    transfer = endpoint->transfer[endpoint->out_idx];
+    j = transfer->packet_idx;
+    if (j == SUBMITTED_IDX)
+        goto leave;
+
+    buf = libusb_get_iso_packet_buffer(transfer->transfer, j);
+    host->read_transfer = transfer;
+    host->read_buffer = buf;
+
+leave:
+    UNLOCK(host);
+    return buf;
+}
+
 static void LIBUSB_CALL usbredirhost_interrupt_out_packet_complete(
     struct libusb_transfer *libusb_transfer)
 {
@@ -2409,6 +3924,9 @@ static void LIBUSB_CALL usbredirhost_interrupt_out_packet_complete(
     struct usbredirhost *host = transfer->host;
 
     LOCK(host);
+    USBREDIR_TRACE5(urb_complete, libusb_transfer->endpoint,
+                    libusb_transfer->type, transfer->id,
+                    libusb_transfer->status, libusb_transfer->actual_length);
 
     interrupt_packet = transfer->interrupt_packet;
     interrupt_packet.status = libusb_status_or_error_to_redir_status(host,
@@ -2447,6 +3965,11 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
     struct usbredirtransfer *transfer;
     int r;
 
+    if (usbredirhost_queue_op(host, usb_redir_interrupt_packet, id,
+                              interrupt_packet, sizeof(*interrupt_packet),
+                              data, data_len))
+        return;
+
     DEBUG("interrupt submit ep %02X len %d id %"PRIu64, ep,
           interrupt_packet->length, id);
 
@@ -2467,7 +3990,9 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
         return;
     }
 
-    if (data_len > host->endpoint[EP2I(ep)].max_packetsize) {
+    /* See usbredirhost_iso_packet */
+    if (data_len > host->endpoint[EP2I(ep)].max_packetsize ||
+            interrupt_packet->length > host->endpoint[EP2I(ep)].max_packetsize) {
         ERROR("error received interrupt out packet is larger than wMaxPacketSize");
         usbredirhost_send_interrupt_status(host, id, interrupt_packet,
                                            usb_redir_inval);
@@ -2497,6 +4022,8 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
 
     usbredirhost_add_transfer(host, transfer);
 
+    USBREDIR_TRACE4(urb_submit, transfer->transfer->endpoint,
+                    transfer->transfer->type, id, transfer->transfer->length);
     r = libusb_submit_transfer(transfer->transfer);
     if (r < 0) {
         ERROR("error submitting interrupt transfer on ep %02X: %s",
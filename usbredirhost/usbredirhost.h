@@ -63,6 +63,24 @@ typedef uint64_t (*usbredirhost_buffered_output_size)(void *priv);
 
 enum {
     usbredirhost_fl_write_cb_owns_buffer = 0x01, /* See usbredirparser.h */
+    usbredirhost_fl_lockfree_write_queue = 0x02, /* See usbredirparser.h */
+    /* Use the builtin lock for both the host and its parser, see
+       usbredirparser.h, the lock callbacks are then ignored (and may be
+       NULL) */
+    usbredirhost_fl_builtin_lock = 0x04,
+    usbredirhost_fl_write_priority = 0x08, /* See usbredirparser.h */
+    /* Run the blocking libusb calls for set_configuration, set_alt_setting
+       and clear halt requests from the guest on a worker thread, so that
+       usbredirhost_read_guest_data does not block on them, and packets for
+       unaffected endpoints keep flowing. Packets for affected endpoints
+       get handled by the worker after the op. This requires locking (lock
+       callbacks or usbredirhost_fl_builtin_lock), see README.multi-thread */
+    usbredirhost_fl_async_ops = 0x10,
+    /* For iso in endpoints of uvc video streaming interfaces, decide
+       whether to drop data (see usbredirhost_set_buffered_output_size_cb)
+       per video frame, rather then per urb, so that the guest does not get
+       partial frames */
+    usbredirhost_fl_uvc_frame_drop = 0x20,
 };
 
 struct usbredirhost *usbredirhost_open(
@@ -87,6 +105,26 @@ struct usbredirhost *usbredirhost_open_full(
     usbredirparser_free_lock free_lock_func,
     void *func_priv, const char *version, int verbose, int flags);
 
+/* Like usbredirhost_open_full, but all memory owned by the usbredirhost and
+   its usbredirparser gets allocated through allocator, see
+   usbredirparser_create_with_allocator. Note that with
+   usbredirhost_fl_write_cb_owns_buffer the write callback must free the
+   buffers it gets with usbredirhost_free_write_buffer(). allocator may be
+   NULL to use the libc malloc. */
+struct usbredirhost *usbredirhost_open_with_allocator(
+    libusb_context *usb_ctx,
+    libusb_device_handle *usb_dev_handle,
+    usbredirparser_log log_func,
+    usbredirparser_read  read_guest_data_func,
+    usbredirparser_write write_guest_data_func,
+    usbredirhost_flush_writes flush_writes_func,
+    usbredirparser_alloc_lock alloc_lock_func,
+    usbredirparser_lock lock_func,
+    usbredirparser_unlock unlock_func,
+    usbredirparser_free_lock free_lock_func,
+    void *func_priv, const char *version, int verbose, int flags,
+    const struct usbredirparser_allocator *allocator);
+
 /* Closes (destroys) the usbredirhost, if the usbredirhost currently
    is redirecting a device this function will first call
    usbredirhost_set_device(host, NULL); See the notes for that function!
@@ -116,6 +154,52 @@ void usbredirhost_close(struct usbredirhost *host);
 int usbredirhost_set_device(struct usbredirhost *host,
                             libusb_device_handle *usb_dev_handle);
 
+/* Called when an usbredirhost_set_device_async call has completed, with the
+   status usbredirhost_set_device would have returned. Note this gets called
+   from the host's worker thread. */
+typedef void (*usbredirhost_set_device_done)(void *priv, int status);
+
+/* Non blocking version of usbredirhost_set_device, the claiming and
+   resetting of the device, as well as reading its descriptors, is done by a
+   worker thread owned by the host, which calls done_func when finished.
+   If the guest has already connected by then the device_connect will have
+   been sent (from the worker thread) before done_func gets called, else it
+   gets send when the guest's hello is received as usual. Since each host
+   has its own worker, multiple hosts can attach their devices in parallel.
+
+   The same notes as for usbredirhost_set_device apply. The host may be
+   used (e.g. usbredirhost_read_guest_data may be called) while the attach
+   is in progress. usbredirhost_set_device and usbredirhost_close wait for
+   a pending attach to complete.
+
+   Only attaching a device while no device is attached (or being attached)
+   is done asynchronously. Replacing a device, or passing NULL, is done
+   synchronously, as by usbredirhost_set_device, and done_func is called
+   before this function returns.
+
+   This requires locking (lock callbacks or usbredirhost_fl_builtin_lock),
+   without it, or if the worker thread cannot be created, the attach is done
+   synchronously and done_func is called before this function returns. */
+void usbredirhost_set_device_async(struct usbredirhost *host,
+    libusb_device_handle *usb_dev_handle,
+    usbredirhost_set_device_done done_func, void *done_priv);
+
+/* Load per device quirks from a file, replacing any previously loaded ones.
+   The quirks apply to devices passed to usbredirhost_set_device afterwards,
+   for all hosts. The file has one "vendorid:productid quirk[,quirk...]"
+   line per device (ids in hex), '#' starts a comment, lines may be at most
+   254 characters long. Supported quirks:
+   no-reset      never reset the device (it does not survive a reset)
+   always-reset  reset the device on release, even if it was not used by
+                 the guest since it got reset when it was attached
+   none          no quirks, overrides the builtin quirks for the device
+
+   Return value: 0 on success, -errno when the file cannot be read, -ENOMEM,
+       or -EINVAL on a parsing error, in which case *error_line (if not
+       NULL) is set to the offending line number.
+*/
+int usbredirhost_load_quirks(const char *filename, int *error_line);
+
 /* Call this function to set a callback in usbredirhost.
    The usbredirhost_buffered_output_size callback should return the
    application's pending writes buffer size (in bytes).
@@ -124,6 +208,8 @@ int usbredirhost_set_device(struct usbredirhost *host,
    provided by the usb device. In case the application's buffer is increasing
    too much then usbredirhost uses the threshold limits to drop isochronous
    packages but still send full frames whenever is possible.
+   This is decided once per urb, or once per video frame for uvc devices
+   when opened with usbredirhost_fl_uvc_frame_drop.
 */
 void usbredirhost_set_buffered_output_size_cb(struct usbredirhost *host,
     usbredirhost_buffered_output_size buffered_output_size_func);
@@ -159,6 +245,56 @@ enum {
 };
 int usbredirhost_write_guest_data(struct usbredirhost *host);
 
+/* See usbredirparser_set_endpoint_weight, only has an effect when the host
+   was opened with usbredirhost_fl_write_priority */
+int usbredirhost_set_endpoint_weight(struct usbredirhost *host,
+                                     uint8_t ep, int weight);
+
+/* Capture the packets exchanged with the guest to filename, see
+   usbredirparser_start_capture. Returns 0 on success, -1 on error. */
+int usbredirhost_start_capture(struct usbredirhost *host,
+                               const char *filename);
+void usbredirhost_stop_capture(struct usbredirhost *host);
+
+/* Get the combined lock stats of the host and its parser, see
+   usbredirparser_get_lock_stats. Returns 0 on success, -1 if the host was
+   opened without usbredirhost_fl_builtin_lock or usbredir was built without
+   --enable-lock-stats */
+int usbredirhost_get_lock_stats(struct usbredirhost *host,
+                                struct usbredirparser_lock_stats *stats);
+
+/* Interrupt receiving keeps a number of transfers in flight (the depth),
+   sized from the endpoint's bInterval and the observed rate of reports.
+   An underrun is counted each time depth completions got handled back to
+   back (less then half a polling period apart), so all transfers had
+   completed before one could be resubmitted, the depth then gets doubled.
+   Packets counts the packets send to the guest, this is less then
+   completions when reports got coalesced, see
+   usbredirhost_set_interrupt_coalescing. */
+struct usbredirhost_interrupt_stats {
+    uint64_t completions;
+    uint64_t underruns;
+    uint64_t packets;
+    int depth;
+    int max_depth;
+};
+
+/* Get the interrupt receiving stats of interrupt in endpoint ep, these get
+   reset when interrupt receiving is started. Returns 0 on success, -1 if
+   ep is not an interrupt in endpoint */
+int usbredirhost_get_interrupt_stats(struct usbredirhost *host, uint8_t ep,
+                                     struct usbredirhost_interrupt_stats *stats);
+
+/* When the guest has usb_redir_cap_coalesced_interrupt, interrupt in reports
+   which complete while earlier packets are still waiting to be written to
+   the guest get collected and send as a single packet by the next
+   usbredirhost_write_guest_data call. Reports are never held back when
+   nothing else is waiting to be written. window_us limits how long
+   reports get collected while the guest connection is backed up, the
+   default is 1000 us, 0 disables coalescing. */
+void usbredirhost_set_interrupt_coalescing(struct usbredirhost *host,
+                                           int window_us);
+
 /* When passing the usbredirhost_fl_write_cb_owns_buffer flag to
    usbredirhost_open, this function must be called to free the data buffer
    passed to write_guest_data_func when done with this buffer. */
@@ -179,6 +315,35 @@ void usbredirhost_get_guest_filter(struct usbredirhost *host,
 int usbredirhost_check_device_filter(const struct usbredirfilter_rule *rules,
     int rules_count, libusb_device *dev, int flags);
 
+/* An usbredirhost_engine runs the libusb event handling for any number of
+   usbredirhost instances, so that the app does not have to call
+   libusb_handle_events itself.
+
+   libusb handles the events of a context from a single thread at a time, so
+   the engine creates one libusb context per thread. Get a context with
+   usbredirhost_engine_get_context (this hands out the engine's contexts
+   round robin), open the device with it and pass it to usbredirhost_open*.
+   The host then detects that its context belongs to an engine.
+
+   Notes:
+   1) Transfer completion callbacks run on the engine's threads, so the
+      hosts must be opened with locking enabled, see README.multi-thread.
+   2) When cancelling transfers (usbredirhost_set_device, usbredirhost_close
+      and some guest requests) the host waits for the engine thread to
+      complete them, rather then calling libusb_handle_events itself, so
+      that callbacks of other hosts never run from within its calls.
+   3) All hosts using the engine must be closed before destroying it, this
+      also calls libusb_exit for the engine's contexts.
+
+   usbredirhost_engine_create returns NULL on failure.
+*/
+struct usbredirhost_engine;
+
+struct usbredirhost_engine *usbredirhost_engine_create(int threads);
+void usbredirhost_engine_destroy(struct usbredirhost_engine *engine);
+libusb_context *usbredirhost_engine_get_context(
+    struct usbredirhost_engine *engine);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,255 @@
+/* usbredirquirks.c usbredirhost internal per device quirks table
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "usbredirhost.h"
+#include "usbredirquirks.h"
+
+struct usbredir_quirk {
+    uint32_t id;        /* vendor_id << 16 | product_id, 0 for an empty slot */
+    int quirks;
+};
+
+/* Open addressing hash table, size is a power of 2 and it is never more
+   then half full */
+struct usbredir_quirk_table {
+    struct usbredir_quirk *entries;
+    uint32_t size;
+    uint32_t count;
+};
+
+static const struct usbredir_quirk usbredir_builtin_quirks[] = {
+    { 0x1210001c, QUIRK_DO_NOT_RESET },
+    { 0x27980001, QUIRK_DO_NOT_RESET },
+};
+
+static const struct {
+    const char *name;
+    int quirk;
+} usbredir_quirk_names[] = {
+    { "none", 0 },
+    { "no-reset", QUIRK_DO_NOT_RESET },
+    { "always-reset", QUIRK_ALWAYS_RESET },
+};
+
+/* Protects the table pointer, the tables themselves are never modified
+   once in use, usbredirhost_load_quirks builds a new one and swaps it in */
+static pthread_mutex_t usbredir_quirks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct usbredir_quirk_table *usbredir_quirks;
+
+static uint32_t usbredir_quirks_hash(uint32_t id, uint32_t size)
+{
+    /* Fibonacci hashing */
+    return (id * 2654435761u) & (size - 1);
+}
+
+static void usbredir_quirks_free(struct usbredir_quirk_table *table)
+{
+    if (!table)
+        return;
+    free(table->entries);
+    free(table);
+}
+
+/* Add or replace the entry for id, growing the table when needed */
+static int usbredir_quirks_set(struct usbredir_quirk_table *table,
+                               uint32_t id, int quirks)
+{
+    struct usbredir_quirk *entries;
+    uint32_t i, j, size;
+
+    if ((table->count + 1) * 2 > table->size) {
+        size = table->size ? table->size * 2 : 16;
+        entries = calloc(size, sizeof(*entries));
+        if (!entries)
+            return -ENOMEM;
+        for (i = 0; i < table->size; i++) {
+            if (!table->entries[i].id)
+                continue;
+            j = usbredir_quirks_hash(table->entries[i].id, size);
+            while (entries[j].id)
+                j = (j + 1) & (size - 1);
+            entries[j] = table->entries[i];
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->size = size;
+    }
+
+    i = usbredir_quirks_hash(id, table->size);
+    while (table->entries[i].id && table->entries[i].id != id)
+        i = (i + 1) & (table->size - 1);
+    if (!table->entries[i].id)
+        table->count++;
+    table->entries[i].id = id;
+    table->entries[i].quirks = quirks;
+    return 0;
+}
+
+static struct usbredir_quirk_table *usbredir_quirks_new(void)
+{
+    struct usbredir_quirk_table *table;
+    size_t i;
+
+    table = calloc(1, sizeof(*table));
+    if (!table)
+        return NULL;
+
+    for (i = 0; i < sizeof(usbredir_builtin_quirks) /
+                    sizeof(usbredir_builtin_quirks[0]); i++) {
+        if (usbredir_quirks_set(table, usbredir_builtin_quirks[i].id,
+                                usbredir_builtin_quirks[i].quirks) != 0) {
+            usbredir_quirks_free(table);
+            return NULL;
+        }
+    }
+    return table;
+}
+
+#define QUIRK_SEP ", \t\r\n"
+
+/* Parse a "vid:pid quirk[,quirk...]" line, returns 0 on success (or for an
+   empty / comment line, in which case *id is set to 0) */
+static int usbredir_quirks_parse_line(char *line, uint32_t *id, int *quirks)
+{
+    char *p, *end, *name;
+    unsigned long vid, pid;
+    size_t i;
+
+    *id = 0;
+    *quirks = 0;
+
+    p = strchr(line, '#');
+    if (p)
+        *p = '\0';
+    p = line + strspn(line, " \t\r\n");
+    if (!*p)
+        return 0;
+
+    vid = strtoul(p, &end, 16);
+    if (end == p || *end != ':' || vid > 0xffff)
+        return -EINVAL;
+    p = end + 1;
+    pid = strtoul(p, &end, 16);
+    if (end == p || pid > 0xffff || !strchr(" \t", *end))
+        return -EINVAL;
+    if (vid == 0 && pid == 0)
+        return -EINVAL;
+
+    /* Split the quirk names by hand, as strtok is not thread safe, and our
+       strtok_r replacement for win32 is not exported by libusbredirparser */
+    p = end + strspn(end, QUIRK_SEP);
+    if (!*p)
+        return -EINVAL;
+    while (*p) {
+        name = p;
+        p += strcspn(p, QUIRK_SEP);
+        if (*p)
+            *p++ = '\0';
+        p += strspn(p, QUIRK_SEP);
+        for (i = 0; i < sizeof(usbredir_quirk_names) /
+                        sizeof(usbredir_quirk_names[0]); i++) {
+            if (strcmp(name, usbredir_quirk_names[i].name) == 0)
+                break;
+        }
+        if (i == sizeof(usbredir_quirk_names) /
+                 sizeof(usbredir_quirk_names[0]))
+            return -EINVAL;
+        *quirks |= usbredir_quirk_names[i].quirk;
+    }
+
+    *id = vid << 16 | pid;
+    return 0;
+}
+
+int usbredirhost_load_quirks(const char *filename, int *error_line)
+{
+    struct usbredir_quirk_table *table, *old;
+    char line[256];
+    int r = 0, line_nr = 0, quirks;
+    uint32_t id;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f)
+        return -errno;
+
+    table = usbredir_quirks_new();
+    if (!table) {
+        fclose(f);
+        return -ENOMEM;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        line_nr++;
+        /* Reject over-long lines, rather then parsing them in pieces */
+        if (!strchr(line, '\n') && !feof(f)) {
+            r = -EINVAL;
+            break;
+        }
+        r = usbredir_quirks_parse_line(line, &id, &quirks);
+        if (r == 0 && id)
+            r = usbredir_quirks_set(table, id, quirks);
+        if (r != 0)
+            break;
+    }
+    if (r == 0 && ferror(f))
+        r = -EIO;
+    fclose(f);
+
+    if (r != 0) {
+        if (r == -EINVAL && error_line)
+            *error_line = line_nr;
+        usbredir_quirks_free(table);
+        return r;
+    }
+
+    pthread_mutex_lock(&usbredir_quirks_mutex);
+    old = usbredir_quirks;
+    usbredir_quirks = table;
+    pthread_mutex_unlock(&usbredir_quirks_mutex);
+    usbredir_quirks_free(old);
+    return 0;
+}
+
+int usbredir_quirks_lookup(uint16_t vendor_id, uint16_t product_id)
+{
+    uint32_t i, id = (uint32_t)vendor_id << 16 | product_id;
+    int quirks = 0;
+
+    pthread_mutex_lock(&usbredir_quirks_mutex);
+    if (!usbredir_quirks)
+        usbredir_quirks = usbredir_quirks_new();
+    if (usbredir_quirks && id) {
+        i = usbredir_quirks_hash(id, usbredir_quirks->size);
+        while (usbredir_quirks->entries[i].id) {
+            if (usbredir_quirks->entries[i].id == id) {
+                quirks = usbredir_quirks->entries[i].quirks;
+                break;
+            }
+            i = (i + 1) & (usbredir_quirks->size - 1);
+        }
+    }
+    pthread_mutex_unlock(&usbredir_quirks_mutex);
+    return quirks;
+}
@@ -0,0 +1,31 @@
+/* usbredirquirks.h usbredirhost internal per device quirks table
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRQUIRKS_H
+#define __USBREDIRQUIRKS_H
+
+#include <stdint.h>
+
+/* quirk flags */
+#define QUIRK_DO_NOT_RESET    0x01 /* Never reset the device */
+#define QUIRK_ALWAYS_RESET    0x02 /* Reset on release, even if unused */
+
+/* Returns the QUIRK_* flags for the device, from the builtin table or the
+   file loaded with usbredirhost_load_quirks */
+int usbredir_quirks_lookup(uint16_t vendor_id, uint16_t product_id);
+
+#endif
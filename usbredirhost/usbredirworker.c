@@ -0,0 +1,133 @@
+/* usbredirworker.c usbredirhost internal worker thread
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <pthread.h>
+#include "usbrediralloc.h"
+#include "usbredirworker.h"
+
+struct usbredir_worker {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;      /* Signalled when a job gets queued */
+    pthread_cond_t idle_cond; /* Signalled when the queue becomes empty */
+    struct usbredir_worker_job *head;
+    struct usbredir_worker_job **tail;
+    int busy;                 /* Set while running a job */
+    int quit;
+};
+
+static void *usbredir_worker_thread(void *arg)
+{
+    struct usbredir_worker *worker = arg;
+    struct usbredir_worker_job *job;
+
+    pthread_mutex_lock(&worker->mutex);
+    for (;;) {
+        while (!worker->head && !worker->quit)
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+        job = worker->head;
+        if (!job)
+            break; /* Only quit once the queue is empty */
+
+        worker->head = job->next;
+        if (!worker->head)
+            worker->tail = &worker->head;
+        worker->busy = 1;
+        pthread_mutex_unlock(&worker->mutex);
+
+        job->func(job); /* This may free the job */
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->busy = 0;
+        if (!worker->head)
+            pthread_cond_broadcast(&worker->idle_cond);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    return NULL;
+}
+
+struct usbredir_worker *usbredir_worker_create(
+    const struct usbredirparser_allocator *allocator)
+{
+    struct usbredir_worker *worker;
+
+    worker = usbredir_calloc(allocator, sizeof(*worker));
+    if (!worker)
+        return NULL;
+
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    pthread_cond_init(&worker->idle_cond, NULL);
+    worker->tail = &worker->head;
+
+    if (pthread_create(&worker->thread, NULL, usbredir_worker_thread,
+                       worker) != 0) {
+        pthread_cond_destroy(&worker->idle_cond);
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->mutex);
+        usbredir_free(allocator, worker);
+        return NULL;
+    }
+    return worker;
+}
+
+void usbredir_worker_destroy(const struct usbredirparser_allocator *allocator,
+                             struct usbredir_worker *worker)
+{
+    if (!worker)
+        return;
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->quit = 1;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+    pthread_join(worker->thread, NULL);
+
+    pthread_cond_destroy(&worker->idle_cond);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    usbredir_free(allocator, worker);
+}
+
+void usbredir_worker_queue(struct usbredir_worker *worker,
+                           struct usbredir_worker_job *job,
+                           usbredir_worker_func func)
+{
+    job->next = NULL;
+    job->func = func;
+
+    pthread_mutex_lock(&worker->mutex);
+    *worker->tail = job;
+    worker->tail = &job->next;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+void usbredir_worker_flush(struct usbredir_worker *worker)
+{
+    pthread_mutex_lock(&worker->mutex);
+    while (worker->head || worker->busy)
+        pthread_cond_wait(&worker->idle_cond, &worker->mutex);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+int usbredir_worker_is_current(struct usbredir_worker *worker)
+{
+    return pthread_equal(pthread_self(), worker->thread);
+}
@@ -0,0 +1,54 @@
+/* usbredirworker.h usbredirhost internal worker thread
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRWORKER_H
+#define __USBREDIRWORKER_H
+
+/* A single thread executing jobs in the order in which they were queued,
+   used by usbredirhost to run blocking libusb calls outside of the parser
+   read callbacks, see usbredirhost_fl_async_ops. */
+
+#include "usbredirparser.h"
+
+struct usbredir_worker;
+struct usbredir_worker_job;
+
+typedef void (*usbredir_worker_func)(struct usbredir_worker_job *job);
+
+/* To be embedded in the caller's job struct, the job is owned by the worker
+   from queueing it until func gets called */
+struct usbredir_worker_job {
+    struct usbredir_worker_job *next;
+    usbredir_worker_func func;
+};
+
+/* Returns NULL on failure (out of memory, or unable to create the thread) */
+struct usbredir_worker *usbredir_worker_create(
+    const struct usbredirparser_allocator *allocator);
+/* Runs any still queued jobs, then stops the thread */
+void usbredir_worker_destroy(const struct usbredirparser_allocator *allocator,
+                             struct usbredir_worker *worker);
+
+void usbredir_worker_queue(struct usbredir_worker *worker,
+                           struct usbredir_worker_job *job,
+                           usbredir_worker_func func);
+/* Wait until all queued jobs have been run, must not be called from a job */
+void usbredir_worker_flush(struct usbredir_worker *worker);
+/* Returns true when called from a job (from the worker thread) */
+int usbredir_worker_is_current(struct usbredir_worker *worker);
+
+#endif
@@ -0,0 +1,118 @@
+/* usbrediralloc.c usbredir allocation statistics
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdint.h>
+#include "usbrediralloc.h"
+
+#ifdef ENABLE_ALLOC_STATS
+
+/* Max number of distinct allocation call sites, there are less then 32 */
+#define MAX_SITES 128
+
+enum { site_free, site_claiming, site_used };
+
+/* Open addressing hash table of call sites, slots are claimed lock free,
+   counters are updated with atomic adds, so this can be used from multiple
+   threads without any locking */
+static struct {
+    int state;
+    const char *file;
+    int line;
+    uint64_t count;
+    uint64_t bytes;
+} sites[MAX_SITES];
+
+void usbredir_alloc_stats_add(const char *file, int line, size_t size)
+{
+    unsigned int i, n;
+    int state;
+
+    i = ((uintptr_t)file / 8 + line * 31) % MAX_SITES;
+    for (n = 0; n < MAX_SITES; n++, i = (i + 1) % MAX_SITES) {
+        state = __atomic_load_n(&sites[i].state, __ATOMIC_ACQUIRE);
+        if (state == site_free) {
+            int expected = site_free;
+            if (__atomic_compare_exchange_n(&sites[i].state, &expected,
+                                            site_claiming, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                sites[i].file = file;
+                sites[i].line = line;
+                __atomic_store_n(&sites[i].state, site_used,
+                                 __ATOMIC_RELEASE);
+            }
+            state = expected;
+        }
+        /* Wait for another thread to finish claiming the slot */
+        while (state == site_claiming)
+            state = __atomic_load_n(&sites[i].state, __ATOMIC_ACQUIRE);
+
+        if (sites[i].file == file && sites[i].line == line) {
+            __atomic_fetch_add(&sites[i].count, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&sites[i].bytes, size, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    /* Table full, should never happen, the site simply does not get
+       counted */
+}
+
+int usbredirparser_get_alloc_stats(struct usbredirparser_alloc_site *dest,
+                                   int max_sites)
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAX_SITES; i++) {
+        if (__atomic_load_n(&sites[i].state, __ATOMIC_ACQUIRE) != site_used ||
+                !__atomic_load_n(&sites[i].count, __ATOMIC_RELAXED))
+            continue;
+        if (n < max_sites) {
+            dest[n].file  = sites[i].file;
+            dest[n].line  = sites[i].line;
+            dest[n].count = __atomic_load_n(&sites[i].count, __ATOMIC_RELAXED);
+            dest[n].bytes = __atomic_load_n(&sites[i].bytes, __ATOMIC_RELAXED);
+        }
+        n++;
+    }
+    return n;
+}
+
+void usbredirparser_reset_alloc_stats(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_SITES; i++) {
+        __atomic_store_n(&sites[i].count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&sites[i].bytes, 0, __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+int usbredirparser_get_alloc_stats(struct usbredirparser_alloc_site *dest,
+                                   int max_sites)
+{
+    return -1;
+}
+
+void usbredirparser_reset_alloc_stats(void)
+{
+}
+
+#endif
@@ -0,0 +1,90 @@
+/* usbrediralloc.h usbredir internal memory allocation helpers
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRALLOC_H
+#define __USBREDIRALLOC_H
+
+/* All memory owned by a usbredirparser / usbredirhost must be allocated and
+   freed through these, with the allocator of the parser (the host uses the
+   allocator of its parser, since buffers get passed between the 2), see
+   usbredirparser_create_with_allocator(). */
+
+#include <stdlib.h>
+#include <string.h>
+#include "usbredirparser.h"
+
+#ifdef ENABLE_ALLOC_STATS
+/* Exported for use by usbredirhost only, not part of the API */
+void usbredir_alloc_stats_add(const char *file, int line, size_t size);
+#define USBREDIR_ALLOC_STATS_ADD(file, line, size) \
+    usbredir_alloc_stats_add(file, line, size)
+#else
+#define USBREDIR_ALLOC_STATS_ADD(file, line, size) do {} while (0)
+#endif
+
+static inline void *usbredir_malloc_at(
+    const struct usbredirparser_allocator *allocator, size_t size,
+    const char *file, int line)
+{
+    void *ptr;
+
+    if (allocator->malloc_func)
+        ptr = allocator->malloc_func(allocator->priv, size);
+    else
+        ptr = malloc(size);
+    if (ptr)
+        USBREDIR_ALLOC_STATS_ADD(file, line, size);
+    return ptr;
+}
+
+static inline void *usbredir_calloc_at(
+    const struct usbredirparser_allocator *allocator, size_t size,
+    const char *file, int line)
+{
+    void *ptr;
+
+    if (!allocator->malloc_func) {
+        ptr = calloc(1, size);
+        if (ptr)
+            USBREDIR_ALLOC_STATS_ADD(file, line, size);
+        return ptr;
+    }
+
+    ptr = usbredir_malloc_at(allocator, size, file, line);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+static inline void usbredir_free(
+    const struct usbredirparser_allocator *allocator, void *ptr)
+{
+    if (!ptr)
+        return;
+    if (allocator->free_func)
+        allocator->free_func(allocator->priv, ptr);
+    else
+        free(ptr);
+}
+
+#define usbredir_malloc(allocator, size) \
+    usbredir_malloc_at(allocator, size, __FILE__, __LINE__)
+/* Note unlike calloc this takes a single size argument */
+#define usbredir_calloc(allocator, size) \
+    usbredir_calloc_at(allocator, size, __FILE__, __LINE__)
+
+#endif
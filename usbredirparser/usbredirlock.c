@@ -0,0 +1,139 @@
+/* usbredirlock.c usbredir built-in lock
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#elif defined(WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+#include "usbrediralloc.h"
+#include "usbredirlock.h"
+
+/* Number of times a contended lock is retried before going to sleep */
+#define SPIN_COUNT 100
+
+static inline void usbredir_lock_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+struct usbredir_lock *usbredir_lock_alloc(
+    const struct usbredirparser_allocator *allocator)
+{
+    return usbredir_calloc(allocator, sizeof(struct usbredir_lock));
+}
+
+void usbredir_lock_free(const struct usbredirparser_allocator *allocator,
+                        struct usbredir_lock *lock)
+{
+    usbredir_free(allocator, lock);
+}
+
+/* Contended lock slow path, this is the 3 state mutex from Ulrich Drepper's
+   "Futexes Are Tricky": once a waiter has set the state to 2, the unlocker
+   knows it must wake someone up */
+void usbredir_lock_wait(struct usbredir_lock *lock)
+{
+    int i, state;
+#ifdef ENABLE_LOCK_STATS
+    uint64_t start = usbredir_lock_nsecs();
+#endif
+
+    /* The lock is normally held only briefly, so spin a while first */
+    for (i = 0; i < SPIN_COUNT; i++) {
+        state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (state == 0) {
+            if (__atomic_compare_exchange_n(&lock->state, &state, 1, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                goto done;
+        } else if (state == 2) {
+            break; /* Others are sleeping already, no point in spinning */
+        }
+        usbredir_lock_cpu_relax();
+    }
+
+    while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0) {
+#ifdef __linux__
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2,
+                NULL, NULL, 0);
+#elif defined(WIN32)
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+
+done:
+#ifdef ENABLE_LOCK_STATS
+    lock->contended++;
+    lock->wait_ns += usbredir_lock_nsecs() - start;
+#endif
+    return;
+}
+
+void usbredir_lock_wake(struct usbredir_lock *lock)
+{
+#ifdef __linux__
+    syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+#ifdef ENABLE_LOCK_STATS
+
+uint64_t usbredir_lock_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int usbredir_lock_add_stats(struct usbredir_lock *lock,
+                            struct usbredirparser_lock_stats *stats)
+{
+    usbredir_lock_acquire(lock);
+    stats->acquired += lock->acquired;
+    stats->contended += lock->contended;
+    stats->wait_ns += lock->wait_ns;
+    stats->hold_ns += lock->hold_ns;
+    if (lock->max_hold_ns > stats->max_hold_ns)
+        stats->max_hold_ns = lock->max_hold_ns;
+    usbredir_lock_release(lock);
+    return 0;
+}
+
+#else
+
+int usbredir_lock_add_stats(struct usbredir_lock *lock,
+                            struct usbredirparser_lock_stats *stats)
+{
+    return -1;
+}
+
+#endif
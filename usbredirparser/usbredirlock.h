@@ -0,0 +1,85 @@
+/* usbredirlock.h usbredir internal built-in lock
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRLOCK_H
+#define __USBREDIRLOCK_H
+
+/* The lock used by usbredirparser / usbredirhost when they are initialized
+   with the builtin_lock flag. The uncontended lock and unlock are a single
+   atomic operation, inlined into the callers. A contended lock spins for a
+   while and then sleeps on a futex (on Linux, elsewhere it yields). */
+
+#include <stdint.h>
+#include "usbredirparser.h"
+
+struct usbredir_lock {
+    /* 0 unlocked, 1 locked, 2 locked and (possibly) waiters sleeping */
+    int state;
+#ifdef ENABLE_LOCK_STATS
+    /* Only updated with the lock held */
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+    uint64_t locked_at;
+#endif
+};
+
+/* Exported for use by usbredirhost only, not part of the API */
+struct usbredir_lock *usbredir_lock_alloc(
+    const struct usbredirparser_allocator *allocator);
+void usbredir_lock_free(const struct usbredirparser_allocator *allocator,
+                        struct usbredir_lock *lock);
+void usbredir_lock_wait(struct usbredir_lock *lock);
+void usbredir_lock_wake(struct usbredir_lock *lock);
+/* Add the stats of lock to stats, returns -1 if built without
+   --enable-lock-stats */
+int usbredir_lock_add_stats(struct usbredir_lock *lock,
+                            struct usbredirparser_lock_stats *stats);
+
+#ifdef ENABLE_LOCK_STATS
+uint64_t usbredir_lock_nsecs(void);
+#endif
+
+static inline void usbredir_lock_acquire(struct usbredir_lock *lock)
+{
+    int expected = 0;
+
+    if (!__atomic_compare_exchange_n(&lock->state, &expected, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        usbredir_lock_wait(lock);
+#ifdef ENABLE_LOCK_STATS
+    lock->acquired++;
+    lock->locked_at = usbredir_lock_nsecs();
+#endif
+}
+
+static inline void usbredir_lock_release(struct usbredir_lock *lock)
+{
+#ifdef ENABLE_LOCK_STATS
+    uint64_t held = usbredir_lock_nsecs() - lock->locked_at;
+
+    lock->hold_ns += held;
+    if (held > lock->max_hold_ns)
+        lock->max_hold_ns = held;
+#endif
+    if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)
+        usbredir_lock_wake(lock);
+}
+
+#endif
@@ -24,43 +24,118 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/time.h>
 #include "usbredirproto-compat.h"
 #include "usbredirparser.h"
 #include "usbredirfilter.h"
+#include "usbredirtrace.h"
+#include "usbrediralloc.h"
+#include "usbredirlock.h"
 
 /* Put *some* upper limit on bulk transfer sizes */
 #define MAX_BULK_TRANSFER_SIZE (128u * 1024u * 1024u)
+#define MAX_DESCRIPTORS_SIZE (1024u * 1024u)
+#define MAX_COALESCED_INTERRUPT_SIZE (1024u * 1024u)
+
+/* Macros to go from an endpoint address to an index for our ep array */
+#define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
+
+/* pcap link type and max record len for captures */
+#define CAPTURE_LINKTYPE 147 /* LINKTYPE_USER0 */
+#define CAPTURE_SNAPLEN (MAX_BULK_TRANSFER_SIZE + 65536)
 
 /* Locking convenience macros */
 #define LOCK(parser) \
     do { \
         if ((parser)->lock) \
-            (parser)->callb.lock_func((parser)->lock); \
+            usbredirparser_lock_acquire((parser), (parser)->lock); \
     } while (0)
 
 #define UNLOCK(parser) \
     do { \
         if ((parser)->lock) \
-            (parser)->callb.unlock_func((parser)->lock); \
+            usbredirparser_lock_release((parser), (parser)->lock); \
+    } while (0)
+
+#define WRITE_LOCK(parser) \
+    do { \
+        if ((parser)->write_lock) \
+            usbredirparser_lock_acquire((parser), (parser)->write_lock); \
+    } while (0)
+
+#define WRITE_UNLOCK(parser) \
+    do { \
+        if ((parser)->write_lock) \
+            usbredirparser_lock_release((parser), (parser)->write_lock); \
     } while (0)
 
+/* Write queue priority classes, without usbredirparser_fl_write_priority
+   only WRITE_PRIO_HIGH is used */
+enum {
+    WRITE_PRIO_HIGH, /* Control, interrupt and device level packets */
+    WRITE_PRIO_LOW,  /* Bulk and iso packets */
+    WRITE_PRIO_COUNT
+};
+
+/* Write queues, the low priority class has a queue per endpoint, which
+   are scheduled with deficit round robin, and one for low priority packets
+   which are not for a single endpoint */
+enum {
+    WRITE_QUEUE_HIGH,
+    WRITE_QUEUE_LOW,
+    WRITE_QUEUE_EP, /* + EP2I(ep) */
+    WRITE_QUEUE_COUNT = WRITE_QUEUE_EP + 32
+};
+
+#define WRITE_QUEUE_PRIO(q) \
+    ((q) == WRITE_QUEUE_HIGH ? WRITE_PRIO_HIGH : WRITE_PRIO_LOW)
+
+/* Max number of high priority packets written in a row while there are
+   older low priority packets waiting */
+#define WRITE_PRIO_MAX_STREAK 16
+/* Deficit round robin quantum of an endpoint queue with weight 1 */
+#define WRITE_DRR_QUANTUM 65536
+#define WRITE_DRR_MAX_WEIGHT 256
+
 struct usbredirparser_buf {
     uint8_t *buf;
     int pos;
     int len;
+    /* With usbredirparser_fl_write_priority, the queueing order over all
+       write queues, the write queue index, and whether this is a device
+       level packet, which must not overtake older low priority packets */
+    uint64_t seq;
+    uint8_t queue;
+    uint8_t barrier;
 
     struct usbredirparser_buf *next;
 };
 
+struct usbredirparser_write_queue {
+    struct usbredirparser_buf *head;
+    struct usbredirparser_buf *tail;
+    /* Number of buffers in the head / tail list, protected by lock, or
+       with usbredirparser_fl_lockfree_write_queue by write_lock */
+    int count;
+    /* Deficit round robin state of endpoint queues, only accessed with
+       write_lock held */
+    int deficit;
+    int quantum;
+};
+
 struct usbredirparser_priv {
     struct usbredirparser callb;
     int flags;
+    struct usbredirparser_allocator allocator;
 
     int have_peer_caps;
     uint32_t our_caps[USB_REDIR_CAPS_SIZE];
     uint32_t peer_caps[USB_REDIR_CAPS_SIZE];
 
     void *lock;
+    /* Serializes do_write callers, held while calling write_func, so that
+       lock only needs to be held to add / remove write_queue entries */
+    void *write_lock;
 
     union {
         struct usb_redir_header header;
@@ -73,11 +148,78 @@ struct usbredirparser_priv {
     uint8_t *data;
     int data_len;
     int data_read;
+    /* Set when data is a buffer returned by get_data_buffer_func, which is
+       owned by the application */
+    int data_from_app;
     int to_skip;
-    struct usbredirparser_buf *write_buf;
-    int write_buf_count;
+    struct usbredirparser_write_queue write_queue[WRITE_QUEUE_COUNT];
+    /* Number of buffers queued per priority class, updated atomically
+       since usbredirparser_has_data_to_write reads it without any lock */
+    int write_count[WRITE_PRIO_COUNT];
+    /* With usbredirparser_fl_lockfree_write_queue senders push new buffers
+       onto these (newest first) without taking lock, and do_write moves
+       them to the end of their write queue */
+    struct usbredirparser_buf *write_incoming[WRITE_PRIO_COUNT];
+    /* See usbredirparser_buf.seq */
+    uint64_t write_seq;
+    /* Scheduler state, only accessed with write_lock held: high priority
+       packets written in a row, the write queue with a partially written
+       buffer or -1, and the current endpoint of the round robin */
+    int write_prio_streak;
+    int write_partial;
+    int write_drr_current;
+    /* Max packet size per endpoint, as send / received in ep_info packets,
+       0 if unknown */
+    uint16_t ep_max_packet_size[32];
+    /* Capture, see usbredirparser_start_capture() */
+    FILE *capture;
+    void *capture_lock;
+    /* Our hello as queued by usbredirparser_init, so that a capture started
+       after init can still start with it */
+    struct usb_redir_hello_header our_hello;
+    int our_hello_queued;
 };
 
+/* Lock helpers, dispatching to either the builtin lock or the app's lock
+   callbacks, the builtin lock ops get inlined */
+static void *usbredirparser_lock_alloc(struct usbredirparser_priv *parser)
+{
+    if (parser->flags & usbredirparser_fl_builtin_lock)
+        return usbredir_lock_alloc(&parser->allocator);
+    if (parser->callb.alloc_lock_func)
+        return parser->callb.alloc_lock_func();
+    return NULL;
+}
+
+static inline void usbredirparser_lock_acquire(
+    struct usbredirparser_priv *parser, void *lock)
+{
+    if (parser->flags & usbredirparser_fl_builtin_lock)
+        usbredir_lock_acquire(lock);
+    else
+        parser->callb.lock_func(lock);
+}
+
+static inline void usbredirparser_lock_release(
+    struct usbredirparser_priv *parser, void *lock)
+{
+    if (parser->flags & usbredirparser_fl_builtin_lock)
+        usbredir_lock_release(lock);
+    else
+        parser->callb.unlock_func(lock);
+}
+
+static void usbredirparser_lock_free(struct usbredirparser_priv *parser,
+                                     void *lock)
+{
+    if (!lock)
+        return;
+    if (parser->flags & usbredirparser_fl_builtin_lock)
+        usbredir_lock_free(&parser->allocator, lock);
+    else
+        parser->callb.free_lock_func(lock);
+}
+
 static void
 #if defined __GNUC__
 __attribute__((format(printf, 3, 4)))
@@ -108,23 +250,29 @@ static void serialize_test(struct usbredirparser *parser_pub)
         (struct usbredirparser_priv *)parser_pub;
     struct usbredirparser_buf *wbuf, *next_wbuf;
     uint8_t *data;
-    int len;
+    int i, len;
 
     if (usbredirparser_serialize(parser_pub, &data, &len))
         return;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
-        next_wbuf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
-        wbuf = next_wbuf;
+    for (i = 0; i < WRITE_QUEUE_COUNT; i++) {
+        wbuf = parser->write_queue[i].head;
+        while (wbuf) {
+            next_wbuf = wbuf->next;
+            usbredir_free(&parser->allocator, wbuf->buf);
+            usbredir_free(&parser->allocator, wbuf);
+            wbuf = next_wbuf;
+        }
+        parser->write_queue[i].head = parser->write_queue[i].tail = NULL;
+        parser->write_queue[i].count = 0;
     }
-    parser->write_buf = NULL;
-    parser->write_buf_count = 0;
+    memset(parser->write_count, 0, sizeof(parser->write_count));
+    parser->write_partial = -1;
 
-    free(parser->data);
+    if (!parser->data_from_app)
+        usbredir_free(&parser->allocator, parser->data);
     parser->data = NULL;
+    parser->data_from_app = 0;
 
     parser->type_header_len = parser->data_len = parser->have_peer_caps = 0;
 
@@ -135,12 +283,40 @@ static void serialize_test(struct usbredirparser *parser_pub)
 
 static void usbredirparser_queue(struct usbredirparser *parser, uint32_t type,
     uint64_t id, void *type_header_in, uint8_t *data_in, int data_len);
+static void usbredirparser_collect_write_bufs(
+    struct usbredirparser_priv *parser);
 static int usbredirparser_caps_get_cap(struct usbredirparser_priv *parser,
     uint32_t *caps, int cap);
 
+/* Number of parsers with a custom allocator, while this is 0 packet data
+   and write buffers get freed without looking at the parser at all, see
+   usbredirparser_free_packet_data */
+static int custom_allocator_parsers;
+
 struct usbredirparser *usbredirparser_create(void)
 {
-    return calloc(1, sizeof(struct usbredirparser_priv));
+    return usbredirparser_create_with_allocator(NULL);
+}
+
+struct usbredirparser *usbredirparser_create_with_allocator(
+    const struct usbredirparser_allocator *allocator)
+{
+    const struct usbredirparser_allocator default_allocator = { NULL, };
+    struct usbredirparser_priv *parser;
+
+    if (!allocator)
+        allocator = &default_allocator;
+    else if (!allocator->malloc_func != !allocator->free_func)
+        return NULL;
+
+    parser = usbredir_calloc(allocator, sizeof(*parser));
+    if (!parser)
+        return NULL;
+
+    parser->allocator = *allocator;
+    if (allocator->free_func)
+        __atomic_add_fetch(&custom_allocator_parsers, 1, __ATOMIC_RELAXED);
+    return &parser->callb;
 }
 
 static void usbredirparser_verify_caps(struct usbredirparser_priv *parser,
@@ -156,17 +332,146 @@ static void usbredirparser_verify_caps(struct usbredirparser_priv *parser,
     }
 }
 
+/* Write a complete packet as a pcap record, direction: 0 recv, 1 send.
+   When data is NULL while data_len is not 0 the data was skipped, then the
+   record gets written truncated, without the data. Must be called with
+   capture_lock held. */
+static void usbredirparser_capture_unlocked(struct usbredirparser_priv *parser,
+    int direction, void *header, int header_len,
+    void *type_header, int type_header_len, void *data, int data_len)
+{
+    uint32_t record_header[4];
+    uint8_t pseudo_header[4];
+    struct timeval tv;
+    uint32_t len;
+    int ok;
+
+    if (!parser->capture)
+        return;
+
+    len = sizeof(pseudo_header) + header_len + type_header_len;
+    gettimeofday(&tv, NULL);
+    record_header[0] = tv.tv_sec;
+    record_header[1] = tv.tv_usec;
+    record_header[2] = data ? len + data_len : len;
+    record_header[3] = len + data_len;
+
+    pseudo_header[0] = direction;
+    pseudo_header[1] = (parser->flags & usbredirparser_fl_usb_host) ? 1 : 0;
+    pseudo_header[2] = header_len;
+    pseudo_header[3] = 0;
+
+    ok = fwrite(record_header, sizeof(record_header), 1,
+                parser->capture) == 1 &&
+         fwrite(pseudo_header, sizeof(pseudo_header), 1,
+                parser->capture) == 1 &&
+         fwrite(header, header_len, 1, parser->capture) == 1;
+    if (ok && type_header_len)
+        ok = fwrite(type_header, type_header_len, 1, parser->capture) == 1;
+    if (ok && data && data_len)
+        ok = fwrite(data, data_len, 1, parser->capture) == 1;
+    if (!ok) {
+        ERROR("error writing capture file, stopping capture");
+        fclose(parser->capture);
+        parser->capture = NULL;
+    }
+}
+
+static void usbredirparser_capture(struct usbredirparser_priv *parser,
+    int direction, void *header, int header_len,
+    void *type_header, int type_header_len, void *data, int data_len)
+{
+    if (parser->capture_lock)
+        usbredirparser_lock_acquire(parser, parser->capture_lock);
+    usbredirparser_capture_unlocked(parser, direction, header, header_len,
+                                    type_header, type_header_len,
+                                    data, data_len);
+    if (parser->capture_lock)
+        usbredirparser_lock_release(parser, parser->capture_lock);
+}
+
+int usbredirparser_start_capture(struct usbredirparser *parser_pub,
+    const char *filename)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint32_t file_header[6];
+    FILE *f;
+
+    usbredirparser_stop_capture(parser_pub);
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        ERROR("error opening capture file %s", filename);
+        return -1;
+    }
+
+    file_header[0] = 0xa1b2c3d4; /* pcap magic, us timestamps */
+    file_header[1] = 2 | (4 << 16); /* version 2.4 */
+    file_header[2] = 0; /* thiszone */
+    file_header[3] = 0; /* sigfigs */
+    file_header[4] = CAPTURE_SNAPLEN;
+    file_header[5] = CAPTURE_LINKTYPE;
+    if (fwrite(file_header, sizeof(file_header), 1, f) != 1) {
+        ERROR("error writing capture file %s", filename);
+        fclose(f);
+        return -1;
+    }
+
+    if (parser->capture_lock)
+        usbredirparser_lock_acquire(parser, parser->capture_lock);
+    parser->capture = f;
+    if (parser->our_hello_queued) {
+        struct usb_redir_header_32bit_id header;
+
+        /* Started after usbredirparser_init, start with our hello (which
+           always gets send with a 32 bit id header) */
+        header.type = usb_redir_hello;
+        header.length = sizeof(parser->our_hello) +
+                        USB_REDIR_CAPS_SIZE * sizeof(uint32_t);
+        header.id = 0;
+        usbredirparser_capture_unlocked(parser, 1, &header, sizeof(header),
+            &parser->our_hello, sizeof(parser->our_hello),
+            parser->our_caps, USB_REDIR_CAPS_SIZE * sizeof(uint32_t));
+    }
+    if (parser->capture_lock)
+        usbredirparser_lock_release(parser, parser->capture_lock);
+    INFO("capturing packets to %s", filename);
+    return 0;
+}
+
+void usbredirparser_stop_capture(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if (parser->capture_lock)
+        usbredirparser_lock_acquire(parser, parser->capture_lock);
+    if (parser->capture) {
+        fclose(parser->capture);
+        parser->capture = NULL;
+    }
+    if (parser->capture_lock)
+        usbredirparser_lock_release(parser, parser->capture_lock);
+}
+
 void usbredirparser_init(struct usbredirparser *parser_pub,
     const char *version, uint32_t *caps, int caps_len, int flags)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
     struct usb_redir_hello_header hello = { { 0 }, };
+    int i;
 
     parser->flags = (flags & ~usbredirparser_fl_no_hello);
-    if (parser->callb.alloc_lock_func) {
-        parser->lock = parser->callb.alloc_lock_func();
-    }
+    parser->lock = usbredirparser_lock_alloc(parser);
+    parser->write_lock = usbredirparser_lock_alloc(parser);
+    /* Always allocated, as a capture may be started later from any thread */
+    parser->capture_lock = usbredirparser_lock_alloc(parser);
+    for (i = WRITE_QUEUE_EP; i < WRITE_QUEUE_COUNT; i++)
+        parser->write_queue[i].quantum = WRITE_DRR_QUANTUM;
+    parser->write_partial = -1;
+    parser->write_drr_current = WRITE_QUEUE_EP;
 
     snprintf(hello.version, sizeof(hello.version), "%s", version);
     if (caps_len > USB_REDIR_CAPS_SIZE) {
@@ -178,30 +483,48 @@ void usbredirparser_init(struct usbredirparser *parser_pub,
         usbredirparser_caps_set_cap(parser->our_caps,
                                     usb_redir_cap_device_disconnect_ack);
     usbredirparser_verify_caps(parser, parser->our_caps, "our");
-    if (!(flags & usbredirparser_fl_no_hello))
+    if (!(flags & usbredirparser_fl_no_hello)) {
+        parser->our_hello = hello;
+        parser->our_hello_queued = 1;
         usbredirparser_queue(parser_pub, usb_redir_hello, 0, &hello,
                              (uint8_t *)parser->our_caps,
                              USB_REDIR_CAPS_SIZE * sizeof(uint32_t));
+    }
 }
 
 void usbredirparser_destroy(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_allocator allocator;
     struct usbredirparser_buf *wbuf, *next_wbuf;
+    int i;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
-        next_wbuf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
-        wbuf = next_wbuf;
+    usbredirparser_collect_write_bufs(parser);
+    for (i = 0; i < WRITE_QUEUE_COUNT; i++) {
+        wbuf = parser->write_queue[i].head;
+        while (wbuf) {
+            next_wbuf = wbuf->next;
+            usbredir_free(&parser->allocator, wbuf->buf);
+            usbredir_free(&parser->allocator, wbuf);
+            wbuf = next_wbuf;
+        }
     }
 
-    if (parser->lock)
-        parser->callb.free_lock_func(parser->lock);
+    /* Data of a partially received packet */
+    if (!parser->data_from_app)
+        usbredir_free(&parser->allocator, parser->data);
+
+    usbredirparser_lock_free(parser, parser->lock);
+    usbredirparser_lock_free(parser, parser->write_lock);
 
-    free(parser);
+    usbredirparser_stop_capture(parser_pub);
+    usbredirparser_lock_free(parser, parser->capture_lock);
+
+    allocator = parser->allocator;
+    usbredir_free(&allocator, parser);
+    if (allocator.free_func)
+        __atomic_sub_fetch(&custom_allocator_parsers, 1, __ATOMIC_RELAXED);
 }
 
 static int usbredirparser_caps_get_cap(struct usbredirparser_priv *parser,
@@ -262,6 +585,7 @@ static void usbredirparser_handle_hello(struct usbredirparser *parser_pub,
 
     if (parser->have_peer_caps) {
         ERROR("Received second hello message, ignoring");
+        usbredir_free(&parser->allocator, data);
         return;
     }
 
@@ -278,7 +602,7 @@ static void usbredirparser_handle_hello(struct usbredirparser *parser_pub,
     }
     usbredirparser_verify_caps(parser, parser->peer_caps, "peer");
     parser->have_peer_caps = 1;
-    free(data);
+    usbredir_free(&parser->allocator, data);
 
     INFO("Peer version: %s, using %d-bits ids", buf,
          usbredirparser_using_32bits_ids(parser_pub) ? 32 : 64);
@@ -490,6 +814,12 @@ static int usbredirparser_get_type_header_len(
         } else {
             return -1;
         }
+    case usb_redir_descriptors:
+        if (!command_for_host) {
+            return sizeof(struct usb_redir_descriptors_header);
+        } else {
+            return -1;
+        }
     case usb_redir_control_packet:
         return sizeof(struct usb_redir_control_packet_header);
     case usb_redir_bulk_packet:
@@ -511,6 +841,12 @@ static int usbredirparser_get_type_header_len(
         } else {
             return -1;
         }
+    case usb_redir_coalesced_interrupt_packet:
+        if (!command_for_host) {
+            return sizeof(struct usb_redir_coalesced_interrupt_packet_header);
+        } else {
+            return -1;
+        }
     default:
         return -1;
     }
@@ -524,11 +860,13 @@ static int usbredirparser_expect_extra_data(struct usbredirparser_priv *parser)
     switch (parser->header.type) {
     case usb_redir_hello: /* For the variable length capabilities array */
     case usb_redir_filter_filter:
+    case usb_redir_descriptors:
     case usb_redir_control_packet:
     case usb_redir_bulk_packet:
     case usb_redir_iso_packet:
     case usb_redir_interrupt_packet:
     case usb_redir_buffered_bulk_packet:
+    case usb_redir_coalesced_interrupt_packet:
         return 1;
     default:
         return 0;
@@ -551,6 +889,110 @@ static int usbredirparser_verify_bulk_recv_cap(
     return 1; /* Verify ok */
 }
 
+static int usbredirparser_verify_descriptors(
+    struct usbredirparser *parser_pub,
+    struct usb_redir_descriptors_header *descriptors,
+    uint8_t *data, int data_len, int send)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usb_redir_descriptor_entry *entry;
+    uint32_t i;
+    int pos = 0;
+
+    if ((send && !usbredirparser_peer_has_cap(parser_pub,
+                                              usb_redir_cap_descriptors)) ||
+        (!send && !usbredirparser_have_cap(parser_pub,
+                                           usb_redir_cap_descriptors))) {
+        ERROR("error descriptors without cap_descriptors");
+        return 0;
+    }
+    if ((uint32_t)data_len > MAX_DESCRIPTORS_SIZE) {
+        ERROR("descriptors length exceeds limits %u > %u",
+              (uint32_t)data_len, MAX_DESCRIPTORS_SIZE);
+        return 0;
+    }
+
+    for (i = 0; i < descriptors->count; i++) {
+        if (data_len - pos < (int)sizeof(*entry)) {
+            ERROR("error descriptors data too short for %u entries",
+                  descriptors->count);
+            return 0;
+        }
+        entry = (struct usb_redir_descriptor_entry *)(data + pos);
+        pos += sizeof(*entry);
+        if (entry->length < 2 || data_len - pos < entry->length ||
+                data[pos + 1] != entry->type) {
+            ERROR("error invalid descriptor entry %u type %02x len %u",
+                  i, entry->type, entry->length);
+            return 0;
+        }
+        pos += entry->length;
+    }
+    if (pos != data_len) {
+        ERROR("error descriptors data len %d != entries len %d",
+              data_len, pos);
+        return 0;
+    }
+    return 1; /* Verify ok */
+}
+
+static int usbredirparser_verify_coalesced_interrupt(
+    struct usbredirparser *parser_pub,
+    struct usb_redir_coalesced_interrupt_packet_header *coalesced,
+    uint8_t *data, int data_len, int send)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usb_redir_interrupt_report *report;
+    int max_packet_size = parser->ep_max_packet_size[EP2I(coalesced->endpoint)];
+    int i, pos = 0;
+
+    if ((send && !usbredirparser_peer_has_cap(parser_pub,
+                                      usb_redir_cap_coalesced_interrupt)) ||
+        (!send && !usbredirparser_have_cap(parser_pub,
+                                      usb_redir_cap_coalesced_interrupt))) {
+        ERROR("error coalesced interrupt packet without cap_coalesced_interrupt");
+        return 0;
+    }
+    if (coalesced->length > MAX_COALESCED_INTERRUPT_SIZE) {
+        ERROR("coalesced interrupt packet length exceeds limits %u > %u",
+              coalesced->length, MAX_COALESCED_INTERRUPT_SIZE);
+        return 0;
+    }
+    /* The length itself gets checked against data_len by our caller */
+    if (data_len != (int)coalesced->length)
+        return 1;
+    if (!coalesced->count != !data_len) {
+        ERROR("error coalesced interrupt packet with %u reports in %d bytes",
+              coalesced->count, data_len);
+        return 0;
+    }
+
+    for (i = 0; i < coalesced->count; i++) {
+        if (data_len - pos < (int)sizeof(*report)) {
+            ERROR("error coalesced interrupt data too short for %u reports",
+                  coalesced->count);
+            return 0;
+        }
+        report = (struct usb_redir_interrupt_report *)(data + pos);
+        pos += sizeof(*report);
+        if (data_len - pos < report->length ||
+                (max_packet_size && report->length > max_packet_size)) {
+            ERROR("error invalid interrupt report %d len %u ep %02X",
+                  i, report->length, coalesced->endpoint);
+            return 0;
+        }
+        pos += report->length;
+    }
+    if (pos != data_len) {
+        ERROR("error coalesced interrupt data len %d != reports len %d",
+              data_len, pos);
+        return 0;
+    }
+    return 1; /* Verify ok */
+}
+
 static int usbredirparser_verify_type_header(
     struct usbredirparser *parser_pub,
     int32_t type, void *header, uint8_t *data, int data_len, int send)
@@ -686,6 +1128,12 @@ static int usbredirparser_verify_type_header(
         }
         break;
     }
+    case usb_redir_descriptors:
+        if (!usbredirparser_verify_descriptors(parser_pub, header,
+                                               data, data_len, send)) {
+            return 0;
+        }
+        break;
     case usb_redir_control_packet:
         length = ((struct usb_redir_control_packet_header *)header)->length;
         ep = ((struct usb_redir_control_packet_header *)header)->endpoint;
@@ -696,7 +1144,8 @@ static int usbredirparser_verify_type_header(
                                 usb_redir_cap_32bits_bulk_length) &&
             usbredirparser_peer_has_cap(parser_pub,
                                 usb_redir_cap_32bits_bulk_length)) {
-            length = (bulk_packet->length_high << 16) | bulk_packet->length;
+            length = ((uint32_t)bulk_packet->length_high << 16) |
+                     bulk_packet->length;
         } else {
             length = bulk_packet->length;
             if (!send)
@@ -732,6 +1181,16 @@ static int usbredirparser_verify_type_header(
         ep = buf_bulk_pkt->endpoint;
         break;
     }
+    case usb_redir_coalesced_interrupt_packet: {
+        struct usb_redir_coalesced_interrupt_packet_header *coalesced = header;
+        if (!usbredirparser_verify_coalesced_interrupt(parser_pub, coalesced,
+                                                       data, data_len, send)) {
+            return 0;
+        }
+        length = coalesced->length;
+        ep = coalesced->endpoint;
+        break;
+    }
     }
 
     if (ep != -1) {
@@ -763,6 +1222,9 @@ static int usbredirparser_verify_type_header(
             case usb_redir_buffered_bulk_packet:
                 ERROR("error buffered bulk packet send in wrong direction");
                 return 0;
+            case usb_redir_coalesced_interrupt_packet:
+                ERROR("error coalesced interrupt packet send in wrong direction");
+                return 0;
             }
         }
     }
@@ -770,6 +1232,193 @@ static int usbredirparser_verify_type_header(
     return 1; /* Verify ok */
 }
 
+/* Remember the max packet sizes from an ep_info packet we send or receive,
+   so that we can check iso and interrupt packet lengths against them as soon
+   as we've read the type specific header of a packet */
+static void usbredirparser_update_ep_max_packet_size(
+    struct usbredirparser *parser_pub, struct usb_redir_ep_info_header *ep_info)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int i;
+
+    if (!usbredirparser_have_cap(parser_pub,
+                                 usb_redir_cap_ep_info_max_packet_size) ||
+        !usbredirparser_peer_has_cap(parser_pub,
+                                     usb_redir_cap_ep_info_max_packet_size)) {
+        memset(parser->ep_max_packet_size, 0,
+               sizeof(parser->ep_max_packet_size));
+        return;
+    }
+
+    for (i = 0; i < 32; i++) {
+        parser->ep_max_packet_size[i] = ep_info->max_packet_size[i];
+    }
+}
+
+static void usbredirparser_call_type_func(struct usbredirparser *parser_pub);
+
+/* Check the data length of the iso / interrupt packet being read against the
+   max packet size of its endpoint. Note a max packet size of 0 means that
+   it is unknown (no ep_info seen yet), in which case we cannot check. */
+static int usbredirparser_verify_max_packet_size(
+    struct usbredirparser_priv *parser, int data_len)
+{
+    int ep, max_packet_size;
+
+    switch (parser->header.type) {
+    case usb_redir_iso_packet:
+        ep = ((struct usb_redir_iso_packet_header *)
+              parser->type_header)->endpoint;
+        break;
+    case usb_redir_interrupt_packet:
+        ep = ((struct usb_redir_interrupt_packet_header *)
+              parser->type_header)->endpoint;
+        break;
+    default:
+        return 1; /* Verify ok */
+    }
+
+    max_packet_size = parser->ep_max_packet_size[EP2I(ep)];
+    if (max_packet_size && data_len > max_packet_size) {
+        ERROR("error packet type %u data len %d > max packet size %d ep %02X",
+              parser->header.type, data_len, max_packet_size, ep);
+        return 0;
+    }
+
+    return 1; /* Verify ok */
+}
+
+/* Called when the type specific header of the packet being read is complete,
+   allocates the buffer for the packet data (if any), or gets it from the
+   application for data packets */
+static int usbredirparser_start_packet_data(struct usbredirparser_priv *parser)
+{
+    struct usbredirparser *parser_pub = (struct usbredirparser *)parser;
+    uint64_t id;
+    int data_len, ret = -1;
+
+    if (!usbredirparser_verify_max_packet_size(parser, parser->data_len)) {
+        /* Skip only the data, the packet itself still gets captured,
+           verified and passed on without data, so that the receiver can
+           complete the transfer it belongs to */
+        if (parser->capture)
+            usbredirparser_capture(parser, 0, &parser->header,
+                usbredirparser_get_header_len(parser_pub),
+                parser->type_header, parser->type_header_len,
+                NULL, parser->data_len);
+        if (usbredirparser_verify_type_header(parser_pub,
+                 parser->header.type, parser->type_header,
+                 NULL, parser->data_len, 0)) {
+            data_len = parser->data_len;
+            parser->data_len = 0;
+            usbredirparser_call_type_func(parser_pub);
+            parser->data_len = data_len;
+            ret = 0;
+        }
+        goto skip;
+    }
+
+    if (parser->data_len && parser->callb.get_data_buffer_func) {
+        switch (parser->header.type) {
+        case usb_redir_control_packet:
+        case usb_redir_bulk_packet:
+        case usb_redir_iso_packet:
+        case usb_redir_interrupt_packet:
+        case usb_redir_buffered_bulk_packet:
+        case usb_redir_coalesced_interrupt_packet:
+            if (usbredirparser_using_32bits_ids(&parser->callb))
+                id = parser->header_32bit_id.id;
+            else
+                id = parser->header.id;
+            parser->data = parser->callb.get_data_buffer_func(
+                parser->callb.priv, id, parser->header.type,
+                parser->type_header, parser->data_len);
+            if (parser->data) {
+                parser->data_from_app = 1;
+                return 0;
+            }
+            break;
+        }
+    }
+
+    if (parser->data_len) {
+        parser->data = usbredir_malloc(&parser->allocator, parser->data_len);
+        if (!parser->data) {
+            ERROR("Out of memory allocating data buffer");
+            goto skip;
+        }
+    }
+    return 0;
+
+skip:
+    /* Skip the data without ever storing it */
+    parser->to_skip = parser->data_len;
+    parser->header_read = 0;
+    parser->type_header_len  = 0;
+    parser->type_header_read = 0;
+    parser->data_len = 0;
+    return ret;
+}
+
+/* Endpoint of a data packet for tracepoints, 0 for other packets */
+static uint8_t usbredirparser_trace_ep(uint32_t type, uint8_t *type_header)
+{
+    switch (type) {
+    case usb_redir_control_packet:
+        return ((struct usb_redir_control_packet_header *)type_header)->endpoint;
+    case usb_redir_bulk_packet:
+        return ((struct usb_redir_bulk_packet_header *)type_header)->endpoint;
+    case usb_redir_iso_packet:
+        return ((struct usb_redir_iso_packet_header *)type_header)->endpoint;
+    case usb_redir_interrupt_packet:
+        return ((struct usb_redir_interrupt_packet_header *)type_header)->endpoint;
+    case usb_redir_buffered_bulk_packet:
+        return ((struct usb_redir_buffered_bulk_packet_header *)type_header)->endpoint;
+    case usb_redir_coalesced_interrupt_packet:
+        return ((struct usb_redir_coalesced_interrupt_packet_header *)type_header)->endpoint;
+    default:
+        return 0;
+    }
+}
+
+/* For apps which advertise cap_coalesced_interrupt without setting
+   coalesced_interrupt_packet_func, pass each report on as a separate
+   interrupt packet. The reports have consecutive ids. */
+static void usbredirparser_split_coalesced_interrupt(
+    struct usbredirparser_priv *parser, uint64_t id)
+{
+    struct usb_redir_coalesced_interrupt_packet_header *coalesced =
+        (struct usb_redir_coalesced_interrupt_packet_header *)
+        parser->type_header;
+    struct usb_redir_interrupt_packet_header interrupt_packet;
+    struct usb_redir_interrupt_report *report;
+    uint8_t *data;
+    int i, pos = 0;
+
+    for (i = 0; i < coalesced->count; i++) {
+        report = (struct usb_redir_interrupt_report *)(parser->data + pos);
+        pos += sizeof(*report);
+        data = NULL;
+        if (report->length) {
+            data = usbredir_malloc(&parser->allocator, report->length);
+            if (!data) {
+                ERROR("Out of memory splitting coalesced interrupt packet");
+                break;
+            }
+            memcpy(data, parser->data + pos, report->length);
+        }
+        interrupt_packet.endpoint = coalesced->endpoint;
+        interrupt_packet.status = report->status;
+        interrupt_packet.length = report->length;
+        parser->callb.interrupt_packet_func(parser->callb.priv, id + i,
+            &interrupt_packet, data, report->length);
+        pos += report->length;
+    }
+    if (!parser->data_from_app)
+        usbredir_free(&parser->allocator, parser->data);
+}
+
 static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
@@ -781,6 +1430,11 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
     else
         id = parser->header.id;
 
+    USBREDIR_TRACE4(packet_parse, parser->header.type,
+                    usbredirparser_trace_ep(parser->header.type,
+                                            parser->type_header),
+                    id, parser->header.length);
+
     switch (parser->header.type) {
     case usb_redir_hello:
         usbredirparser_handle_hello(parser_pub,
@@ -806,6 +1460,8 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
             (struct usb_redir_interface_info_header *)parser->type_header);
         break;
     case usb_redir_ep_info:
+        usbredirparser_update_ep_max_packet_size(parser_pub,
+            (struct usb_redir_ep_info_header *)parser->type_header);
         parser->callb.ep_info_func(parser->callb.priv,
             (struct usb_redir_ep_info_header *)parser->type_header);
         break;
@@ -883,6 +1539,7 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
 
         r = usbredirfilter_string_to_rules((char *)parser->data, ",", "|",
                                            &rules, &count);
+        usbredir_free(&parser->allocator, parser->data);
         if (r) {
             ERROR("error parsing filter (%d), ignoring filter message", r);
             break;
@@ -908,6 +1565,15 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
             (struct usb_redir_bulk_receiving_status_header *)
             parser->type_header);
         break;
+    case usb_redir_descriptors:
+        if (parser->callb.descriptors_func) {
+            parser->callb.descriptors_func(parser->callb.priv,
+                (struct usb_redir_descriptors_header *)parser->type_header,
+                parser->data, parser->data_len);
+        } else {
+            usbredir_free(&parser->allocator, parser->data);
+        }
+        break;
     case usb_redir_control_packet:
         parser->callb.control_packet_func(parser->callb.priv, id,
             (struct usb_redir_control_packet_header *)parser->type_header,
@@ -933,6 +1599,15 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
           (struct usb_redir_buffered_bulk_packet_header *)parser->type_header,
           parser->data, parser->data_len);
         break;
+    case usb_redir_coalesced_interrupt_packet:
+        if (parser->callb.coalesced_interrupt_packet_func) {
+            parser->callb.coalesced_interrupt_packet_func(parser->callb.priv,
+              id, (struct usb_redir_coalesced_interrupt_packet_header *)
+              parser->type_header, parser->data, parser->data_len);
+        } else {
+            usbredirparser_split_coalesced_interrupt(parser, id);
+        }
+        break;
     }
 }
 
@@ -945,18 +1620,19 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
 
     header_len = usbredirparser_get_header_len(parser_pub);
 
-    /* Skip forward to next packet (only used in error conditions) */
-    while (parser->to_skip > 0) {
-        uint8_t buf[65536];
-        r = (parser->to_skip > sizeof(buf)) ? sizeof(buf) : parser->to_skip;
-        r = parser->callb.read_func(parser->callb.priv, buf, r);
-        if (r <= 0)
-            return r;
-        parser->to_skip -= r;
-    }
-
     /* Consume data until read would block or returns an error */
     while (1) {
+        /* Skip forward to next packet (used in error conditions and for
+           the data of oversized iso / interrupt packets) */
+        while (parser->to_skip > 0) {
+            uint8_t buf[65536];
+            r = (parser->to_skip > sizeof(buf)) ? sizeof(buf) : parser->to_skip;
+            r = parser->callb.read_func(parser->callb.priv, buf, r);
+            if (r <= 0)
+                return r;
+            parser->to_skip -= r;
+        }
+
         if (parser->header_read < header_len) {
             r = header_len - parser->header_read;
             dest = (uint8_t *)&parser->header + parser->header_read;
@@ -1005,34 +1681,39 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
                     return -2;
                 }
                 data_len = parser->header.length - type_header_len;
-                if (data_len) {
-                    parser->data = malloc(data_len);
-                    if (!parser->data) {
-                        ERROR("Out of memory allocating data buffer");
-                        parser->to_skip = parser->header.length;
-                        parser->header_read = 0;
-                        return -2;
-                    }
-                }
                 parser->type_header_len = type_header_len;
                 parser->data_len = data_len;
+                if (type_header_len == 0 &&
+                        usbredirparser_start_packet_data(parser))
+                    return -2;
             }
         } else if (parser->type_header_read < parser->type_header_len) {
             parser->type_header_read += r;
+            if (parser->type_header_read == parser->type_header_len &&
+                    usbredirparser_start_packet_data(parser))
+                return -2;
         } else {
             parser->data_read += r;
             if (parser->data_read == parser->data_len) {
+                if (parser->capture)
+                    usbredirparser_capture(parser, 0, &parser->header,
+                        header_len, parser->type_header,
+                        parser->type_header_len, parser->data,
+                        parser->data_len);
                 r = usbredirparser_verify_type_header(parser_pub,
                          parser->header.type, parser->type_header,
                          parser->data, parser->data_len, 0);
                 if (r)
                     usbredirparser_call_type_func(parser_pub);
+                else if (!parser->data_from_app)
+                    usbredir_free(&parser->allocator, parser->data);
                 parser->header_read = 0;
                 parser->type_header_len  = 0;
                 parser->type_header_read = 0;
                 parser->data_len  = 0;
                 parser->data_read = 0;
                 parser->data = NULL;
+                parser->data_from_app = 0;
                 if (!r)
                     return -2;
                 /* header len may change if this was an hello packet */
@@ -1042,62 +1723,435 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
     }
 }
 
-int usbredirparser_has_data_to_write(struct usbredirparser *parser_pub)
+int usbredirparser_get_lock_stats(struct usbredirparser *parser_pub,
+                                  struct usbredirparser_lock_stats *stats)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    return parser->write_buf_count;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!(parser->flags & usbredirparser_fl_builtin_lock))
+        return -1;
+    if (usbredir_lock_add_stats(parser->lock, stats) ||
+            usbredir_lock_add_stats(parser->write_lock, stats))
+        return -1;
+    if (parser->capture_lock)
+        usbredir_lock_add_stats(parser->capture_lock, stats);
+    return 0;
 }
 
-int usbredirparser_do_write(struct usbredirparser *parser_pub)
+int usbredirparser_has_data_to_write(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf* wbuf;
-    int w, ret = 0;
+    int i, count = 0;
+
+    for (i = 0; i < WRITE_PRIO_COUNT; i++)
+        count += __atomic_load_n(&parser->write_count[i], __ATOMIC_RELAXED);
+    return count;
+}
+
+static void usbredirparser_append_write_buf(
+    struct usbredirparser_priv *parser, struct usbredirparser_buf *wbuf)
+{
+    struct usbredirparser_write_queue *queue =
+        &parser->write_queue[wbuf->queue];
+
+    wbuf->next = NULL;
+    if (queue->tail)
+        queue->tail->next = wbuf;
+    else
+        queue->head = wbuf;
+    queue->tail = wbuf;
+    queue->count++;
+}
+
+/* Move the buffers pushed by senders in lockfree mode to the end of
+   their write queues, must be called with write_lock held */
+static void usbredirparser_collect_write_bufs(
+    struct usbredirparser_priv *parser)
+{
+    struct usbredirparser_buf *wbuf, *next, *first;
+    int i;
+
+    if (!(parser->flags & usbredirparser_fl_lockfree_write_queue))
+        return;
+
+    /* Collect the high priority class first, so that all low priority
+       packets queued before a collected barrier packet are collected too */
+    for (i = 0; i < WRITE_PRIO_COUNT; i++) {
+        /* Taking the entire list at once means there is no ABA problem */
+        wbuf = __atomic_exchange_n(&parser->write_incoming[i], NULL,
+                                   __ATOMIC_ACQUIRE);
+
+        /* Reverse it to get it in queueing order */
+        first = NULL;
+        while (wbuf) {
+            next = wbuf->next;
+            wbuf->next = first;
+            first = wbuf;
+            wbuf = next;
+        }
+
+        for (wbuf = first; wbuf; wbuf = next) {
+            next = wbuf->next;
+            usbredirparser_append_write_buf(parser, wbuf);
+        }
+    }
+}
+
+/* Unlink the first count buffers from write queue q, returns the first one.
+   Must be called with lock held, or in lockfree mode with write_lock held */
+static struct usbredirparser_buf *usbredirparser_unlink_write_bufs(
+    struct usbredirparser_priv *parser, int q, int count)
+{
+    struct usbredirparser_write_queue *queue = &parser->write_queue[q];
+    struct usbredirparser_buf *done, *wbuf;
+    int i;
+
+    done = queue->head;
+    for (i = 0, wbuf = done; i < count; i++)
+        wbuf = wbuf->next;
+    queue->head = wbuf;
+    if (!wbuf)
+        queue->tail = NULL;
+    queue->count -= count;
+    __atomic_sub_fetch(&parser->write_count[WRITE_QUEUE_PRIO(q)], count,
+                       __ATOMIC_RELAXED);
+    return done;
+}
+
+/* Deficit round robin over the endpoint queues, only buffers queued before
+   limit may be written. Each time the round robin moves on to an endpoint
+   with a buffer to write, that endpoint gets its quantum added to its
+   deficit, and it gets to write buffers as long as their length fits in
+   its deficit. So each endpoint gets a share of the bandwidth proportional
+   to its weight, regardless of its packet sizes. The caller must make sure
+   there is a buffer to write. */
+static int usbredirparser_pick_drr_queue(struct usbredirparser_priv *parser,
+    struct usbredirparser_buf **wbuf, int *remaining, uint64_t limit)
+{
+    struct usbredirparser_write_queue *queue;
+    int q = parser->write_drr_current;
 
-    LOCK(parser);
     for (;;) {
-        wbuf = parser->write_buf;
-        if (!wbuf)
+        queue = &parser->write_queue[q];
+        if (!remaining[q]) {
+            /* An idle endpoint does not get to save up */
+            queue->deficit = 0;
+        } else if (wbuf[q]->seq < limit && wbuf[q]->len <= queue->deficit) {
             break;
+        }
+
+        if (++q == WRITE_QUEUE_COUNT)
+            q = WRITE_QUEUE_EP;
+        if (remaining[q] && wbuf[q]->seq < limit)
+            parser->write_queue[q].deficit += parser->write_queue[q].quantum;
+    }
+    parser->write_drr_current = q;
+    return q;
+}
+
+/* Pick the queue to write the next buffer from, given the first unwritten
+   buffer and the number of unwritten buffers of each queue. Returns -1 when
+   there is nothing left to write. A low priority packet is never written
+   before an older high priority one, so the only reordering is high
+   priority packets overtaking bulk / iso packets, except for barriers, and
+   packets of different endpoints overtaking each other. */
+static int usbredirparser_pick_write_queue(
+    struct usbredirparser_priv *parser,
+    struct usbredirparser_buf **wbuf, int *remaining)
+{
+    uint64_t high_seq = UINT64_MAX, misc_seq = UINT64_MAX;
+    uint64_t ep_seq = UINT64_MAX;
+    int q;
+
+    /* Finish a partially written buffer first */
+    if (parser->write_partial != -1)
+        return parser->write_partial;
+
+    if (!(parser->flags & usbredirparser_fl_write_priority))
+        return remaining[WRITE_QUEUE_HIGH] ? WRITE_QUEUE_HIGH : -1;
+
+    if (remaining[WRITE_QUEUE_HIGH])
+        high_seq = wbuf[WRITE_QUEUE_HIGH]->seq;
+    if (remaining[WRITE_QUEUE_LOW])
+        misc_seq = wbuf[WRITE_QUEUE_LOW]->seq;
+    for (q = WRITE_QUEUE_EP; q < WRITE_QUEUE_COUNT; q++) {
+        if (remaining[q] && wbuf[q]->seq < ep_seq)
+            ep_seq = wbuf[q]->seq;
+    }
 
-        w = wbuf->len - wbuf->pos;
-        w = parser->callb.write_func(parser->callb.priv,
-                                     wbuf->buf + wbuf->pos, w);
-        if (w <= 0) {
-            ret = w;
+    if (remaining[WRITE_QUEUE_HIGH]) {
+        if (misc_seq > high_seq && ep_seq > high_seq) {
+            parser->write_prio_streak = 0;
+            return WRITE_QUEUE_HIGH;
+        }
+        /* Device level packets keep their place in the queueing order,
+           and don't let the low priority queues starve */
+        if (!wbuf[WRITE_QUEUE_HIGH]->barrier &&
+                parser->write_prio_streak < WRITE_PRIO_MAX_STREAK) {
+            parser->write_prio_streak++;
+            return WRITE_QUEUE_HIGH;
+        }
+    }
+    parser->write_prio_streak = 0;
+
+    /* Low priority packets which are not for a single endpoint, such as
+       cancel_data_packet, are not overtaken by nor overtake other low
+       priority packets */
+    if (misc_seq < ep_seq)
+        return WRITE_QUEUE_LOW;
+    if (ep_seq == UINT64_MAX)
+        return -1;
+
+    return usbredirparser_pick_drr_queue(parser, wbuf, remaining,
+                                         high_seq < misc_seq ?
+                                             high_seq : misc_seq);
+}
+
+/* Only the holder of write_lock removes buffers from the head of the write
+   queues, and usbredirparser_queue only appends to them, so the first
+   count buffers taken under lock stay valid, and their next pointers stay
+   unchanged (except for that of the last one), while writing them without
+   holding lock. This way senders, such as libusb completion callbacks in
+   usbredirhost, do not block on socket writes. */
+int usbredirparser_do_write(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_buf *wbuf[WRITE_QUEUE_COUNT], *next;
+    int count[WRITE_QUEUE_COUNT], written[WRITE_QUEUE_COUNT];
+    int remaining[WRITE_QUEUE_COUNT];
+    int i, q, w, queues, left, stop = 0, ret = 0;
+    uint32_t type;
+
+    /* Without usbredirparser_fl_write_priority only the first one is used */
+    queues = (parser->flags & usbredirparser_fl_write_priority) ?
+             WRITE_QUEUE_COUNT : 1;
+
+    WRITE_LOCK(parser);
+    while (!stop) {
+        if (parser->flags & usbredirparser_fl_lockfree_write_queue)
+            usbredirparser_collect_write_bufs(parser);
+        else
+            LOCK(parser);
+        left = 0;
+        for (q = 0; q < queues; q++) {
+            wbuf[q] = parser->write_queue[q].head;
+            count[q] = parser->write_queue[q].count;
+            left += count[q];
+        }
+        if (!(parser->flags & usbredirparser_fl_lockfree_write_queue))
+            UNLOCK(parser);
+        if (!left)
             break;
+
+        for (q = 0; q < queues; q++) {
+            written[q] = 0;
+            remaining[q] = count[q];
         }
 
-        /* See usbredirparser_write documentation */
-        if ((parser->flags & usbredirparser_fl_write_cb_owns_buffer) &&
-                w != wbuf->len)
-            abort();
+        while ((q = usbredirparser_pick_write_queue(parser, wbuf,
+                                                    remaining)) != -1) {
+            /* For tracing, the write cb may own (and free) the buffer */
+            type = ((struct usb_redir_header *)wbuf[q]->buf)->type;
+
+            w = wbuf[q]->len - wbuf[q]->pos;
+            w = parser->callb.write_func(parser->callb.priv,
+                                         wbuf[q]->buf + wbuf[q]->pos, w);
+            if (w <= 0) {
+                ret = w;
+                stop = 1;
+                break;
+            }
+
+            /* See usbredirparser_write documentation */
+            if ((parser->flags & usbredirparser_fl_write_cb_owns_buffer) &&
+                    w != wbuf[q]->len)
+                abort();
+
+            wbuf[q]->pos += w;
+            if (wbuf[q]->pos != wbuf[q]->len) {
+                parser->write_partial = q;
+                stop = 1;
+                break;
+            }
 
-        wbuf->pos += w;
-        if (wbuf->pos == wbuf->len) {
-            parser->write_buf = wbuf->next;
-            if (!(parser->flags & usbredirparser_fl_write_cb_owns_buffer))
-                free(wbuf->buf);
-            free(wbuf);
-            parser->write_buf_count--;
+            parser->write_partial = -1;
+            if (q >= WRITE_QUEUE_EP)
+                parser->write_queue[q].deficit -= wbuf[q]->len;
+            written[q]++;
+            remaining[q]--;
+            left--;
+            USBREDIR_TRACE3(write_done, type, wbuf[q]->len, left);
+            if (remaining[q])
+                wbuf[q] = wbuf[q]->next;
+
+            /* Don't make newly queued high priority packets wait for the
+               rest of the bulk / iso packets taken from the queues */
+            if (q != WRITE_QUEUE_HIGH &&
+                    __atomic_load_n(&parser->write_count[WRITE_PRIO_HIGH],
+                                    __ATOMIC_RELAXED) >
+                        count[WRITE_QUEUE_HIGH])
+                break;
+        }
+
+        /* Retire the completely written buffers */
+        if (!(parser->flags & usbredirparser_fl_lockfree_write_queue))
+            LOCK(parser);
+        for (q = 0; q < queues; q++) {
+            if (written[q])
+                wbuf[q] = usbredirparser_unlink_write_bufs(parser, q,
+                                                           written[q]);
+        }
+        if (!(parser->flags & usbredirparser_fl_lockfree_write_queue))
+            UNLOCK(parser);
+        for (q = 0; q < queues; q++) {
+            for (i = 0; i < written[q]; i++, wbuf[q] = next) {
+                next = wbuf[q]->next;
+                if (!(parser->flags & usbredirparser_fl_write_cb_owns_buffer))
+                    usbredir_free(&parser->allocator, wbuf[q]->buf);
+                usbredir_free(&parser->allocator, wbuf[q]);
+            }
         }
     }
-    UNLOCK(parser);
+    WRITE_UNLOCK(parser);
     return ret;
 }
 
-void usbredirparser_free_write_buffer(struct usbredirparser *parser,
+/* When no parser uses a custom allocator these do not touch the parser,
+   as before allocators were added, so that apps may still pass NULL or a
+   parser which has already been destroyed */
+static int usbredirparser_uses_libc_free(struct usbredirparser_priv *parser)
+{
+    return !parser ||
+           !__atomic_load_n(&custom_allocator_parsers, __ATOMIC_RELAXED) ||
+           !parser->allocator.free_func;
+}
+
+void usbredirparser_free_write_buffer(struct usbredirparser *parser_pub,
     uint8_t *data)
 {
-    free(data);
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if (usbredirparser_uses_libc_free(parser)) {
+        free(data);
+        return;
+    }
+    usbredir_free(&parser->allocator, data);
 }
 
-void usbredirparser_free_packet_data(struct usbredirparser *parser,
+void usbredirparser_free_packet_data(struct usbredirparser *parser_pub,
     uint8_t *data)
 {
-    free(data);
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if (usbredirparser_uses_libc_free(parser)) {
+        free(data);
+        return;
+    }
+    usbredir_free(&parser->allocator, data);
+}
+
+int usbredirparser_set_endpoint_weight(struct usbredirparser *parser_pub,
+    uint8_t ep, int weight)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if (weight < 1 || weight > WRITE_DRR_MAX_WEIGHT)
+        return -1;
+
+    WRITE_LOCK(parser);
+    parser->write_queue[WRITE_QUEUE_EP + EP2I(ep)].quantum =
+        weight * WRITE_DRR_QUANTUM;
+    WRITE_UNLOCK(parser);
+    return 0;
+}
+
+/* Get the write queue for a packet type. Each data packet type belongs to a
+   single endpoint type, and all packets for an endpoint end up in the same
+   queue and stay in order. Device level packets are high priority barriers,
+   see usbredirparser_pick_write_queue */
+static int usbredirparser_write_queue_index(
+    struct usbredirparser_priv *parser, uint32_t type, void *type_header,
+    uint8_t *barrier)
+{
+    uint8_t ep;
+
+    *barrier = 0;
+    if (!(parser->flags & usbredirparser_fl_write_priority))
+        return WRITE_QUEUE_HIGH;
+
+    switch (type) {
+    case usb_redir_control_packet:
+    case usb_redir_interrupt_packet:
+    case usb_redir_coalesced_interrupt_packet:
+    case usb_redir_start_interrupt_receiving:
+    case usb_redir_stop_interrupt_receiving:
+    case usb_redir_interrupt_receiving_status:
+        return WRITE_QUEUE_HIGH;
+    case usb_redir_start_iso_stream:
+        ep = ((struct usb_redir_start_iso_stream_header *)type_header)->endpoint;
+        break;
+    case usb_redir_stop_iso_stream:
+        ep = ((struct usb_redir_stop_iso_stream_header *)type_header)->endpoint;
+        break;
+    case usb_redir_iso_stream_status:
+        ep = ((struct usb_redir_iso_stream_status_header *)type_header)->endpoint;
+        break;
+    case usb_redir_iso_packet:
+        ep = ((struct usb_redir_iso_packet_header *)type_header)->endpoint;
+        break;
+    case usb_redir_start_bulk_receiving:
+        ep = ((struct usb_redir_start_bulk_receiving_header *)type_header)->endpoint;
+        break;
+    case usb_redir_stop_bulk_receiving:
+        ep = ((struct usb_redir_stop_bulk_receiving_header *)type_header)->endpoint;
+        break;
+    case usb_redir_bulk_receiving_status:
+        ep = ((struct usb_redir_bulk_receiving_status_header *)type_header)->endpoint;
+        break;
+    case usb_redir_bulk_packet:
+        ep = ((struct usb_redir_bulk_packet_header *)type_header)->endpoint;
+        break;
+    case usb_redir_buffered_bulk_packet:
+        ep = ((struct usb_redir_buffered_bulk_packet_header *)type_header)->endpoint;
+        break;
+    case usb_redir_alloc_bulk_streams:
+    case usb_redir_free_bulk_streams:
+    case usb_redir_bulk_streams_status:
+    /* Never overtakes the packet it cancels this way */
+    case usb_redir_cancel_data_packet:
+        return WRITE_QUEUE_LOW;
+    default:
+        *barrier = 1;
+        return WRITE_QUEUE_HIGH;
+    }
+    return WRITE_QUEUE_EP + EP2I(ep);
+}
+
+/* Lockfree multi producer push, see usbredirparser_priv.write_incoming */
+static void usbredirparser_push_write_buf(struct usbredirparser_priv *parser,
+    struct usbredirparser_buf *new_wbuf)
+{
+    int prio = WRITE_QUEUE_PRIO(new_wbuf->queue);
+    struct usbredirparser_buf *head;
+
+    /* Count first, so that the count never goes negative when do_write
+       writes the buffer before we get to count it */
+    __atomic_add_fetch(&parser->write_count[prio], 1, __ATOMIC_RELAXED);
+
+    head = __atomic_load_n(&parser->write_incoming[prio], __ATOMIC_RELAXED);
+    do {
+        new_wbuf->next = head;
+    } while (!__atomic_compare_exchange_n(&parser->write_incoming[prio],
+                                          &head, new_wbuf, 1,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
 }
 
 static void usbredirparser_queue(struct usbredirparser *parser_pub,
@@ -1108,7 +2162,7 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
         (struct usbredirparser_priv *)parser_pub;
     uint8_t *buf, *type_header_out, *data_out;
     struct usb_redir_header *header;
-    struct usbredirparser_buf *wbuf, *new_wbuf;
+    struct usbredirparser_buf *new_wbuf;
     int header_len, type_header_len;
 
     header_len = usbredirparser_get_header_len(parser_pub);
@@ -1124,16 +2178,21 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
         return;
     }
 
-    new_wbuf = calloc(1, sizeof(*new_wbuf));
-    buf = malloc(header_len + type_header_len + data_len);
+    new_wbuf = usbredir_calloc(&parser->allocator, sizeof(*new_wbuf));
+    buf = usbredir_malloc(&parser->allocator,
+                          header_len + type_header_len + data_len);
     if (!new_wbuf || !buf) {
         ERROR("Out of memory allocating buffer to send packet, dropping!");
-        free(new_wbuf); free(buf);
+        usbredir_free(&parser->allocator, new_wbuf);
+        usbredir_free(&parser->allocator, buf);
         return;
     }
 
     new_wbuf->buf = buf;
     new_wbuf->len = header_len + type_header_len + data_len;
+    new_wbuf->queue = usbredirparser_write_queue_index(parser, type,
+                                                       type_header_in,
+                                                       &new_wbuf->barrier);
 
     header = (struct usb_redir_header *)buf;
     type_header_out = buf + header_len;
@@ -1145,21 +2204,41 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
         ((struct usb_redir_header_32bit_id *)header)->id = id;
     else
         header->id = id;
-    memcpy(type_header_out, type_header_in, type_header_len);
-    memcpy(data_out, data_in, data_len);
+    if (type_header_len)
+        memcpy(type_header_out, type_header_in, type_header_len);
+    if (data_len)
+        memcpy(data_out, data_in, data_len);
+
+    USBREDIR_TRACE4(packet_queue, type,
+                    usbredirparser_trace_ep(type, type_header_out), id,
+                    header->length);
+
+    /* When capturing take the lock, so that the capture order matches the
+       wire order */
+    if ((parser->flags & usbredirparser_fl_lockfree_write_queue) &&
+            !parser->capture) {
+        if (parser->flags & usbredirparser_fl_write_priority)
+            new_wbuf->seq = __atomic_fetch_add(&parser->write_seq, 1,
+                                               __ATOMIC_RELAXED);
+        usbredirparser_push_write_buf(parser, new_wbuf);
+        return;
+    }
 
     LOCK(parser);
-    if (!parser->write_buf) {
-        parser->write_buf = new_wbuf;
+    /* Capture with the lock held, so that the order matches the wire
+       (or the queueing order with usbredirparser_fl_write_priority) */
+    if (parser->capture)
+        usbredirparser_capture(parser, 1, buf, header_len, type_header_out,
+                               type_header_len, data_out, data_len);
+    new_wbuf->seq = __atomic_fetch_add(&parser->write_seq, 1,
+                                       __ATOMIC_RELAXED);
+    if (parser->flags & usbredirparser_fl_lockfree_write_queue) {
+        usbredirparser_push_write_buf(parser, new_wbuf);
     } else {
-        /* limiting the write_buf's stack depth is our users responsibility */
-        wbuf = parser->write_buf;
-        while (wbuf->next)
-            wbuf = wbuf->next;
-
-        wbuf->next = new_wbuf;
+        usbredirparser_append_write_buf(parser, new_wbuf);
+        __atomic_add_fetch(&parser->write_count[WRITE_QUEUE_PRIO(new_wbuf->queue)],
+                           1, __ATOMIC_RELAXED);
     }
-    parser->write_buf_count++;
     UNLOCK(parser);
 }
 
@@ -1191,6 +2270,7 @@ void usbredirparser_send_interface_info(struct usbredirparser *parser,
 void usbredirparser_send_ep_info(struct usbredirparser *parser,
     struct usb_redir_ep_info_header *ep_info)
 {
+    usbredirparser_update_ep_max_packet_size(parser, ep_info);
     usbredirparser_queue(parser, usb_redir_ep_info, 0, ep_info, NULL, 0);
 }
 
@@ -1372,6 +2452,14 @@ void usbredirparser_send_bulk_receiving_status(struct usbredirparser *parser,
                          bulk_receiving_status, NULL, 0);
 }
 
+void usbredirparser_send_descriptors(struct usbredirparser *parser,
+    struct usb_redir_descriptors_header *descriptors,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue(parser, usb_redir_descriptors, 0, descriptors,
+                         data, data_len);
+}
+
 /* Data packets: */
 void usbredirparser_send_control_packet(struct usbredirparser *parser,
     uint64_t id,
@@ -1418,6 +2506,15 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
                          buffered_bulk_header, data, data_len);
 }
 
+void usbredirparser_send_coalesced_interrupt_packet(
+    struct usbredirparser *parser, uint64_t id,
+    struct usb_redir_coalesced_interrupt_packet_header *coalesced_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue(parser, usb_redir_coalesced_interrupt_packet, id,
+                         coalesced_header, data, data_len);
+}
+
 /****** Serialization support ******/
 
 #define USBREDIRPARSER_SERIALIZE_MAGIC        0x55525031
@@ -1440,6 +2537,10 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
     uint32 write_buf_count: followed by write_buf_count times:
         uint32 write_buf_len
         uint8  write_buf_data[write_buf_len]
+
+   Note the ep max packet sizes are not part of the state, so that older
+   versions can still unserialize it, they get learned again from the next
+   ep_info packet.
 */
 
 static int serialize_alloc(struct usbredirparser_priv *parser,
@@ -1519,7 +2620,8 @@ static int serialize_data(struct usbredirparser_priv *parser,
     *pos += sizeof(uint32_t);
     *remain -= sizeof(uint32_t);
 
-    memcpy(*pos, data, len);
+    if (len)
+        memcpy(*pos, data, len);
     *pos += len;
     *remain -= len;
 
@@ -1548,7 +2650,7 @@ static int unserialize_data(struct usbredirparser_priv *parser,
         return -1;
     }
     if (*data == NULL && len > 0) {
-        *data = malloc(len);
+        *data = usbredir_malloc(&parser->allocator, len);
         if (!*data) {
             ERROR("Out of memory allocating unserialize buffer");
             return -1;
@@ -1560,7 +2662,8 @@ static int unserialize_data(struct usbredirparser_priv *parser,
         }
     }
 
-    memcpy(*data, *pos, len);
+    if (len)
+        memcpy(*data, *pos, len);
     *pos += len;
     *remain -= len;
     *len_in_out = len;
@@ -1579,9 +2682,10 @@ int usbredirparser_serialize(struct usbredirparser *parser_pub,
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf;
+    struct usbredirparser_buf *wbuf, *head[WRITE_QUEUE_COUNT];
     uint8_t *write_buf_count_pos, *state = NULL, *pos = NULL;
     uint32_t write_buf_count = 0, len, remain = 0;
+    int i, q;
 
     *state_dest = NULL;
     *state_len = 0;
@@ -1631,14 +2735,31 @@ int usbredirparser_serialize(struct usbredirparser *parser_pub,
     if (serialize_int(parser, &state, &pos, &remain, 0, "write_buf_count"))
         return -1;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
+    WRITE_LOCK(parser);
+    usbredirparser_collect_write_bufs(parser);
+    WRITE_UNLOCK(parser);
+    /* Store the write queues as one, in queueing order, except that a
+       partially written buffer must come first */
+    for (i = 0; i < WRITE_QUEUE_COUNT; i++)
+        head[i] = parser->write_queue[i].head;
+    q = parser->write_partial;
+    for (;;) {
+        if (q == -1) {
+            for (i = 0; i < WRITE_QUEUE_COUNT; i++) {
+                if (head[i] && (q == -1 || head[i]->seq < head[q]->seq))
+                    q = i;
+            }
+            if (q == -1)
+                break;
+        }
+        wbuf = head[q];
+        head[q] = wbuf->next;
+        q = -1;
         if (serialize_data(parser, &state, &pos, &remain,
                            wbuf->buf + wbuf->pos, wbuf->len - wbuf->pos,
                            "write-buf"))
             return -1;
         write_buf_count++;
-        wbuf = wbuf->next;
     }
     /* Patch in write_buf_count */
     memcpy(write_buf_count_pos, &write_buf_count, sizeof(int32_t));
@@ -1658,6 +2779,7 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_write_queue *queue;
     struct usbredirparser_buf *wbuf, **next;
     uint32_t orig_caps[USB_REDIR_CAPS_SIZE];
     uint8_t *data;
@@ -1743,8 +2865,10 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         return -1;
     parser->type_header_read = i;
 
-    if (parser->data_len) {
-        parser->data = malloc(parser->data_len);
+    /* The data buffer gets allocated once the type header is complete */
+    if (parser->data_len &&
+            parser->type_header_read == parser->type_header_len) {
+        parser->data = usbredir_malloc(&parser->allocator, parser->data_len);
         if (!parser->data) {
             ERROR("Out of memory allocating unserialize buffer");
             return -1;
@@ -1758,9 +2882,12 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
     /* Get the write buffer count and the write buffers */
     if (unserialize_int(parser, &state, &remain, &i, "write_buf_count"))
         return -1;
-    next = &parser->write_buf;
+    /* Restore them in the high priority queue, so that their order is
+       kept even with usbredirparser_fl_write_priority */
+    queue = &parser->write_queue[WRITE_QUEUE_HIGH];
+    next = &queue->head;
     while (i) {
-        wbuf = calloc(1, sizeof(*wbuf));
+        wbuf = usbredir_calloc(&parser->allocator, sizeof(*wbuf));
         if (!wbuf) {
             ERROR("Out of memory allocating unserialize buffer");
             return -1;
@@ -1770,7 +2897,11 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         if (unserialize_data(parser, &state, &remain, &wbuf->buf, &l, "wbuf"))
             return -1;
         wbuf->len = l;
+        wbuf->seq = parser->write_seq++;
         next = &wbuf->next;
+        queue->tail = wbuf;
+        queue->count++;
+        parser->write_count[WRITE_PRIO_HIGH]++;
         i--;
     }
 
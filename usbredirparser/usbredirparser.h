@@ -21,6 +21,7 @@
 #ifndef __USBREDIRPARSER_H
 #define __USBREDIRPARSER_H
 
+#include <stddef.h>
 #include "usbredirproto.h"
 
 #ifdef __cplusplus
@@ -115,12 +116,29 @@ typedef void (*usbredirparser_stop_bulk_receiving)(void *priv,
     uint64_t id, struct usb_redir_stop_bulk_receiving_header *stop_bulk_receiving);
 typedef void (*usbredirparser_bulk_receiving_status)(void *priv,
     uint64_t id, struct usb_redir_bulk_receiving_status_header *bulk_receiving_status);
+/* The data holds descriptors->count usb_redir_descriptor_entry-s, each
+   followed by its descriptor, the parser has checked that these exactly fill
+   data_len. These are the standard descriptors of the device, which
+   the usb-guest may use to answer GET_DESCRIPTOR requests without a round
+   trip to the usb-host, until the next device_disconnect.
+   Like with data packets, ownership of data is passed on to the callback,
+   which should free it with usbredirparser_free_packet_data. */
+typedef void (*usbredirparser_descriptors)(void *priv,
+    struct usb_redir_descriptors_header *descriptors,
+    uint8_t *data, int data_len);
 
 /* Data packets:
 
    Note that ownership of the the data buffer (if not NULL) is passed on to
    the callback. The callback should free it by calling
-   usbredirparser_free_packet_data when it is done with it. */
+   usbredirparser_free_packet_data when it is done with it, unless it is a
+   buffer returned by get_data_buffer_func (see below).
+
+   Iso and interrupt packets whose data is larger than the max packet size
+   of their endpoint (as send in the ep_info packet) get passed on without
+   data (data NULL, data_len 0), their header is left as the peer send it,
+   so these can be recognized by the length in the header being larger than
+   data_len. */
 typedef void (*usbredirparser_control_packet)(void *priv,
     uint64_t id, struct usb_redir_control_packet_header *control_header,
     uint8_t *data, int data_len);
@@ -136,6 +154,30 @@ typedef void (*usbredirparser_interrupt_packet)(void *priv,
 typedef void (*usbredirparser_buffered_bulk_packet)(void *priv, uint64_t id,
     struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
     uint8_t *data, int data_len);
+/* The data holds coalesced_header->count usb_redir_interrupt_report-s, each
+   followed by its report data, the parser has checked that these exactly
+   fill data_len. Report i has id id + i. If this callback is not set, the
+   parser calls interrupt_packet_func for each report instead. */
+typedef void (*usbredirparser_coalesced_interrupt_packet)(void *priv,
+    uint64_t id,
+    struct usb_redir_coalesced_interrupt_packet_header *coalesced_header,
+    uint8_t *data, int data_len);
+
+/* Called for data packets carrying data once their type specific header has
+   been read, before reading the data. This may return a buffer of at least
+   data_len bytes for the parser to read the data into, or NULL to have the
+   parser allocate one as usual. This allows reading the data straight into
+   its final destination, for example an urb. Note the type header has not
+   been verified yet when this gets called.
+
+   A returned buffer stays owned by the application, the parser only writes
+   the data into it, and passes it as data to the data packet callback,
+   which must not free it. The buffer must stay valid until the data packet
+   callback has been called, get_data_buffer_func is called again, or the
+   parser is destroyed. If the packet turns out to be invalid the data
+   packet callback does not get called. */
+typedef uint8_t *(*usbredirparser_get_data_buffer)(void *priv, uint64_t id,
+    uint32_t type, void *type_header, int data_len);
 
 
 /* Public part of the data allocated by usbredirparser_alloc, *never* allocate
@@ -194,6 +236,12 @@ struct usbredirparser {
     usbredirparser_bulk_receiving_status bulk_receiving_status_func;
     /* usbredir 0.6 new data packet complete callbacks */
     usbredirparser_buffered_bulk_packet buffered_bulk_packet_func;
+    /* usbredir 0.8 new data packet buffer callback */
+    usbredirparser_get_data_buffer get_data_buffer_func;
+    /* usbredir 0.8 new descriptors callback */
+    usbredirparser_descriptors descriptors_func;
+    /* usbredir 0.8 new coalesced interrupt data packet callback */
+    usbredirparser_coalesced_interrupt_packet coalesced_interrupt_packet_func;
 };
 
 /* Allocate a usbredirparser, after this the app should set the callback app
@@ -201,6 +249,53 @@ struct usbredirparser {
    usbredirparser_init */
 struct usbredirparser *usbredirparser_create(void);
 
+/* Custom memory allocation. All memory owned by a usbredirparser (the
+   parser itself, packet data buffers passed to the data packet callbacks,
+   write buffers, etc.) is allocated with malloc_func and freed with
+   free_func (both must be set), these get passed priv as first argument.
+   Note this means that packet data must be freed with
+   usbredirparser_free_packet_data and write buffers with
+   usbredirparser_free_write_buffer, not with free(), and that with a custom
+   allocator this must be done before destroying the parser (with the
+   default allocator the parser may be NULL or already destroyed).
+
+   Memory which is handed over to the application and documented to be
+   freed with free() (serialized state, filter rules) is still allocated
+   with malloc(). */
+struct usbredirparser_allocator {
+    void *priv;
+    void *(*malloc_func)(void *priv, size_t size);
+    void (*free_func)(void *priv, void *ptr);
+};
+
+/* Like usbredirparser_create, but with a custom allocator, the allocator
+   struct is copied. Passing NULL, or an allocator with neither function
+   set, is the same as usbredirparser_create. Returns NULL on out of memory
+   or if only one of malloc_func and free_func is set. */
+struct usbredirparser *usbredirparser_create_with_allocator(
+    const struct usbredirparser_allocator *allocator);
+
+/* Allocation statistics, when usbredir is configured with
+   --enable-alloc-stats, the number of allocations and bytes allocated by
+   usbredirparser and usbredirhost are counted per call site, for all
+   instances in the process. */
+struct usbredirparser_alloc_site {
+    const char *file;
+    int line;
+    uint64_t count;
+    uint64_t bytes;
+};
+
+/* Store the stats of up to max_sites call sites in sites.
+   Return value: the number of call sites with allocations (which may be
+   larger then max_sites), or -1 if usbredir was built without
+   --enable-alloc-stats */
+int usbredirparser_get_alloc_stats(struct usbredirparser_alloc_site *sites,
+                                   int max_sites);
+
+/* Reset all allocation counters to 0 */
+void usbredirparser_reset_alloc_stats(void);
+
 /* Set capability cap in the USB_REDIR_CAPS_SIZE sized caps array,
    this is a helper function to set capabilities in the caps array
    passed to usbredirparser_init(). */
@@ -208,11 +303,43 @@ void usbredirparser_caps_set_cap(uint32_t *caps, int cap);
 
 /* Init the parser, this will queue an initial usb_redir_hello packet,
    sending the version and caps to the peer, as well as configure the parsing
-   according to the passed in flags. */
+   according to the passed in flags.
+
+   Normally usbredirparser_send_* take the parser lock to add the packet to
+   the write queue. With usbredirparser_fl_lockfree_write_queue packets get
+   queued with an atomic push instead, so that senders never block each other
+   or usbredirparser_do_write. Concurrent do_write calls are still serialized
+   through a second parser lock. When a capture is running
+   (see usbredirparser_start_capture) the lock is still taken, to keep the
+   capture in wire order.
+
+   With usbredirparser_fl_builtin_lock the parser uses its own lock
+   implementation (a spinning futex based mutex, whose lock and unlock are
+   inlined) instead of the alloc_lock_func, lock_func, unlock_func and
+   free_lock_func callbacks, which are then ignored. This makes the parser
+   safe for multi-thread use without the app having to provide any locking
+   callbacks.
+
+   Normally packets are written in the order in which they are queued.
+   With usbredirparser_fl_write_priority control and interrupt packets
+   (and the interrupt receiving start / stop / status packets) get written
+   before already queued bulk and iso packets, so that for example HID input
+   does not lag behind a large backlog of buffered bulk data. Packets for the
+   same endpoint stay in order, device level packets (such as ep_info, reset
+   or set_configuration) never overtake older packets, and a bulk / iso
+   packet gets its turn at least once every 16 packets. Bulk and iso packets
+   are queued per endpoint, and the endpoints share the bandwidth by bytes
+   written (deficit round robin), so that a fast streaming endpoint does not
+   make the packets of other endpoints wait, see
+   usbredirparser_set_endpoint_weight. Note that a capture (see
+   usbredirparser_start_capture) shows the queueing order. */
 enum {
     usbredirparser_fl_usb_host = 0x01,
     usbredirparser_fl_write_cb_owns_buffer = 0x02,
     usbredirparser_fl_no_hello = 0x04,
+    usbredirparser_fl_lockfree_write_queue = 0x08,
+    usbredirparser_fl_builtin_lock = 0x10,
+    usbredirparser_fl_write_priority = 0x20,
 };
 
 void usbredirparser_init(struct usbredirparser *parser,
@@ -244,6 +371,23 @@ int usbredirparser_do_read(struct usbredirparser *parser);
 /* This returns the number of usbredir packets queued up for writing */
 int usbredirparser_has_data_to_write(struct usbredirparser *parser);
 
+/* Lock statistics, when usbredir is configured with --enable-lock-stats,
+   for parsers initialized with usbredirparser_fl_builtin_lock. All times
+   are in nanoseconds. */
+struct usbredirparser_lock_stats {
+    uint64_t acquired;    /* Number of times the lock was taken */
+    uint64_t contended;   /* Number of times taking the lock had to wait */
+    uint64_t wait_ns;     /* Total time spent waiting for the lock */
+    uint64_t hold_ns;     /* Total time the lock was held */
+    uint64_t max_hold_ns; /* Longest time the lock was held */
+};
+
+/* Fill stats with the combined stats of all locks of the parser.
+   Returns 0 on success, -1 if the parser does not use the builtin lock or
+   usbredir was built without --enable-lock-stats */
+int usbredirparser_get_lock_stats(struct usbredirparser *parser,
+                                  struct usbredirparser_lock_stats *stats);
+
 /* Call this when usbredirparser_has_data_to_write returns > 0
    returns 0 on success, -1 if a write error happened.
    If a write error happened, this function will retry writing any queued data
@@ -253,6 +397,14 @@ enum {
 };
 int usbredirparser_do_write(struct usbredirparser *parser);
 
+/* With usbredirparser_fl_write_priority, set the share of the bandwidth
+   available to bulk / iso packets which endpoint ep gets when several
+   endpoints have packets queued. weight must be between 1 (the default)
+   and 256, an endpoint with weight 2 gets twice the bytes written of an
+   endpoint with weight 1. Returns 0 on success, -1 on an invalid weight. */
+int usbredirparser_set_endpoint_weight(struct usbredirparser *parser,
+                                       uint8_t ep, int weight);
+
 /* See usbredirparser_write documentation */
 void usbredirparser_free_write_buffer(struct usbredirparser *parser,
     uint8_t *data);
@@ -335,6 +487,9 @@ void usbredirparser_send_stop_bulk_receiving(struct usbredirparser *parser,
 void usbredirparser_send_bulk_receiving_status(struct usbredirparser *parser,
     uint64_t id,
     struct usb_redir_bulk_receiving_status_header *bulk_receiving_status);
+void usbredirparser_send_descriptors(struct usbredirparser *parser,
+    struct usb_redir_descriptors_header *descriptors,
+    uint8_t *data, int data_len);
 /* Data packets: */
 void usbredirparser_send_control_packet(struct usbredirparser *parser,
     uint64_t id,
@@ -356,6 +511,10 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
     uint64_t id,
     struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
     uint8_t *data, int data_len);
+void usbredirparser_send_coalesced_interrupt_packet(
+    struct usbredirparser *parser, uint64_t id,
+    struct usb_redir_coalesced_interrupt_packet_header *coalesced_header,
+    uint8_t *data, int data_len);
 
 
 /* Serialization */
@@ -379,6 +538,37 @@ int usbredirparser_serialize(struct usbredirparser *parser,
 int usbredirparser_unserialize(struct usbredirparser *parser_pub,
                                uint8_t *state, int len);
 
+
+/* Capture */
+
+/* Start capturing all packets send and received by the parser to filename.
+   The capture is written in pcap format, with a link type of
+   LINKTYPE_USER0 (147), each record contains a 4 byte pseudo header:
+   uint8_t direction:  0 received from the peer, 1 send to the peer
+   uint8_t flags:      bit 0 set if the capturing parser is the usb-host side
+   uint8_t header_len: length of the usb_redir_header of the packet (12 / 16)
+   uint8_t reserved
+   Followed by the complete usbredir packet as send over the wire. Packets
+   whose data the parser skips (see the iso and interrupt packet callbacks)
+   are captured without their data, as truncated records.
+   Received packets are timestamped when they have been fully read, send
+   packets when they are queued.
+
+   This may be called before or after usbredirparser_init, when called after
+   it the capture starts with our hello packet. With multiple threads it must
+   be called after usbredirparser_init, which allocates the capture lock.
+   Note the capture contains all data transferred to and from the device,
+   the parser never starts a capture by itself, this is left to the
+   application (e.g. usbredirserver --capture).
+
+   Return value: 0 on success, -1 on error (could not open filename). */
+int usbredirparser_start_capture(struct usbredirparser *parser,
+                                 const char *filename);
+
+/* Stop a capture started with usbredirparser_start_capture. This is also
+   done by usbredirparser_destroy. */
+void usbredirparser_stop_capture(struct usbredirparser *parser);
+
 #ifdef __cplusplus
 }
 #endif
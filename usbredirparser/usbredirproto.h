@@ -105,6 +105,7 @@ enum {
     usb_redir_start_bulk_receiving,
     usb_redir_stop_bulk_receiving,
     usb_redir_bulk_receiving_status,
+    usb_redir_descriptors,
 
     /* Data packets */
     usb_redir_control_packet = 100,
@@ -112,6 +113,7 @@ enum {
     usb_redir_iso_packet,
     usb_redir_interrupt_packet,
     usb_redir_buffered_bulk_packet,
+    usb_redir_coalesced_interrupt_packet,
 };
 
 enum {
@@ -131,6 +133,10 @@ enum {
     usb_redir_cap_32bits_bulk_length,
     /* Supports bulk receiving / buffered bulk input */
     usb_redir_cap_bulk_receiving,
+    /* Supports the usb_redir_descriptors packet */
+    usb_redir_cap_descriptors,
+    /* Supports the usb_redir_coalesced_interrupt_packet packet */
+    usb_redir_cap_coalesced_interrupt,
 };
 /* Number of uint32_t-s needed to hold all (known) capabilities */
 #define USB_REDIR_CAPS_SIZE 1
@@ -257,6 +263,19 @@ struct usb_redir_bulk_receiving_status_header {
     uint8_t status;
 } ATTR_PACKED;
 
+struct usb_redir_descriptors_header {
+    uint32_t count;       /* Number of descriptors in the packet data */
+} ATTR_PACKED;
+
+/* The data of a usb_redir_descriptors packet consists of count of these,
+   each followed by length bytes of descriptor */
+struct usb_redir_descriptor_entry {
+    uint8_t type;         /* Descriptor type (high byte of wValue) */
+    uint8_t index;        /* Descriptor index (low byte of wValue) */
+    uint16_t langid;      /* Language id for strings (wIndex), else 0 */
+    uint16_t length;
+} ATTR_PACKED;
+
 struct usb_redir_control_packet_header {
     uint8_t endpoint;
     uint8_t request;
@@ -294,6 +313,19 @@ struct usb_redir_buffered_bulk_packet_header {
     uint8_t status;
 } ATTR_PACKED;
 
+struct usb_redir_coalesced_interrupt_packet_header {
+    uint8_t endpoint;
+    uint16_t count;       /* Number of reports in the packet data */
+    uint32_t length;      /* Length of the packet data */
+} ATTR_PACKED;
+
+/* The data of a usb_redir_coalesced_interrupt_packet consists of count of
+   these, each followed by length bytes of report data */
+struct usb_redir_interrupt_report {
+    uint8_t status;
+    uint16_t length;
+} ATTR_PACKED;
+
 #undef ATTR_PACKED
 
 #if defined(__MINGW32__) || !defined(__GNUC__)
@@ -0,0 +1,75 @@
+/* usbredirtrace.h usbredir static tracepoints
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRTRACE_H
+#define __USBREDIRTRACE_H
+
+/* When built with systemtap's sys/sdt.h available (see configure
+   --enable-usdt), the hot paths of libusbredirparser and libusbredirhost
+   contain USDT probes under the "usbredir" provider. These compile to a
+   single nop, and can be used from perf, bpftrace, systemtap, etc. E.g.:
+
+   bpftrace -e 'usdt:/usr/lib64/libusbredirhost.so.1:usbredir:urb_complete
+                { @[arg0] = hist(arg4); }'
+
+   libusbredirparser probes:
+   packet_parse(type, ep, id, len)   a complete valid packet has been received
+                                     and is passed to its callback
+   packet_queue(type, ep, id, len)   a packet has been queued for sending
+   write_done(type, len, queued)     a packet has been completely written,
+                                     queued is the number of packets left
+   libusbredirhost probes:
+   urb_submit(ep, xfer_type, id, len)
+   urb_complete(ep, xfer_type, id, status, len)
+                                     status is the libusb transfer status
+   cancel(ep, id)                    the guest cancelled packet id, ep is 0
+                                     if the packet was not found (completed)
+   packet_drop(ep, id, len)          an iso / interrupt / buffered bulk packet
+                                     was dropped because the connection to
+                                     the guest (or the iso out queue towards
+                                     the device) is not keeping up
+
+   type is the usb_redir_* packet type, ep is the endpoint address for data
+   packets and 0 for other packets, len is the packet length (type header +
+   data) for parser probes and the data length for host probes. */
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define USBREDIR_TRACE2(name, a, b) \
+    DTRACE_PROBE2(usbredir, name, a, b)
+#define USBREDIR_TRACE3(name, a, b, c) \
+    DTRACE_PROBE3(usbredir, name, a, b, c)
+#define USBREDIR_TRACE4(name, a, b, c, d) \
+    DTRACE_PROBE4(usbredir, name, a, b, c, d)
+#define USBREDIR_TRACE5(name, a, b, c, d, e) \
+    DTRACE_PROBE5(usbredir, name, a, b, c, d, e)
+#else
+/* Reference the arguments so that values only used for tracing don't cause
+   unused warnings, without evaluating them */
+#define USBREDIR_TRACE2(name, a, b) \
+    do { if (0) { (void)(a); (void)(b); } } while (0)
+#define USBREDIR_TRACE3(name, a, b, c) \
+    do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#define USBREDIR_TRACE4(name, a, b, c, d) \
+    do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#define USBREDIR_TRACE5(name, a, b, c, d, e) \
+    do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } \
+    } while (0)
+#endif
+
+#endif
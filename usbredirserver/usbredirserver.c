@@ -49,6 +49,8 @@ static struct usbredirhost *host;
 static const struct option longopts[] = {
     { "port", required_argument, NULL, 'p' },
     { "verbose", required_argument, NULL, 'v' },
+    { "quirks", required_argument, NULL, 'q' },
+    { "capture", required_argument, NULL, 'c' },
     { "help", no_argument, NULL, 'h' },
     { NULL, 0, NULL, 0 }
 };
@@ -93,7 +95,7 @@ static int usbredirserver_write(void *priv, uint8_t *data, int count)
 static void usage(int exit_code, char *argv0)
 {
     fprintf(exit_code? stderr:stdout,
-        "Usage: %s [-p|--port <port>] [-v|--verbose <0-5>] <usbbus-usbaddr|vendorid:prodid>\n",
+        "Usage: %s [-p|--port <port>] [-v|--verbose <0-5>] [-q|--quirks <file>] [-c|--capture <prefix>] <usbbus-usbaddr|vendorid:prodid>\n",
         argv0);
     exit(exit_code);
 }
@@ -190,8 +192,9 @@ static void quit_handler(int sig)
 
 int main(int argc, char *argv[])
 {
-    int o, flags, server_fd = -1;
-    char *endptr, *delim;
+    int o, r, flags, server_fd = -1, error_line = 0, capture_count = 0;
+    char *endptr, *delim, *capture_prefix = NULL;
+    char capture_filename[1024];
     int port       = 4000;
     int usbbus     = -1;
     int usbaddr    = -1;
@@ -202,7 +205,7 @@ int main(int argc, char *argv[])
     struct sigaction act;
     libusb_device_handle *handle = NULL;
 
-    while ((o = getopt_long(argc, argv, "hp:v:", longopts, NULL)) != -1) {
+    while ((o = getopt_long(argc, argv, "hp:v:q:c:", longopts, NULL)) != -1) {
         switch (o) {
         case 'p':
             port = strtol(optarg, &endptr, 10);
@@ -218,6 +221,21 @@ int main(int argc, char *argv[])
                 usage(1, argv[0]);
             }
             break;
+        case 'q':
+            r = usbredirhost_load_quirks(optarg, &error_line);
+            if (r == -EINVAL) {
+                fprintf(stderr, "Error parsing %s line %d\n", optarg,
+                        error_line);
+                exit(1);
+            } else if (r) {
+                fprintf(stderr, "Error loading %s: %s\n", optarg,
+                        strerror(-r));
+                exit(1);
+            }
+            break;
+        case 'c':
+            capture_prefix = optarg;
+            break;
         case '?':
         case 'h':
             usage(o == '?', argv[0]);
@@ -358,9 +376,15 @@ int main(int argc, char *argv[])
 
         host = usbredirhost_open(ctx, handle, usbredirserver_log,
                                  usbredirserver_read, usbredirserver_write,
-                                 NULL, SERVER_VERSION, verbose, 0);
+                                 NULL, SERVER_VERSION, verbose,
+                                 usbredirhost_fl_write_priority);
         if (!host)
             exit(1);
+        if (capture_prefix) {
+            snprintf(capture_filename, sizeof(capture_filename),
+                     "%s-%d.pcap", capture_prefix, capture_count++);
+            usbredirhost_start_capture(host, capture_filename);
+        }
         run_main_loop();
         usbredirhost_close(host);
         handle = NULL;
@@ -0,0 +1,1697 @@
+/* usbredirsim.c simulated usb devices behind the libusb API
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE /* For ppoll */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "usbredirsim.h"
+
+#define SIM_VENDOR_ID       0x1209
+#define SIM_PRODUCT_ID      0x0001 /* + device type */
+#define SIM_FIFO_SIZE       (1024 * 1024)
+#define SIM_HID_REPORT_SIZE 8
+#define SIM_CLASS_VIDEO     0x0e
+#define SIM_SC_VIDEOSTREAMING 0x02
+
+#define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
+
+enum {
+    sim_transfer_idle,
+    sim_transfer_submitted,
+    sim_transfer_cancelled,
+};
+
+/* libusb_alloc_transfer returns a pointer to the transfer member */
+struct usbredirsim_transfer {
+    struct usbredirsim_transfer *next;
+    uint64_t deadline;
+    int state;
+    int timed_out;
+    uint32_t stream_id;
+    struct libusb_transfer transfer; /* Must be last! */
+};
+
+#define SIM_TRANSFER(t) ((struct usbredirsim_transfer *) \
+    ((char *)(t) - offsetof(struct usbredirsim_transfer, transfer)))
+
+struct usbredirsim_ep {
+    uint64_t busy_until;
+    uint8_t seq;
+    int halted;
+};
+
+struct libusb_device {
+    libusb_context *ctx;
+    int refcount;
+    struct usbredirsim_config config;
+    int frame_us;
+    int bulk_rate; /* bytes per us */
+    uint8_t address;
+    /* Descriptors */
+    struct libusb_device_descriptor desc;
+    struct libusb_config_descriptor config_desc;
+    struct libusb_interface interface;
+    struct libusb_interface_descriptor altsetting[2];
+    struct libusb_endpoint_descriptor endpoint[2];
+    uint8_t raw_device[LIBUSB_DT_DEVICE_SIZE];
+    uint8_t raw_config[64];
+    const char *product;
+    /* State */
+    int active_config;
+    int claimed;
+    int alt;
+    int disconnected;
+    struct usbredirsim_ep ep[32];
+    uint8_t *fifo;
+    int fifo_pos;
+    int fifo_len;
+    unsigned int seed;
+    uint64_t uvc_packet;        /* Iso IN packets send, for the uvc headers */
+    struct usbredirsim_stats stats;
+};
+
+struct libusb_device_handle {
+    libusb_device *dev;
+};
+
+struct libusb_context {
+    pthread_mutex_t lock;
+    int pipe[2];
+    struct libusb_pollfd pollfd;
+    libusb_device *dev;
+    /* Submitted transfers, sorted by deadline */
+    struct usbredirsim_transfer *pending;
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usbredirsim_config sim_config;
+static int sim_config_initialized;
+static libusb_context *default_ctx;
+static int default_ctx_refcount;
+static uint8_t sim_next_address = 2;
+
+/* HID descriptor and boot keyboard report descriptor */
+static const uint8_t hid_desc[9] = {
+    0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 63, 0x00
+};
+
+static const uint8_t hid_report_desc[63] = {
+    0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7,
+    0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+    0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+    0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+    0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+    0x81, 0x00, 0xc0
+};
+
+#define GET_CTX(ctx) ((ctx) ? (ctx) : default_ctx)
+#define LOCK(ctx)    pthread_mutex_lock(&(ctx)->lock)
+#define UNLOCK(ctx)  pthread_mutex_unlock(&(ctx)->lock)
+
+/****** Configuration ******/
+
+static int sim_getenv_int(const char *name, int def)
+{
+    const char *val = getenv(name);
+    char *endptr;
+    long l;
+
+    if (!val)
+        return def;
+
+    l = strtol(val, &endptr, 0);
+    if (*endptr != '\0') {
+        fprintf(stderr, "usbredirsim: invalid value for %s: '%s'\n",
+                name, val);
+        return def;
+    }
+    return l;
+}
+
+static int sim_getenv_enum(const char *name, const char * const *names,
+                           const int *values, int def)
+{
+    const char *val = getenv(name);
+    int i;
+
+    if (!val)
+        return def;
+
+    for (i = 0; names[i]; i++) {
+        if (!strcmp(val, names[i]))
+            return values[i];
+    }
+    fprintf(stderr, "usbredirsim: invalid value for %s: '%s'\n", name, val);
+    return def;
+}
+
+static void sim_init_config(void)
+{
+    static const char * const device_names[] = { "bulk", "iso", "hid", NULL };
+    static const int devices[] = {
+        usbredirsim_device_bulk, usbredirsim_device_iso, usbredirsim_device_hid
+    };
+    static const char * const speed_names[] = {
+        "low", "full", "high", "super", NULL
+    };
+    static const int speeds[] = {
+        LIBUSB_SPEED_LOW, LIBUSB_SPEED_FULL, LIBUSB_SPEED_HIGH,
+        LIBUSB_SPEED_SUPER
+    };
+    static const char * const status_names[] = {
+        "error", "stall", "timeout", "overflow", NULL
+    };
+    static const int statuses[] = {
+        LIBUSB_TRANSFER_ERROR, LIBUSB_TRANSFER_STALL,
+        LIBUSB_TRANSFER_TIMED_OUT, LIBUSB_TRANSFER_OVERFLOW
+    };
+
+    if (sim_config_initialized)
+        return;
+
+    sim_config.device = sim_getenv_enum("USBREDIRSIM_DEVICE", device_names,
+                                        devices, usbredirsim_device_bulk);
+    sim_config.speed = sim_getenv_enum("USBREDIRSIM_SPEED", speed_names,
+                                       speeds, 0);
+    sim_config.latency = sim_getenv_int("USBREDIRSIM_LATENCY", 0);
+    sim_config.sync_latency = sim_getenv_int("USBREDIRSIM_SYNC_LATENCY", 0);
+    sim_config.iso_max_packet_size =
+        sim_getenv_int("USBREDIRSIM_ISO_MAX_PACKET_SIZE", 0);
+    sim_config.iso_packet_len = sim_getenv_int("USBREDIRSIM_ISO_PACKET_LEN", 0);
+    sim_config.uvc_frame_packets =
+        sim_getenv_int("USBREDIRSIM_UVC_FRAME_PACKETS", 0);
+    sim_config.interrupt_interval =
+        sim_getenv_int("USBREDIRSIM_INTERRUPT_INTERVAL", 0);
+    sim_config.error_rate = sim_getenv_int("USBREDIRSIM_ERROR_RATE", 0);
+    sim_config.error_status = sim_getenv_enum("USBREDIRSIM_ERROR_STATUS",
+                                              status_names, statuses,
+                                              LIBUSB_TRANSFER_ERROR);
+    sim_config.disconnect_after =
+        sim_getenv_int("USBREDIRSIM_DISCONNECT_AFTER", 0);
+    sim_config.seed = sim_getenv_int("USBREDIRSIM_SEED", 1);
+    sim_config_initialized = 1;
+}
+
+void usbredirsim_get_config(struct usbredirsim_config *config)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_init_config();
+    *config = sim_config;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void usbredirsim_set_config(const struct usbredirsim_config *config)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_config = *config;
+    sim_config_initialized = 1;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+/****** Helpers ******/
+
+static uint64_t sim_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sim_sync_delay(libusb_device *dev)
+{
+    if (dev->config.sync_latency)
+        usleep(dev->config.sync_latency);
+}
+
+static void sim_wakeup(libusb_context *ctx)
+{
+    uint8_t c = 0;
+
+    /* The pipe is non blocking and a full pipe is as good a wakeup */
+    if (write(ctx->pipe[1], &c, 1) != 1 && errno != EAGAIN) {
+        fprintf(stderr, "usbredirsim: error writing wakeup pipe: %s\n",
+                strerror(errno));
+    }
+}
+
+static int sim_inject_error(libusb_device *dev)
+{
+    if (!dev->config.error_rate)
+        return 0;
+    return (rand_r(&dev->seed) % dev->config.error_rate) == 0;
+}
+
+static const struct libusb_endpoint_descriptor *sim_find_endpoint(
+    libusb_device *dev, uint8_t ep)
+{
+    const struct libusb_interface_descriptor *intf;
+    int i;
+
+    if (!dev->active_config)
+        return NULL;
+
+    intf = &dev->altsetting[dev->alt];
+    for (i = 0; i < intf->bNumEndpoints; i++) {
+        if (intf->endpoint[i].bEndpointAddress == ep)
+            return &intf->endpoint[i];
+    }
+    return NULL;
+}
+
+/* Returns the (micro)frame based period of a periodic ep in us */
+static int sim_ep_period(libusb_device *dev,
+                         const struct libusb_endpoint_descriptor *endp)
+{
+    int interval = endp->bInterval;
+
+    if (interval < 1)
+        interval = 1;
+    if (dev->frame_us == 125 ||
+            (endp->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+                LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        if (interval > 16)
+            interval = 16;
+        return dev->frame_us << (interval - 1);
+    }
+    return interval * 1000;
+}
+
+static void sim_reset_endpoints(libusb_device *dev)
+{
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        dev->ep[i].busy_until = 0;
+        dev->ep[i].halted = 0;
+    }
+    dev->fifo_pos = dev->fifo_len = 0;
+}
+
+/****** Device creation ******/
+
+static void sim_fill_endpoint(struct libusb_endpoint_descriptor *endp,
+    uint8_t address, uint8_t type, uint16_t max_packet_size, uint8_t interval)
+{
+    endp->bLength = LIBUSB_DT_ENDPOINT_SIZE;
+    endp->bDescriptorType = LIBUSB_DT_ENDPOINT;
+    endp->bEndpointAddress = address;
+    endp->bmAttributes = type;
+    endp->wMaxPacketSize = max_packet_size;
+    endp->bInterval = interval;
+}
+
+static void sim_fill_interface(struct libusb_interface_descriptor *intf,
+    uint8_t alt, uint8_t num_endpoints,
+    const struct libusb_endpoint_descriptor *endpoint,
+    uint8_t class, uint8_t subclass, uint8_t protocol)
+{
+    intf->bLength = LIBUSB_DT_INTERFACE_SIZE;
+    intf->bDescriptorType = LIBUSB_DT_INTERFACE;
+    intf->bInterfaceNumber = 0;
+    intf->bAlternateSetting = alt;
+    intf->bNumEndpoints = num_endpoints;
+    intf->bInterfaceClass = class;
+    intf->bInterfaceSubClass = subclass;
+    intf->bInterfaceProtocol = protocol;
+    intf->endpoint = endpoint;
+}
+
+static uint16_t sim_iso_max_packet_size(libusb_device *dev)
+{
+    int size = dev->config.iso_max_packet_size;
+    int mult = 1;
+
+    switch (dev->config.speed) {
+    case LIBUSB_SPEED_HIGH:
+        if (size <= 0 || size > 3072)
+            size = 1024;
+        mult = (size + 1023) / 1024;
+        size /= mult;
+        break;
+    case LIBUSB_SPEED_SUPER:
+        if (size <= 0 || size > 1024)
+            size = 1024;
+        break;
+    default:
+        if (size <= 0 || size > 1023)
+            size = 1023;
+    }
+    return size | ((mult - 1) << 11);
+}
+
+static void sim_serialize_descriptors(libusb_device *dev)
+{
+    struct libusb_device_descriptor *d = &dev->desc;
+    uint8_t *p = dev->raw_device;
+    int i, j;
+
+    *p++ = d->bLength;
+    *p++ = d->bDescriptorType;
+    *p++ = d->bcdUSB & 0xff;
+    *p++ = d->bcdUSB >> 8;
+    *p++ = d->bDeviceClass;
+    *p++ = d->bDeviceSubClass;
+    *p++ = d->bDeviceProtocol;
+    *p++ = d->bMaxPacketSize0;
+    *p++ = d->idVendor & 0xff;
+    *p++ = d->idVendor >> 8;
+    *p++ = d->idProduct & 0xff;
+    *p++ = d->idProduct >> 8;
+    *p++ = d->bcdDevice & 0xff;
+    *p++ = d->bcdDevice >> 8;
+    *p++ = d->iManufacturer;
+    *p++ = d->iProduct;
+    *p++ = d->iSerialNumber;
+    *p++ = d->bNumConfigurations;
+
+    p = dev->raw_config + LIBUSB_DT_CONFIG_SIZE;
+    for (i = 0; i < dev->interface.num_altsetting; i++) {
+        const struct libusb_interface_descriptor *intf = &dev->altsetting[i];
+
+        *p++ = intf->bLength;
+        *p++ = intf->bDescriptorType;
+        *p++ = intf->bInterfaceNumber;
+        *p++ = intf->bAlternateSetting;
+        *p++ = intf->bNumEndpoints;
+        *p++ = intf->bInterfaceClass;
+        *p++ = intf->bInterfaceSubClass;
+        *p++ = intf->bInterfaceProtocol;
+        *p++ = intf->iInterface;
+        memcpy(p, intf->extra, intf->extra_length);
+        p += intf->extra_length;
+        for (j = 0; j < intf->bNumEndpoints; j++) {
+            const struct libusb_endpoint_descriptor *endp = &intf->endpoint[j];
+
+            *p++ = endp->bLength;
+            *p++ = endp->bDescriptorType;
+            *p++ = endp->bEndpointAddress;
+            *p++ = endp->bmAttributes;
+            *p++ = endp->wMaxPacketSize & 0xff;
+            *p++ = endp->wMaxPacketSize >> 8;
+            *p++ = endp->bInterval;
+        }
+    }
+    dev->config_desc.wTotalLength = p - dev->raw_config;
+
+    p = dev->raw_config;
+    *p++ = dev->config_desc.bLength;
+    *p++ = dev->config_desc.bDescriptorType;
+    *p++ = dev->config_desc.wTotalLength & 0xff;
+    *p++ = dev->config_desc.wTotalLength >> 8;
+    *p++ = dev->config_desc.bNumInterfaces;
+    *p++ = dev->config_desc.bConfigurationValue;
+    *p++ = dev->config_desc.iConfiguration;
+    *p++ = dev->config_desc.bmAttributes;
+    *p++ = dev->config_desc.MaxPower;
+}
+
+static libusb_device *sim_device_new(libusb_context *ctx,
+                                     const struct usbredirsim_config *config)
+{
+    libusb_device *dev;
+    uint16_t bulk_max_packet_size;
+    int interval;
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return NULL;
+
+    dev->ctx = ctx;
+    dev->config = *config;
+    dev->seed = config->seed;
+    if (!dev->config.speed) {
+        dev->config.speed = (config->device == usbredirsim_device_hid) ?
+                            LIBUSB_SPEED_FULL : LIBUSB_SPEED_HIGH;
+    }
+
+    switch (dev->config.speed) {
+    case LIBUSB_SPEED_LOW:
+        dev->frame_us = 1000;
+        dev->bulk_rate = 1;
+        bulk_max_packet_size = 8;
+        dev->desc.bcdUSB = 0x0110;
+        dev->desc.bMaxPacketSize0 = 8;
+        break;
+    case LIBUSB_SPEED_FULL:
+        dev->frame_us = 1000;
+        dev->bulk_rate = 1;
+        bulk_max_packet_size = 64;
+        dev->desc.bcdUSB = 0x0110;
+        dev->desc.bMaxPacketSize0 = 64;
+        break;
+    case LIBUSB_SPEED_SUPER:
+        dev->frame_us = 125;
+        dev->bulk_rate = 400;
+        bulk_max_packet_size = 1024;
+        dev->desc.bcdUSB = 0x0300;
+        dev->desc.bMaxPacketSize0 = 9;
+        break;
+    default:
+        dev->config.speed = LIBUSB_SPEED_HIGH;
+        dev->frame_us = 125;
+        dev->bulk_rate = 40;
+        bulk_max_packet_size = 512;
+        dev->desc.bcdUSB = 0x0200;
+        dev->desc.bMaxPacketSize0 = 64;
+    }
+
+    switch (config->device) {
+    case usbredirsim_device_iso:
+        dev->product = "usbredirsim iso source / sink";
+        sim_fill_endpoint(&dev->endpoint[0], 0x82,
+                          LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+                          sim_iso_max_packet_size(dev), 1);
+        sim_fill_endpoint(&dev->endpoint[1], 0x02,
+                          LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+                          sim_iso_max_packet_size(dev), 1);
+        if (dev->config.uvc_frame_packets > 0) {
+            sim_fill_interface(&dev->altsetting[0], 0, 0, NULL,
+                               SIM_CLASS_VIDEO, SIM_SC_VIDEOSTREAMING, 0);
+            sim_fill_interface(&dev->altsetting[1], 1, 2, dev->endpoint,
+                               SIM_CLASS_VIDEO, SIM_SC_VIDEOSTREAMING, 0);
+        } else {
+            sim_fill_interface(&dev->altsetting[0], 0, 0, NULL, 0xff, 0, 0);
+            sim_fill_interface(&dev->altsetting[1], 1, 2, dev->endpoint,
+                               0xff, 0, 0);
+        }
+        dev->interface.num_altsetting = 2;
+        if (dev->config.iso_packet_len <= 0) {
+            uint16_t maxp = dev->endpoint[0].wMaxPacketSize;
+            dev->config.iso_packet_len =
+                (maxp & 0x7ff) * (((maxp >> 11) & 3) + 1);
+        }
+        break;
+    case usbredirsim_device_hid:
+        dev->product = "usbredirsim hid keyboard";
+        interval = config->interrupt_interval;
+        if (interval <= 0)
+            interval = (dev->frame_us == 125) ? 7 : 10;
+        sim_fill_endpoint(&dev->endpoint[0], 0x81,
+                          LIBUSB_TRANSFER_TYPE_INTERRUPT,
+                          SIM_HID_REPORT_SIZE, interval);
+        sim_fill_interface(&dev->altsetting[0], 0, 1, dev->endpoint,
+                           0x03, 0x01, 0x01);
+        dev->altsetting[0].extra = hid_desc;
+        dev->altsetting[0].extra_length = sizeof(hid_desc);
+        dev->interface.num_altsetting = 1;
+        break;
+    default:
+        dev->config.device = usbredirsim_device_bulk;
+        dev->product = "usbredirsim bulk loopback";
+        sim_fill_endpoint(&dev->endpoint[0], 0x01,
+                          LIBUSB_TRANSFER_TYPE_BULK, bulk_max_packet_size, 0);
+        sim_fill_endpoint(&dev->endpoint[1], 0x81,
+                          LIBUSB_TRANSFER_TYPE_BULK, bulk_max_packet_size, 0);
+        sim_fill_interface(&dev->altsetting[0], 0, 2, dev->endpoint,
+                           0xff, 0, 0);
+        dev->interface.num_altsetting = 1;
+        dev->fifo = malloc(SIM_FIFO_SIZE);
+        if (!dev->fifo) {
+            free(dev);
+            return NULL;
+        }
+    }
+    dev->interface.altsetting = dev->altsetting;
+
+    dev->desc.bLength = LIBUSB_DT_DEVICE_SIZE;
+    dev->desc.bDescriptorType = LIBUSB_DT_DEVICE;
+    dev->desc.idVendor = SIM_VENDOR_ID;
+    dev->desc.idProduct = SIM_PRODUCT_ID + dev->config.device;
+    dev->desc.bcdDevice = 0x0100;
+    dev->desc.iManufacturer = 1;
+    dev->desc.iProduct = 2;
+    dev->desc.iSerialNumber = 3;
+    dev->desc.bNumConfigurations = 1;
+
+    dev->config_desc.bLength = LIBUSB_DT_CONFIG_SIZE;
+    dev->config_desc.bDescriptorType = LIBUSB_DT_CONFIG;
+    dev->config_desc.bNumInterfaces = 1;
+    dev->config_desc.bConfigurationValue = 1;
+    dev->config_desc.bmAttributes = 0x80;
+    dev->config_desc.MaxPower = 50;
+    dev->config_desc.interface = &dev->interface;
+
+    sim_serialize_descriptors(dev);
+
+    /* Like a real device bound to a kernel driver, start out configured */
+    dev->active_config = 1;
+    dev->refcount = 1;
+
+    pthread_mutex_lock(&sim_lock);
+    dev->address = sim_next_address++;
+    pthread_mutex_unlock(&sim_lock);
+
+    return dev;
+}
+
+/****** Context ******/
+
+int libusb_init(libusb_context **ctx_ret)
+{
+    struct usbredirsim_config config;
+    libusb_context *ctx;
+
+    if (!ctx_ret) {
+        pthread_mutex_lock(&sim_lock);
+        if (default_ctx) {
+            default_ctx_refcount++;
+            pthread_mutex_unlock(&sim_lock);
+            return LIBUSB_SUCCESS;
+        }
+        pthread_mutex_unlock(&sim_lock);
+    }
+
+    usbredirsim_get_config(&config);
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return LIBUSB_ERROR_NO_MEM;
+
+    if (pipe(ctx->pipe)) {
+        free(ctx);
+        return LIBUSB_ERROR_OTHER;
+    }
+    fcntl(ctx->pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(ctx->pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(ctx->pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ctx->pipe[1], F_SETFD, FD_CLOEXEC);
+    ctx->pollfd.fd = ctx->pipe[0];
+    ctx->pollfd.events = POLLIN;
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    ctx->dev = sim_device_new(ctx, &config);
+    if (!ctx->dev) {
+        close(ctx->pipe[0]);
+        close(ctx->pipe[1]);
+        free(ctx);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    if (ctx_ret) {
+        *ctx_ret = ctx;
+    } else {
+        pthread_mutex_lock(&sim_lock);
+        default_ctx = ctx;
+        default_ctx_refcount = 1;
+        pthread_mutex_unlock(&sim_lock);
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+    if (!ctx) {
+        pthread_mutex_lock(&sim_lock);
+        if (!default_ctx || --default_ctx_refcount) {
+            pthread_mutex_unlock(&sim_lock);
+            return;
+        }
+        ctx = default_ctx;
+        default_ctx = NULL;
+        pthread_mutex_unlock(&sim_lock);
+    }
+
+    close(ctx->pipe[0]);
+    close(ctx->pipe[1]);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx->dev->fifo);
+    free(ctx->dev);
+    free(ctx);
+}
+
+void libusb_set_debug(libusb_context *ctx, int level)
+{
+}
+
+const char *libusb_error_name(int errcode)
+{
+    switch (errcode) {
+    case LIBUSB_SUCCESS:             return "LIBUSB_SUCCESS";
+    case LIBUSB_ERROR_IO:            return "LIBUSB_ERROR_IO";
+    case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+    case LIBUSB_ERROR_ACCESS:        return "LIBUSB_ERROR_ACCESS";
+    case LIBUSB_ERROR_NO_DEVICE:     return "LIBUSB_ERROR_NO_DEVICE";
+    case LIBUSB_ERROR_NOT_FOUND:     return "LIBUSB_ERROR_NOT_FOUND";
+    case LIBUSB_ERROR_BUSY:          return "LIBUSB_ERROR_BUSY";
+    case LIBUSB_ERROR_TIMEOUT:       return "LIBUSB_ERROR_TIMEOUT";
+    case LIBUSB_ERROR_OVERFLOW:      return "LIBUSB_ERROR_OVERFLOW";
+    case LIBUSB_ERROR_PIPE:          return "LIBUSB_ERROR_PIPE";
+    case LIBUSB_ERROR_INTERRUPTED:   return "LIBUSB_ERROR_INTERRUPTED";
+    case LIBUSB_ERROR_NO_MEM:        return "LIBUSB_ERROR_NO_MEM";
+    case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+    case LIBUSB_TRANSFER_ERROR:      return "LIBUSB_TRANSFER_ERROR";
+    case LIBUSB_TRANSFER_TIMED_OUT:  return "LIBUSB_TRANSFER_TIMED_OUT";
+    case LIBUSB_TRANSFER_CANCELLED:  return "LIBUSB_TRANSFER_CANCELLED";
+    case LIBUSB_TRANSFER_STALL:      return "LIBUSB_TRANSFER_STALL";
+    case LIBUSB_TRANSFER_NO_DEVICE:  return "LIBUSB_TRANSFER_NO_DEVICE";
+    case LIBUSB_TRANSFER_OVERFLOW:   return "LIBUSB_TRANSFER_OVERFLOW";
+    default:                         return "LIBUSB_ERROR_OTHER";
+    }
+}
+
+/****** Device enumeration and descriptors ******/
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    ctx = GET_CTX(ctx);
+
+    *list = calloc(2, sizeof(libusb_device *));
+    if (!*list)
+        return LIBUSB_ERROR_NO_MEM;
+
+    LOCK(ctx);
+    if (ctx->dev->disconnected) {
+        UNLOCK(ctx);
+        return 0;
+    }
+    (*list)[0] = ctx->dev;
+    ctx->dev->refcount++;
+    UNLOCK(ctx);
+    return 1;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+    int i;
+
+    if (!list)
+        return;
+
+    for (i = 0; unref_devices && list[i]; i++)
+        libusb_unref_device(list[i]);
+    free(list);
+}
+
+/* The device is owned by its context, so we only keep count */
+libusb_device *libusb_ref_device(libusb_device *dev)
+{
+    LOCK(dev->ctx);
+    dev->refcount++;
+    UNLOCK(dev->ctx);
+    return dev;
+}
+
+void libusb_unref_device(libusb_device *dev)
+{
+    LOCK(dev->ctx);
+    dev->refcount--;
+    UNLOCK(dev->ctx);
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+    return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+    return dev->address;
+}
+
+int libusb_get_device_speed(libusb_device *dev)
+{
+    return dev->config.speed;
+}
+
+int libusb_get_device_descriptor(libusb_device *dev,
+    struct libusb_device_descriptor *desc)
+{
+    *desc = dev->desc;
+    return LIBUSB_SUCCESS;
+}
+
+/* The returned config descriptor is a shallow copy, the interface
+   descriptors are owned by the device */
+int libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index,
+    struct libusb_config_descriptor **config)
+{
+    if (config_index != 0)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    *config = malloc(sizeof(**config));
+    if (!*config)
+        return LIBUSB_ERROR_NO_MEM;
+
+    **config = dev->config_desc;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_get_active_config_descriptor(libusb_device *dev,
+    struct libusb_config_descriptor **config)
+{
+    if (!dev->active_config)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    return libusb_get_config_descriptor(dev, 0, config);
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+    free(config);
+}
+
+int libusb_get_ss_endpoint_companion_descriptor(libusb_context *ctx,
+    const struct libusb_endpoint_descriptor *endpoint,
+    struct libusb_ss_endpoint_companion_descriptor **ep_comp)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+void libusb_free_ss_endpoint_companion_descriptor(
+    struct libusb_ss_endpoint_companion_descriptor *ep_comp)
+{
+    free(ep_comp);
+}
+
+/****** Device handles ******/
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle)
+{
+    if (dev->disconnected)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    *handle = calloc(1, sizeof(**handle));
+    if (!*handle)
+        return LIBUSB_ERROR_NO_MEM;
+
+    (*handle)->dev = libusb_ref_device(dev);
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_close(libusb_device_handle *handle)
+{
+    if (!handle)
+        return;
+
+    LOCK(handle->dev->ctx);
+    handle->dev->claimed = 0;
+    UNLOCK(handle->dev->ctx);
+    libusb_unref_device(handle->dev);
+    free(handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *handle)
+{
+    return handle->dev;
+}
+
+libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *ctx,
+    uint16_t vendor_id, uint16_t product_id)
+{
+    libusb_device_handle *handle;
+    libusb_device *dev;
+
+    ctx = GET_CTX(ctx);
+    dev = ctx->dev;
+    if (dev->desc.idVendor != vendor_id || dev->desc.idProduct != product_id)
+        return NULL;
+
+    if (libusb_open(dev, &handle) != LIBUSB_SUCCESS)
+        return NULL;
+
+    return handle;
+}
+
+/* Must be called with the ctx lock held */
+static int sim_set_configuration(libusb_device *dev, int configuration)
+{
+    if (dev->disconnected)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (dev->claimed)
+        return LIBUSB_ERROR_BUSY;
+    if (configuration != -1 && configuration != 0 &&
+            configuration != dev->config_desc.bConfigurationValue)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    dev->active_config = (configuration == 1);
+    dev->alt = 0;
+    sim_reset_endpoints(dev);
+    return LIBUSB_SUCCESS;
+}
+
+/* Must be called with the ctx lock held */
+static int sim_set_interface_alt_setting(libusb_device *dev,
+    int interface_number, int alternate_setting)
+{
+    if (dev->disconnected)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (!dev->active_config || interface_number != 0 ||
+            alternate_setting < 0 ||
+            alternate_setting >= dev->interface.num_altsetting)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    dev->alt = alternate_setting;
+    sim_reset_endpoints(dev);
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_get_configuration(libusb_device_handle *handle, int *config)
+{
+    *config = handle->dev->active_config;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_set_configuration(libusb_device_handle *handle, int configuration)
+{
+    libusb_device *dev = handle->dev;
+    int r;
+
+    sim_sync_delay(dev);
+    LOCK(dev->ctx);
+    r = sim_set_configuration(dev, configuration);
+    UNLOCK(dev->ctx);
+    return r;
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int interface_number)
+{
+    libusb_device *dev = handle->dev;
+    int r = LIBUSB_SUCCESS;
+
+    LOCK(dev->ctx);
+    if (dev->disconnected)
+        r = LIBUSB_ERROR_NO_DEVICE;
+    else if (!dev->active_config || interface_number != 0)
+        r = LIBUSB_ERROR_NOT_FOUND;
+    else
+        dev->claimed |= 1 << interface_number;
+    UNLOCK(dev->ctx);
+    return r;
+}
+
+int libusb_release_interface(libusb_device_handle *handle,
+                             int interface_number)
+{
+    libusb_device *dev = handle->dev;
+    int r = LIBUSB_SUCCESS;
+
+    LOCK(dev->ctx);
+    if (dev->disconnected)
+        r = LIBUSB_ERROR_NO_DEVICE;
+    else if (interface_number < 0 || interface_number >= 32 ||
+             !(dev->claimed & (1 << interface_number)))
+        r = LIBUSB_ERROR_NOT_FOUND;
+    else
+        dev->claimed &= ~(1 << interface_number);
+    UNLOCK(dev->ctx);
+    return r;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *handle,
+    int interface_number, int alternate_setting)
+{
+    libusb_device *dev = handle->dev;
+    int r;
+
+    sim_sync_delay(dev);
+    LOCK(dev->ctx);
+    if (interface_number < 0 || interface_number >= 32 ||
+            !(dev->claimed & (1 << interface_number)))
+        r = LIBUSB_ERROR_NOT_FOUND;
+    else
+        r = sim_set_interface_alt_setting(dev, interface_number,
+                                          alternate_setting);
+    UNLOCK(dev->ctx);
+    return r;
+}
+
+int libusb_clear_halt(libusb_device_handle *handle, unsigned char endpoint)
+{
+    libusb_device *dev = handle->dev;
+    int r = LIBUSB_SUCCESS;
+
+    sim_sync_delay(dev);
+    LOCK(dev->ctx);
+    if (dev->disconnected)
+        r = LIBUSB_ERROR_NO_DEVICE;
+    else if (!sim_find_endpoint(dev, endpoint))
+        r = LIBUSB_ERROR_NOT_FOUND;
+    else
+        dev->ep[EP2I(endpoint)].halted = 0;
+    UNLOCK(dev->ctx);
+    return r;
+}
+
+int libusb_reset_device(libusb_device_handle *handle)
+{
+    libusb_device *dev = handle->dev;
+    int r = LIBUSB_SUCCESS;
+
+    sim_sync_delay(dev);
+    LOCK(dev->ctx);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        dev->alt = 0;
+        sim_reset_endpoints(dev);
+    }
+    UNLOCK(dev->ctx);
+    return r;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *handle,
+                                int interface_number)
+{
+    return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *handle,
+                                int interface_number)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_attach_kernel_driver(libusb_device_handle *handle,
+                                int interface_number)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle *handle,
+                                         int enable)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_alloc_streams(libusb_device_handle *handle, uint32_t num_streams,
+    unsigned char *endpoints, int num_endpoints)
+{
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int libusb_free_streams(libusb_device_handle *handle,
+    unsigned char *endpoints, int num_endpoints)
+{
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/****** Transfer completion ******/
+
+static void sim_fill(libusb_device *dev, uint8_t ep, uint8_t *buf, int len)
+{
+    memset(buf, dev->ep[EP2I(ep)].seq++, len);
+}
+
+/* A minimal uvc payload header: bHeaderLength and bmHeaderInfo */
+static void sim_uvc_header(libusb_device *dev, uint8_t *buf)
+{
+    uint64_t frame = dev->uvc_packet / dev->config.uvc_frame_packets;
+
+    buf[0] = 2;
+    buf[1] = frame & 1; /* FID */
+    if (dev->uvc_packet % dev->config.uvc_frame_packets ==
+            (uint64_t)dev->config.uvc_frame_packets - 1)
+        buf[1] |= 0x02; /* EOF */
+    dev->uvc_packet++;
+}
+
+static int sim_get_string(libusb_device *dev, int index, uint8_t *buf)
+{
+    const char *str;
+    int i;
+
+    switch (index) {
+    case 0:
+        buf[0] = 4;
+        buf[1] = LIBUSB_DT_STRING;
+        buf[2] = 0x09;
+        buf[3] = 0x04;
+        return 4;
+    case 1:
+        str = "usbredir";
+        break;
+    case 2:
+        str = dev->product;
+        break;
+    case 3:
+        str = "0001";
+        break;
+    default:
+        return -1;
+    }
+
+    for (i = 0; str[i]; i++) {
+        buf[2 + 2 * i] = str[i];
+        buf[3 + 2 * i] = 0;
+    }
+    buf[0] = 2 + 2 * i;
+    buf[1] = LIBUSB_DT_STRING;
+    return buf[0];
+}
+
+static int sim_control(libusb_device *dev, struct libusb_transfer *transfer)
+{
+    struct libusb_control_setup *setup = (void *)transfer->buffer;
+    uint8_t *data = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+    int length = libusb_le16_to_cpu(setup->wLength);
+    int value = libusb_le16_to_cpu(setup->wValue);
+    const uint8_t *src = NULL;
+    uint8_t buf[128];
+    int r, src_len = 0;
+
+    transfer->actual_length = 0;
+
+    switch (setup->bmRequestType & 0x60) {
+    case LIBUSB_REQUEST_TYPE_STANDARD:
+        switch (setup->bRequest) {
+        case LIBUSB_REQUEST_GET_DESCRIPTOR:
+            switch (value >> 8) {
+            case LIBUSB_DT_DEVICE:
+                src = dev->raw_device;
+                src_len = sizeof(dev->raw_device);
+                break;
+            case LIBUSB_DT_CONFIG:
+                if ((value & 0xff) != 0)
+                    return LIBUSB_TRANSFER_STALL;
+                src = dev->raw_config;
+                src_len = dev->config_desc.wTotalLength;
+                break;
+            case LIBUSB_DT_STRING:
+                src_len = sim_get_string(dev, value & 0xff, buf);
+                if (src_len < 0)
+                    return LIBUSB_TRANSFER_STALL;
+                src = buf;
+                break;
+            case 0x22: /* HID report descriptor */
+                if (dev->config.device != usbredirsim_device_hid)
+                    return LIBUSB_TRANSFER_STALL;
+                src = hid_report_desc;
+                src_len = sizeof(hid_report_desc);
+                break;
+            default:
+                return LIBUSB_TRANSFER_STALL;
+            }
+            break;
+        case LIBUSB_REQUEST_GET_CONFIGURATION:
+            buf[0] = dev->active_config;
+            src = buf;
+            src_len = 1;
+            break;
+        case LIBUSB_REQUEST_GET_INTERFACE:
+            buf[0] = dev->alt;
+            src = buf;
+            src_len = 1;
+            break;
+        case LIBUSB_REQUEST_GET_STATUS:
+            buf[0] = buf[1] = 0;
+            if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT)
+                buf[0] = dev->ep[EP2I(setup->wIndex)].halted;
+            src = buf;
+            src_len = 2;
+            break;
+        case LIBUSB_REQUEST_SET_CONFIGURATION:
+            if (dev->claimed)
+                dev->claimed = 0;
+            r = sim_set_configuration(dev, value);
+            if (r != LIBUSB_SUCCESS)
+                return LIBUSB_TRANSFER_STALL;
+            break;
+        case LIBUSB_REQUEST_SET_INTERFACE:
+            r = sim_set_interface_alt_setting(dev, setup->wIndex, value);
+            if (r != LIBUSB_SUCCESS)
+                return LIBUSB_TRANSFER_STALL;
+            break;
+        case LIBUSB_REQUEST_CLEAR_FEATURE:
+            if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT &&
+                    value == 0)
+                dev->ep[EP2I(setup->wIndex)].halted = 0;
+            break;
+        case LIBUSB_REQUEST_SET_FEATURE:
+            break;
+        default:
+            return LIBUSB_TRANSFER_STALL;
+        }
+        break;
+    default:
+        /* Accept any class / vendor request, IN requests get a pattern */
+        if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+            sim_fill(dev, 0x80, data, length);
+            transfer->actual_length = length;
+            dev->stats.bytes_in += length;
+            return LIBUSB_TRANSFER_COMPLETED;
+        }
+    }
+
+    if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+        if (src_len > length)
+            src_len = length;
+        memcpy(data, src, src_len);
+        transfer->actual_length = src_len;
+        dev->stats.bytes_in += src_len;
+    } else {
+        transfer->actual_length = length;
+        dev->stats.bytes_out += length;
+    }
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+static int sim_bulk(libusb_device *dev, struct libusb_transfer *transfer)
+{
+    int n, len = transfer->length;
+    uint8_t *buf = transfer->buffer;
+
+    if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+        if (!dev->fifo || !dev->fifo_len) {
+            sim_fill(dev, transfer->endpoint, buf, len);
+            transfer->actual_length = len;
+            dev->stats.bytes_in += len;
+            return LIBUSB_TRANSFER_COMPLETED;
+        }
+        if (len > dev->fifo_len)
+            len = dev->fifo_len;
+        transfer->actual_length = len;
+        dev->stats.bytes_in += len;
+        while (len) {
+            n = SIM_FIFO_SIZE - dev->fifo_pos;
+            if (n > len)
+                n = len;
+            memcpy(buf, dev->fifo + dev->fifo_pos, n);
+            dev->fifo_pos = (dev->fifo_pos + n) % SIM_FIFO_SIZE;
+            dev->fifo_len -= n;
+            buf += n;
+            len -= n;
+        }
+    } else {
+        transfer->actual_length = len;
+        dev->stats.bytes_out += len;
+        /* When the fifo is full, the data is dropped */
+        if (dev->fifo && len > SIM_FIFO_SIZE - dev->fifo_len)
+            len = SIM_FIFO_SIZE - dev->fifo_len;
+        while (dev->fifo && len) {
+            int pos = (dev->fifo_pos + dev->fifo_len) % SIM_FIFO_SIZE;
+
+            n = SIM_FIFO_SIZE - pos;
+            if (n > len)
+                n = len;
+            memcpy(dev->fifo + pos, buf, n);
+            dev->fifo_len += n;
+            buf += n;
+            len -= n;
+        }
+    }
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+static int sim_interrupt(libusb_device *dev, struct libusb_transfer *transfer)
+{
+    uint8_t report[SIM_HID_REPORT_SIZE] = { 0, };
+    uint8_t seq;
+    int len = transfer->length;
+
+    if (!(transfer->endpoint & LIBUSB_ENDPOINT_IN)) {
+        transfer->actual_length = len;
+        dev->stats.bytes_out += len;
+        return LIBUSB_TRANSFER_COMPLETED;
+    }
+
+    /* Alternately press and release a key from a..z */
+    seq = dev->ep[EP2I(transfer->endpoint)].seq++;
+    if (seq & 1)
+        report[2] = 0x04 + (seq / 2) % 26;
+
+    if (len > SIM_HID_REPORT_SIZE)
+        len = SIM_HID_REPORT_SIZE;
+    memcpy(transfer->buffer, report, len);
+    transfer->actual_length = len;
+    dev->stats.bytes_in += len;
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+static int sim_iso(libusb_device *dev, struct libusb_transfer *transfer)
+{
+    uint8_t *buf = transfer->buffer;
+    int i, len;
+
+    transfer->actual_length = 0;
+    for (i = 0; i < transfer->num_iso_packets; i++) {
+        struct libusb_iso_packet_descriptor *pkt =
+            &transfer->iso_packet_desc[i];
+
+        dev->stats.iso_packets++;
+        if (sim_inject_error(dev)) {
+            pkt->status = dev->config.error_status;
+            pkt->actual_length = 0;
+            dev->stats.errors++;
+        } else if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+            len = pkt->length;
+            if (len > dev->config.iso_packet_len)
+                len = dev->config.iso_packet_len;
+            sim_fill(dev, transfer->endpoint, buf, len);
+            if (dev->config.uvc_frame_packets > 0 && len >= 2)
+                sim_uvc_header(dev, buf);
+            pkt->status = LIBUSB_TRANSFER_COMPLETED;
+            pkt->actual_length = len;
+            dev->stats.bytes_in += len;
+        } else {
+            pkt->status = LIBUSB_TRANSFER_COMPLETED;
+            pkt->actual_length = pkt->length;
+            dev->stats.bytes_out += pkt->length;
+        }
+        transfer->actual_length += pkt->actual_length;
+        buf += pkt->length;
+    }
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+/* Must be called with the ctx lock held */
+static void sim_complete(libusb_device *dev, struct usbredirsim_transfer *t)
+{
+    struct libusb_transfer *transfer = &t->transfer;
+    struct usbredirsim_ep *ep = &dev->ep[EP2I(transfer->endpoint)];
+    int status;
+
+    transfer->actual_length = 0;
+
+    if (t->state == sim_transfer_cancelled) {
+        status = LIBUSB_TRANSFER_CANCELLED;
+        dev->stats.cancelled++;
+    } else if (dev->disconnected) {
+        status = LIBUSB_TRANSFER_NO_DEVICE;
+    } else if (t->timed_out) {
+        status = LIBUSB_TRANSFER_TIMED_OUT;
+    } else if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        status = sim_iso(dev, transfer);
+    } else if (ep->halted && transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL) {
+        status = LIBUSB_TRANSFER_STALL;
+    } else if (sim_inject_error(dev)) {
+        status = dev->config.error_status;
+        if (status == LIBUSB_TRANSFER_STALL &&
+                transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL)
+            ep->halted = 1;
+    } else {
+        switch (transfer->type) {
+        case LIBUSB_TRANSFER_TYPE_CONTROL:
+            status = sim_control(dev, transfer);
+            break;
+        case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+            status = sim_interrupt(dev, transfer);
+            break;
+        default:
+            status = sim_bulk(dev, transfer);
+        }
+    }
+
+    if (status != LIBUSB_TRANSFER_COMPLETED &&
+            status != LIBUSB_TRANSFER_CANCELLED)
+        dev->stats.errors++;
+    dev->stats.completed++;
+    transfer->status = status;
+    t->state = sim_transfer_idle;
+}
+
+/* Synchronous control transfers, used by libusb_get_descriptor and friends */
+int libusb_control_transfer(libusb_device_handle *handle,
+    uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+    uint16_t wIndex, unsigned char *data, uint16_t wLength,
+    unsigned int timeout)
+{
+    libusb_device *dev = handle->dev;
+    struct libusb_transfer transfer;
+    unsigned char *buf;
+    int r, status;
+
+    buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+    if (!buf)
+        return LIBUSB_ERROR_NO_MEM;
+
+    libusb_fill_control_setup(buf, bmRequestType, bRequest, wValue, wIndex,
+                              wLength);
+    if (!(bmRequestType & LIBUSB_ENDPOINT_IN))
+        memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.dev_handle = handle;
+    transfer.type = LIBUSB_TRANSFER_TYPE_CONTROL;
+    transfer.buffer = buf;
+    transfer.length = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+
+    sim_sync_delay(dev);
+    LOCK(dev->ctx);
+    if (dev->disconnected)
+        status = LIBUSB_TRANSFER_NO_DEVICE;
+    else
+        status = sim_control(dev, &transfer);
+    UNLOCK(dev->ctx);
+
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        r = transfer.actual_length;
+        if (bmRequestType & LIBUSB_ENDPOINT_IN)
+            memcpy(data, buf + LIBUSB_CONTROL_SETUP_SIZE, r);
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        r = LIBUSB_ERROR_PIPE;
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        r = LIBUSB_ERROR_NO_DEVICE;
+        break;
+    default:
+        r = LIBUSB_ERROR_IO;
+    }
+    free(buf);
+    return r;
+}
+
+/****** Transfers ******/
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+    struct usbredirsim_transfer *t;
+
+    t = calloc(1, sizeof(*t) +
+                  iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+    if (!t)
+        return NULL;
+
+    t->transfer.num_iso_packets = iso_packets;
+    return &t->transfer;
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    if (!transfer)
+        return;
+
+    if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+        free(transfer->buffer);
+    free(SIM_TRANSFER(transfer));
+}
+
+void libusb_transfer_set_stream_id(struct libusb_transfer *transfer,
+                                   uint32_t stream_id)
+{
+    SIM_TRANSFER(transfer)->stream_id = stream_id;
+}
+
+uint32_t libusb_transfer_get_stream_id(struct libusb_transfer *transfer)
+{
+    return SIM_TRANSFER(transfer)->stream_id;
+}
+
+/* Must be called with the ctx lock held */
+static void sim_queue_transfer(libusb_context *ctx,
+                               struct usbredirsim_transfer *t)
+{
+    struct usbredirsim_transfer **prev = &ctx->pending;
+
+    while (*prev && (*prev)->deadline <= t->deadline)
+        prev = &(*prev)->next;
+    t->next = *prev;
+    *prev = t;
+
+    /* Wake up the event handling thread if the first deadline changed */
+    if (prev == &ctx->pending)
+        sim_wakeup(ctx);
+}
+
+/* Must be called with the ctx lock held */
+static void sim_unqueue_transfer(libusb_context *ctx,
+                                 struct usbredirsim_transfer *t)
+{
+    struct usbredirsim_transfer **prev = &ctx->pending;
+
+    while (*prev && *prev != t)
+        prev = &(*prev)->next;
+    if (*prev)
+        *prev = t->next;
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    struct usbredirsim_transfer *t = SIM_TRANSFER(transfer);
+    const struct libusb_endpoint_descriptor *endp = NULL;
+    libusb_device *dev = transfer->dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    struct usbredirsim_ep *ep;
+    uint64_t now, start, busy_until;
+    int type = transfer->type;
+
+    if (type == LIBUSB_TRANSFER_TYPE_BULK_STREAM)
+        type = LIBUSB_TRANSFER_TYPE_BULK;
+
+    LOCK(ctx);
+    if (t->state != sim_transfer_idle) {
+        UNLOCK(ctx);
+        return LIBUSB_ERROR_BUSY;
+    }
+    if (dev->config.disconnect_after &&
+            dev->stats.submitted >= dev->config.disconnect_after)
+        dev->disconnected = 1;
+    if (dev->disconnected) {
+        UNLOCK(ctx);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (type != LIBUSB_TRANSFER_TYPE_CONTROL) {
+        endp = sim_find_endpoint(dev, transfer->endpoint);
+        if (!endp) {
+            UNLOCK(ctx);
+            return LIBUSB_ERROR_NOT_FOUND;
+        }
+        if ((endp->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != type) {
+            UNLOCK(ctx);
+            return LIBUSB_ERROR_INVALID_PARAM;
+        }
+    }
+
+    /* Transfers on an ep are serialized, periodic transfers complete at
+       the rate of the ep's interval, bulk transfers at the bus rate */
+    now = sim_now();
+    ep = &dev->ep[EP2I(transfer->endpoint)];
+    start = (ep->busy_until > now) ? ep->busy_until : now;
+    switch (type) {
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+        busy_until = start +
+            (uint64_t)transfer->num_iso_packets * sim_ep_period(dev, endp);
+        break;
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+        busy_until = start + sim_ep_period(dev, endp);
+        break;
+    case LIBUSB_TRANSFER_TYPE_BULK:
+        busy_until = start + transfer->length / dev->bulk_rate;
+        break;
+    default:
+        busy_until = now;
+    }
+    t->deadline = busy_until + dev->config.latency;
+    t->timed_out = 0;
+    if (transfer->timeout &&
+            t->deadline > now + (uint64_t)transfer->timeout * 1000) {
+        t->deadline = now + (uint64_t)transfer->timeout * 1000;
+        t->timed_out = 1;
+    } else {
+        ep->busy_until = busy_until;
+    }
+
+    t->state = sim_transfer_submitted;
+    dev->stats.submitted++;
+    sim_queue_transfer(ctx, t);
+    UNLOCK(ctx);
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    struct usbredirsim_transfer *t = SIM_TRANSFER(transfer);
+    libusb_context *ctx = transfer->dev_handle->dev->ctx;
+
+    LOCK(ctx);
+    if (t->state != sim_transfer_submitted) {
+        UNLOCK(ctx);
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    /* Complete the transfer with a status of cancelled asap */
+    sim_unqueue_transfer(ctx, t);
+    t->state = sim_transfer_cancelled;
+    t->deadline = 0;
+    sim_queue_transfer(ctx, t);
+    UNLOCK(ctx);
+    return LIBUSB_SUCCESS;
+}
+
+/****** Event handling ******/
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+    struct timeval *tv, int *completed)
+{
+    struct usbredirsim_transfer *t, *done = NULL, **done_tail = &done;
+    struct pollfd pollfd;
+    struct timespec ts;
+    uint64_t now, timeout;
+    uint8_t buf[64];
+
+    ctx = GET_CTX(ctx);
+
+    timeout = (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+    LOCK(ctx);
+    now = sim_now();
+    if (ctx->pending) {
+        if (ctx->pending->deadline <= now)
+            timeout = 0;
+        else if (ctx->pending->deadline - now < timeout)
+            timeout = ctx->pending->deadline - now;
+    }
+    UNLOCK(ctx);
+
+    if (timeout && !(completed && *completed)) {
+        pollfd.fd = ctx->pipe[0];
+        pollfd.events = POLLIN;
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        ppoll(&pollfd, 1, &ts, NULL);
+    }
+    while (read(ctx->pipe[0], buf, sizeof(buf)) == sizeof(buf));
+
+    LOCK(ctx);
+    now = sim_now();
+    while (ctx->pending && ctx->pending->deadline <= now) {
+        t = ctx->pending;
+        ctx->pending = t->next;
+        sim_complete(ctx->dev, t);
+        t->next = NULL;
+        *done_tail = t;
+        done_tail = &t->next;
+    }
+    UNLOCK(ctx);
+
+    /* Call the callbacks without holding the lock, since they will likely
+       submit new transfers, or even free the transfer */
+    while (done) {
+        struct libusb_transfer *transfer = &done->transfer;
+        int free_transfer = transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER;
+
+        done = done->next;
+        if (transfer->callback)
+            transfer->callback(transfer);
+        if (free_transfer)
+            libusb_free_transfer(transfer);
+    }
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+    return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed)
+{
+    struct timeval tv = { 60, 0 };
+
+    return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+int libusb_handle_events(libusb_context *ctx)
+{
+    return libusb_handle_events_completed(ctx, NULL);
+}
+
+void libusb_interrupt_event_handler(libusb_context *ctx)
+{
+    sim_wakeup(GET_CTX(ctx));
+}
+
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+{
+    uint64_t now, timeout = 0;
+
+    ctx = GET_CTX(ctx);
+
+    LOCK(ctx);
+    if (!ctx->pending) {
+        UNLOCK(ctx);
+        return 0;
+    }
+    now = sim_now();
+    if (ctx->pending->deadline > now)
+        timeout = ctx->pending->deadline - now;
+    UNLOCK(ctx);
+
+    tv->tv_sec = timeout / 1000000;
+    tv->tv_usec = timeout % 1000000;
+    return 1;
+}
+
+/* The returned array and the pollfd are allocated in one go, so that
+   they can be freed with a single free() as older libusb versions need */
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx)
+{
+    struct {
+        const struct libusb_pollfd *list[2];
+        struct libusb_pollfd pollfd;
+    } *pollfds;
+
+    ctx = GET_CTX(ctx);
+
+    pollfds = malloc(sizeof(*pollfds));
+    if (!pollfds)
+        return NULL;
+
+    pollfds->pollfd = ctx->pollfd;
+    pollfds->list[0] = &pollfds->pollfd;
+    pollfds->list[1] = NULL;
+    return pollfds->list;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+    free(pollfds);
+}
+
+/* Our pollfd never changes, so the notifiers are never called */
+void libusb_set_pollfd_notifiers(libusb_context *ctx,
+    libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+    void *user_data)
+{
+}
+
+/****** API ******/
+
+void usbredirsim_get_stats(libusb_context *ctx,
+                           struct usbredirsim_stats *stats)
+{
+    ctx = GET_CTX(ctx);
+
+    LOCK(ctx);
+    *stats = ctx->dev->stats;
+    UNLOCK(ctx);
+}
+
+void usbredirsim_disconnect(libusb_context *ctx)
+{
+    struct usbredirsim_transfer *t;
+
+    ctx = GET_CTX(ctx);
+
+    LOCK(ctx);
+    ctx->dev->disconnected = 1;
+    /* Fail all pending transfers asap */
+    for (t = ctx->pending; t; t = t->next)
+        t->deadline = 0;
+    sim_wakeup(ctx);
+    UNLOCK(ctx);
+}
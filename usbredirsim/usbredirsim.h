@@ -0,0 +1,118 @@
+/* usbredirsim.h simulated usb devices behind the libusb API
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRSIM_H
+#define __USBREDIRSIM_H
+
+/* usbredirsim implements (the subset of) the libusb API used by usbredirhost
+   and usbredirserver on top of a simulated usb device, so that the host side
+   can be tested and benchmarked without any real usb hardware.
+
+   It can be used in 2 ways:
+   1) LD_PRELOAD the shared lib into an unmodified application, e.g.:
+      USBREDIRSIM_DEVICE=iso LD_PRELOAD=libusbredirsim.so usbredirserver 1209:0002
+   2) Link it into a test / benchmark program (before libusb) and configure
+      it through the API below.
+
+   Each libusb_context gets a single simulated device, which is created from
+   the configuration which is active at the time of libusb_init(). The default
+   configuration is taken from the following environment variables:
+
+   USBREDIRSIM_DEVICE              bulk (default), iso or hid
+   USBREDIRSIM_SPEED               low, full, high or super
+   USBREDIRSIM_LATENCY             completion latency in us for control and
+                                   bulk transfers
+   USBREDIRSIM_SYNC_LATENCY        latency in us of blocking calls like
+                                   libusb_set_configuration
+   USBREDIRSIM_ISO_MAX_PACKET_SIZE iso ep max packet size (incl. mult)
+   USBREDIRSIM_ISO_PACKET_LEN      bytes per (micro)frame send by the iso
+                                   source ep, this sets the iso stream rate
+   USBREDIRSIM_UVC_FRAME_PACKETS   make the iso device a uvc video streaming
+                                   interface, with a frame every n packets
+   USBREDIRSIM_INTERRUPT_INTERVAL  bInterval of the hid interrupt ep
+   USBREDIRSIM_ERROR_RATE          fail 1 in n transfers (iso: packets)
+   USBREDIRSIM_ERROR_STATUS        error, stall, timeout or overflow
+   USBREDIRSIM_DISCONNECT_AFTER    unplug the device after n transfers
+   USBREDIRSIM_SEED                seed for the error injection
+
+   The simulated devices are:
+   bulk: 1209:0001 vendor class device with a bulk OUT ep 0x01 and a bulk
+         IN ep 0x81. Data written to ep 0x01 is looped back to ep 0x81, when
+         there is no looped back data the IN ep returns a test pattern.
+   iso:  1209:0002 vendor class device with an iso IN (source) ep 0x82 and
+         an iso OUT (sink) ep 0x02 in interface 0 alt setting 1.
+         With USBREDIRSIM_UVC_FRAME_PACKETS set, the interface is a uvc
+         video streaming interface instead, and each IN packet starts with
+         a 2 byte uvc payload header, with the FID bit toggling per frame
+         and EOF set on the last packet of a frame.
+   hid:  1209:0003 boot keyboard with an interrupt IN ep 0x81, which sends
+         a report every interval.
+
+   All devices answer the standard requests on ep 0 and accept any vendor
+   request. */
+
+#include <stdint.h>
+#include <libusb.h>
+
+enum {
+    usbredirsim_device_bulk,
+    usbredirsim_device_iso,
+    usbredirsim_device_hid,
+};
+
+struct usbredirsim_config {
+    int device;              /* usbredirsim_device_* */
+    int speed;               /* LIBUSB_SPEED_*, 0 for the device default */
+    int latency;             /* in us */
+    int sync_latency;        /* in us */
+    int iso_max_packet_size;
+    int iso_packet_len;
+    int uvc_frame_packets;   /* 0 for a vendor class iso device */
+    int interrupt_interval;  /* 0 for the device default */
+    int error_rate;          /* 0 to disable error injection */
+    int error_status;        /* enum libusb_transfer_status */
+    int disconnect_after;    /* 0 to never disconnect */
+    unsigned int seed;
+};
+
+struct usbredirsim_stats {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t cancelled;
+    uint64_t errors;
+    uint64_t iso_packets;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+/* Get the current configuration, this starts with the defaults from the
+   environment */
+void usbredirsim_get_config(struct usbredirsim_config *config);
+
+/* Set the configuration used for devices created by subsequent libusb_init()
+   calls */
+void usbredirsim_set_config(const struct usbredirsim_config *config);
+
+/* Get the transfer statistics for the device of ctx */
+void usbredirsim_get_stats(libusb_context *ctx,
+                           struct usbredirsim_stats *stats);
+
+/* Simulate an unplug of the device of ctx, all pending and future transfers
+   will fail with LIBUSB_TRANSFER_NO_DEVICE */
+void usbredirsim_disconnect(libusb_context *ctx);
+
+#endif
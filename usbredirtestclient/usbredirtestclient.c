@@ -32,9 +32,11 @@
 #include <poll.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include "usbredirparser.h"
@@ -45,9 +47,18 @@
 
 #define TESTCLIENT_VERSION "usbredirtestclient " PACKAGE_VERSION
 
+/* Max number of outstanding requests in load mode */
+#define MAX_LOAD_DEPTH 256
+#define MAX_LOAD_ARGS 9
+
+static void usbredirtestclient_hello(void *priv,
+    struct usb_redir_hello_header *hello);
 static void usbredirtestclient_device_connect(void *priv,
     struct usb_redir_device_connect_header *device_connect);
 static void usbredirtestclient_device_disconnect(void *priv);
+static void usbredirtestclient_descriptors(void *priv,
+    struct usb_redir_descriptors_header *descriptors,
+    uint8_t *data, int data_len);
 static void usbredirtestclient_interface_info(void *priv,
     struct usb_redir_interface_info_header *interface_info);
 static void usbredirtestclient_ep_info(void *priv,
@@ -74,6 +85,14 @@ static void usbredirtestclient_iso_packet(void *priv, uint64_t id,
 static void usbredirtestclient_interrupt_packet(void *priv, uint64_t id,
     struct usb_redir_interrupt_packet_header *interrupt_packet,
     uint8_t *data, int data_len);
+static void usbredirtestclient_bulk_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_receiving_status_header *bulk_receiving_status);
+static void usbredirtestclient_buffered_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
+    uint8_t *data, int data_len);
+static void usbredirtestclient_cmdline_parse(void);
+static void usbredirtestclient_load_next(void);
+static void usbredirtestclient_load_print(void);
 
 /* id's for all the test commands we send */
 enum {
@@ -85,14 +104,84 @@ enum {
    first_cmdline_id
 };
 
+/* Load mode commands */
+enum {
+    load_ctrl,
+    load_bulk,
+    load_interrupt,
+    load_iso,
+    load_bulk_receiving,
+    load_alt,
+    load_sleep,
+};
+
+static const struct {
+    const char *name;
+    int type;
+    int arg_count;
+    const char *args;
+} load_cmd_info[] = {
+    { "ctrl", load_ctrl, 9, "<count> <rate> <depth> <endpoint> <request> "
+                            "<request_type> <value> <index> <length>" },
+    { "bulk", load_bulk, 5, "<count> <rate> <depth> <endpoint> <length>" },
+    { "interrupt", load_interrupt, 2, "<seconds> <endpoint>" },
+    { "iso", load_iso, 4, "<seconds> <endpoint> <pkts_per_urb> <no_urbs>" },
+    { "bulk-receiving", load_bulk_receiving, 4,
+      "<seconds> <endpoint> <bytes_per_transfer> <no_transfers>" },
+    { "alt", load_alt, 2, "<interface> <alt>" },
+    { "sleep", load_sleep, 1, "<ms>" },
+};
+#define LOAD_CMD_INFO_COUNT \
+    (int)(sizeof(load_cmd_info) / sizeof(load_cmd_info[0]))
+
+struct load_cmd {
+    char *text;
+    int type;
+    long args[MAX_LOAD_ARGS];
+};
+
+/* State of the currently running load command */
+struct load_state {
+    struct load_cmd *cmd;
+    int skipped;
+    uint64_t start_time;
+    uint64_t end_time;
+    uint64_t cpu_time;
+    /* Requests (ctrl / bulk) */
+    uint64_t count;
+    uint64_t first_id;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t submit_time[MAX_LOAD_DEPTH];
+    uint8_t *data;
+    /* Streams (interrupt / iso / bulk-receiving) */
+    uint64_t packets;
+    uint64_t expected_id;
+    uint64_t last_time;
+    uint64_t drops;
+    int stream_started;
+    /* Results */
+    uint64_t bytes;
+    uint64_t errors;
+    uint32_t *latencies;
+    uint64_t latency_count;
+    uint64_t latency_size;
+};
+
 static int verbose = usbredirparser_info; /* 2 */
 static int client_fd, running = 1;
 static struct usbredirparser *parser;
 static int id = first_cmdline_id;
+static struct load_cmd *load_cmds;
+static int load_cmd_count, load_cmd_index, load_failed;
+static struct load_state load;
+static uint8_t ep_type[32];
 
 static const struct option longopts[] = {
     { "port", required_argument, NULL, 'p' },
     { "verbose", required_argument, NULL, 'v' },
+    { "script", required_argument, NULL, 's' },
+    { "command", required_argument, NULL, 'c' },
     { "help", no_argument, NULL, 'h' },
     { NULL, 0, NULL, 0 }
 };
@@ -136,15 +225,169 @@ static int usbredirtestclient_write(void *priv, uint8_t *data, int count)
 
 static void usage(int exit_code, char *argv0)
 {
-    fprintf(exit_code? stderr:stdout,
-        "Usage: %s [-p|--port <port>] [-v|--verbose <0-3>] <server>\n",
+    FILE *f = exit_code? stderr:stdout;
+    int i;
+
+    fprintf(f,
+        "Usage: %s [-p|--port <port>] [-v|--verbose <0-3>]\n"
+        "          [-s|--script <file>] [-c|--command <load-command>] <server>\n"
+        "\n"
+        "With --script and / or --command the testclient runs in load mode,\n"
+        "it runs the given load commands (one per line in the script) one\n"
+        "after the other, prints their results and then exits. Commands:\n",
         argv0);
+    for (i = 0; i < LOAD_CMD_INFO_COUNT; i++)
+        fprintf(f, "  %s %s\n", load_cmd_info[i].name, load_cmd_info[i].args);
+    fprintf(f,
+        "ctrl and bulk send count requests at rate requests per second\n"
+        "(0 for as fast as possible) with at most depth (max %d) requests\n"
+        "outstanding and report the round trip latency per request. The\n"
+        "stream commands receive from endpoint for the given number of\n"
+        "seconds and report the packet inter-arrival time.\n",
+        MAX_LOAD_DEPTH);
     exit(exit_code);
 }
 
+static uint64_t usbredirtestclient_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t usbredirtestclient_cpu_time(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int usbredirtestclient_load_parse(char *line, struct load_cmd *cmd)
+{
+    char *arg, *endptr, *saveptr;
+    int i, j;
+
+    cmd->text = strdup(line);
+    if (!cmd->text) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+
+    arg = strtok_r(line, " \t\n", &saveptr);
+    for (i = 0; i < LOAD_CMD_INFO_COUNT; i++) {
+        if (!strcmp(arg, load_cmd_info[i].name))
+            break;
+    }
+    if (i == LOAD_CMD_INFO_COUNT) {
+        fprintf(stderr, "Unknown load command: '%s'\n", arg);
+        return -1;
+    }
+    cmd->type = load_cmd_info[i].type;
+
+    for (j = 0; j < load_cmd_info[i].arg_count; j++) {
+        arg = strtok_r(NULL, " \t\n", &saveptr);
+        if (arg)
+            cmd->args[j] = strtol(arg, &endptr, 0);
+        if (!arg || *endptr != '\0' || cmd->args[j] < 0) {
+            fprintf(stderr, "Missing or invalid argument %d for: '%s'\n"
+                    "Usage: %s %s\n", j + 1, cmd->text,
+                    load_cmd_info[i].name, load_cmd_info[i].args);
+            return -1;
+        }
+    }
+    if (strtok_r(NULL, " \t\n", &saveptr)) {
+        fprintf(stderr, "Excess arguments for: '%s'\n", cmd->text);
+        return -1;
+    }
+    if ((cmd->type == load_ctrl || cmd->type == load_bulk) &&
+            (cmd->args[2] < 1 || cmd->args[2] > MAX_LOAD_DEPTH)) {
+        fprintf(stderr, "depth must be between 1 and %d: '%s'\n",
+                MAX_LOAD_DEPTH, cmd->text);
+        return -1;
+    }
+    return 0;
+}
+
+static int usbredirtestclient_load_add(const char *text)
+{
+    struct load_cmd *cmds;
+    char line[256];
+
+    /* Skip empty lines and comments */
+    text += strspn(text, " \t\n");
+    if (*text == '\0' || *text == '#')
+        return 0;
+
+    cmds = realloc(load_cmds, (load_cmd_count + 1) * sizeof(*cmds));
+    if (!cmds) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    load_cmds = cmds;
+
+    snprintf(line, sizeof(line), "%s", text);
+    line[strcspn(line, "\n")] = '\0';
+    if (usbredirtestclient_load_parse(line, &load_cmds[load_cmd_count]))
+        return -1;
+    load_cmd_count++;
+    return 0;
+}
+
+static int usbredirtestclient_load_script(const char *filename)
+{
+    char line[256];
+    FILE *f;
+    int r = 0;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Error opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    while (r == 0 && fgets(line, sizeof(line), f))
+        r = usbredirtestclient_load_add(line);
+    fclose(f);
+    return r;
+}
+
+/* How long till the load mode needs to do something without any
+   packets getting received, in us */
+static uint64_t usbredirtestclient_load_timeout(void)
+{
+    uint64_t now, next;
+    long rate;
+
+    if (!load.cmd)
+        return 100000;
+
+    switch (load.cmd->type) {
+    case load_ctrl:
+    case load_bulk:
+        rate = load.cmd->args[1];
+        if (load.submitted == load.count ||
+                load.submitted - load.completed >= load.cmd->args[2])
+            return 100000; /* Waiting for completions */
+        if (rate == 0)
+            return 0;
+        next = load.start_time + load.submitted * 1000000 / rate;
+        break;
+    default:
+        next = load.end_time;
+    }
+    now = usbredirtestclient_now();
+    return (next > now) ? next - now : 0;
+}
+
+static void usbredirtestclient_load_tick(void);
+
 static void run_main_loop(void)
 {
     fd_set readfds, writefds;
+    struct timeval tv, *timeout;
+    uint64_t t;
     int n, nfds;
 
     while (running && client_fd != -1) {
@@ -157,7 +400,15 @@ static void run_main_loop(void)
         }
         nfds = client_fd + 1;
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        timeout = NULL;
+        if (load_cmd_count) {
+            t = usbredirtestclient_load_timeout();
+            tv.tv_sec = t / 1000000;
+            tv.tv_usec = t % 1000000;
+            timeout = &tv;
+        }
+
+        n = select(nfds, &readfds, &writefds, NULL, timeout);
         if (n == -1) {
             if (errno == EINTR) {
                 continue;
@@ -171,11 +422,15 @@ static void run_main_loop(void)
                 break;
             }
         }
-        if (FD_ISSET(client_fd, &writefds)) {
+        /* Note client_fd gets set to -1 when the server disconnects */
+        if (client_fd != -1 && FD_ISSET(client_fd, &writefds)) {
             if (usbredirparser_do_write(parser)) {
                 break;
             }
         }
+        if (load_cmd_count && client_fd != -1) {
+            usbredirtestclient_load_tick();
+        }
     }
     if (client_fd != -1) { /* Broken out of the loop because of an error ? */
         close(client_fd);
@@ -196,8 +451,9 @@ int main(int argc, char *argv[])
     struct sigaction act;
     char port_str[16];
     int port = 4000;
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
 
-    while ((o = getopt_long(argc, argv, "hp:", longopts, NULL)) != -1) {
+    while ((o = getopt_long(argc, argv, "hp:v:s:c:", longopts, NULL)) != -1) {
         switch (o) {
         case 'p':
             port = strtol(optarg, &endptr, 10);
@@ -213,6 +469,14 @@ int main(int argc, char *argv[])
                 usage(1, argv[0]);
             }
             break;
+        case 's':
+            if (usbredirtestclient_load_script(optarg))
+                exit(1);
+            break;
+        case 'c':
+            if (usbredirtestclient_load_add(optarg))
+                exit(1);
+            break;
         case '?':
         case 'h':
             usage(o == '?', argv[0]);
@@ -284,6 +548,7 @@ int main(int argc, char *argv[])
     parser->log_func = usbredirtestclient_log;
     parser->read_func = usbredirtestclient_read;
     parser->write_func = usbredirtestclient_write;
+    parser->hello_func = usbredirtestclient_hello;
     parser->device_connect_func = usbredirtestclient_device_connect;
     parser->device_disconnect_func = usbredirtestclient_device_disconnect;
     parser->interface_info_func = usbredirtestclient_interface_info;
@@ -297,16 +562,29 @@ int main(int argc, char *argv[])
     parser->bulk_packet_func = usbredirtestclient_bulk_packet;
     parser->iso_packet_func = usbredirtestclient_iso_packet;
     parser->interrupt_packet_func = usbredirtestclient_interrupt_packet;
-    usbredirparser_init(parser, TESTCLIENT_VERSION, NULL, 0, 0);
-
-    /* Queue a reset + set config the other test commands will be send in
-       response to the status packets of previous commands */
-    usbredirparser_send_reset(parser);
-    usbredirparser_send_get_configuration(parser, get_config_id);
+    parser->bulk_receiving_status_func = usbredirtestclient_bulk_receiving_status;
+    parser->buffered_bulk_packet_func = usbredirtestclient_buffered_bulk_packet;
+    parser->descriptors_func = usbredirtestclient_descriptors;
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_descriptors);
+    /* Coalesced interrupt reports get split up by the parser, as we don't
+       set coalesced_interrupt_packet_func */
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_coalesced_interrupt);
+    usbredirparser_init(parser, TESTCLIENT_VERSION, caps, USB_REDIR_CAPS_SIZE,
+                        0);
 
     run_main_loop();
 
-    exit(0);
+    /* Interrupted, or the connection was lost, print what we have */
+    if (load.cmd && !load.skipped) {
+        usbredirtestclient_load_print();
+        load_failed = 1;
+    }
+
+    exit(load_failed);
 }
 
 static void usbredirtestclient_cmdline_help(void)
@@ -444,6 +722,407 @@ static void usbredirtestclient_cmdline_parse(void)
     }
 }
 
+static void usbredirtestclient_load_add_latency(uint64_t latency)
+{
+    if (load.latency_count == load.latency_size) {
+        uint64_t size = load.latency_size ? load.latency_size * 2 : 4096;
+        uint32_t *latencies;
+
+        latencies = realloc(load.latencies, size * sizeof(uint32_t));
+        if (!latencies) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        load.latencies = latencies;
+        load.latency_size = size;
+    }
+    load.latencies[load.latency_count++] = latency;
+}
+
+static int usbredirtestclient_cmp_latency(const void *a, const void *b)
+{
+    uint32_t l1 = *(const uint32_t *)a, l2 = *(const uint32_t *)b;
+
+    return (l1 > l2) - (l1 < l2);
+}
+
+static uint32_t usbredirtestclient_load_percentile(int permille)
+{
+    uint64_t i;
+
+    if (!load.latency_count)
+        return 0;
+
+    i = load.latency_count * permille / 1000;
+    if (i >= load.latency_count)
+        i = load.latency_count - 1;
+    return load.latencies[i];
+}
+
+static void usbredirtestclient_load_print(void)
+{
+    uint64_t now = usbredirtestclient_now();
+    uint64_t cpu_time = usbredirtestclient_cpu_time() - load.cpu_time;
+    double secs = (now - load.start_time) / 1e6;
+    uint64_t done;
+    const char *what;
+
+    switch (load.cmd->type) {
+    case load_ctrl:
+    case load_bulk:
+        done = load.completed;
+        what = "request";
+        break;
+    case load_interrupt:
+    case load_iso:
+    case load_bulk_receiving:
+        done = load.packets;
+        what = "packet";
+        break;
+    default:
+        return;
+    }
+
+    qsort(load.latencies, load.latency_count, sizeof(uint32_t),
+          usbredirtestclient_cmp_latency);
+
+    printf("%s\n", load.cmd->text);
+    printf("  %"PRIu64" %ss in %.2f s: %.0f/s, %.2f MB/s, %"PRIu64
+           " errors, %"PRIu64" dropped\n", done, what, secs,
+           secs > 0 ? done / secs : 0.0,
+           secs > 0 ? load.bytes / secs / 1e6 : 0.0,
+           load.errors, load.drops);
+    printf("  cpu: %.1f%%, %.2f us per %s\n",
+           secs > 0 ? cpu_time / (secs * 1e4) : 0.0,
+           done ? (double)cpu_time / done : 0.0, what);
+    printf("  %-14s %8s %8s %8s %8s %8s %8s\n",
+           load.cmd->type <= load_bulk ? "latency us" : "interval us",
+           "min", "p50", "p90", "p99", "p99.9", "max");
+    printf("  %-14s %8u %8u %8u %8u %8u %8u\n", "",
+           usbredirtestclient_load_percentile(0),
+           usbredirtestclient_load_percentile(500),
+           usbredirtestclient_load_percentile(900),
+           usbredirtestclient_load_percentile(990),
+           usbredirtestclient_load_percentile(999),
+           usbredirtestclient_load_percentile(1000));
+    fflush(stdout);
+}
+
+static void usbredirtestclient_load_submit(void)
+{
+    struct load_cmd *cmd = load.cmd;
+    uint64_t req_id = id++;
+
+    load.submit_time[(req_id - load.first_id) % MAX_LOAD_DEPTH] =
+        usbredirtestclient_now();
+    load.submitted++;
+
+    if (cmd->type == load_ctrl) {
+        struct usb_redir_control_packet_header control_packet = {
+            .endpoint    = cmd->args[3],
+            .request     = cmd->args[4],
+            .requesttype = cmd->args[5],
+            .value       = cmd->args[6],
+            .index       = cmd->args[7],
+            .length      = cmd->args[8],
+        };
+        usbredirparser_send_control_packet(parser, req_id, &control_packet,
+            (control_packet.endpoint & 0x80) ? NULL : load.data,
+            (control_packet.endpoint & 0x80) ? 0 : control_packet.length);
+    } else {
+        struct usb_redir_bulk_packet_header bulk_packet = {
+            .endpoint    = cmd->args[3],
+            .length      = cmd->args[4],
+            .length_high = cmd->args[4] >> 16,
+        };
+        usbredirparser_send_bulk_packet(parser, req_id, &bulk_packet,
+            (bulk_packet.endpoint & 0x80) ? NULL : load.data,
+            (bulk_packet.endpoint & 0x80) ? 0 : cmd->args[4]);
+    }
+}
+
+static void usbredirtestclient_load_stop_stream(void)
+{
+    struct load_cmd *cmd = load.cmd;
+
+    if (!load.stream_started)
+        return;
+
+    switch (cmd->type) {
+    case load_interrupt: {
+        struct usb_redir_stop_interrupt_receiving_header stop = {
+            .endpoint = cmd->args[1],
+        };
+        usbredirparser_send_stop_interrupt_receiving(parser, id++, &stop);
+        break;
+    }
+    case load_iso: {
+        struct usb_redir_stop_iso_stream_header stop = {
+            .endpoint = cmd->args[1],
+        };
+        usbredirparser_send_stop_iso_stream(parser, id++, &stop);
+        break;
+    }
+    case load_bulk_receiving: {
+        struct usb_redir_stop_bulk_receiving_header stop = {
+            .endpoint = cmd->args[1],
+        };
+        usbredirparser_send_stop_bulk_receiving(parser, id++, &stop);
+        break;
+    }
+    }
+    load.stream_started = 0;
+}
+
+/* The server silently ignores streams started on an endpoint of the wrong
+   type, so check this ourselves */
+static int usbredirtestclient_load_check_ep(struct load_cmd *cmd)
+{
+    static const struct {
+        int cmd_type;
+        int ep_arg;
+        uint8_t ep_type;
+    } checks[] = {
+        { load_bulk, 3, usb_redir_type_bulk },
+        { load_interrupt, 1, usb_redir_type_interrupt },
+        { load_iso, 1, usb_redir_type_iso },
+        { load_bulk_receiving, 1, usb_redir_type_bulk },
+    };
+    int i;
+
+    for (i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+        if (checks[i].cmd_type != cmd->type)
+            continue;
+        if (ep_type[EP2I(cmd->args[checks[i].ep_arg])] == checks[i].ep_type)
+            return 0;
+        fprintf(stderr, "%s: endpoint %02lX is not of type %d\n", cmd->text,
+                cmd->args[checks[i].ep_arg], (int)checks[i].ep_type);
+        load_failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void usbredirtestclient_load_start(struct load_cmd *cmd)
+{
+    long length = 0;
+
+    free(load.latencies);
+    memset(&load, 0, sizeof(load));
+    load.cmd = cmd;
+    load.first_id = id;
+    load.start_time = usbredirtestclient_now();
+    load.cpu_time = usbredirtestclient_cpu_time();
+
+    if (usbredirtestclient_load_check_ep(cmd)) {
+        /* Skip the command, load_tick will move on to the next one */
+        load.skipped = 1;
+        load.end_time = load.start_time;
+        return;
+    }
+
+    switch (cmd->type) {
+    case load_ctrl:
+        length = cmd->args[8];
+        /* Fall through */
+    case load_bulk:
+        if (cmd->type == load_bulk)
+            length = cmd->args[4];
+        load.count = cmd->args[0];
+        load.data = calloc(1, length ? length : 1);
+        if (!load.data) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        break;
+    case load_interrupt: {
+        struct usb_redir_start_interrupt_receiving_header start = {
+            .endpoint = cmd->args[1],
+        };
+        usbredirparser_send_start_interrupt_receiving(parser, id++, &start);
+        load.stream_started = 1;
+        break;
+    }
+    case load_iso: {
+        struct usb_redir_start_iso_stream_header start = {
+            .endpoint = cmd->args[1],
+            .pkts_per_urb = cmd->args[2],
+            .no_urbs = cmd->args[3],
+        };
+        usbredirparser_send_start_iso_stream(parser, id++, &start);
+        load.stream_started = 1;
+        break;
+    }
+    case load_bulk_receiving: {
+        struct usb_redir_start_bulk_receiving_header start = {
+            .endpoint = cmd->args[1],
+            .bytes_per_transfer = cmd->args[2],
+            .no_transfers = cmd->args[3],
+        };
+        if (!usbredirparser_peer_has_cap(parser,
+                                         usb_redir_cap_bulk_receiving)) {
+            fprintf(stderr, "%s: server does not support bulk receiving\n",
+                    cmd->text);
+            load_failed = 1;
+            load.skipped = 1;
+            load.end_time = load.start_time;
+            break;
+        }
+        usbredirparser_send_start_bulk_receiving(parser, id++, &start);
+        load.stream_started = 1;
+        break;
+    }
+    case load_alt: {
+        struct usb_redir_set_alt_setting_header set_alt = {
+            .interface = cmd->args[0],
+            .alt = cmd->args[1],
+        };
+        usbredirparser_send_set_alt_setting(parser, id++, &set_alt);
+        break;
+    }
+    case load_sleep:
+        load.end_time = load.start_time + cmd->args[0] * 1000;
+        return;
+    }
+    if (cmd->type >= load_interrupt && cmd->type <= load_bulk_receiving &&
+            load.stream_started)
+        load.end_time = load.start_time + cmd->args[0] * 1000000;
+}
+
+/* Finish the current load command (if any) and start the next one */
+static void usbredirtestclient_load_next(void)
+{
+    if (load.cmd) {
+        usbredirtestclient_load_stop_stream();
+        if (!load.skipped)
+            usbredirtestclient_load_print();
+        free(load.data);
+        load.data = NULL;
+        load.cmd = NULL;
+    }
+
+    /* When all commands are done usbredirtestclient_load_tick() will
+       disconnect once any queued packets have been written */
+    if (load_cmd_index == load_cmd_count)
+        return;
+
+    usbredirtestclient_load_start(&load_cmds[load_cmd_index++]);
+    usbredirtestclient_load_tick();
+}
+
+static void usbredirtestclient_load_tick(void)
+{
+    struct load_cmd *cmd = load.cmd;
+    uint64_t now;
+
+    if (!cmd) {
+        if (load_cmd_index == load_cmd_count &&
+                !usbredirparser_has_data_to_write(parser)) {
+            close(client_fd);
+            client_fd = -1;
+        }
+        return;
+    }
+
+    switch (cmd->type) {
+    case load_ctrl:
+    case load_bulk:
+        while (load.submitted < load.count &&
+               load.submitted - load.completed < cmd->args[2]) {
+            if (cmd->args[1] && load.start_time +
+                    load.submitted * 1000000 / cmd->args[1] >
+                    usbredirtestclient_now())
+                break;
+            usbredirtestclient_load_submit();
+        }
+        if (load.completed == load.count)
+            usbredirtestclient_load_next();
+        break;
+    case load_interrupt:
+    case load_iso:
+    case load_bulk_receiving:
+    case load_sleep:
+        now = usbredirtestclient_now();
+        if (now >= load.end_time)
+            usbredirtestclient_load_next();
+        break;
+    }
+}
+
+static void usbredirtestclient_load_request_done(uint64_t req_id,
+    int type, int status, int data_len)
+{
+    uint64_t now = usbredirtestclient_now();
+
+    if (!load.cmd || load.cmd->type != type || req_id < load.first_id ||
+            req_id >= load.first_id + load.submitted) {
+        fprintf(stderr, "Unexpected packet, id: %"PRIu64"\n", req_id);
+        return;
+    }
+
+    usbredirtestclient_load_add_latency(now -
+        load.submit_time[(req_id - load.first_id) % MAX_LOAD_DEPTH]);
+    load.completed++;
+    if (status != usb_redir_success)
+        load.errors++;
+    if (type == load_ctrl)
+        load.bytes += load.cmd->args[8];
+    else
+        load.bytes += (load.cmd->args[3] & 0x80) ? data_len :
+                                                   load.cmd->args[4];
+}
+
+/* For streams we record the inter-arrival time, and use gaps in the packet
+   ids to detect packets dropped by the server */
+static void usbredirtestclient_load_stream_packet(uint64_t pkt_id, int type,
+    int status, int data_len)
+{
+    uint64_t now = usbredirtestclient_now();
+
+    /* Ignore packets which were in flight when we stopped the stream */
+    if (!load.cmd || load.cmd->type != type || !load.stream_started)
+        return;
+
+    if (load.packets)
+        usbredirtestclient_load_add_latency(now - load.last_time);
+    else
+        load.expected_id = pkt_id;
+    load.last_time = now;
+
+    if (pkt_id > load.expected_id)
+        load.drops += pkt_id - load.expected_id;
+    load.expected_id = pkt_id + 1;
+    if (status != usb_redir_success)
+        load.errors++;
+    load.packets++;
+    load.bytes += data_len;
+}
+
+static void usbredirtestclient_load_stream_status(const char *what,
+    uint8_t endpoint, int status)
+{
+    if (status == usb_redir_success || status == usb_redir_stall)
+        return;
+
+    fprintf(stderr, "%s ep %02X status: %d\n", what, endpoint, status);
+    if (load.cmd && load.stream_started && load.cmd->args[1] == endpoint) {
+        load_failed = 1;
+        load.stream_started = 0;
+        usbredirtestclient_load_next();
+    }
+}
+
+static void usbredirtestclient_hello(void *priv,
+    struct usb_redir_hello_header *hello)
+{
+    /* Queue a reset + set config the other test commands will be send in
+       response to the status packets of previous commands. This must be done
+       after receiving the hello, as the header size depends on the peer's
+       64 bits ids cap */
+    usbredirparser_send_reset(parser);
+    usbredirparser_send_get_configuration(parser, get_config_id);
+}
+
 static void usbredirtestclient_device_connect(void *priv,
     struct usb_redir_device_connect_header *device_connect)
 {
@@ -462,6 +1141,23 @@ static void usbredirtestclient_device_connect(void *priv,
            device_connect->vendor_id, device_connect->product_id);
 }
 
+static void usbredirtestclient_descriptors(void *priv,
+    struct usb_redir_descriptors_header *descriptors,
+    uint8_t *data, int data_len)
+{
+    struct usb_redir_descriptor_entry *entry;
+    int pos = 0;
+
+    printf("descriptors: %u, %d bytes\n", descriptors->count, data_len);
+    while (pos < data_len) {
+        entry = (struct usb_redir_descriptor_entry *)(data + pos);
+        printf("  type %02x index %3d langid %04x length %d\n",
+               entry->type, entry->index, entry->langid, entry->length);
+        pos += sizeof(*entry) + entry->length;
+    }
+    usbredirparser_free_packet_data(parser, data);
+}
+
 static void usbredirtestclient_device_disconnect(void *priv)
 {
     printf("device disconnected");
@@ -486,6 +1182,7 @@ static void usbredirtestclient_ep_info(void *priv,
 {
     int i;
 
+    memcpy(ep_type, ep_info->type, sizeof(ep_type));
     for (i = 0; i < 32; i++) {
        if (ep_info->type[i] != usb_redir_type_invalid) {
            printf("endpoint: %02X, type: %d, interval: %d, interface: %d\n",
@@ -539,10 +1236,23 @@ static void usbredirtestclient_alt_setting_status(void *priv, uint64_t id,
         printf("Set alt: %d, interface: %d, status: %d\n",
                alt_setting_status->alt, alt_setting_status->interface,
                alt_setting_status->status);
-        /* Auto tests done, go interactive */
-        usbredirtestclient_cmdline_parse();
+        /* Auto tests done, go interactive or start the load commands */
+        if (load_cmd_count)
+            usbredirtestclient_load_next();
+        else
+            usbredirtestclient_cmdline_parse();
         break;
     default:
+        if (load.cmd && load.cmd->type == load_alt &&
+                id == load.first_id) {
+            if (alt_setting_status->status != usb_redir_success) {
+                fprintf(stderr, "%s: status %d\n", load.cmd->text,
+                        alt_setting_status->status);
+                load_failed = 1;
+            }
+            usbredirtestclient_load_next();
+            break;
+        }
         fprintf(stderr, "Unexpected alt status packet, id: %"PRIu64"\n", id);
     }
 }
@@ -550,11 +1260,16 @@ static void usbredirtestclient_alt_setting_status(void *priv, uint64_t id,
 static void usbredirtestclient_iso_stream_status(void *priv, uint64_t id,
     struct usb_redir_iso_stream_status_header *iso_stream_status)
 {
+    usbredirtestclient_load_stream_status("iso stream",
+        iso_stream_status->endpoint, iso_stream_status->status);
 }
 
 static void usbredirtestclient_interrupt_receiving_status(void *priv, uint64_t id,
     struct usb_redir_interrupt_receiving_status_header *interrupt_receiving_status)
 {
+    usbredirtestclient_load_stream_status("interrupt receiving",
+        interrupt_receiving_status->endpoint,
+        interrupt_receiving_status->status);
 }
 
 static void usbredirtestclient_bulk_streams_status(void *priv, uint64_t id,
@@ -567,6 +1282,14 @@ static void usbredirtestclient_control_packet(void *priv, uint64_t id,
     uint8_t *data, int data_len)
 {
     int i;
+
+    if (load_cmd_count) {
+        usbredirparser_free_packet_data(parser, data);
+        usbredirtestclient_load_request_done(id, load_ctrl,
+                                             control_packet->status, data_len);
+        return;
+    }
+
     printf("Control packet id: %"PRIu64", status: %d", id,
            control_packet->status);
 
@@ -587,16 +1310,42 @@ static void usbredirtestclient_bulk_packet(void *priv, uint64_t id,
     struct usb_redir_bulk_packet_header *bulk_packet,
     uint8_t *data, int data_len)
 {
+    usbredirparser_free_packet_data(parser, data);
+    usbredirtestclient_load_request_done(id, load_bulk, bulk_packet->status,
+                                         data_len);
 }
 
 static void usbredirtestclient_iso_packet(void *priv, uint64_t id,
     struct usb_redir_iso_packet_header *iso_packet,
     uint8_t *data, int data_len)
 {
+    usbredirparser_free_packet_data(parser, data);
+    usbredirtestclient_load_stream_packet(id, load_iso, iso_packet->status,
+                                          data_len);
 }
 
 static void usbredirtestclient_interrupt_packet(void *priv, uint64_t id,
     struct usb_redir_interrupt_packet_header *interrupt_packet,
     uint8_t *data, int data_len)
 {
+    usbredirparser_free_packet_data(parser, data);
+    usbredirtestclient_load_stream_packet(id, load_interrupt,
+                                          interrupt_packet->status, data_len);
+}
+
+static void usbredirtestclient_bulk_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_receiving_status_header *bulk_receiving_status)
+{
+    usbredirtestclient_load_stream_status("bulk receiving",
+        bulk_receiving_status->endpoint, bulk_receiving_status->status);
+}
+
+static void usbredirtestclient_buffered_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_free_packet_data(parser, data);
+    usbredirtestclient_load_stream_packet(id, load_bulk_receiving,
+                                          buffered_bulk_header->status,
+                                          data_len);
 }